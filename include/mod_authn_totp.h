@@ -0,0 +1,120 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * \file mod_authn_totp.h
+ * \brief Optional functions of mod_authn_totp for use by other modules
+ *
+ * All functions apply the TOTP settings of the location of the given
+ * request (TOTPAuthTokenDir, TOTPAuthStateDir, TOTPExpires, ...) and share
+ * the caches, rate limits and state files of the module. Retrieve them in a
+ * post_config hook with APR_RETRIEVE_OPTIONAL_FN, e.g.
+ *
+ *   APR_OPTIONAL_FN_TYPE(authn_totp_check_code) *check_code =
+ *       APR_RETRIEVE_OPTIONAL_FN(authn_totp_check_code);
+ */
+
+#ifndef MOD_AUTHN_TOTP_H
+#define MOD_AUTHN_TOTP_H
+
+#include "apr_optional.h"
+#include "httpd.h"
+#include "mod_auth.h"
+
+/**
+  * \brief authn_totp_check_code Verify and consume a TOTP code or scratch code of a user
+  * \param r Request
+  * \param user User name
+  * \param code TOTP code (6 digits) or scratch code (8 digits)
+  * \return AUTH_GRANTED if the code is accepted, AUTH_DENIED or AUTH_USER_NOT_FOUND otherwise
+ **/
+APR_DECLARE_OPTIONAL_FN(authn_status, authn_totp_check_code,
+                        (request_rec *r, const char *user, const char *code));
+
+/**
+  * \brief authn_totp_check_codes Verify and consume the codes of several users
+  * \param r Request
+  * \param count Number of codes
+  * \param users Array of user names
+  * \param codes Array of codes
+  * \param results Array that receives the result of each code
+ **/
+APR_DECLARE_OPTIONAL_FN(void, authn_totp_check_codes,
+                        (request_rec *r, int count, const char *const *users,
+                         const char *const *codes, authn_status *results));
+
+/**
+  * \brief authn_totp_issue_token Verify and consume a code and issue a session token for it
+  * \param r Request
+  * \param user User name
+  * \param code TOTP code (6 digits) or scratch code (8 digits)
+  * \return Session token allocated from the request pool, NULL if the code is not accepted
+ **/
+APR_DECLARE_OPTIONAL_FN(const char *, authn_totp_issue_token,
+                        (request_rec *r, const char *user, const char *code));
+
+/**
+  * \brief authn_totp_verify_token Verify a session token
+  * \param r Request
+  * \param token Session token
+  * \param user Function returns pointer to the user name within the token, may be NULL
+  * \return AUTH_GRANTED if the token is valid, AUTH_DENIED otherwise
+ **/
+APR_DECLARE_OPTIONAL_FN(authn_status, authn_totp_verify_token,
+                        (request_rec *r, const char *token, const char **user));
+
+/**
+  * \brief authn_totp_verify_tokens Verify several session tokens
+  * \param r Request
+  * \param count Number of tokens
+  * \param tokens Array of session tokens
+  * \param users Array that receives pointers to the user names within the tokens, may be NULL
+  * \param results Array that receives the result of each token
+ **/
+APR_DECLARE_OPTIONAL_FN(void, authn_totp_verify_tokens,
+                        (request_rec *r, int count, const char *const *tokens,
+                         const char **users, authn_status *results));
+
+/*
+ * Secret providers fetch the configuration of a user in the format of a
+ * Google Authenticator file: the BASE32 encoded secret on the first line,
+ * followed by option lines starting with '"' and scratch codes. Modules may
+ * add providers with ap_register_provider in their register_hooks, e.g.
+ *
+ *   ap_register_provider(p, AUTHN_TOTP_SECRET_PROVIDER_GROUP, "ldap",
+ *                        AUTHN_TOTP_SECRET_PROVIDER_VERSION, &provider);
+ *
+ * and select them with "TOTPAuthSecretProvider ldap <argument>".
+ */
+#define AUTHN_TOTP_SECRET_PROVIDER_GROUP   "authn_totp_secret"
+#define AUTHN_TOTP_SECRET_PROVIDER_VERSION "0"
+
+typedef struct {
+    /**
+      * \brief get_user_secret Fetch the configuration of a user
+      * \param r Request
+      * \param user User name
+      * \param arg Argument of TOTPAuthSecretProvider, TOTPAuthTokenDir for "file"
+      * \param data Function returns the configuration, allocated from the request pool
+      * \param len Function returns the length of the configuration in bytes
+      * \return APR_SUCCESS on success, APR_NOTFOUND if the user is unknown, error code otherwise
+     **/
+    apr_status_t    (*get_user_secret) (request_rec *r, const char *user,
+                                        const char *arg, const char **data,
+                                        apr_size_t *len);
+} authn_totp_secret_provider;
+
+#endif /* MOD_AUTHN_TOTP_H */
@@ -0,0 +1,80 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * \file totpd.h
+ * \brief Protocol between mod_authn_totp and totpd, see totpd.c
+ */
+
+#ifndef TOTPD_H
+#define TOTPD_H
+
+#define TOTPD_OP_GET            'G'
+#define TOTPD_OP_SET            'S'
+#define TOTPD_OP_DELETE         'D'
+#define TOTPD_OP_UPDATE         'U'
+
+#define TOTPD_STATUS_OK         0
+#define TOTPD_STATUS_NOTFOUND   1
+#define TOTPD_STATUS_ERROR      2
+
+#define TOTPD_REQUEST_LEN       15      /* request header length */
+#define TOTPD_RESPONSE_LEN      5       /* response header length */
+
+#define TOTPD_MAX_KEY_LEN       1024
+#define TOTPD_MAX_VALUE_LEN     65536
+
+/*
+ * TOTPD_OP_UPDATE changes one kind of entries of a user's state in place, so
+ * that checking a code and marking it used cannot interleave with another
+ * request for the same user. The state has the layout of mod_authn_totp's
+ * state cache:
+ *
+ *   version (BE32) | length of each kind (BE32) | entries of each kind
+ *
+ * Code entries are a timestamp (int64) and a code (uint32) padded to 16
+ * bytes, login entries a timestamp (int64), both in host byte order. The
+ * user kind holds a single record replaced as a whole.
+ *
+ *   request value:  kind (1) | mode (1) | window (BE64) | entry
+ *   response value: count (BE32) | state after the update
+ *
+ * All modes but TOTPD_UPDATE_REPLACE drop the entries newer than the entry
+ * and those older than the window, count as described below, and append the
+ * entry with TOTPD_UPDATE_APPEND. The state expires at the later of its old
+ * and the requested expiry.
+ */
+#define TOTPD_STATE_VERSION     2
+#define TOTPD_STATE_CODES       0
+#define TOTPD_STATE_LOGINS      1
+#define TOTPD_STATE_USER        2
+#define TOTPD_STATE_KINDS       3
+#define TOTPD_STATE_HEADER_LEN  (4 + 4 * TOTPD_STATE_KINDS)
+#define TOTPD_STATE_MAX         8192
+#define TOTPD_CODE_ENTRY_LEN    16
+#define TOTPD_LOGIN_ENTRY_LEN   8
+
+#define TOTPD_UPDATE_LEN        10      /* request value length without the entry */
+
+#define TOTPD_UPDATE_KEEP       0       /* count nothing */
+#define TOTPD_UPDATE_SAME_CODE  1       /* count the entries with the code of the entry */
+#define TOTPD_UPDATE_SAME_ENTRY 2       /* count the entries equal to the entry */
+#define TOTPD_UPDATE_EARLIER    3       /* also drop equal timestamps, count all kept */
+#define TOTPD_UPDATE_CLEAR      4       /* drop the entries up to the entry instead */
+#define TOTPD_UPDATE_REPLACE    5       /* replace all entries by the entry */
+#define TOTPD_UPDATE_APPEND     0x80
+
+#endif /* TOTPD_H */
@@ -0,0 +1,40 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * \file totpenc.h
+ * \brief Format of encrypted user configurations, see totpenc.c
+ */
+
+#ifndef TOTPENC_H
+#define TOTPENC_H
+
+/*
+ * magic | nonce | AES-256-GCM ciphertext | tag
+ *
+ * The user name is the additional authenticated data, so the configuration
+ * of one user cannot be passed off as another's.
+ */
+#define TOTPENC_MAGIC           "TOTPENC1"
+#define TOTPENC_MAGIC_LEN       8
+#define TOTPENC_NONCE_LEN       12
+#define TOTPENC_TAG_LEN         16
+#define TOTPENC_KEY_LEN         32      /* raw, or 64 hex digits in the key file */
+
+#define TOTPENC_MAX_PLAIN_LEN   16384   /* longest user configuration */
+#define TOTPENC_OVERHEAD        (TOTPENC_MAGIC_LEN + TOTPENC_NONCE_LEN + TOTPENC_TAG_LEN)
+
+#endif /* TOTPENC_H */
@@ -28,11 +28,26 @@
  */
 
 #include <stdbool.h>            /* for bool */
+#include <errno.h>
+#include <fcntl.h>              /* for openat */
+#include <unistd.h>             /* for read, write, close */
+#include <sys/socket.h>
+#include <sys/un.h>             /* for sockaddr_un */
+#include <sys/mman.h>           /* for mlock */
+#include <sys/file.h>           /* for flock */
+
+#include <openssl/crypto.h>     /* for OPENSSL_cleanse */
+#include <openssl/evp.h>        /* for EVP_aes_256_gcm */
 
 #include "httpd.h"
+#include "http_config.h"
 #include "http_log.h"
 #include "http_core.h"          /* for ap_auth_name */
 #include "http_request.h"
+#include "http_protocol.h"      /* for ap_rprintf */
+#include "util_mutex.h"         /* for ap_global_mutex_create */
+#include "ap_provider.h"        /* for ap_lookup_provider */
+#include "ap_socache.h"         /* for ap_socache_provider_t */
 
 #include "apr_general.h"
 #include "apr_time.h"           /* for apr_time_t */
@@ -44,13 +59,29 @@
 #include "apr_pools.h"          /* for apr_pool_t */
 #include "apr_md5.h"            /* for APR_MD5_DIGESTSIZE */
 #include "apr_sha1.h"           /* for APR_SHA1_DIGESTSIZE */
+#include "apr_shm.h"            /* for apr_shm_t */
+#include "apr_global_mutex.h"   /* for apr_global_mutex_t */
+#include "apr_thread_mutex.h"   /* for apr_thread_mutex_t */
+#include "apr_atomic.h"         /* for apr_atomic_cas32 */
+#include "apr_hash.h"           /* for apr_hash_t */
+#include "apr_network_io.h"     /* for apr_socket_sendto */
+#include "apr_thread_proc.h"    /* for apr_thread_create */
+#include "apr_dbm.h"            /* for apr_dbm_fetch */
+#include "apr_dbd.h"            /* for apr_dbd_pvselect */
 
 #include "mod_auth.h"
 #include "mod_session.h"
+#include "mod_dbd.h"
+#include "mod_authn_totp.h"
+#include "totpd.h"            /* for the totpd protocol */
+#include "totpenc.h"          /* for encrypted user configurations */
 
 static APR_OPTIONAL_FN_TYPE(ap_session_load) *ap_session_load_fn = NULL;
 static APR_OPTIONAL_FN_TYPE(ap_session_get)  *ap_session_get_fn = NULL;
 static APR_OPTIONAL_FN_TYPE(ap_session_set)  *ap_session_set_fn = NULL;
+static APR_OPTIONAL_FN_TYPE(ap_authn_cache_store) *authn_cache_store_fn = NULL;
+static APR_OPTIONAL_FN_TYPE(ap_dbd_prepare) *dbd_prepare_fn = NULL;
+static APR_OPTIONAL_FN_TYPE(ap_dbd_acquire) *dbd_acquire_fn = NULL;
 
 #define DEBUG_TOTP_AUTH
 
@@ -102,27 +133,33 @@ to_totp_timestamp(apr_time_t ts)
     return apr_time_sec(ts) / 30;
 }
 
+typedef struct {
+    apr_sha1_ctx_t  inner;
+    apr_sha1_ctx_t  outer;
+} totp_hmac_ctx;
+
 /**
-  * \brief hmac_sha1 HMAC SHA1 implementation (adapted from code by Markus Gutschke)
+  * \brief hmac_sha1_init Start an HMAC SHA1 computation (adapted from code by Markus Gutschke)
+  * \param ctx Pointer to HMAC context
+  * \param key Pointer to the key
+  * \param keyLength Key length in bytes
  **/
 static void
-hmac_sha1(const unsigned char *key, unsigned int keyLength,
-          const unsigned char *data, unsigned int dataLength,
-          char unsigned *result, unsigned int resultLength)
+hmac_sha1_init(totp_hmac_ctx *ctx, const unsigned char *key,
+               unsigned int keyLength)
 {
     int             i;
-    apr_sha1_ctx_t  ctx;
+    apr_sha1_ctx_t  key_ctx;
 
-    unsigned char   sha[APR_SHA1_DIGESTSIZE];
     unsigned char   tmp_key[64];
     unsigned char   hashed_key[APR_SHA1_DIGESTSIZE];
 
     if (keyLength > 64) {
         // The key can be no bigger than 64 bytes. If it is, we'll hash it down to
         // 20 bytes.
-        apr_sha1_init(&ctx);
-        apr_sha1_update(&ctx, key, keyLength);
-        apr_sha1_final(hashed_key, &ctx);
+        apr_sha1_init(&key_ctx);
+        apr_sha1_update(&key_ctx, key, keyLength);
+        apr_sha1_final(hashed_key, &key_ctx);
         key = hashed_key;
         keyLength = APR_SHA1_DIGESTSIZE;
     }
@@ -134,11 +171,9 @@ hmac_sha1(const unsigned char *key, unsigned int keyLength,
     }
     memset(tmp_key + keyLength, 0x36, 64 - keyLength);
 
-    // Compute inner digest
-    apr_sha1_init(&ctx);
-    apr_sha1_update(&ctx, tmp_key, 64);
-    apr_sha1_update(&ctx, data, dataLength);
-    apr_sha1_final(sha, &ctx);
+    // Start inner digest
+    apr_sha1_init(&ctx->inner);
+    apr_sha1_update(&ctx->inner, tmp_key, 64);
 
     // The key for the outer digest is derived from our key, by padding the key
     // the full length of 64 bytes, and then XOR'ing each byte with 0x5C.
@@ -147,11 +182,41 @@ hmac_sha1(const unsigned char *key, unsigned int keyLength,
     }
     memset(tmp_key + keyLength, 0x5C, 64 - keyLength);
 
+    // Start outer digest
+    apr_sha1_init(&ctx->outer);
+    apr_sha1_update(&ctx->outer, tmp_key, 64);
+
+    // Zero out all internal data structures
+    memset(hashed_key, 0, sizeof(hashed_key));
+    memset(tmp_key, 0, sizeof(tmp_key));
+    memset(&key_ctx, 0, sizeof(key_ctx));
+}
+
+/**
+  * \brief hmac_sha1_update Add data to an HMAC SHA1 computation
+ **/
+static void
+hmac_sha1_update(totp_hmac_ctx *ctx, const unsigned char *data,
+                 unsigned int dataLength)
+{
+    apr_sha1_update(&ctx->inner, data, dataLength);
+}
+
+/**
+  * \brief hmac_sha1_final Finish an HMAC SHA1 computation, the context is zeroed
+ **/
+static void
+hmac_sha1_final(totp_hmac_ctx *ctx, unsigned char *result,
+                unsigned int resultLength)
+{
+    unsigned char   sha[APR_SHA1_DIGESTSIZE];
+
+    // Compute inner digest
+    apr_sha1_final(sha, &ctx->inner);
+
     // Compute outer digest
-    apr_sha1_init(&ctx);
-    apr_sha1_update(&ctx, tmp_key, 64);
-    apr_sha1_update(&ctx, sha, APR_SHA1_DIGESTSIZE);
-    apr_sha1_final(sha, &ctx);
+    apr_sha1_update(&ctx->outer, sha, APR_SHA1_DIGESTSIZE);
+    apr_sha1_final(sha, &ctx->outer);
 
     // Copy result to output buffer and truncate or pad as necessary
     memset(result, 0, resultLength);
@@ -161,26 +226,130 @@ hmac_sha1(const unsigned char *key, unsigned int keyLength,
     memcpy(result, sha, resultLength);
 
     // Zero out all internal data structures
-    memset(hashed_key, 0, sizeof(hashed_key));
     memset(sha, 0, sizeof(sha));
-    memset(tmp_key, 0, sizeof(tmp_key));
+    memset(ctx, 0, sizeof(*ctx));
+}
+
+/**
+  * \brief hmac_sha1 HMAC SHA1 implementation (adapted from code by Markus Gutschke)
+ **/
+static void
+hmac_sha1(const unsigned char *key, unsigned int keyLength,
+          const unsigned char *data, unsigned int dataLength,
+          char unsigned *result, unsigned int resultLength)
+{
+    totp_hmac_ctx   ctx;
+
+    hmac_sha1_init(&ctx, key, keyLength);
+    hmac_sha1_update(&ctx, data, dataLength);
+    hmac_sha1_final(&ctx, result, resultLength);
+}
+
+/**
+  * \brief put_be32 Store a 32-bit value in big-endian byte order
+ **/
+static void
+put_be32(unsigned char *dst, apr_uint32_t value)
+{
+    int             j;
+
+    for (j = 4; j--; value >>= 8)
+        dst[j] = value;
+}
+
+/**
+  * \brief put_be64 Store a 64-bit value in big-endian byte order
+ **/
+static void
+put_be64(unsigned char *dst, apr_uint64_t value)
+{
+    int             j;
+
+    for (j = 8; j--; value >>= 8)
+        dst[j] = value;
+}
+
+/**
+  * \brief get_be32 Load a 32-bit value stored in big-endian byte order
+ **/
+static          apr_uint32_t
+get_be32(const unsigned char *src)
+{
+    apr_uint32_t    value = 0;
+    int             j;
+
+    for (j = 0; j < 4; ++j)
+        value = (value << 8) | src[j];
+    return value;
+}
+
+/**
+  * \brief get_be64 Load a 64-bit value stored in big-endian byte order
+ **/
+static          apr_uint64_t
+get_be64(const unsigned char *src)
+{
+    apr_uint64_t    value = 0;
+    int             j;
+
+    for (j = 0; j < 8; ++j)
+        value = (value << 8) | src[j];
+    return value;
+}
+
+/**
+  * \brief digest_equal Compare two digests in constant time
+  * \param a First digest
+  * \param b Second digest
+  * \param len Length of the digests in bytes
+  * \return true if the digests are equal, false otherwise
+ **/
+static bool
+digest_equal(const unsigned char *a, const unsigned char *b, apr_size_t len)
+{
+    unsigned char   diff = 0;
+    apr_size_t      j;
+
+    for (j = 0; j < len; ++j)
+        diff |= a[j] ^ b[j];
+    return (diff == 0);
 }
 
 /* Module configuration */
 
+module AP_MODULE_DECLARE_DATA authn_totp_module;
+
+#define TOTP_SESSION_KEY_MAX    128
+
+/* session field name "<AuthName>-totp", filled in once for the first realm seen */
+typedef struct {
+    volatile apr_uint32_t state; /* 0: empty, 1: being filled, 2: ready */
+    apr_size_t      realm_len;
+    char            name[TOTP_SESSION_KEY_MAX];
+} totp_session_key;
+
 typedef struct {
     char           *tokenDir;
     char           *stateDir;
     apr_time_t      expires;
+    int             session_state_check;
+    apr_time_t      session_renew;
+    int             rate_limit_failures;
+    int             socache;
+    int             hashed_dirs;
+    const authn_totp_secret_provider *secret_provider;  /* NULL for files */
+    const char     *secret_arg;
+    totp_session_key session_key;
 } totp_auth_config_rec;
 
 static void    *
 create_authn_totp_config(apr_pool_t *p, char *d)
 {
-    totp_auth_config_rec *conf = apr_palloc(p, sizeof(*conf));
+    totp_auth_config_rec *conf = apr_pcalloc(p, sizeof(*conf));
     conf->tokenDir = NULL;
     conf->stateDir = NULL;
     conf->expires  = 3600; /* one hour */
+    conf->session_state_check = 1;
 
     return conf;
 }
@@ -191,1112 +360,7245 @@ set_totp_auth_config_path(cmd_parms *cmd, void *offset, const char *path)
     return ap_set_file_slot(cmd, offset, path);
 }
 
+static const char *
+set_totp_auth_secret_provider(cmd_parms *cmd, void *config, const char *name,
+                              const char *arg)
+{
+    totp_auth_config_rec *conf = config;
+    static unsigned int label_num = 0;
+    const char     *path, *sep;
+
+    if (0 == strcmp(name, "file")) {
+        conf->secret_provider = NULL;
+        conf->secret_arg = NULL;
+        return NULL;
+    }
+
+    conf->secret_provider =
+        ap_lookup_provider(AUTHN_TOTP_SECRET_PROVIDER_GROUP, name,
+                           AUTHN_TOTP_SECRET_PROVIDER_VERSION);
+    if (!conf->secret_provider)
+        return apr_psprintf(cmd->pool,
+                            "TOTPAuthSecretProvider: unknown provider \"%s\"",
+                            name);
+    if (!arg)
+        return apr_psprintf(cmd->pool,
+                            "TOTPAuthSecretProvider %s requires an argument",
+                            name);
+
+    if (0 == strcmp(name, "dbm")) {
+        /* [type:]path, passed on as type:path */
+        sep = ap_strchr_c(arg, ':');
+        path = ap_server_root_relative(cmd->pool, sep ? sep + 1 : arg);
+        if (!path)
+            return apr_pstrcat(cmd->pool, "TOTPAuthSecretProvider: invalid path ",
+                               arg, NULL);
+        conf->secret_arg = apr_pstrcat(cmd->pool,
+                                       sep ? apr_pstrmemdup(cmd->pool, arg,
+                                                            sep - arg) : "default",
+                                       ":", path, NULL);
+    } else if (0 == strcmp(name, "dbd")) {
+        /* the query is prepared by mod_dbd and looked up by its label */
+        if (!dbd_prepare_fn) {
+            dbd_prepare_fn = APR_RETRIEVE_OPTIONAL_FN(ap_dbd_prepare);
+            dbd_acquire_fn = APR_RETRIEVE_OPTIONAL_FN(ap_dbd_acquire);
+            if (!dbd_prepare_fn || !dbd_acquire_fn)
+                return "TOTPAuthSecretProvider dbd requires mod_dbd";
+        }
+        conf->secret_arg = apr_psprintf(cmd->pool, "authn_totp_secret_%u",
+                                        ++label_num);
+        dbd_prepare_fn(cmd->server, arg, conf->secret_arg);
+    } else {
+        conf->secret_arg = arg;
+    }
+
+    return NULL;
+}
+
 static const char *
 set_totp_auth_config_int(cmd_parms *cmd, void *offset, const char *value)
 {
 	return ap_set_int_slot(cmd, offset, value);
 }
 
-static const command_rec authn_totp_cmds[] = {
-    AP_INIT_TAKE1("TOTPAuthTokenDir", set_totp_auth_config_path,
-                  (void *) APR_OFFSETOF(totp_auth_config_rec, tokenDir),
-                  OR_AUTHCFG,
-                  "Directory containing Google Authenticator credential files"),
-    AP_INIT_TAKE1("TOTPAuthStateDir", set_totp_auth_config_path,
-                  (void *) APR_OFFSETOF(totp_auth_config_rec, stateDir),
-                  OR_AUTHCFG,
-                  "Directory that contains TOTP key state information"),
-    AP_INIT_TAKE1("TOTPExpires", set_totp_auth_config_int,
-                  (void *) APR_OFFSETOF(totp_auth_config_rec, expires),
-                  OR_AUTHCFG,
-                  "Expiry time (in seconds) for TOTP authentication token"),
-    {NULL}
-};
+/* longest TOTPExpires in the configuration, bounds the lifetime of revocations */
+static apr_time_t totp_max_expires = 3600;
 
-module AP_MODULE_DECLARE_DATA authn_totp_module;
+static const char *
+set_totp_auth_expires(cmd_parms *cmd, void *offset, const char *value)
+{
+    const char     *err = ap_set_int_slot(cmd, offset, value);
 
-/* Authentication Helpers */
+    if (!err)
+        totp_max_expires = max(totp_max_expires, apr_atoi64(value));
 
-typedef struct {
-    const char     *shared_key;
-    apr_size_t      shared_key_len;
-    bool            disallow_reuse;
-    unsigned char   window_size;
-    unsigned int    rate_limit_count;
-    apr_time_t      rate_limit_seconds;
-    unsigned int    scratch_codes[10];
-    unsigned char   scratch_codes_count;
-} totp_user_config;
+    return err;
+}
 
 typedef struct {
-    totp_user_config *conf;
-    apr_time_t      exp;
-    unsigned int    res;
-} totp_file_helper_cb_data;
+    unsigned int    verdict_cache_size;
+    unsigned int    revocation_list_size;
+    unsigned int    config_cache_size;
+    apr_time_t      config_cache_ttl;
+    unsigned int    client_limit_count;
+    apr_time_t      client_limit_seconds;
+    unsigned int    subnet_limit_count;
+    apr_time_t      subnet_limit_seconds;
+    unsigned int    global_login_rate;
+    unsigned int    global_login_burst;
+    unsigned int    login_rate;
+    unsigned int    login_burst;
+    int             login_rate_set;
+    int             admission_index;    /* bucket of this server, 0 if none */
+    unsigned int    lockout_size;
+    unsigned int    lockout_failures;
+    apr_time_t      lockout_seconds;
+    unsigned int    hitters_size;
+    apr_time_t      hitters_window;
+    unsigned int    hitters_max_failures;
+    unsigned int    hmac_budget;
+    const ap_socache_provider_t *state_cache_provider;
+    ap_socache_instance_t *state_cache;
+    const char     *peer_listen;
+    apr_array_header_t *peers;
+    const char     *peer_secret;
+    const char     *snapshot_path;
+    apr_time_t      snapshot_interval;
+    apr_time_t      write_behind_interval;
+    const char     *master_key_path;
+} totp_auth_server_config_rec;
 
-/**
- * \brief totp_file_helper_cb Callback function used by check_n_update_file_helper
- * \param new Pointer to new data entry
- * \param old Pointer to an existing data entry
- * \param data Pointert to callback function data
- * \return if old if not NULL then retunr true if existing entry should be kept, false otherwise.
- * When old is NULL, return if true if new entry should be appended to the file, false otherwise.
-**/
-typedef bool    (*totp_file_helper_cb)(const void *new, const void *old,
-                                       totp_file_helper_cb_data * data);
+static void    *
+create_authn_totp_server_config(apr_pool_t *p, server_rec *s)
+{
+    totp_auth_server_config_rec *conf = apr_palloc(p, sizeof(*conf));
+    conf->verdict_cache_size = 0; /* disabled */
+    conf->revocation_list_size = 0; /* disabled */
+    conf->config_cache_size = 0;  /* disabled */
+    conf->config_cache_ttl = 0;
+    conf->client_limit_count = 0; /* disabled */
+    conf->client_limit_seconds = 0;
+    conf->subnet_limit_count = 0; /* disabled */
+    conf->subnet_limit_seconds = 0;
+    conf->global_login_rate = 0;  /* disabled */
+    conf->global_login_burst = 0;
+    conf->login_rate = 0;         /* disabled */
+    conf->login_burst = 0;
+    conf->login_rate_set = 0;
+    conf->admission_index = 0;
+    conf->lockout_size = 0;       /* disabled */
+    conf->lockout_failures = 0;
+    conf->lockout_seconds = 0;
+    conf->hitters_size = 0;       /* disabled */
+    conf->hitters_window = 0;
+    conf->hitters_max_failures = 0;
+    conf->hmac_budget = 0;        /* unlimited */
+    conf->state_cache_provider = NULL;  /* state files */
+    conf->state_cache = NULL;
+    conf->peer_listen = NULL;     /* disabled */
+    conf->peers = NULL;
+    conf->peer_secret = NULL;
+    conf->snapshot_path = NULL;   /* disabled */
+    conf->snapshot_interval = 0;
+    conf->write_behind_interval = 0;    /* disabled */
+    conf->master_key_path = NULL; /* plain user configurations only */
 
-/**
-  * \brief read_user_config Read a user's TOTP configuration from configuration file
-  * \param user User name
-  * \param token_dir Directory contianing TOTP configuration
-  * \param pool The pool which we are logging for
-  * \return Pointer to structure containing TOTP configuration for given user on success, NULL otherwise
- **/
-static totp_user_config *
-read_user_config(request_rec *r, const char *user, const char *token_dir)
+    return conf;
+}
+
+static void    *
+merge_authn_totp_server_config(apr_pool_t *p, void *basev, void *addv)
 {
-    const char     *psep = " ";
-    char           *config_filename;
-    char           *token, *last;
-    char            line[MAX_STRING_LEN];
-    char            err_char;
-    unsigned int    line_len = 0, line_no = 0;
-    apr_status_t    status;
-    ap_configfile_t *config_file;
-    totp_user_config *user_config = NULL;
+    totp_auth_server_config_rec *base = basev;
+    totp_auth_server_config_rec *add = addv;
+    totp_auth_server_config_rec *conf = apr_palloc(p, sizeof(*conf));
+
+    /* global settings are only set in the main server */
+    memcpy(conf, base, sizeof(*conf));
+
+    /* per virtual host settings */
+    if (add->login_rate_set) {
+        conf->login_rate = add->login_rate;
+        conf->login_burst = add->login_burst;
+        conf->login_rate_set = 1;
+    }
 
-    config_filename = apr_psprintf(r->pool, "%s/%s", token_dir, user);
+    return conf;
+}
 
-    status = ap_pcfg_openfile(&config_file, r->pool, config_filename);
+static const char *
+set_totp_auth_verdict_cache(cmd_parms *cmd, void *dummy, const char *value)
+{
+    totp_auth_server_config_rec *conf =
+        ap_get_module_config(cmd->server->module_config, &authn_totp_module);
+    const char     *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
 
-    if (status != APR_SUCCESS) {
-        ap_log_rerror(APLOG_MARK, APLOG_ERR, status, r,
-                      "read_user_config: could not open user configuration file \"%s\"",
-                      config_filename);
-        return NULL;
-    }
+    if (err)
+        return err;
 
-    user_config = apr_palloc(r->pool, sizeof(*user_config));
-    memset(user_config, 0, sizeof(*user_config));
+    if (!is_digit_str(value))
+        return "TOTPAuthVerdictCache must be a non-negative number of entries";
 
-    while (!(ap_cfg_getline(line, MAX_STRING_LEN, config_file))) {
-        /* Bump line number counter */
-        line_no++;
-        /* Skip blank lines. */
-        if (!line[0])
-            continue;
-        /* Parse authentication settings. */
-        if (line[0] == '"') {
-            token = apr_strtok(&line[2], psep, &last);
-            if (token != NULL) {
-                if (0 == apr_strnatcmp(token, "DISALLOW_REUSE")) {
-                    user_config->disallow_reuse = true;
-                } else if (0 == apr_strnatcmp(token, "WINDOW_SIZE")) {
-                    token = apr_strtok(NULL, psep, &last);
-
-                    if (!is_digit_str(token))
-                        ap_log_rerror(APLOG_MARK,
-                                      APLOG_ERR,
-                                      0, r,
-                                      "read_user_config: window size value \"%s\" contains invalid characters at line %d",
-                                      token, line_no);
-                    else
-                        user_config->window_size =
-                            max(0, min(apr_atoi64(token), 32));
-                } else if (0 == apr_strnatcmp(token, "RATE_LIMIT")) {
-                    token = apr_strtok(NULL, psep, &last);
-
-                    if (!is_digit_str(token))
-                        ap_log_rerror(APLOG_MARK,
-                                      APLOG_ERR,
-                                      0, r,
-                                      "read_user_config: rate limit count value \"%s\" contains invalid characters at line %d",
-                                      token, line_no);
-                    else
-                        user_config->rate_limit_count =
-                            max(0, min(apr_atoi64(token), 5));
-
-                    token = apr_strtok(NULL, psep, &last);
-
-                    if (!is_digit_str(token)) {
-                        user_config->rate_limit_count = 0;
-                        ap_log_rerror(APLOG_MARK,
-                                      APLOG_ERR,
-                                      0, r,
-                                      "read_user_config: rate limit seconds value \"%s\" contains invalid characters at line %d",
-                                      token, line_no);
-                    } else
-                        user_config->rate_limit_seconds =
-                            max(0, min(apr_atoi64(token), 300));
-                } else
-                    ap_log_rerror(APLOG_MARK, APLOG_DEBUG,
-                                  0, r,
-                                  "read_user_config: unrecognized directive \"%s\" at line %d",
-                                  line, line_no);
+    conf->verdict_cache_size = min(apr_atoi64(value), 1 << 20);
 
-            } else
-                ap_log_rerror(APLOG_MARK, APLOG_DEBUG,
-                              0, r,
-                              "read_user_config: skipping comment line \"%s\" at line %d",
-                              line, line_no);
-        }
-        /* Shared key is on the first valid line */
-        else if (!user_config->shared_key) {
-            token = apr_pstrdup(r->pool, line);
-            line_len = strlen(token);
-
-            user_config->shared_key =
-                apr_pdecode_base32(r->pool, token, line_len, APR_ENCODE_NONE,
-                                   &user_config->shared_key_len);
-
-            if (!user_config->shared_key) {
-                ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r,
-                              "read_user_config: could not find a valid BASE32 encoded secret at line %d",
-                              line_no);
-                return NULL;
-            }
-        }
-        /* Handle scratch codes */
-        else {
-            token = apr_pstrdup(r->pool, line);
-            line_len = strlen(token);
-
-            /* validate scratch code */
-            if (!is_digit_str(token))
-                ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r,
-                              "read_user_config: scratch code \"%s\" contains invalid characters and was skipped at line %d",
-                              line, line_no);
-            else if (user_config->scratch_codes_count < 10)
-                user_config->scratch_codes[user_config->scratch_codes_count++]
-                    = apr_atoi64(token);
-            else
-                ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r,
-                              "read_user_config: scratch code \"%s\" at line %d was skipped, only 10 scratch codes per user are supported",
-                              line, line_no);
-        }
-    }
+    return NULL;
+}
+
+static const char *
+set_totp_auth_revocation_list(cmd_parms *cmd, void *dummy, const char *value)
+{
+    totp_auth_server_config_rec *conf =
+        ap_get_module_config(cmd->server->module_config, &authn_totp_module);
+    const char     *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+
+    if (err)
+        return err;
 
-    ap_cfg_closefile(config_file);
+    if (!is_digit_str(value))
+        return "TOTPAuthRevocationList must be a non-negative number of entries";
 
-    return user_config;
+    conf->revocation_list_size = min(apr_atoi64(value), 1 << 20);
+
+    return NULL;
 }
 
-/**
-  * \brief get_user_config Based on the given username, get the users TOTP configuration
-  * \param r Request
-  * \param user User name
-  * \return Pointer to structure containing TOTP configuration for given user on success, NULL otherwise
- **/
-static totp_user_config *
-get_user_config(request_rec *r, const char *user)
+static const char *
+set_totp_auth_config_cache(cmd_parms *cmd, void *dummy, const char *size,
+                           const char *ttl)
 {
-    totp_auth_config_rec *conf =
-        ap_get_module_config(r->per_dir_config, &authn_totp_module);
+    totp_auth_server_config_rec *conf =
+        ap_get_module_config(cmd->server->module_config, &authn_totp_module);
+    const char     *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
 
-    if (!conf->tokenDir) {
-        ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r,
-                      "get_user_config: TOTPAuthTokenDir is not defined");
-        return NULL;
-    }
+    if (err)
+        return err;
 
-    return read_user_config(r, user, conf->tokenDir);
+    if (!is_digit_str(size) || !is_digit_str(ttl))
+        return "TOTPAuthConfigCache takes a number of entries and a lifetime in seconds";
+
+    conf->config_cache_size = min(apr_atoi64(size), 1 << 20);
+    conf->config_cache_ttl = min(apr_atoi64(ttl), 86400);
+
+    return NULL;
 }
 
-/**
-  * \brief generate_totp_code Generate a one time password using shared secret and timestamp
-  * \param timestamp Unix timestamp
-  * \param totp_config Pointer to structure containing TOTP configuration
-  * \param hash_out Either NULL or a pointer to memory location to store the SHA1 hash digest
-  * \return TOTP code as an unsigned integer
- **/
-static unsigned int
-generate_totp_code(apr_time_t timestamp, const totp_user_config *totp_config)
+static const char *
+set_totp_auth_client_limit(cmd_parms *cmd, void *dummy, const char *count,
+                           const char *seconds)
 {
-    unsigned char   hash[APR_SHA1_DIGESTSIZE];
-    const size_t    challenge_size = sizeof(apr_time_t);
-    unsigned char   challenge_data[sizeof(apr_time_t)];
-    unsigned int    totp_code = 0;
-    int             j, offset;
+    totp_auth_server_config_rec *conf =
+        ap_get_module_config(cmd->server->module_config, &authn_totp_module);
+    const char     *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
 
-    for (j = challenge_size; j--; timestamp >>= 8)
-        challenge_data[j] = timestamp;
+    if (err)
+        return err;
 
-    hmac_sha1(totp_config->shared_key,
-              totp_config->shared_key_len,
-              challenge_data, challenge_size, hash, APR_SHA1_DIGESTSIZE);
-    offset = hash[APR_SHA1_DIGESTSIZE - 1] & 0xF;
-    for (j = 0; j < 4; ++j) {
-        totp_code <<= 8;
-        totp_code |= hash[offset + j];
+    if (!is_digit_str(count) || !is_digit_str(seconds) || !apr_atoi64(seconds))
+        return apr_pstrcat(cmd->pool, cmd->cmd->name,
+                           " takes a number of attempts and a positive number of seconds",
+                           NULL);
+
+    if (cmd->info) {
+        conf->subnet_limit_count = min(apr_atoi64(count), 1 << 20);
+        conf->subnet_limit_seconds = min(apr_atoi64(seconds), 86400);
+    } else {
+        conf->client_limit_count = min(apr_atoi64(count), 1 << 20);
+        conf->client_limit_seconds = min(apr_atoi64(seconds), 86400);
     }
-    memset(hash, 0, sizeof(hash));
-    totp_code &= 0x7FFFFFFF;
-    totp_code %= 1000000;
 
-    return totp_code;
+    return NULL;
 }
 
-/**
-  * \brief check_n_update_file_helper Update file entries and apend new entry
-  * \param r Request
-  * \param filepath Path to target file
-  * \param entry Pointer to new data entry
-  * \param entry_size Size of the entry data structure in bytes
-  * \param cb_check Pointer to callback function that is called on each entry
-  * \param cb_data Pointert to callback function data
-  * \param pool APR pool
-  * \return Pointer to structure containing TOTP configuration for given user on success, NULL otherwise
- **/
-static          apr_status_t
-check_n_update_file_helper(request_rec *r, const char *filepath,
-                           const void *entry, apr_size_t entry_size,
-                           totp_file_helper_cb cb_check,
-                           totp_file_helper_cb_data *cb_data)
+static const char *
+set_totp_auth_login_rate(cmd_parms *cmd, void *dummy, const char *rate,
+                         const char *burst)
 {
-    apr_status_t    status;
-    const char     *tmp_filepath;
-    apr_file_t     *tmp_file;
-    apr_file_t     *target_file;
-    apr_finfo_t     target_finfo;
-    apr_mmap_t     *target_mmap;
-    apr_size_t      bytes_written;
-    apr_time_t      timestamp = *((apr_time_t *) entry);
-    apr_size_t      entry_pos;
-    apr_time_t      entry_time;
-    const char     *file_data;
+    totp_auth_server_config_rec *conf =
+        ap_get_module_config(cmd->server->module_config, &authn_totp_module);
+    const char     *err;
 
-    tmp_filepath = apr_psprintf(r->pool, "%s.%" APR_TIME_T_FMT, filepath, timestamp);
+    if (cmd->info && (err = ap_check_cmd_context(cmd, GLOBAL_ONLY)))
+        return err;
 
-    status = apr_file_open(&tmp_file,   /* temporary file handle */
-                           tmp_filepath,        /* file name */
-                           APR_FOPEN_EXCL |     /* return an error if file exists */
-                           APR_FOPEN_WRITE |    /* open file for writing */
-                           APR_FOPEN_CREATE |   /* create file if it does * not
-                                                 * exist */
-                           APR_FOPEN_BUFFERED | /* buffered file IO */
-                           APR_FOPEN_TRUNCATE,  /* truncate file to 0 length */
-                           APR_UREAD | APR_UWRITE,      /* set read/write
-                                                         * permissions * only for
-                                                         * owner */
-                           r->pool      /* memory pool to use */
-        );
-    if (APR_SUCCESS != status) {
-        ap_log_rerror(APLOG_MARK, APLOG_ERR, status, r,
-                      "totp_update_file_helper: could not create temporary file \"%s\"",
-                      tmp_filepath);
-        return status;
-    }
+    if (!is_digit_str(rate) || !is_digit_str(burst))
+        return apr_pstrcat(cmd->pool, cmd->cmd->name,
+                           " takes a number of logins per second and a burst size",
+                           NULL);
 
-    status = apr_file_open(&target_file,        /* target file handle */
-                           filepath,    /* file name */
-                           APR_FOPEN_READ,      /* open file for reading */
-                           APR_FPROT_OS_DEFAULT,        /* default permissions */
-                           r->pool      /* memory pool to use */
-        );
-    if ((APR_SUCCESS != status) && (APR_ENOENT != status)) {
-        ap_log_rerror(APLOG_MARK, APLOG_ERR, status, r,
-                      "totp_update_file_helper: could not open target file \"%s\"",
-                      filepath);
-        apr_file_close(tmp_file);
-        return status;
+    if (cmd->info) {
+        conf->global_login_rate = min(apr_atoi64(rate), 1 << 20);
+        conf->global_login_burst = max(1, min(apr_atoi64(burst), 1 << 20));
+    } else {
+        conf->login_rate = min(apr_atoi64(rate), 1 << 20);
+        conf->login_burst = max(1, min(apr_atoi64(burst), 1 << 20));
+        conf->login_rate_set = 1;
     }
 
-    if (APR_ENOENT != status) {
-        /* Read current target file contents into a memory map */
-        if ((status =
-             apr_file_info_get(&target_finfo, APR_FINFO_SIZE,
-                               target_file)) != APR_SUCCESS) {
-            ap_log_rerror(APLOG_MARK, APLOG_ERR, status, r,
-                          "totp_update_file_helper: could not get target file \"%s\" size",
-                          filepath);
-            apr_file_close(tmp_file);
-            return status;
-        }
-        if ((status =
-             apr_mmap_create(&target_mmap, target_file, 0, target_finfo.size,
-                             APR_MMAP_READ, r->pool)) != APR_SUCCESS) {
-            ap_log_rerror(APLOG_MARK, APLOG_ERR, status, r,
-                          "totp_update_file_helper: could not load target file \"%s\" into memory",
-                          filepath);
-            apr_file_close(tmp_file);
-            return status;
-        }
+    return NULL;
+}
 
-        /* close the target file once contents have been loaded into memory */
-        apr_file_close(target_file);
+static const char *
+set_totp_auth_lockout(cmd_parms *cmd, void *dummy, const char *size,
+                      const char *failures, const char *seconds)
+{
+    totp_auth_server_config_rec *conf =
+        ap_get_module_config(cmd->server->module_config, &authn_totp_module);
+    const char     *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
 
-        /* process the file contents */
-        file_data = target_mmap->mm;
-        for (entry_pos = 0; entry_pos < target_mmap->size;
-             entry_pos += entry_size, file_data += entry_size) {
-            entry_time = *((apr_time_t *) file_data);
+    if (err)
+        return err;
 
-            if (timestamp >= entry_time) {
-                /* check if entry time is within time tolerance */
-                if ((*cb_check) (entry, file_data, cb_data)) {
-                    /* keep the entry */
-                    ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r,
-                                  "totp_update_file_helper: entry %ld is kept, cb_data->res = %u",
-                                  entry_time, cb_data->res);
-                    bytes_written = entry_size;
-                    if (((status =
-                          apr_file_write(tmp_file, file_data,
-                                         &bytes_written)) != APR_SUCCESS)
-                        || (bytes_written != entry_size)) {
-                        ap_log_rerror(APLOG_MARK, APLOG_ERR, status, r,
-                                      "totp_update_file_helper: could not write to temporary file \"%s\"",
-                                      tmp_filepath);
-                        apr_mmap_delete(target_mmap);
-                        apr_file_close(tmp_file);
-                        return status;
-                    }
-                } else {
-                    ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r,
-                                  "totp_update_file_helper: entry %ld is NOT kept, cb_data->res = %u",
-                                  entry_time, cb_data->res);
-                }
-            } else {
-                /* entry is in the future */
-                ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r,
-                              "totp_update_file_helper: entry %ld is in the future and will be dropped",
-                              entry_time);
-            }
-        }
+    if (!is_digit_str(size) || !is_digit_str(failures) ||
+        !is_digit_str(seconds) || !apr_atoi64(failures) || !apr_atoi64(seconds))
+        return "TOTPAuthLockout takes a number of entries, a number of failures and a lockout time in seconds";
 
-        /* delete the memory map */
-        apr_mmap_delete(target_mmap);
-    }
+    conf->lockout_size = min(apr_atoi64(size), 1 << 20);
+    conf->lockout_failures = min(apr_atoi64(failures), 1 << 20);
+    conf->lockout_seconds = min(apr_atoi64(seconds), 86400);
 
-    /* add current entry to file */
-    if ((*cb_check) (entry, NULL, cb_data)) {
-        ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r,
-                      "totp_update_file_helper: adding new entry %ld, cb_data->res = %u",
-                      timestamp, cb_data->res);
-        bytes_written = entry_size;
-        if (((status =
-              apr_file_write(tmp_file, entry, &bytes_written)) != APR_SUCCESS)
-            || (bytes_written != entry_size)) {
-            ap_log_rerror(APLOG_MARK, APLOG_ERR, status, r,
-                          "totp_update_file_helper: could not write to temporary file \"%s\"",
-                          tmp_filepath);
-            apr_file_close(tmp_file);
-            return status;
-        }
-    } else {
-        ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r,
-                      "totp_update_file_helper: NOT adding new entry %ld, cb_data->res = %u",
-                      timestamp, cb_data->res);
+    return NULL;
+}
+
+static const char *
+set_totp_auth_heavy_hitters(cmd_parms *cmd, void *dummy, const char *size,
+                            const char *seconds, const char *failures)
+{
+    totp_auth_server_config_rec *conf =
+        ap_get_module_config(cmd->server->module_config, &authn_totp_module);
+    const char     *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+
+    if (err)
+        return err;
+
+    if (!is_digit_str(size) || !is_digit_str(seconds) || !apr_atoi64(seconds) ||
+        (failures && !is_digit_str(failures)))
+        return "TOTPAuthHeavyHitters takes a number of entries, a window in seconds and an optional number of failures";
+
+    conf->hitters_size = min(apr_atoi64(size), 256);
+    conf->hitters_window = min(apr_atoi64(seconds), 86400);
+    conf->hitters_max_failures = failures ? min(apr_atoi64(failures), 1 << 20) : 0;
+
+    return NULL;
+}
+
+static const char *
+set_totp_auth_hmac_budget(cmd_parms *cmd, void *dummy, const char *value)
+{
+    totp_auth_server_config_rec *conf =
+        ap_get_module_config(cmd->server->module_config, &authn_totp_module);
+    const char     *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+
+    if (err)
+        return err;
+
+    if (!is_digit_str(value))
+        return "TOTPAuthHmacBudget must be a non-negative number of HMAC computations per second";
+
+    conf->hmac_budget = min(apr_atoi64(value), 1 << 30);
+
+    return NULL;
+}
+
+static const char *
+set_totp_auth_state_cache(cmd_parms *cmd, void *dummy, const char *arg)
+{
+    totp_auth_server_config_rec *conf =
+        ap_get_module_config(cmd->server->module_config, &authn_totp_module);
+    const char     *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+    const char     *sep, *name;
+
+    if (err)
+        return err;
+
+    /* argument is "<provider>[:<provider arguments>]" */
+    sep = ap_strchr_c(arg, ':');
+    name = sep ? apr_pstrmemdup(cmd->temp_pool, arg, sep - arg) : arg;
+
+    conf->state_cache_provider =
+        ap_lookup_provider(AP_SOCACHE_PROVIDER_GROUP, name,
+                           AP_SOCACHE_PROVIDER_VERSION);
+    if (!conf->state_cache_provider)
+        return apr_psprintf(cmd->pool,
+                            "TOTPAuthStateCache: unknown socache provider \"%s\", "
+                            "maybe you need to load mod_socache_%s", name, name);
+
+    err = conf->state_cache_provider->create(&conf->state_cache,
+                                             sep ? sep + 1 : NULL,
+                                             cmd->temp_pool, cmd->pool);
+    if (err)
+        return apr_pstrcat(cmd->pool, "TOTPAuthStateCache: ", err, NULL);
+
+    return NULL;
+}
+
+static const char *
+set_totp_auth_peer_listen(cmd_parms *cmd, void *dummy, const char *addr)
+{
+    totp_auth_server_config_rec *conf =
+        ap_get_module_config(cmd->server->module_config, &authn_totp_module);
+    const char     *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+
+    if (err)
+        return err;
+
+    conf->peer_listen = addr;
+    return NULL;
+}
+
+static const char *
+set_totp_auth_peers(cmd_parms *cmd, void *dummy, const char *peer)
+{
+    totp_auth_server_config_rec *conf =
+        ap_get_module_config(cmd->server->module_config, &authn_totp_module);
+    const char     *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+
+    if (err)
+        return err;
+
+    if (!conf->peers)
+        conf->peers = apr_array_make(cmd->pool, 4, sizeof(const char *));
+    APR_ARRAY_PUSH(conf->peers, const char *) = peer;
+    return NULL;
+}
+
+static const char *
+set_totp_auth_peer_secret(cmd_parms *cmd, void *dummy, const char *secret)
+{
+    totp_auth_server_config_rec *conf =
+        ap_get_module_config(cmd->server->module_config, &authn_totp_module);
+    const char     *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+
+    if (err)
+        return err;
+
+    if (strlen(secret) < 16)
+        return "TOTPAuthPeerSecret must be at least 16 characters long";
+
+    conf->peer_secret = secret;
+    return NULL;
+}
+
+static const char *
+set_totp_auth_snapshot(cmd_parms *cmd, void *dummy, const char *path,
+                       const char *seconds)
+{
+    totp_auth_server_config_rec *conf =
+        ap_get_module_config(cmd->server->module_config, &authn_totp_module);
+    const char     *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+
+    if (err)
+        return err;
+
+    if (seconds && (!is_digit_str(seconds) || !apr_atoi64(seconds)))
+        return "TOTPAuthSnapshot interval must be a positive number of seconds";
+
+    conf->snapshot_path = ap_server_root_relative(cmd->pool, path);
+    if (!conf->snapshot_path)
+        return apr_pstrcat(cmd->pool, "TOTPAuthSnapshot: invalid path ", path,
+                           NULL);
+    conf->snapshot_interval =
+        apr_time_from_sec(seconds ? min(apr_atoi64(seconds), 86400) : 60);
+
+    return NULL;
+}
+
+static const char *
+set_totp_auth_write_behind(cmd_parms *cmd, void *dummy, const char *seconds)
+{
+    totp_auth_server_config_rec *conf =
+        ap_get_module_config(cmd->server->module_config, &authn_totp_module);
+    const char     *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+
+    if (err)
+        return err;
+
+    if (!is_digit_str(seconds))
+        return "TOTPAuthWriteBehind must be a number of seconds";
+
+    conf->write_behind_interval = apr_time_from_sec(min(apr_atoi64(seconds), 3600));
+    return NULL;
+}
+
+static const char *
+set_totp_auth_master_key(cmd_parms *cmd, void *dummy, const char *path)
+{
+    totp_auth_server_config_rec *conf =
+        ap_get_module_config(cmd->server->module_config, &authn_totp_module);
+    const char     *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+
+    if (err)
+        return err;
+
+    conf->master_key_path = ap_server_root_relative(cmd->pool, path);
+    if (!conf->master_key_path)
+        return apr_pstrcat(cmd->pool, "TOTPAuthMasterKey: invalid path ", path,
+                           NULL);
+    return NULL;
+}
+
+static const command_rec authn_totp_cmds[] = {
+    AP_INIT_TAKE1("TOTPAuthTokenDir", set_totp_auth_config_path,
+                  (void *) APR_OFFSETOF(totp_auth_config_rec, tokenDir),
+                  OR_AUTHCFG,
+                  "Directory containing Google Authenticator credential files"),
+    AP_INIT_TAKE1("TOTPAuthStateDir", set_totp_auth_config_path,
+                  (void *) APR_OFFSETOF(totp_auth_config_rec, stateDir),
+                  OR_AUTHCFG,
+                  "Directory that contains TOTP key state information"),
+    AP_INIT_TAKE12("TOTPAuthSecretProvider", set_totp_auth_secret_provider,
+                   NULL,
+                   ACCESS_CONF | RSRC_CONF,
+                   "Where to fetch user secrets from: file (TOTPAuthTokenDir, default), dbm [type:]path or dbd \"query\""),
+    AP_INIT_TAKE1("TOTPExpires", set_totp_auth_expires,
+                  (void *) APR_OFFSETOF(totp_auth_config_rec, expires),
+                  OR_AUTHCFG,
+                  "Expiry time (in seconds) for TOTP authentication token"),
+    AP_INIT_FLAG("TOTPAuthSessionStateCheck", ap_set_flag_slot,
+                 (void *) APR_OFFSETOF(totp_auth_config_rec, session_state_check),
+                 OR_AUTHCFG,
+                 "Look up the login of a session token in the state directory (default On)"),
+    AP_INIT_TAKE1("TOTPAuthSessionRenew", set_totp_auth_config_int,
+                  (void *) APR_OFFSETOF(totp_auth_config_rec, session_renew),
+                  OR_AUTHCFG,
+                  "Re-issue an active session token at most once per this many seconds (0 to disable)"),
+    AP_INIT_FLAG("TOTPAuthRateLimitFailures", ap_set_flag_slot,
+                 (void *) APR_OFFSETOF(totp_auth_config_rec, rate_limit_failures),
+                 OR_AUTHCFG,
+                 "Count only failed login attempts against RATE_LIMIT and clear them on success (default Off)"),
+    AP_INIT_FLAG("TOTPAuthSocache", ap_set_flag_slot,
+                 (void *) APR_OFFSETOF(totp_auth_config_rec, socache),
+                 OR_AUTHCFG,
+                 "Offer verified TOTP codes to mod_authn_socache (default Off)"),
+    AP_INIT_FLAG("TOTPAuthHashedDirs", ap_set_flag_slot,
+                 (void *) APR_OFFSETOF(totp_auth_config_rec, hashed_dirs),
+                 OR_AUTHCFG,
+                 "Keep user files in <dir>/xx/yy/<user>, with xxyy from the MD5 hash of the user name (default Off)"),
+    AP_INIT_TAKE1("TOTPAuthRevocationList", set_totp_auth_revocation_list,
+                  NULL,
+                  RSRC_CONF,
+                  "Number of session revocations to keep in shared memory (0 to disable)"),
+    AP_INIT_TAKE2("TOTPAuthClientRateLimit", set_totp_auth_client_limit,
+                  NULL,
+                  RSRC_CONF,
+                  "Maximum number of login attempts per client address within the given number of seconds"),
+    AP_INIT_TAKE2("TOTPAuthSubnetRateLimit", set_totp_auth_client_limit,
+                  (void *) 1,
+                  RSRC_CONF,
+                  "Maximum number of login attempts per /24 (IPv4) or /64 (IPv6) network within the given number of seconds"),
+    AP_INIT_TAKE2("TOTPAuthGlobalLoginRate", set_totp_auth_login_rate,
+                  (void *) 1,
+                  RSRC_CONF,
+                  "Number of full TOTP verifications per second admitted server-wide, and burst size"),
+    AP_INIT_TAKE2("TOTPAuthLoginRate", set_totp_auth_login_rate,
+                  NULL,
+                  RSRC_CONF,
+                  "Number of full TOTP verifications per second admitted per virtual host, and burst size"),
+    AP_INIT_TAKE3("TOTPAuthLockout", set_totp_auth_lockout,
+                  NULL,
+                  RSRC_CONF,
+                  "Number of users tracked in shared memory, failed logins before a lockout and initial lockout time in seconds"),
+    AP_INIT_TAKE23("TOTPAuthHeavyHitters", set_totp_auth_heavy_hitters,
+                   NULL,
+                   RSRC_CONF,
+                   "Number of heaviest users and clients to track, window in seconds and optional number of failures per window to deny"),
+    AP_INIT_TAKE1("TOTPAuthHmacBudget", set_totp_auth_hmac_budget,
+                  NULL,
+                  RSRC_CONF,
+                  "Number of code computations per second before code windows are narrowed (0 for unlimited)"),
+    AP_INIT_TAKE1("TOTPAuthStateCache", set_totp_auth_state_cache,
+                  NULL,
+                  RSRC_CONF,
+                  "Keep used codes and login attempts in a socache provider instead of files, e.g. memcache:host:port"),
+    AP_INIT_TAKE1("TOTPAuthWriteBehind", set_totp_auth_write_behind,
+                  NULL,
+                  RSRC_CONF,
+                  "Also write the TOTPAuthStateCache state to the state files, at most this many seconds after it changed (0 to disable)"),
+    AP_INIT_TAKE12("TOTPAuthSnapshot", set_totp_auth_snapshot,
+                   NULL,
+                   RSRC_CONF,
+                   "File to keep the shared memory state in across restarts, and the interval between snapshots in seconds (default 60)"),
+    AP_INIT_TAKE1("TOTPAuthPeerListen", set_totp_auth_peer_listen,
+                  NULL,
+                  RSRC_CONF,
+                  "[Address:]port to receive used codes and login attempts of the TOTPAuthPeers on (UDP)"),
+    AP_INIT_ITERATE("TOTPAuthPeers", set_totp_auth_peers,
+                    NULL,
+                    RSRC_CONF,
+                    "Host:port of the nodes to send used codes and login attempts to (UDP)"),
+    AP_INIT_TAKE1("TOTPAuthPeerSecret", set_totp_auth_peer_secret,
+                  NULL,
+                  RSRC_CONF,
+                  "Secret shared by all peers to sign their messages"),
+    AP_INIT_TAKE1("TOTPAuthMasterKey", set_totp_auth_master_key,
+                  NULL,
+                  RSRC_CONF,
+                  "File with the key to decrypt user configurations encrypted by totpenc"),
+    AP_INIT_TAKE2("TOTPAuthConfigCache", set_totp_auth_config_cache,
+                  NULL,
+                  RSRC_CONF,
+                  "Number of user configurations to cache in each process and their lifetime in seconds"),
+    AP_INIT_TAKE1("TOTPAuthVerdictCache", set_totp_auth_verdict_cache,
+                  NULL,
+                  RSRC_CONF,
+                  "Number of successful Basic authentication verdicts to cache in shared memory (0 to disable)"),
+    {NULL}
+};
+
+/* Shared memory zones */
+
+typedef struct {
+    const char     *mutex_type; /* mutex type registered in pre_config */
+    apr_size_t      size;       /* zone size in bytes, 0 if zone is unused */
+    apr_shm_t      *shm;
+    apr_global_mutex_t *mutex;
+    void           *base;
+} totp_shm_zone;
+
+/**
+  * \brief totp_shm_zone_register Register the mutex type protecting a shared memory zone
+  * \param zone Pointer to the zone
+  * \param pconf Configuration pool
+  * \return APR_SUCCESS on success, error code otherwise
+ **/
+static          apr_status_t
+totp_shm_zone_register(totp_shm_zone *zone, apr_pool_t *pconf)
+{
+    zone->size = 0;
+    zone->shm = NULL;
+    zone->mutex = NULL;
+    zone->base = NULL;
+
+    return ap_mutex_register(pconf, zone->mutex_type, NULL, APR_LOCK_DEFAULT, 0);
+}
+
+/**
+  * \brief totp_shm_zone_create Create a shared memory zone and its mutex, the zone memory is zeroed
+  * \param zone Pointer to the zone, zone->size must be set
+  * \param pconf Configuration pool
+  * \param s Server record
+  * \return APR_SUCCESS on success, error code otherwise
+ **/
+static          apr_status_t
+totp_shm_zone_create(totp_shm_zone *zone, apr_pool_t *pconf, server_rec *s)
+{
+    apr_status_t    status;
+    const char     *shm_filename = NULL;
+
+    /* try an anonymous segment first, fall back to a name-based one */
+    status = apr_shm_create(&zone->shm, zone->size, NULL, pconf);
+    if (APR_ENOTIMPL == status) {
+        shm_filename =
+            ap_runtime_dir_relative(pconf,
+                                    apr_pstrcat(pconf, zone->mutex_type,
+                                                ".shm", NULL));
+        apr_shm_remove(shm_filename, pconf);
+        status = apr_shm_create(&zone->shm, zone->size, shm_filename, pconf);
+    }
+    if (APR_SUCCESS != status) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, status, s,
+                     "totp_shm_zone_create: could not create shared memory zone \"%s\" of %"
+                     APR_SIZE_T_FMT " bytes", zone->mutex_type, zone->size);
+        return status;
     }
 
-    apr_file_close(tmp_file);
+    zone->base = apr_shm_baseaddr_get(zone->shm);
+    memset(zone->base, 0, zone->size);
 
-    status = apr_file_rename(tmp_filepath, filepath, r->pool);
+    status = ap_global_mutex_create(&zone->mutex, NULL, zone->mutex_type, NULL,
+                                    s, pconf, 0);
     if (APR_SUCCESS != status) {
-        ap_log_rerror(APLOG_MARK, APLOG_ERR, status, r,
-                      "totp_update_file_helper: unable to move file \"%s\" to \"%s\"",
-                      tmp_filepath, filepath);
+        ap_log_error(APLOG_MARK, APLOG_ERR, status, s,
+                     "totp_shm_zone_create: could not create mutex for zone \"%s\"",
+                     zone->mutex_type);
         return status;
     }
 
     return APR_SUCCESS;
 }
 
-/* Authentication Helpers: Toekn Authentication */
-
 /**
-  * \brief generate_token_hash Generate token hash from TOTP password and timestamp
-  * \param timestamp Unix timestamp
-  * \param totp_code TOTP code
-  * \param totp_config Pointer to structure containing TOTP configuration
-  * \return Pointer to memory location that contains the SHA1 hash digest
+  * \brief totp_shm_zone_child_init Re-open the zone mutex in a child process
+  * \param zone Pointer to the zone
+  * \param p Child pool
+  * \param s Server record
  **/
-static unsigned char *
-generate_token_hash(apr_pool_t *pool, apr_time_t timestamp, unsigned int totp_code,
-                    const totp_user_config *totp_config)
+static void
+totp_shm_zone_child_init(totp_shm_zone *zone, apr_pool_t *p, server_rec *s)
 {
-    const apr_size_t challenge_len = sizeof(apr_time_t) + sizeof(unsigned int);
-    unsigned char   challenge_data[challenge_len];
-    unsigned char  *hash = apr_palloc(pool, APR_SHA1_DIGESTSIZE);
-
-    memcpy(challenge_data, &totp_code, sizeof(unsigned int));
-    memcpy(challenge_data + sizeof(unsigned int), &timestamp, sizeof(apr_time_t));
+    apr_status_t    status;
 
-    hmac_sha1(totp_config->shared_key,
-              totp_config->shared_key_len,
-              challenge_data, challenge_len, hash, APR_SHA1_DIGESTSIZE);
+    if (!zone->mutex)
+        return;
 
-    return hash;
+    status = apr_global_mutex_child_init(&zone->mutex,
+                                         apr_global_mutex_lockfile(zone->mutex), p);
+    if (APR_SUCCESS != status) {
+        ap_log_error(APLOG_MARK, APLOG_CRIT, status, s,
+                     "totp_shm_zone_child_init: could not re-open mutex for zone \"%s\"",
+                     zone->mutex_type);
+    }
 }
 
 /**
-  * \brief generate_authn_token Generate an authentication token
+  * \brief totp_shm_zone_lock Lock a shared memory zone
+  * \param zone Pointer to the zone
   * \param r Request
-  * \param timestamp Unix timestamp
-  * \param totp_code TOTP code
-  * \return Pointer to string containing the authentication token on success, NULL otherwise
+  * \return true if the zone is available and was locked, false otherwise
  **/
+static bool
+totp_shm_zone_lock(totp_shm_zone *zone, request_rec *r)
+{
+    apr_status_t    status;
+
+    if (!zone->base)
+        return false;
+
+    status = apr_global_mutex_lock(zone->mutex);
+    if (APR_SUCCESS != status) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, status, r,
+                      "totp_shm_zone_lock: could not lock zone \"%s\"",
+                      zone->mutex_type);
+        return false;
+    }
+
+    return true;
+}
+
+static void
+totp_shm_zone_unlock(totp_shm_zone *zone)
+{
+    apr_global_mutex_unlock(zone->mutex);
+}
+
+/* Authentication Helpers */
+
+#define TOTP_MAX_SECRET_LEN     128
+#define TOTP_MAX_USER_LEN       64
+#define TOTP_MAX_SCRATCH_TEXT   128     /* 10 codes of 8 digits and CRLF */
+
+typedef struct {
+    unsigned char   shared_key[TOTP_MAX_SECRET_LEN];
+    apr_size_t      shared_key_len;
+    bool            disallow_reuse;
+    unsigned char   window_size;
+    unsigned int    rate_limit_count;
+    apr_time_t      rate_limit_seconds;
+    totp_hmac_ctx   hmac;       /* HMAC state after the key, see hmac_sha1_init */
+    unsigned int    scratch_codes[10];
+    unsigned char   scratch_codes_count;
+    bool            scratch_parsed;
+    unsigned char   scratch_text_len;
+    char            scratch_text[TOTP_MAX_SCRATCH_TEXT];    /* unparsed lines */
+} totp_user_config;
+
+typedef struct {
+    totp_user_config *conf;
+    apr_time_t      exp;
+    unsigned int    res;
+} totp_file_helper_cb_data;
+
+/**
+ * \brief totp_file_helper_cb Callback function used by check_n_update_file_helper
+ * \param new Pointer to new data entry
+ * \param old Pointer to an existing data entry
+ * \param data Pointert to callback function data
+ * \return if old if not NULL then retunr true if existing entry should be kept, false otherwise.
+ * When old is NULL, return if true if new entry should be appended to the file, false otherwise.
+**/
+typedef bool    (*totp_file_helper_cb)(const void *new, const void *old,
+                                       totp_file_helper_cb_data * data);
+
+bool            cb_check_code(const void *new, const void *old,
+                              totp_file_helper_cb_data * data);
+bool            cb_verify_code(const void *new, const void *old,
+                               totp_file_helper_cb_data * data);
+bool            cb_rate_limit(const void *new, const void *old,
+                              totp_file_helper_cb_data * data);
+
+/* Per-process directory handles */
+
+/*
+ * Each child opens every TOTPAuthTokenDir and TOTPAuthStateDir once and
+ * opens, creates, renames and removes the user files relative to the
+ * directory handle, so the kernel does not resolve the whole path for each
+ * of these calls. A directory that is replaced requires a restart.
+ */
+typedef struct {
+    apr_pool_t     *pool;
+    apr_hash_t     *fds;        /* directory path to descriptor */
+#if APR_HAS_THREADS
+    apr_thread_mutex_t *mutex;
+#endif
+} totp_dir_cache;
+
+static totp_dir_cache dir_cache;
+
+static          apr_status_t
+dir_cache_cleanup(void *data)
+{
+    apr_hash_index_t *hi;
+    int            *fd;
+
+    for (hi = apr_hash_first(NULL, dir_cache.fds); hi; hi = apr_hash_next(hi)) {
+        apr_hash_this(hi, NULL, NULL, (void **) &fd);
+        close(*fd);
+    }
+    memset(&dir_cache, 0, sizeof(dir_cache));
+
+    return APR_SUCCESS;
+}
+
+/**
+  * \brief dir_cache_child_init Set up the directory handles of a child process
+ **/
+static void
+dir_cache_child_init(apr_pool_t *p, server_rec *s)
+{
+#if APR_HAS_THREADS
+    if (APR_SUCCESS !=
+        apr_thread_mutex_create(&dir_cache.mutex, APR_THREAD_MUTEX_DEFAULT, p)) {
+        ap_log_error(APLOG_MARK, APLOG_CRIT, 0, s,
+                     "dir_cache_child_init: could not create mutex, user files will be opened by path");
+        return;
+    }
+#endif
+
+    dir_cache.pool = p;
+    dir_cache.fds = apr_hash_make(p);
+
+    apr_pool_cleanup_register(p, NULL, dir_cache_cleanup,
+                              apr_pool_cleanup_null);
+}
+
+/**
+  * \brief dir_cache_lookup Get the handle of the directory a user file path was built from
+  * \param dir Directory
+  * \param filepath Path of the file
+  * \param name Pointer to store the path of the file relative to the directory
+  * \return Directory descriptor, -1 if the file has to be accessed by its path
+ **/
+static int
+dir_cache_lookup(const char *dir, const char *filepath, const char **name)
+{
+    apr_size_t      len;
+    int            *fd;
+    int             dirfd;
+
+    if (!dir_cache.fds || !dir)
+        return -1;
+
+    len = strlen(dir);
+    if (strncmp(filepath, dir, len) || (filepath[len] != '/'))
+        return -1;
+
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(dir_cache.mutex);
+#endif
+    fd = apr_hash_get(dir_cache.fds, dir, len);
+    if (!fd && ((dirfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) >= 0)) {
+        fd = apr_palloc(dir_cache.pool, sizeof(int));
+        *fd = dirfd;
+        apr_hash_set(dir_cache.fds, apr_pstrmemdup(dir_cache.pool, dir, len),
+                     len, fd);
+    }
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(dir_cache.mutex);
+#endif
+
+    if (!fd)
+        return -1;
+
+    *name = filepath + len + 1;
+    return *fd;
+}
+
+/**
+  * \brief user_file_cleanup Close a user file opened relative to its directory, unless it was closed
+ **/
+static          apr_status_t
+user_file_cleanup(void *data)
+{
+    apr_file_t     *file = data;
+    apr_os_file_t   fd;
+
+    if ((APR_SUCCESS == apr_os_file_get(&fd, file)) && (fd >= 0))
+        apr_file_close(file);
+
+    return APR_SUCCESS;
+}
+
+/**
+  * \brief user_file_open Open a user file, like apr_file_open
+  * \param r Request
+  * \param dir Directory the file path was built from
+  * \param filepath Path of the file
+  * \param flag APR_FOPEN_* flags
+  * \param perm Permissions of a created file
+  * \param file Pointer to store the file handle
+  * \return APR_SUCCESS on success, error code otherwise
+ **/
+static          apr_status_t
+user_file_open(request_rec *r, const char *dir, const char *filepath,
+               apr_int32_t flag, apr_fileperms_t perm, apr_file_t **file)
+{
+    const char     *name;
+    int             dirfd = dir_cache_lookup(dir, filepath, &name);
+    int             oflags, fd;
+    mode_t          mode;
+    apr_status_t    status;
+
+    if (dirfd < 0)
+        return apr_file_open(file, filepath, flag, perm, r->pool);
+
+    if ((flag & APR_FOPEN_READ) && (flag & APR_FOPEN_WRITE))
+        oflags = O_RDWR;
+    else
+        oflags = (flag & APR_FOPEN_WRITE) ? O_WRONLY : O_RDONLY;
+    if (flag & APR_FOPEN_CREATE)
+        oflags |= O_CREAT;
+    if (flag & APR_FOPEN_EXCL)
+        oflags |= O_EXCL;
+    if (flag & APR_FOPEN_TRUNCATE)
+        oflags |= O_TRUNC;
+
+    /* APR_UREAD etc. are the permission bits shifted by one hex digit per class */
+    if (perm == APR_FPROT_OS_DEFAULT)
+        mode = 0666;
+    else
+        mode = (((perm >> 8) & 7) << 6) | (((perm >> 4) & 7) << 3) | (perm & 7);
+
+    if ((fd = openat(dirfd, name, oflags | O_CLOEXEC, mode)) < 0)
+        return APR_FROM_OS_ERROR(errno);
+
+    status = apr_os_file_put(file, &fd, flag & (APR_FOPEN_READ |
+                                                APR_FOPEN_WRITE |
+                                                APR_FOPEN_BUFFERED), r->pool);
+    if (APR_SUCCESS != status) {
+        close(fd);
+        return status;
+    }
+    apr_pool_cleanup_register(r->pool, *file, user_file_cleanup,
+                              apr_pool_cleanup_null);
+
+    return APR_SUCCESS;
+}
+
+/**
+  * \brief user_file_rename Rename a user file within its directory, like apr_file_rename
+ **/
+static          apr_status_t
+user_file_rename(request_rec *r, const char *dir, const char *from_path,
+                 const char *to_path)
+{
+    const char     *from, *to;
+    int             dirfd = dir_cache_lookup(dir, from_path, &from);
+
+    if ((dirfd < 0) || (dir_cache_lookup(dir, to_path, &to) < 0))
+        return apr_file_rename(from_path, to_path, r->pool);
+
+    return (renameat(dirfd, from, dirfd, to) < 0) ?
+        APR_FROM_OS_ERROR(errno) : APR_SUCCESS;
+}
+
+/**
+  * \brief user_file_remove Remove a user file, like apr_file_remove
+ **/
+static          apr_status_t
+user_file_remove(request_rec *r, const char *dir, const char *filepath)
+{
+    const char     *name;
+    int             dirfd = dir_cache_lookup(dir, filepath, &name);
+
+    if (dirfd < 0)
+        return apr_file_remove(filepath, r->pool);
+
+    return (unlinkat(dirfd, name, 0) < 0) ? APR_FROM_OS_ERROR(errno) : APR_SUCCESS;
+}
+
+/**
+  * \brief user_file_path Build the path of a user's file in the token or state directory
+  * \param r Request
+  * \param dir Directory
+  * \param user User name
+  * \param suffix File name suffix, e.g. ".codes"
+  * \return Path of the file
+ **/
+static char    *
+user_file_path(request_rec *r, const char *dir, const char *user,
+               const char *suffix)
+{
+    totp_auth_config_rec *conf =
+        ap_get_module_config(r->per_dir_config, &authn_totp_module);
+    unsigned char   digest[APR_MD5_DIGESTSIZE];
+
+    if (!conf->hashed_dirs)
+        return apr_pstrcat(r->pool, dir, "/", user, suffix, NULL);
+
+    /* fan out over 65536 directories, see totp-hash-dirs.sh */
+    apr_md5(digest, user, strlen(user));
+    return apr_psprintf(r->pool, "%s/%02x/%02x/%s%s", dir, digest[0],
+                        digest[1], user, suffix);
+}
+
+/**
+  * \brief create_parent_dir Create the missing directories of a file in a hashed directory
+  * \param r Request
+  * \param filepath Path of the file
+  * \return APR_SUCCESS if directories were created, error code otherwise
+ **/
+static          apr_status_t
+create_parent_dir(request_rec *r, const char *filepath)
+{
+    totp_auth_config_rec *conf =
+        ap_get_module_config(r->per_dir_config, &authn_totp_module);
+    const char     *sep = strrchr(filepath, '/');
+
+    if (!conf->hashed_dirs || !sep)
+        return APR_ENOENT;
+
+    return apr_dir_make_recursive(apr_pstrmemdup(r->pool, filepath,
+                                                 sep - filepath),
+                                  APR_UREAD | APR_UWRITE | APR_UEXECUTE,
+                                  r->pool);
+}
+
+/**
+  * \brief config_next_line Find the next line of a user configuration, without leading and trailing white space
+  * \param pos Pointer to the current position, moved past the line
+  * \param end End of the configuration
+  * \param len Function returns the length of the line
+  * \return Start of the line, NULL at the end of the configuration
+ **/
+static const char *
+config_next_line(const char **pos, const char *end, apr_size_t *len)
+{
+    const char     *line = *pos, *eol;
+
+    if (line >= end)
+        return NULL;
+
+    eol = memchr(line, '\n', end - line);
+    *pos = eol ? eol + 1 : end;
+    if (!eol)
+        eol = end;
+
+    while ((line < eol) && apr_isspace(*line))
+        ++line;
+    while ((eol > line) && apr_isspace(eol[-1]))
+        --eol;
+
+    *len = eol - line;
+    return line;
+}
+
+/**
+  * \brief config_next_token Find the next space separated token of an option line
+  * \param pos Pointer to the current position, moved past the token
+  * \param end End of the line
+  * \param len Function returns the length of the token, 0 if there is none
+  * \return Start of the token
+ **/
+static const char *
+config_next_token(const char **pos, const char *end, apr_size_t *len)
+{
+    const char     *token = *pos;
+
+    while ((token < end) && (*token == ' '))
+        ++token;
+    for (*pos = token; (*pos < end) && (**pos != ' '); ++*pos);
+
+    *len = *pos - token;
+    return token;
+}
+
+/**
+  * \brief config_token_number Convert a token of digits to a number, capped at 1000000000
+  * \return true if the token is a number, false otherwise
+ **/
+static bool
+config_token_number(const char *token, apr_size_t len, apr_int64_t *value)
+{
+    apr_size_t      i;
+
+    *value = 0;
+    for (i = 0; i < len; ++i) {
+        if (!apr_isdigit(token[i]))
+            return false;
+        *value = min(*value * 10 + (token[i] - '0'), 1000000000);
+    }
+
+    return (len > 0);
+}
+
+/**
+  * \brief read_user_config Parse a user's TOTP configuration in a single pass, scratch codes are left to parse_scratch_codes()
+  * \param r Request
+  * \param config_filename Name of the configuration for log messages
+  * \param data Configuration in the format of a Google Authenticator file
+  * \param len Length of the configuration in bytes
+  * \param user_config Pointer to memory location to store the TOTP configuration
+  * \return true on success, false otherwise
+ **/
+static bool
+read_user_config(request_rec *r, const char *config_filename, const char *data,
+                 apr_size_t len, totp_user_config *user_config)
+{
+    const char     *pos = data, *end = data + len;
+    const char     *line, *line_end, *token;
+    const char     *scratch = NULL, *scratch_end = NULL;
+    apr_size_t      line_len, token_len, key_len = 0;
+    apr_int64_t     value;
+    unsigned int    line_no = 0;
+    apr_status_t    status;
+
+    memset(user_config, 0, sizeof(*user_config));
+
+    while ((line = config_next_line(&pos, end, &line_len))) {
+        line_end = line + line_len;
+        /* Bump line number counter */
+        line_no++;
+        /* Skip blank lines. */
+        if (!line_len)
+            continue;
+        /* Parse authentication settings. */
+        if (line[0] == '"') {
+            line += min(line_len, 2);
+            token = config_next_token(&line, line_end, &token_len);
+            if (!token_len) {
+                ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r,
+                              "read_user_config: skipping comment line at line %d",
+                              line_no);
+            } else if ((token_len == 14) &&
+                       (0 == memcmp(token, "DISALLOW_REUSE", 14))) {
+                user_config->disallow_reuse = true;
+            } else if ((token_len == 11) &&
+                       (0 == memcmp(token, "WINDOW_SIZE", 11))) {
+                token = config_next_token(&line, line_end, &token_len);
+
+                if (!config_token_number(token, token_len, &value))
+                    ap_log_rerror(APLOG_MARK,
+                                  APLOG_ERR,
+                                  0, r,
+                                  "read_user_config: window size value \"%.*s\" contains invalid characters at line %d",
+                                  (int) token_len, token, line_no);
+                else
+                    user_config->window_size = min(value, 32);
+            } else if ((token_len == 10) &&
+                       (0 == memcmp(token, "RATE_LIMIT", 10))) {
+                token = config_next_token(&line, line_end, &token_len);
+
+                if (!config_token_number(token, token_len, &value))
+                    ap_log_rerror(APLOG_MARK,
+                                  APLOG_ERR,
+                                  0, r,
+                                  "read_user_config: rate limit count value \"%.*s\" contains invalid characters at line %d",
+                                  (int) token_len, token, line_no);
+                else
+                    user_config->rate_limit_count = min(value, 5);
+
+                token = config_next_token(&line, line_end, &token_len);
+
+                if (!config_token_number(token, token_len, &value)) {
+                    user_config->rate_limit_count = 0;
+                    ap_log_rerror(APLOG_MARK,
+                                  APLOG_ERR,
+                                  0, r,
+                                  "read_user_config: rate limit seconds value \"%.*s\" contains invalid characters at line %d",
+                                  (int) token_len, token, line_no);
+                } else
+                    user_config->rate_limit_seconds = min(value, 300);
+            } else
+                ap_log_rerror(APLOG_MARK, APLOG_DEBUG,
+                              0, r,
+                              "read_user_config: unrecognized directive \"%.*s\" at line %d",
+                              (int) token_len, token, line_no);
+        }
+        /* Shared key is on the first valid line, decoded straight from the buffer */
+        else if (!user_config->shared_key_len) {
+            status = apr_decode_base32_binary(NULL, line, line_len,
+                                              APR_ENCODE_NONE, &key_len);
+            if ((APR_SUCCESS == status) && (key_len <= TOTP_MAX_SECRET_LEN))
+                status = apr_decode_base32_binary(user_config->shared_key, line,
+                                                  line_len, APR_ENCODE_NONE,
+                                                  &user_config->shared_key_len);
+
+            if ((APR_SUCCESS != status) || (key_len > TOTP_MAX_SECRET_LEN)
+                || !user_config->shared_key_len) {
+                ap_log_rerror(APLOG_MARK, APLOG_ERR, status, r,
+                              "read_user_config: could not find a valid BASE32 encoded secret of at most %d bytes at line %d",
+                              TOTP_MAX_SECRET_LEN, line_no);
+                memset(user_config, 0, sizeof(*user_config));
+                return false;
+            }
+        }
+        /* Scratch codes, only parsed if a scratch code is entered */
+        else {
+            if (!scratch)
+                scratch = line;
+            scratch_end = line_end;
+        }
+    }
+
+    if (!user_config->shared_key_len) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r,
+                      "read_user_config: no secret found in user configuration \"%s\"",
+                      config_filename);
+        return false;
+    }
+
+    hmac_sha1_init(&user_config->hmac, user_config->shared_key,
+                   user_config->shared_key_len);
+
+    if (scratch) {
+        /* cut at the last line that fits, parse_scratch_codes() skips the rest */
+        len = scratch_end - scratch;
+        if (len > sizeof(user_config->scratch_text)) {
+            len = sizeof(user_config->scratch_text);
+            while (len && (scratch[len] != '\n'))
+                --len;
+        }
+        memcpy(user_config->scratch_text, scratch, len);
+        user_config->scratch_text_len = len;
+    }
+
+    return true;
+}
+
+/**
+  * \brief parse_scratch_codes Parse the scratch codes of a user's TOTP configuration once they are needed
+  * \param r Request
+  * \param user_config Pointer to the TOTP configuration
+ **/
+static void
+parse_scratch_codes(request_rec *r, totp_user_config *user_config)
+{
+    const char     *pos = user_config->scratch_text;
+    const char     *end = pos + user_config->scratch_text_len;
+    const char     *line;
+    apr_size_t      line_len;
+    apr_int64_t     value;
+
+    if (user_config->scratch_parsed)
+        return;
+    user_config->scratch_parsed = true;
+
+    while ((line = config_next_line(&pos, end, &line_len))) {
+        /* option lines may follow the scratch codes */
+        if (!line_len || (line[0] == '"'))
+            continue;
+
+        /* validate scratch code */
+        if (!config_token_number(line, line_len, &value))
+            ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r,
+                          "parse_scratch_codes: scratch code \"%.*s\" contains invalid characters and was skipped",
+                          (int) line_len, line);
+        else if (user_config->scratch_codes_count < 10)
+            user_config->scratch_codes[user_config->scratch_codes_count++]
+                = value;
+        else
+            ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r,
+                          "parse_scratch_codes: scratch code \"%.*s\" was skipped, only 10 scratch codes per user are supported",
+                          (int) line_len, line);
+    }
+}
+
+/* Secret Providers */
+
+#define TOTP_MAX_CONFIG_LEN     (TOTPENC_MAX_PLAIN_LEN + TOTPENC_OVERHEAD)
+
+/**
+  * \brief file_get_user_secret Read a user's configuration file in TOTPAuthTokenDir
+ **/
+static          apr_status_t
+file_get_user_secret(request_rec *r, const char *user, const char *token_dir,
+                     const char **data, apr_size_t *len)
+{
+    char           *config_filename = user_file_path(r, token_dir, user, "");
+    char           *buf;
+    apr_file_t     *file;
+    apr_finfo_t     finfo;
+    apr_status_t    status;
+
+    status = user_file_open(r, token_dir, config_filename, APR_FOPEN_READ,
+                            APR_FPROT_OS_DEFAULT, &file);
+    if (APR_STATUS_IS_ENOENT(status))
+        return APR_NOTFOUND;
+    if (APR_SUCCESS != status) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, status, r,
+                      "file_get_user_secret: could not open user configuration file \"%s\"",
+                      config_filename);
+        return status;
+    }
+
+    status = apr_file_info_get(&finfo, APR_FINFO_SIZE, file);
+    if ((APR_SUCCESS == status) && (finfo.size > TOTP_MAX_CONFIG_LEN))
+        status = APR_EINVAL;
+    if (APR_SUCCESS == status) {
+        buf = apr_palloc(r->pool, finfo.size + 1);
+        status = apr_file_read_full(file, buf, finfo.size, len);
+    }
+    apr_file_close(file);
+
+    if (APR_SUCCESS != status) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, status, r,
+                      "file_get_user_secret: could not read user configuration file \"%s\"",
+                      config_filename);
+        return status;
+    }
+
+    buf[*len] = '\0';
+    *data = buf;
+    return APR_SUCCESS;
+}
+
+/**
+  * \brief dbm_get_user_secret Fetch a user's configuration from a DBM file, keyed by user name
+ **/
+static          apr_status_t
+dbm_get_user_secret(request_rec *r, const char *user, const char *arg,
+                    const char **data, apr_size_t *len)
+{
+    const char     *sep = ap_strchr_c(arg, ':');
+    const char     *type = apr_pstrmemdup(r->pool, arg, sep - arg);
+    apr_dbm_t      *dbm;
+    apr_datum_t     key, value;
+    apr_status_t    status;
+
+    status = apr_dbm_open_ex(&dbm, type, sep + 1, APR_DBM_READONLY,
+                             APR_OS_DEFAULT, r->pool);
+    if (APR_SUCCESS != status) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, status, r,
+                      "dbm_get_user_secret: could not open %s DBM file \"%s\"",
+                      type, sep + 1);
+        return status;
+    }
+
+    key.dptr = (char *) user;
+    key.dsize = strlen(user);
+    status = apr_dbm_fetch(dbm, key, &value);
+    if ((APR_SUCCESS == status) && !value.dptr)
+        status = APR_NOTFOUND;
+    if (APR_SUCCESS == status) {
+        *data = apr_pstrmemdup(r->pool, value.dptr, value.dsize);
+        *len = value.dsize;
+    } else if (status != APR_NOTFOUND) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, status, r,
+                      "dbm_get_user_secret: could not fetch \"%s\" from DBM file \"%s\"",
+                      user, sep + 1);
+    }
+    apr_dbm_close(dbm);
+
+    return status;
+}
+
+/**
+  * \brief dbd_get_user_secret Fetch a user's configuration from the first column of a prepared SQL query
+ **/
+static          apr_status_t
+dbd_get_user_secret(request_rec *r, const char *user, const char *label,
+                    const char **data, apr_size_t *len)
+{
+    ap_dbd_t       *dbd = dbd_acquire_fn(r);
+    apr_dbd_prepared_t *statement;
+    apr_dbd_results_t *res = NULL;
+    apr_dbd_row_t  *row = NULL;
+    const char     *value;
+    apr_status_t    status = APR_NOTFOUND;
+    int             ret;
+
+    if (!dbd) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r,
+                      "dbd_get_user_secret: could not acquire a database connection");
+        return APR_EGENERAL;
+    }
+
+    statement = apr_hash_get(dbd->prepared, label, APR_HASH_KEY_STRING);
+    if (!statement) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r,
+                      "dbd_get_user_secret: statement %s was not prepared", label);
+        return APR_EGENERAL;
+    }
+
+    if ((ret = apr_dbd_pvselect(dbd->driver, r->pool, dbd->handle, &res,
+                                statement, 0, user, NULL))) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r,
+                      "dbd_get_user_secret: query for \"%s\" failed: %s", user,
+                      apr_dbd_error(dbd->driver, dbd->handle, ret));
+        return APR_EGENERAL;
+    }
+
+    /* drain the results, some drivers require it */
+    for (ret = apr_dbd_get_row(dbd->driver, r->pool, res, &row, -1);
+         ret != -1;
+         ret = apr_dbd_get_row(dbd->driver, r->pool, res, &row, -1)) {
+        if (ret) {
+            ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r,
+                          "dbd_get_user_secret: could not fetch result for \"%s\": %s",
+                          user, apr_dbd_error(dbd->driver, dbd->handle, ret));
+            return APR_EGENERAL;
+        }
+        if ((status == APR_NOTFOUND) &&
+            (value = apr_dbd_get_entry(dbd->driver, row, 0))) {
+            *data = apr_pstrdup(r->pool, value);
+            *len = strlen(value);
+            status = APR_SUCCESS;
+        }
+    }
+
+    return status;
+}
+
+static const authn_totp_secret_provider file_secret_provider = {
+    &file_get_user_secret
+};
+
+static const authn_totp_secret_provider dbm_secret_provider = {
+    &dbm_get_user_secret
+};
+
+static const authn_totp_secret_provider dbd_secret_provider = {
+    &dbd_get_user_secret
+};
+
+/**
+  * \brief secret_source Get the TOTPAuthTokenDir or provider argument user secrets are fetched with
+  * \param conf Directory configuration
+  * \return Source of the secrets, NULL if TOTP authentication is not configured
+ **/
+static const char *
+secret_source(const totp_auth_config_rec *conf)
+{
+    return conf->secret_provider ? conf->secret_arg : conf->tokenDir;
+}
+
+/* Locked memory */
+
+/*
+ * The master key and the per-process cache of user configurations, which
+ * holds decrypted secrets, live in anonymous mappings that are locked into
+ * RAM, left out of core dumps and framed by inaccessible guard pages, so an
+ * overrun into or out of them faults instead of reading a secret.
+ */
+typedef struct {
+    char           *base;       /* mapping including the guard pages */
+    apr_size_t      size;
+    void           *data;
+    apr_size_t      data_size;
+} totp_slab;
+
+/**
+  * \brief slab_lock Lock a slab into RAM, locks are not inherited by forked children
+  * \param slab Pointer to the slab
+  * \return APR_SUCCESS on success, error code otherwise
+ **/
+static          apr_status_t
+slab_lock(totp_slab *slab)
+{
+    if (mlock(slab->data, slab->data_size) < 0)
+        return APR_FROM_OS_ERROR(errno);
+
+    return APR_SUCCESS;
+}
+
+/**
+  * \brief slab_create Map a zeroed slab between two guard pages and lock it
+  * \param slab Pointer to the slab
+  * \param size Usable size in bytes
+  * \return APR_SUCCESS on success, error code of mlock if only locking failed, slab->base is NULL on other errors
+ **/
+static          apr_status_t
+slab_create(totp_slab *slab, apr_size_t size)
+{
+    apr_size_t      page = sysconf(_SC_PAGESIZE);
+    apr_status_t    status;
+
+    memset(slab, 0, sizeof(*slab));
+    slab->data_size = (size + page - 1) / page * page;
+    slab->size = slab->data_size + 2 * page;
+
+    slab->base = mmap(NULL, slab->size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS,
+                      -1, 0);
+    if (slab->base == MAP_FAILED) {
+        status = APR_FROM_OS_ERROR(errno);
+        memset(slab, 0, sizeof(*slab));
+        return status;
+    }
+    slab->data = slab->base + page;
+
+    if (mprotect(slab->data, slab->data_size, PROT_READ | PROT_WRITE) < 0) {
+        status = APR_FROM_OS_ERROR(errno);
+        munmap(slab->base, slab->size);
+        memset(slab, 0, sizeof(*slab));
+        return status;
+    }
+#ifdef MADV_DONTDUMP
+    madvise(slab->data, slab->data_size, MADV_DONTDUMP);
+#endif
+
+    return slab_lock(slab);
+}
+
+/**
+  * \brief slab_destroy Zero and unmap a slab
+  * \param slab Pointer to the slab
+ **/
+static void
+slab_destroy(totp_slab *slab)
+{
+    if (!slab->base)
+        return;
+
+    OPENSSL_cleanse(slab->data, slab->data_size);
+    munlock(slab->data, slab->data_size);
+    munmap(slab->base, slab->size);
+    memset(slab, 0, sizeof(*slab));
+}
+
+/* Encrypted Secrets */
+
+/*
+ * With TOTPAuthMasterKey, user configurations starting with TOTPENC_MAGIC
+ * are decrypted with the master key after they were fetched, see totpenc.c.
+ * The plain text only exists while it is parsed; the parsed configuration
+ * is then kept in the locked TOTPAuthConfigCache, so cached users cost the
+ * same as with plain files.
+ */
+static totp_slab master_key;    /* TOTPENC_KEY_LEN bytes */
+
+/**
+  * \brief master_key_cleanup Zero the master key when the configuration is unloaded
+ **/
+static          apr_status_t
+master_key_cleanup(void *data)
+{
+    slab_destroy(&master_key);
+
+    return APR_SUCCESS;
+}
+
+/**
+  * \brief master_key_init Load the master key of TOTPAuthMasterKey into a locked slab
+  * \param pconf Configuration pool
+  * \param ptemp Temporary pool
+  * \param s Server record
+  * \return APR_SUCCESS on success, error code otherwise
+ **/
+static          apr_status_t
+master_key_init(apr_pool_t *pconf, apr_pool_t *ptemp, server_rec *s)
+{
+    totp_auth_server_config_rec *sconf =
+        ap_get_module_config(s->module_config, &authn_totp_module);
+    char            buf[2 * TOTPENC_KEY_LEN + 3];
+    apr_size_t      len = sizeof(buf), key_len = 0;
+    apr_file_t     *file;
+    apr_status_t    status;
+
+    if (!sconf->master_key_path)
+        return APR_SUCCESS;
+
+    status = apr_file_open(&file, sconf->master_key_path, APR_FOPEN_READ,
+                           APR_FPROT_OS_DEFAULT, ptemp);
+    if (APR_SUCCESS == status) {
+        status = apr_file_read_full(file, buf, len, &len);
+        if (APR_STATUS_IS_EOF(status))
+            status = APR_SUCCESS;
+        apr_file_close(file);
+    }
+    if (APR_SUCCESS != status) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, status, s,
+                     "master_key_init: could not read \"%s\"",
+                     sconf->master_key_path);
+        return status;
+    }
+    while (len && ((buf[len - 1] == '\n') || (buf[len - 1] == '\r')))
+        --len;
+
+    status = slab_create(&master_key, TOTPENC_KEY_LEN);
+    if (!master_key.base) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, status, s,
+                     "master_key_init: could not map memory for the master key");
+        OPENSSL_cleanse(buf, sizeof(buf));
+        return status;
+    }
+    if (APR_SUCCESS != status)
+        ap_log_error(APLOG_MARK, APLOG_WARNING, status, s,
+                     "master_key_init: could not lock the master key into memory");
+    apr_pool_cleanup_register(pconf, NULL, master_key_cleanup,
+                              apr_pool_cleanup_null);
+
+    /* 32 raw bytes or 64 hex digits */
+    if (len == TOTPENC_KEY_LEN) {
+        memcpy(master_key.data, buf, TOTPENC_KEY_LEN);
+        key_len = TOTPENC_KEY_LEN;
+    } else if ((len == 2 * TOTPENC_KEY_LEN) &&
+               (APR_SUCCESS != apr_decode_base16_binary(master_key.data, buf,
+                                                        len, APR_ENCODE_NONE,
+                                                        &key_len))) {
+        key_len = 0;
+    }
+    OPENSSL_cleanse(buf, sizeof(buf));
+
+    if (key_len != TOTPENC_KEY_LEN) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, s,
+                     "master_key_init: \"%s\" must hold %d bytes or %d hex digits",
+                     sconf->master_key_path, TOTPENC_KEY_LEN,
+                     2 * TOTPENC_KEY_LEN);
+        return APR_EINVAL;
+    }
+
+    if (!sconf->config_cache_size || !sconf->config_cache_ttl)
+        ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s,
+                     "master_key_init: without TOTPAuthConfigCache every login decrypts the user configuration");
+
+    return APR_SUCCESS;
+}
+
+/**
+  * \brief master_key_child_init Lock the master key into memory again in a child process
+ **/
+static void
+master_key_child_init(apr_pool_t *p, server_rec *s)
+{
+    apr_status_t    status;
+
+    if (master_key.base && (APR_SUCCESS != (status = slab_lock(&master_key))))
+        ap_log_error(APLOG_MARK, APLOG_WARNING, status, s,
+                     "master_key_child_init: could not lock the master key into memory");
+}
+
+/**
+  * \brief decrypt_user_config Decrypt a user configuration written by totpenc
+  * \param r Request
+  * \param user User name, authenticated along with the configuration
+  * \param data Pointer to the configuration, replaced by the plain text
+  * \param len Pointer to the length of the configuration, replaced by the length of the plain text
+  * \return true on success, false otherwise
+ **/
+static bool
+decrypt_user_config(request_rec *r, const char *user, const char **data,
+                    apr_size_t *len)
+{
+    const unsigned char *nonce = (const unsigned char *) *data +
+        TOTPENC_MAGIC_LEN;
+    const unsigned char *cipher = nonce + TOTPENC_NONCE_LEN;
+    apr_size_t      cipher_len;
+    unsigned char  *plain;
+    EVP_CIPHER_CTX *ctx;
+    int             outl, finl;
+    bool            ok;
+
+    if (!master_key.base) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r,
+                      "decrypt_user_config: configuration of \"%s\" is encrypted, but TOTPAuthMasterKey is not set",
+                      user);
+        return false;
+    }
+    if (*len < TOTPENC_MAGIC_LEN + TOTPENC_NONCE_LEN + TOTPENC_TAG_LEN) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r,
+                      "decrypt_user_config: configuration of \"%s\" is truncated",
+                      user);
+        return false;
+    }
+    cipher_len = *len - TOTPENC_MAGIC_LEN - TOTPENC_NONCE_LEN - TOTPENC_TAG_LEN;
+    plain = apr_palloc(r->pool, cipher_len + 1);
+
+    ok = (ctx = EVP_CIPHER_CTX_new()) != NULL;
+    if (ok) {
+        ok = EVP_DecryptInit_ex(ctx, EVP_aes_256_gcm(), NULL, NULL, NULL) &&
+            EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_IVLEN,
+                                TOTPENC_NONCE_LEN, NULL) &&
+            EVP_DecryptInit_ex(ctx, NULL, NULL, master_key.data, nonce) &&
+            EVP_DecryptUpdate(ctx, NULL, &outl, (const unsigned char *) user,
+                              strlen(user)) &&
+            EVP_DecryptUpdate(ctx, plain, &outl, cipher, cipher_len) &&
+            EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, TOTPENC_TAG_LEN,
+                                (void *) (cipher + cipher_len)) &&
+            (EVP_DecryptFinal_ex(ctx, plain + outl, &finl) > 0);
+        EVP_CIPHER_CTX_free(ctx);
+    }
+
+    if (!ok) {
+        OPENSSL_cleanse(plain, cipher_len);
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r,
+                      "decrypt_user_config: could not decrypt configuration of \"%s\", wrong master key or user",
+                      user);
+        return false;
+    }
+
+    plain[cipher_len] = '\0';
+    *data = (const char *) plain;
+    *len = cipher_len;
+    return true;
+}
+
+/* Per-process cache of user configurations */
+
+typedef struct {
+    const char     *token_dir;  /* points into the configuration */
+    char            user[TOTP_MAX_USER_LEN + 1];
+    apr_time_t      expires;
+    totp_user_config config;
+} totp_config_cache_rec;
+
+static struct {
+    unsigned int    size;
+    apr_time_t      ttl;
+#if APR_HAS_THREADS
+    apr_thread_mutex_t *mutex;
+#endif
+    totp_slab       slab;
+    totp_config_cache_rec *entries;     /* in the slab */
+} config_cache;
+
+/**
+  * \brief config_cache_index Get the index of the cache entry for a user
+ **/
+static unsigned int
+config_cache_index(const char *token_dir, const char *user)
+{
+    apr_uint32_t    hash = 2166136261U;     /* FNV-1a */
+    const char     *tmp;
+
+    for (tmp = token_dir; *tmp; ++tmp)
+        hash = (hash ^ (unsigned char) *tmp) * 16777619U;
+    for (tmp = user; *tmp; ++tmp)
+        hash = (hash ^ (unsigned char) *tmp) * 16777619U;
+
+    return hash % config_cache.size;
+}
+
+/**
+  * \brief lookup_user_config Look up a user's TOTP configuration in the per-process cache
+  * \param token_dir Directory contianing TOTP configuration
+  * \param user User name
+  * \param timestamp Current time
+  * \param user_config Pointer to memory location to store the TOTP configuration
+  * \return true if the configuration was found, false otherwise
+ **/
+static bool
+lookup_user_config(const char *token_dir, const char *user,
+                   apr_time_t timestamp, totp_user_config *user_config)
+{
+    totp_config_cache_rec *entry;
+    bool            found = false;
+
+    if (!config_cache.entries)
+        return false;
+
+    entry = &config_cache.entries[config_cache_index(token_dir, user)];
+
+#if APR_HAS_THREADS
+    if (config_cache.mutex)
+        apr_thread_mutex_lock(config_cache.mutex);
+#endif
+    if (entry->token_dir && (timestamp < entry->expires) &&
+        (0 == strcmp(entry->user, user)) &&
+        (0 == strcmp(entry->token_dir, token_dir))) {
+        memcpy(user_config, &entry->config, sizeof(*user_config));
+        found = true;
+    } else if (entry->token_dir && (timestamp >= entry->expires)) {
+        /* expired secrets do not linger until the entry is reused */
+        OPENSSL_cleanse(entry, sizeof(*entry));
+    }
+#if APR_HAS_THREADS
+    if (config_cache.mutex)
+        apr_thread_mutex_unlock(config_cache.mutex);
+#endif
+
+    return found;
+}
+
+/**
+  * \brief store_user_config Store a user's TOTP configuration in the per-process cache
+  * \param token_dir Directory contianing TOTP configuration
+  * \param user User name
+  * \param timestamp Current time
+  * \param user_config Pointer to the TOTP configuration
+ **/
+static void
+store_user_config(const char *token_dir, const char *user,
+                  apr_time_t timestamp, const totp_user_config *user_config)
+{
+    totp_config_cache_rec *entry;
+
+    if (!config_cache.entries || (strlen(user) > TOTP_MAX_USER_LEN))
+        return;
+
+    entry = &config_cache.entries[config_cache_index(token_dir, user)];
+
+#if APR_HAS_THREADS
+    if (config_cache.mutex)
+        apr_thread_mutex_lock(config_cache.mutex);
+#endif
+    OPENSSL_cleanse(entry, sizeof(*entry));
+    entry->token_dir = token_dir;
+    strcpy(entry->user, user);
+    entry->expires = timestamp + config_cache.ttl;
+    memcpy(&entry->config, user_config, sizeof(*user_config));
+#if APR_HAS_THREADS
+    if (config_cache.mutex)
+        apr_thread_mutex_unlock(config_cache.mutex);
+#endif
+}
+
+/**
+  * \brief config_cache_cleanup Zero the cached secrets when the process exits
+ **/
+static          apr_status_t
+config_cache_cleanup(void *data)
+{
+    slab_destroy(&config_cache.slab);
+    config_cache.entries = NULL;
+
+    return APR_SUCCESS;
+}
+
+/**
+  * \brief config_cache_child_init Create the per-process cache of user configurations
+  * \param p Child pool
+  * \param s Server record
+ **/
+static void
+config_cache_child_init(apr_pool_t *p, server_rec *s)
+{
+    totp_auth_server_config_rec *sconf =
+        ap_get_module_config(s->module_config, &authn_totp_module);
+    apr_status_t    status;
+
+    if (!sconf->config_cache_size || !sconf->config_cache_ttl)
+        return;
+
+#if APR_HAS_THREADS
+    if (APR_SUCCESS !=
+        apr_thread_mutex_create(&config_cache.mutex, APR_THREAD_MUTEX_DEFAULT, p)) {
+        ap_log_error(APLOG_MARK, APLOG_CRIT, 0, s,
+                     "config_cache_child_init: could not create mutex, user configurations will not be cached");
+        return;
+    }
+#endif
+
+    status = slab_create(&config_cache.slab,
+                         sconf->config_cache_size * sizeof(totp_config_cache_rec));
+    if (!config_cache.slab.base || ((APR_SUCCESS != status) && master_key.base)) {
+        ap_log_error(APLOG_MARK, APLOG_CRIT, status, s,
+                     "config_cache_child_init: could not map and lock memory, user configurations will not be cached");
+        slab_destroy(&config_cache.slab);
+        return;
+    }
+    if (APR_SUCCESS != status)
+        ap_log_error(APLOG_MARK, APLOG_INFO, status, s,
+                     "config_cache_child_init: could not lock the cache of user configurations into memory");
+
+    config_cache.size = sconf->config_cache_size;
+    config_cache.ttl = apr_time_from_sec(sconf->config_cache_ttl);
+    config_cache.entries = config_cache.slab.data;
+
+    apr_pool_cleanup_register(p, NULL, config_cache_cleanup,
+                              apr_pool_cleanup_null);
+}
+
+/**
+  * \brief get_user_config Based on the given username, get the users TOTP configuration
+  * \param r Request
+  * \param user User name
+  * \param user_config Pointer to memory location to store the TOTP configuration
+  * \return true on success, false otherwise
+ **/
+static bool
+get_user_config(request_rec *r, const char *user, totp_user_config *user_config)
+{
+    totp_auth_config_rec *conf =
+        ap_get_module_config(r->per_dir_config, &authn_totp_module);
+    const authn_totp_secret_provider *provider = conf->secret_provider ?
+        conf->secret_provider : &file_secret_provider;
+    const char     *source = secret_source(conf);
+    apr_time_t      timestamp = r->request_time;
+    const char     *data;
+    apr_size_t      len;
+    apr_status_t    status;
+    bool            encrypted, parsed;
+
+    if (!source) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r,
+                      "get_user_config: TOTPAuthTokenDir is not defined");
+        return false;
+    }
+
+    if (lookup_user_config(source, user, timestamp, user_config))
+        return true;
+
+    status = provider->get_user_secret(r, user, source, &data, &len);
+    if (APR_STATUS_IS_NOTFOUND(status))
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r,
+                      "get_user_config: no secret for user \"%s\"", user);
+    if (APR_SUCCESS != status)
+        return false;
+
+    encrypted = (len >= TOTPENC_MAGIC_LEN) &&
+        (0 == memcmp(data, TOTPENC_MAGIC, TOTPENC_MAGIC_LEN));
+    if (encrypted && !decrypt_user_config(r, user, &data, &len))
+        return false;
+
+    parsed = read_user_config(r, apr_pstrcat(r->pool, source, "/", user, NULL),
+                              data, len, user_config);
+    if (encrypted)
+        OPENSSL_cleanse((char *) data, len);
+    if (!parsed)
+        return false;
+
+    store_user_config(source, user, timestamp, user_config);
+
+    return true;
+}
+
+/**
+  * \brief generate_totp_code Generate a one time password using shared secret and timestamp
+  * \param timestamp Unix timestamp
+  * \param totp_config Pointer to structure containing TOTP configuration
+  * \param hash_out Either NULL or a pointer to memory location to store the SHA1 hash digest
+  * \return TOTP code as an unsigned integer
+ **/
+static unsigned int
+generate_totp_code(apr_time_t timestamp, const totp_user_config *totp_config)
+{
+    unsigned char   hash[APR_SHA1_DIGESTSIZE];
+    const size_t    challenge_size = sizeof(apr_time_t);
+    unsigned char   challenge_data[sizeof(apr_time_t)];
+    unsigned int    totp_code = 0;
+    totp_hmac_ctx   ctx;
+    int             j, offset;
+
+    for (j = challenge_size; j--; timestamp >>= 8)
+        challenge_data[j] = timestamp;
+
+    /* continue from the precomputed key state */
+    memcpy(&ctx, &totp_config->hmac, sizeof(ctx));
+    hmac_sha1_update(&ctx, challenge_data, challenge_size);
+    hmac_sha1_final(&ctx, hash, APR_SHA1_DIGESTSIZE);
+    offset = hash[APR_SHA1_DIGESTSIZE - 1] & 0xF;
+    for (j = 0; j < 4; ++j) {
+        totp_code <<= 8;
+        totp_code |= hash[offset + j];
+    }
+    memset(hash, 0, sizeof(hash));
+    totp_code &= 0x7FFFFFFF;
+    totp_code %= 1000000;
+
+    return totp_code;
+}
+
+/**
+  * \brief check_n_update_file_helper Update file entries and apend new entry
+  * \param r Request
+  * \param filepath Path to target file
+  * \param entry Pointer to new data entry
+  * \param entry_size Size of the entry data structure in bytes
+  * \param cb_check Pointer to callback function that is called on each entry
+  * \param cb_data Pointert to callback function data
+  * \param pool APR pool
+  * \return Pointer to structure containing TOTP configuration for given user on success, NULL otherwise
+ **/
+static          apr_status_t
+check_n_update_file_helper(request_rec *r, const char *filepath,
+                           const void *entry, apr_size_t entry_size,
+                           totp_file_helper_cb cb_check,
+                           totp_file_helper_cb_data *cb_data)
+{
+    totp_auth_config_rec *conf =
+        ap_get_module_config(r->per_dir_config, &authn_totp_module);
+    apr_status_t    status;
+    const char     *tmp_filepath;
+    apr_file_t     *tmp_file;
+    apr_file_t     *target_file;
+    apr_finfo_t     target_finfo;
+    apr_mmap_t     *target_mmap;
+    apr_size_t      bytes_written;
+    apr_time_t      timestamp = *((apr_time_t *) entry);
+    apr_size_t      entry_pos;
+    apr_time_t      entry_time;
+    const char     *file_data;
+
+    tmp_filepath = apr_psprintf(r->pool, "%s.%" APR_TIME_T_FMT, filepath, timestamp);
+
+    status = user_file_open(r, conf->stateDir,
+                            tmp_filepath,       /* file name */
+                            APR_FOPEN_EXCL |    /* return an error if file exists */
+                            APR_FOPEN_WRITE |   /* open file for writing */
+                            APR_FOPEN_CREATE |  /* create file if it does * not
+                                                 * exist */
+                            APR_FOPEN_BUFFERED |        /* buffered file IO */
+                            APR_FOPEN_TRUNCATE, /* truncate file to 0 length */
+                            APR_UREAD | APR_UWRITE,     /* set read/write
+                                                         * permissions * only for
+                                                         * owner */
+                            &tmp_file   /* temporary file handle */
+        );
+    /* the first file of a user in a hashed directory */
+    if (APR_STATUS_IS_ENOENT(status) &&
+        (APR_SUCCESS == create_parent_dir(r, filepath)))
+        status = user_file_open(r, conf->stateDir, tmp_filepath,
+                                APR_FOPEN_EXCL | APR_FOPEN_WRITE |
+                                APR_FOPEN_CREATE | APR_FOPEN_BUFFERED |
+                                APR_FOPEN_TRUNCATE, APR_UREAD | APR_UWRITE,
+                                &tmp_file);
+    if (APR_SUCCESS != status) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, status, r,
+                      "totp_update_file_helper: could not create temporary file \"%s\"",
+                      tmp_filepath);
+        return status;
+    }
+
+    status = user_file_open(r, conf->stateDir,
+                            filepath,   /* file name */
+                            APR_FOPEN_READ,     /* open file for reading */
+                            APR_FPROT_OS_DEFAULT,       /* default permissions */
+                            &target_file        /* target file handle */
+        );
+    if ((APR_SUCCESS != status) && (APR_ENOENT != status)) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, status, r,
+                      "totp_update_file_helper: could not open target file \"%s\"",
+                      filepath);
+        apr_file_close(tmp_file);
+        return status;
+    }
+
+    if (APR_ENOENT != status) {
+        /* Read current target file contents into a memory map */
+        if ((status =
+             apr_file_info_get(&target_finfo, APR_FINFO_SIZE,
+                               target_file)) != APR_SUCCESS) {
+            ap_log_rerror(APLOG_MARK, APLOG_ERR, status, r,
+                          "totp_update_file_helper: could not get target file \"%s\" size",
+                          filepath);
+            apr_file_close(tmp_file);
+            return status;
+        }
+        if ((status =
+             apr_mmap_create(&target_mmap, target_file, 0, target_finfo.size,
+                             APR_MMAP_READ, r->pool)) != APR_SUCCESS) {
+            ap_log_rerror(APLOG_MARK, APLOG_ERR, status, r,
+                          "totp_update_file_helper: could not load target file \"%s\" into memory",
+                          filepath);
+            apr_file_close(tmp_file);
+            return status;
+        }
+
+        /* close the target file once contents have been loaded into memory */
+        apr_file_close(target_file);
+
+        /* process the file contents */
+        file_data = target_mmap->mm;
+        for (entry_pos = 0; entry_pos < target_mmap->size;
+             entry_pos += entry_size, file_data += entry_size) {
+            entry_time = *((apr_time_t *) file_data);
+
+            if (timestamp >= entry_time) {
+                /* check if entry time is within time tolerance */
+                if ((*cb_check) (entry, file_data, cb_data)) {
+                    /* keep the entry */
+                    ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r,
+                                  "totp_update_file_helper: entry %ld is kept, cb_data->res = %u",
+                                  entry_time, cb_data->res);
+                    bytes_written = entry_size;
+                    if (((status =
+                          apr_file_write(tmp_file, file_data,
+                                         &bytes_written)) != APR_SUCCESS)
+                        || (bytes_written != entry_size)) {
+                        ap_log_rerror(APLOG_MARK, APLOG_ERR, status, r,
+                                      "totp_update_file_helper: could not write to temporary file \"%s\"",
+                                      tmp_filepath);
+                        apr_mmap_delete(target_mmap);
+                        apr_file_close(tmp_file);
+                        return status;
+                    }
+                } else {
+                    ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r,
+                                  "totp_update_file_helper: entry %ld is NOT kept, cb_data->res = %u",
+                                  entry_time, cb_data->res);
+                }
+            } else {
+                /* entry is in the future */
+                ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r,
+                              "totp_update_file_helper: entry %ld is in the future and will be dropped",
+                              entry_time);
+            }
+        }
+
+        /* delete the memory map */
+        apr_mmap_delete(target_mmap);
+    }
+
+    /* add current entry to file */
+    if ((*cb_check) (entry, NULL, cb_data)) {
+        ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r,
+                      "totp_update_file_helper: adding new entry %ld, cb_data->res = %u",
+                      timestamp, cb_data->res);
+        bytes_written = entry_size;
+        if (((status =
+              apr_file_write(tmp_file, entry, &bytes_written)) != APR_SUCCESS)
+            || (bytes_written != entry_size)) {
+            ap_log_rerror(APLOG_MARK, APLOG_ERR, status, r,
+                          "totp_update_file_helper: could not write to temporary file \"%s\"",
+                          tmp_filepath);
+            apr_file_close(tmp_file);
+            return status;
+        }
+    } else {
+        ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r,
+                      "totp_update_file_helper: NOT adding new entry %ld, cb_data->res = %u",
+                      timestamp, cb_data->res);
+    }
+
+    apr_file_close(tmp_file);
+
+    status = user_file_rename(r, conf->stateDir, tmp_filepath, filepath);
+    if (APR_SUCCESS != status) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, status, r,
+                      "totp_update_file_helper: unable to move file \"%s\" to \"%s\"",
+                      tmp_filepath, filepath);
+        return status;
+    }
+
+    return APR_SUCCESS;
+}
+
+/* Authentication Helpers: Request Data */
+
+/*
+ * What one hook found out about the credentials of a request is kept in
+ * r->request_config for the next one: the admission check runs before the
+ * provider and looks up the same verdict, user configuration and failed
+ * logins.
+ */
+typedef struct {
+    apr_hash_t     *blobs;      /* state of each user, see get_state_blob() */
+    const char     *user;       /* credentials seen by check_login_admission() */
+    const char     *password;
+    bool            verdict;    /* found in the verdict cache */
+    totp_user_config *user_config;      /* of the user, if read */
+    bool            logins_checked;     /* within TOTPAuthRateLimitFailures */
+} totp_request_rec;
+
+/**
+  * \brief get_request_rec Get the data of the current request
+  * \param r Request
+  * \param create Whether to create the data if missing
+  * \return Pointer to the data, NULL if missing and not created
+ **/
+static totp_request_rec *
+get_request_rec(request_rec *r, bool create)
+{
+    totp_request_rec *req = ap_get_module_config(r->request_config,
+                                                 &authn_totp_module);
+
+    if (!req && create) {
+        req = apr_pcalloc(r->pool, sizeof(*req));
+        ap_set_module_config(r->request_config, &authn_totp_module, req);
+    }
+    return req;
+}
+
+/* Authentication Helpers: State Cache */
+
+/*
+ * With TOTPAuthStateCache, the entries of "<user>.codes" and "<user>.logins"
+ * and the record of "<user>.state" are kept together in a single socache
+ * object per user, keyed by what would be the path of the files without
+ * suffix. The object is retrieved once per request, updated in memory by the
+ * same callbacks as the files, and stored back once by commit_user_state()
+ * when the request is done with it.
+ */
+#define TOTP_STATE_CODES        TOTPD_STATE_CODES
+#define TOTP_STATE_LOGINS       TOTPD_STATE_LOGINS
+#define TOTP_STATE_FILES        2   /* kinds kept in files by the write-behind */
+#define TOTP_STATE_USER         TOTPD_STATE_USER    /* the .state record, see read_user_state() */
+#define TOTP_STATE_KINDS        TOTPD_STATE_KINDS
+
+/* the layout is shared with totpd, which updates states in place */
+#define TOTP_STATE_BLOB_VERSION TOTPD_STATE_VERSION
+#define TOTP_STATE_BLOB_MAX     TOTPD_STATE_MAX
+#define TOTP_STATE_HEADER_LEN   TOTPD_STATE_HEADER_LEN
+
+/* the used scratch codes must outlive the used codes, within reason */
+#define TOTP_STATE_USER_EXPIRY  apr_time_from_sec(28 * 86400)
+
+typedef struct {
+    apr_time_t      timestamp;
+    unsigned int    totp_code;
+} totp_login_rec;
+
+/* fails to compile if totpd would not understand the entries */
+typedef char    totp_login_rec_check[(sizeof(totp_login_rec) ==
+                                      TOTPD_CODE_ENTRY_LEN) &&
+                                     (sizeof(apr_time_t) ==
+                                      TOTPD_LOGIN_ENTRY_LEN) ? 1 : -1];
+
+/* change of a user's state made by a request, replicated to the peers */
+#define TOTP_PEER_EVENT_CODE    1   /* code used */
+#define TOTP_PEER_EVENT_LOGIN   2   /* login attempt counted */
+#define TOTP_PEER_EVENT_CLEAR   3   /* login attempts cleared */
+#define TOTP_PEER_EVENT_SCRATCH 4   /* scratch codes used, the timestamp carries their fingerprint */
+
+typedef struct {
+    unsigned char   type;
+    apr_time_t      timestamp;
+    unsigned int    totp_code;
+} totp_peer_event;
+
+typedef struct {
+    const char     *key;
+    const char     *paths[TOTP_STATE_FILES];    /* state files, with TOTPAuthWriteBehind */
+    bool            found;      /* retrieved from the state cache */
+    bool            dirty;
+    bool            updated;    /* changed and already stored by totpd */
+    apr_size_t      len[TOTP_STATE_KINDS];
+    char           *data[TOTP_STATE_KINDS];
+    apr_array_header_t *events; /* totp_peer_event made by this request */
+} totp_state_blob;
+
+typedef struct {
+    const ap_socache_provider_t *provider;
+    ap_socache_instance_t *instance;
+    apr_global_mutex_t *mutex;  /* for providers that are not MP safe */
+    bool            updates;    /* the provider is totpd, see state_cache_update() */
+    server_rec     *s;
+} totp_state_cache;
+
+static totp_state_cache state_cache;
+static const char *state_cache_mutex_type = "authn-totp-state-cache";
+
+static void     send_peer_events(request_rec *r, const totp_state_blob *blob);
+static apr_status_t read_state_files(request_rec *r, totp_state_blob *blob);
+static void     queue_state_write(const totp_state_blob *blob);
+static bool     write_behind_running(void);
+static void     merge_user_state(totp_state_blob *blob,
+                                 apr_uint32_t fingerprint,
+                                 apr_uint32_t scratch_used, apr_pool_t *pool);
+static apr_status_t totpd_update(ap_socache_instance_t *instance,
+                                 server_rec *s, const unsigned char *key,
+                                 unsigned int key_len, apr_time_t expiry,
+                                 const unsigned char *update,
+                                 unsigned int update_len,
+                                 unsigned char *state,
+                                 unsigned int *state_len, apr_pool_t *pool);
+
+/**
+  * \brief state_blob_parse Take the entries of a state from its stored form
+  * \param blob Pointer to the state
+  * \param buf Stored state, referenced by the state afterwards
+  * \param buf_len Length of the stored state in bytes
+  * \return true on success, false if the stored state is invalid
+ **/
+static bool
+state_blob_parse(totp_state_blob *blob, unsigned char *buf, apr_size_t buf_len)
+{
+    apr_size_t      len;
+    int             i;
+
+    /* version | length of each kind | entries of each kind */
+    for (i = 0, len = 0; (buf_len >= TOTP_STATE_HEADER_LEN) &&
+         (i < TOTP_STATE_KINDS); ++i)
+        len += get_be32(buf + 4 + 4 * i);
+    if ((buf_len < TOTP_STATE_HEADER_LEN) ||
+        (get_be32(buf) != TOTP_STATE_BLOB_VERSION) ||
+        (len != buf_len - TOTP_STATE_HEADER_LEN))
+        return false;
+
+    for (i = 0, len = TOTP_STATE_HEADER_LEN; i < TOTP_STATE_KINDS; ++i) {
+        blob->len[i] = get_be32(buf + 4 + 4 * i);
+        blob->data[i] = blob->len[i] ? (char *) buf + len : "";
+        len += blob->len[i];
+    }
+    return true;
+}
+
+/**
+  * \brief state_cache_retrieve Retrieve the state stored under a key, an unknown key yields an empty state
+  * \param s Server record
+  * \param key State key
+  * \param blob Pointer to the state to fill in
+  * \param pool Pool to allocate the state from
+  * \return APR_SUCCESS on success, error code otherwise
+ **/
+static          apr_status_t
+state_cache_retrieve(server_rec *s, const char *key, totp_state_blob *blob,
+                     apr_pool_t *pool)
+{
+    unsigned char  *buf = apr_palloc(pool, TOTP_STATE_BLOB_MAX);
+    unsigned int    buf_len = TOTP_STATE_BLOB_MAX;
+    apr_status_t    status;
+    int             i;
+
+    memset(blob, 0, sizeof(*blob));
+    blob->key = key;
+
+    if (state_cache.mutex)
+        apr_global_mutex_lock(state_cache.mutex);
+    status = state_cache.provider->retrieve(state_cache.instance, s,
+                                            (const unsigned char *) key,
+                                            strlen(key), buf, &buf_len, pool);
+    if (state_cache.mutex)
+        apr_global_mutex_unlock(state_cache.mutex);
+
+    if (APR_SUCCESS == status) {
+        if (state_blob_parse(blob, buf, buf_len))
+            blob->found = true;
+        else
+            ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s,
+                         "state_cache_retrieve: ignoring invalid state of \"%s\"",
+                         key);
+    } else if (APR_STATUS_IS_NOTFOUND(status)) {
+        status = APR_SUCCESS;
+    }
+    for (i = 0; i < TOTP_STATE_KINDS; ++i) {
+        if (!blob->data[i])
+            blob->data[i] = "";
+    }
+
+    return status;
+}
+
+/**
+  * \brief state_cache_store Store a state under its key
+  * \param s Server record
+  * \param blob Pointer to the state
+  * \param pool Pool for temporary allocations
+  * \return APR_SUCCESS on success, error code otherwise
+ **/
+static          apr_status_t
+state_cache_store(server_rec *s, const totp_state_blob *blob, apr_pool_t *pool)
+{
+    unsigned char  *buf;
+    apr_size_t      len = TOTP_STATE_HEADER_LEN;
+    apr_time_t      expiry;
+    apr_status_t    status;
+    int             i;
+
+    for (i = 0; i < TOTP_STATE_KINDS; ++i)
+        len += blob->len[i];
+    buf = apr_palloc(pool, len);
+
+    put_be32(buf, TOTP_STATE_BLOB_VERSION);
+    for (i = 0, len = TOTP_STATE_HEADER_LEN; i < TOTP_STATE_KINDS; ++i) {
+        put_be32(buf + 4 + 4 * i, blob->len[i]);
+        memcpy(buf + len, blob->data[i], blob->len[i]);
+        len += blob->len[i];
+    }
+
+    expiry = apr_time_now() + (blob->len[TOTP_STATE_USER] ?
+                               TOTP_STATE_USER_EXPIRY :
+                               apr_time_from_sec(max(totp_max_expires, 300)));
+
+    if (state_cache.mutex)
+        apr_global_mutex_lock(state_cache.mutex);
+    status = state_cache.provider->store(state_cache.instance, s,
+                                         (const unsigned char *) blob->key,
+                                         strlen(blob->key), expiry, buf,
+                                         len, pool);
+    if (state_cache.mutex)
+        apr_global_mutex_unlock(state_cache.mutex);
+
+    return status;
+}
+
+/**
+  * \brief state_cache_update Let totpd change the entries of a kind in the stored state, and take over the result
+  * \param r Request
+  * \param blob Pointer to the state
+  * \param kind TOTP_STATE_CODES, TOTP_STATE_LOGINS or TOTP_STATE_USER
+  * \param mode TOTPD_UPDATE_* mode, see totpd.h
+  * \param window Age of the oldest entry kept
+  * \param entry Pointer to the entry, starting with its timestamp unless the kind is TOTP_STATE_USER
+  * \param entry_size Size of the entry in bytes
+  * \param count Pointer to add the number of entries counted by the mode to, or NULL
+  * \return APR_SUCCESS on success, error code otherwise
+ **/
+static          apr_status_t
+state_cache_update(request_rec *r, totp_state_blob *blob, int kind, int mode,
+                   apr_interval_time_t window, const void *entry,
+                   apr_size_t entry_size, unsigned int *count)
+{
+    unsigned char  *update = apr_palloc(r->pool, TOTPD_UPDATE_LEN + entry_size);
+    unsigned int    state_len = 4 + TOTP_STATE_BLOB_MAX;
+    unsigned char  *state = apr_palloc(r->pool, state_len);
+    apr_time_t      expiry;
+    apr_status_t    status;
+
+    /* entries read from the files would be lost otherwise */
+    if (blob->dirty) {
+        status = state_cache_store(r->server, blob, r->pool);
+        if (APR_SUCCESS != status)
+            return status;
+        blob->dirty = false;
+        blob->updated = true;
+    }
+
+    update[0] = kind;
+    update[1] = mode;
+    put_be64(update + 2, window);
+    memcpy(update + TOTPD_UPDATE_LEN, entry, entry_size);
+    expiry = apr_time_now() + ((kind == TOTP_STATE_USER) ?
+                               TOTP_STATE_USER_EXPIRY :
+                               apr_time_from_sec(max(totp_max_expires, 300)));
+
+    status = totpd_update(state_cache.instance, r->server,
+                          (const unsigned char *) blob->key,
+                          strlen(blob->key), expiry, update,
+                          TOTPD_UPDATE_LEN + entry_size, state, &state_len,
+                          r->pool);
+    if (APR_SUCCESS != status)
+        return status;
+    if ((state_len < 4) || !state_blob_parse(blob, state + 4, state_len - 4)) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r,
+                      "state_cache_update: invalid state of \"%s\"", blob->key);
+        return APR_EGENERAL;
+    }
+
+    if (count)
+        *count += get_be32(state);
+    blob->found = true;
+    blob->updated = true;
+
+    return APR_SUCCESS;
+}
+
+/**
+  * \brief state_update_mode Find the TOTPD_UPDATE_* mode with the effect of a callback of check_n_update_state()
+  * \param cb_check Callback
+  * \param cb_data Callback data
+  * \param window Pointer to the age of the oldest entry the callback keeps
+  * \return Mode, -1 for an unknown callback
+ **/
+static int
+state_update_mode(totp_file_helper_cb cb_check,
+                  const totp_file_helper_cb_data *cb_data,
+                  apr_interval_time_t *window)
+{
+    if (cb_check == cb_check_code) {
+        *window = apr_time_from_sec(cb_data->exp);
+        return TOTPD_UPDATE_APPEND | (cb_data->conf->disallow_reuse ?
+                                      TOTPD_UPDATE_SAME_CODE :
+                                      TOTPD_UPDATE_KEEP);
+    }
+    if (cb_check == cb_verify_code) {
+        *window = apr_time_from_sec(cb_data->exp);
+        return TOTPD_UPDATE_SAME_ENTRY;
+    }
+    if (cb_check == cb_rate_limit) {
+        *window = apr_time_from_sec(cb_data->conf->rate_limit_seconds);
+        return TOTPD_UPDATE_APPEND | TOTPD_UPDATE_EARLIER;
+    }
+    return -1;
+}
+
+/**
+  * \brief state_blob_set Replace the entries of a kind, dropping the oldest ones if the state grew too large
+  * \param blob Pointer to the state
+  * \param kind TOTP_STATE_CODES, TOTP_STATE_LOGINS or TOTP_STATE_USER
+  * \param data New entries
+  * \param len Length of the new entries in bytes
+  * \param entry_size Size of an entry in bytes
+  * \return true if entries had to be dropped, false otherwise
+ **/
+static bool
+state_blob_set(totp_state_blob *blob, int kind, char *data, apr_size_t len,
+               apr_size_t entry_size)
+{
+    apr_size_t      room = TOTP_STATE_BLOB_MAX - TOTP_STATE_HEADER_LEN;
+    apr_size_t      skip = 0;
+    int             i;
+
+    for (i = 0; i < TOTP_STATE_KINDS; ++i) {
+        if (i != kind)
+            room -= blob->len[i];
+    }
+
+    if (len > room) {
+        skip = (len - room + entry_size - 1) / entry_size * entry_size;
+        data += skip;
+        len -= skip;
+    }
+
+    if ((len != blob->len[kind]) || memcmp(data, blob->data[kind], len)) {
+        blob->data[kind] = data;
+        blob->len[kind] = len;
+        blob->dirty = true;
+    }
+
+    return (skip != 0);
+}
+
+/**
+  * \brief state_blob_add_event Remember a change of the state for the peers
+ **/
+static void
+state_blob_add_event(request_rec *r, totp_state_blob *blob, unsigned char type,
+                     apr_time_t timestamp, unsigned int totp_code)
+{
+    totp_peer_event *event;
+
+    if (!blob->events)
+        blob->events = apr_array_make(r->pool, 4, sizeof(totp_peer_event));
+
+    event = apr_array_push(blob->events);
+    event->type = type;
+    event->timestamp = timestamp;
+    event->totp_code = totp_code;
+}
+
+/**
+  * \brief get_state_blob Get the state of a user from the state cache, retrieved once per request
+  * \param r Request
+  * \param user User name
+  * \return Pointer to the state, NULL on error
+ **/
+static totp_state_blob *
+get_state_blob(request_rec *r, const char *user)
+{
+    totp_auth_config_rec *conf =
+        ap_get_module_config(r->per_dir_config, &authn_totp_module);
+    totp_request_rec *req = get_request_rec(r, true);
+    totp_state_blob *blob;
+    apr_status_t    status;
+    const char     *key;
+
+    key = user_file_path(r, conf->stateDir, user, "");
+
+    if (!req->blobs) {
+        req->blobs = apr_hash_make(r->pool);
+    } else if ((blob = apr_hash_get(req->blobs, key, APR_HASH_KEY_STRING))) {
+        return blob;
+    }
+
+    blob = apr_palloc(r->pool, sizeof(*blob));
+    status = state_cache_retrieve(r->server, key, blob, r->pool);
+    if (APR_SUCCESS != status) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, status, r,
+                      "get_state_blob: could not retrieve state of \"%s\"", key);
+        return NULL;
+    }
+
+    if (write_behind_running()) {
+        blob->paths[TOTP_STATE_CODES] =
+            user_file_path(r, conf->stateDir, user, ".codes");
+        blob->paths[TOTP_STATE_LOGINS] =
+            user_file_path(r, conf->stateDir, user, ".logins");
+        if (!blob->found && (APR_SUCCESS != read_state_files(r, blob)))
+            return NULL;
+    }
+
+    apr_hash_set(req->blobs, key, APR_HASH_KEY_STRING, blob);
+
+    return blob;
+}
+
+/**
+  * \brief commit_user_state Store the states changed by this request back to the state cache
+  * \param r Request
+ **/
+static void
+commit_user_state(request_rec *r)
+{
+    totp_request_rec *req = get_request_rec(r, false);
+    apr_hash_index_t *hi;
+    totp_state_blob *blob;
+    apr_status_t    status;
+
+    if (!state_cache.provider || !req || !req->blobs)
+        return;
+
+    for (hi = apr_hash_first(r->pool, req->blobs); hi; hi = apr_hash_next(hi)) {
+        apr_hash_this(hi, NULL, NULL, (void **) &blob);
+
+        if (blob->dirty) {
+            status = state_cache_store(r->server, blob, r->pool);
+            if (APR_SUCCESS != status)
+                ap_log_rerror(APLOG_MARK, APLOG_ERR, status, r,
+                              "commit_user_state: could not store state of \"%s\"",
+                              blob->key);
+            blob->dirty = false;
+            blob->updated = true;
+        }
+        if (blob->updated && blob->paths[TOTP_STATE_CODES])
+            queue_state_write(blob);
+        blob->updated = false;
+        if (blob->events && blob->events->nelts) {
+            send_peer_events(r, blob);
+            blob->events->nelts = 0;
+        }
+    }
+}
+
+/**
+  * \brief check_n_update_state Update the entries of a user's state and append a new entry
+  * \param r Request
+  * \param user User name
+  * \param kind TOTP_STATE_CODES or TOTP_STATE_LOGINS
+  * \param filepath Path to the state file used without a state cache
+  * \param entry Pointer to new data entry, starting with its timestamp
+  * \param entry_size Size of the entry data structure in bytes
+  * \param cb_check Pointer to callback function that is called on each entry
+  * \param cb_data Pointer to callback function data
+  * \return APR_SUCCESS on success, error code otherwise
+ **/
+static          apr_status_t
+check_n_update_state(request_rec *r, const char *user, int kind,
+                     const char *filepath, const void *entry,
+                     apr_size_t entry_size, totp_file_helper_cb cb_check,
+                     totp_file_helper_cb_data *cb_data)
+{
+    totp_state_blob *blob;
+    apr_time_t      timestamp = *((apr_time_t *) entry);
+    apr_time_t      entry_time;
+    apr_interval_time_t window;
+    apr_size_t      pos, len = 0;
+    apr_status_t    status;
+    char           *data;
+    int             mode;
+
+    if (!state_cache.provider)
+        return check_n_update_file_helper(r, filepath, entry, entry_size,
+                                          cb_check, cb_data);
+
+    if (!(blob = get_state_blob(r, user)))
+        return APR_EGENERAL;
+
+    /* totpd checks and appends in one step, no other request can interleave */
+    if (state_cache.updates &&
+        ((mode = state_update_mode(cb_check, cb_data, &window)) >= 0)) {
+        status = state_cache_update(r, blob, kind, mode, window, entry,
+                                    entry_size, &cb_data->res);
+        if ((APR_SUCCESS == status) && (mode & TOTPD_UPDATE_APPEND))
+            state_blob_add_event(r, blob, (kind == TOTP_STATE_CODES) ?
+                                 TOTP_PEER_EVENT_CODE : TOTP_PEER_EVENT_LOGIN,
+                                 timestamp, (kind == TOTP_STATE_CODES) ?
+                                 ((const totp_login_rec *) entry)->totp_code : 0);
+        return status;
+    }
+
+    /* same rules as check_n_update_file_helper: drop future and stale entries */
+    data = apr_palloc(r->pool, blob->len[kind] + entry_size);
+    for (pos = 0; pos + entry_size <= blob->len[kind]; pos += entry_size) {
+        memcpy(&entry_time, blob->data[kind] + pos, sizeof(apr_time_t));
+        if ((timestamp >= entry_time) &&
+            (*cb_check) (entry, blob->data[kind] + pos, cb_data)) {
+            memcpy(data + len, blob->data[kind] + pos, entry_size);
+            len += entry_size;
+        }
+    }
+    if ((*cb_check) (entry, NULL, cb_data)) {
+        memcpy(data + len, entry, entry_size);
+        len += entry_size;
+        if (kind == TOTP_STATE_CODES)
+            state_blob_add_event(r, blob, TOTP_PEER_EVENT_CODE, timestamp,
+                                 ((const totp_login_rec *) entry)->totp_code);
+        else
+            state_blob_add_event(r, blob, TOTP_PEER_EVENT_LOGIN, timestamp, 0);
+    }
+
+    if (state_blob_set(blob, kind, data, len, entry_size))
+        ap_log_rerror(APLOG_MARK, APLOG_WARNING, 0, r,
+                      "check_n_update_state: state of \"%s\" is too large, dropping oldest entries",
+                      blob->key);
+
+    return APR_SUCCESS;
+}
+
+/**
+  * \brief clear_state Remove all entries of a user's state
+  * \param r Request
+  * \param user User name
+  * \param kind TOTP_STATE_CODES or TOTP_STATE_LOGINS
+  * \param filepath Path to the state file used without a state cache
+  * \return APR_SUCCESS on success, error code otherwise
+ **/
+static          apr_status_t
+clear_state(request_rec *r, const char *user, int kind, const char *filepath)
+{
+    totp_auth_config_rec *conf =
+        ap_get_module_config(r->per_dir_config, &authn_totp_module);
+    totp_state_blob *blob;
+    totp_login_rec  login_data;
+    apr_status_t    status;
+
+    if (!state_cache.provider) {
+        status = user_file_remove(r, conf->stateDir, filepath);
+        return APR_STATUS_IS_ENOENT(status) ? APR_SUCCESS : status;
+    }
+
+    if (!(blob = get_state_blob(r, user)))
+        return APR_EGENERAL;
+
+    /* like the peers, keep the entries other requests added meanwhile */
+    if (state_cache.updates) {
+        memset(&login_data, 0, sizeof(login_data));
+        login_data.timestamp = r->request_time;
+        status = state_cache_update(r, blob, kind, TOTPD_UPDATE_CLEAR, 0,
+                                    &login_data, (kind == TOTP_STATE_CODES) ?
+                                    sizeof(totp_login_rec) :
+                                    sizeof(apr_time_t), NULL);
+        if ((APR_SUCCESS == status) && (kind == TOTP_STATE_LOGINS))
+            state_blob_add_event(r, blob, TOTP_PEER_EVENT_CLEAR,
+                                 r->request_time, 0);
+        return status;
+    }
+
+    if (blob->len[kind]) {
+        blob->len[kind] = 0;
+        blob->dirty = true;
+        if (kind == TOTP_STATE_LOGINS)
+            state_blob_add_event(r, blob, TOTP_PEER_EVENT_CLEAR,
+                                 r->request_time, 0);
+    }
+
+    return APR_SUCCESS;
+}
+
+/* Authentication Helpers: Write-Behind */
+
+/*
+ * With TOTPAuthWriteBehind, the state cache is the live state and the
+ * .codes and .logins files only keep it across restarts of the cache:
+ * commit_user_state() queues the states it stored, and a thread in each
+ * child writes the latest queued state of each user to the files once per
+ * interval. A state missing from the cache is read from the files.
+ */
+typedef struct {
+    const char     *paths[TOTP_STATE_FILES];
+    apr_size_t      len[TOTP_STATE_FILES];
+    char           *data[TOTP_STATE_FILES];
+} totp_write_rec;
+
+typedef struct {
+    apr_pool_t     *pools[2];   /* the pending states are in pools[current] */
+    int             current;
+    apr_hash_t     *pending;    /* state key to totp_write_rec */
+    apr_interval_time_t interval;
+    apr_thread_mutex_t *mutex;
+    apr_thread_cond_t *cond;
+    apr_thread_t   *thread;
+    server_rec     *s;
+    volatile int    stop;
+} totp_write_behind;
+
+static totp_write_behind write_behind;
+
+/**
+  * \brief write_behind_running Check whether the writer thread of this child is running
+ **/
+static bool
+write_behind_running(void)
+{
+    return (write_behind.thread != NULL);
+}
+
+/**
+  * \brief read_state_files Fill a state missing from the state cache in from the state files
+  * \param r Request
+  * \param blob Pointer to the state
+  * \return APR_SUCCESS on success, error code otherwise
+ **/
+static          apr_status_t
+read_state_files(request_rec *r, totp_state_blob *blob)
+{
+    totp_auth_config_rec *conf =
+        ap_get_module_config(r->per_dir_config, &authn_totp_module);
+    apr_file_t     *file;
+    apr_finfo_t     finfo;
+    apr_status_t    status;
+    int             kind;
+
+    for (kind = 0; kind < TOTP_STATE_FILES; ++kind) {
+        status = user_file_open(r, conf->stateDir, blob->paths[kind],
+                                APR_FOPEN_READ, APR_FPROT_OS_DEFAULT, &file);
+        if (APR_STATUS_IS_ENOENT(status))
+            continue;
+        if (APR_SUCCESS == status) {
+            status = apr_file_info_get(&finfo, APR_FINFO_SIZE, file);
+            /* the cache only holds TOTP_STATE_BLOB_MAX, see state_blob_set() */
+            if ((APR_SUCCESS == status) && (finfo.size > 0) &&
+                (finfo.size <= TOTP_STATE_BLOB_MAX - TOTP_STATE_HEADER_LEN -
+                 blob->len[TOTP_STATE_CODES])) {
+                blob->data[kind] = apr_palloc(r->pool, finfo.size);
+                blob->len[kind] = finfo.size;
+                status = apr_file_read_full(file, blob->data[kind],
+                                            finfo.size, NULL);
+            } else if ((APR_SUCCESS == status) && (finfo.size > 0)) {
+                ap_log_rerror(APLOG_MARK, APLOG_WARNING, 0, r,
+                              "read_state_files: ignoring oversized state file \"%s\"",
+                              blob->paths[kind]);
+            }
+            apr_file_close(file);
+        }
+        if (APR_SUCCESS != status) {
+            ap_log_rerror(APLOG_MARK, APLOG_ERR, status, r,
+                          "read_state_files: could not read state file \"%s\"",
+                          blob->paths[kind]);
+            return status;
+        }
+    }
+
+    /* back into the cache with the next commit */
+    blob->dirty = (blob->len[TOTP_STATE_CODES] || blob->len[TOTP_STATE_LOGINS]);
+
+    return APR_SUCCESS;
+}
+
+/**
+  * \brief queue_state_write Queue a stored state to be written to the state files
+  * \param blob Pointer to the state
+ **/
+static void
+queue_state_write(const totp_state_blob *blob)
+{
+    totp_write_rec *rec;
+    apr_pool_t     *pool;
+    int             kind;
+
+    apr_thread_mutex_lock(write_behind.mutex);
+
+    /* a later state of the same user replaces the queued one */
+    pool = write_behind.pools[write_behind.current];
+    rec = apr_palloc(pool, sizeof(*rec));
+    for (kind = 0; kind < TOTP_STATE_FILES; ++kind) {
+        rec->paths[kind] = apr_pstrdup(pool, blob->paths[kind]);
+        rec->len[kind] = blob->len[kind];
+        rec->data[kind] = apr_pmemdup(pool, blob->data[kind], blob->len[kind]);
+    }
+    apr_hash_set(write_behind.pending, apr_pstrdup(pool, blob->key),
+                 APR_HASH_KEY_STRING, rec);
+
+    apr_thread_mutex_unlock(write_behind.mutex);
+}
+
+/**
+  * \brief write_state_file Replace a state file
+  * \param path Path of the file
+  * \param data Entries
+  * \param len Length of the entries in bytes, 0 to remove the file
+  * \param pool Pool for temporary allocations
+  * \return APR_SUCCESS on success, error code otherwise
+ **/
+static          apr_status_t
+write_state_file(const char *path, const char *data, apr_size_t len,
+                 apr_pool_t *pool)
+{
+    const char     *tmp_path, *sep;
+    apr_file_t     *file;
+    apr_status_t    status;
+    apr_int32_t     flags = APR_FOPEN_WRITE | APR_FOPEN_CREATE |
+        APR_FOPEN_TRUNCATE;
+
+    if (!len) {
+        status = apr_file_remove(path, pool);
+        return APR_STATUS_IS_ENOENT(status) ? APR_SUCCESS : status;
+    }
+
+    tmp_path = apr_psprintf(pool, "%s.%" APR_PID_T_FMT, path, getpid());
+    status = apr_file_open(&file, tmp_path, flags, APR_UREAD | APR_UWRITE,
+                           pool);
+    /* the first file of a user in a hashed directory */
+    if (APR_STATUS_IS_ENOENT(status) && (sep = strrchr(path, '/')) &&
+        (APR_SUCCESS ==
+         apr_dir_make_recursive(apr_pstrmemdup(pool, path, sep - path),
+                                APR_UREAD | APR_UWRITE | APR_UEXECUTE, pool)))
+        status = apr_file_open(&file, tmp_path, flags, APR_UREAD | APR_UWRITE,
+                               pool);
+    if (APR_SUCCESS != status)
+        return status;
+
+    status = apr_file_write_full(file, data, len, NULL);
+    apr_file_close(file);
+    if (APR_SUCCESS == status)
+        status = apr_file_rename(tmp_path, path, pool);
+    if (APR_SUCCESS != status)
+        apr_file_remove(tmp_path, pool);
+
+    return status;
+}
+
+/**
+  * \brief flush_state_writes Write all queued states to the state files
+  * \param pool Pool for temporary allocations
+ **/
+static void
+flush_state_writes(apr_pool_t *pool)
+{
+    apr_hash_t     *pending;
+    apr_hash_index_t *hi;
+    apr_pool_t     *queue_pool;
+    totp_write_rec *rec;
+    apr_status_t    status;
+    int             kind;
+
+    /* requests queue into the other pool while this one is written */
+    apr_thread_mutex_lock(write_behind.mutex);
+    pending = write_behind.pending;
+    queue_pool = write_behind.pools[write_behind.current];
+    write_behind.current ^= 1;
+    write_behind.pending =
+        apr_hash_make(write_behind.pools[write_behind.current]);
+    apr_thread_mutex_unlock(write_behind.mutex);
+
+    for (hi = apr_hash_first(pool, pending); hi; hi = apr_hash_next(hi)) {
+        apr_hash_this(hi, NULL, NULL, (void **) &rec);
+        for (kind = 0; kind < TOTP_STATE_FILES; ++kind) {
+            status = write_state_file(rec->paths[kind], rec->data[kind],
+                                      rec->len[kind], pool);
+            if (APR_SUCCESS != status)
+                ap_log_error(APLOG_MARK, APLOG_ERR, status, write_behind.s,
+                             "flush_state_writes: could not write state file \"%s\"",
+                             rec->paths[kind]);
+        }
+    }
+
+    apr_pool_clear(queue_pool);
+}
+
+/**
+  * \brief write_behind_thread Write the queued states once per TOTPAuthWriteBehind interval
+ **/
+static void    *APR_THREAD_FUNC
+write_behind_thread(apr_thread_t *thread, void *data)
+{
+    apr_pool_t     *pool;
+    int             stop;
+
+    apr_pool_create(&pool, NULL);
+
+    do {
+        apr_thread_mutex_lock(write_behind.mutex);
+        if (!write_behind.stop)
+            apr_thread_cond_timedwait(write_behind.cond, write_behind.mutex,
+                                      write_behind.interval);
+        stop = write_behind.stop;
+        apr_thread_mutex_unlock(write_behind.mutex);
+
+        /* the last round writes what was queued before the child exits */
+        flush_state_writes(pool);
+        apr_pool_clear(pool);
+    } while (!stop);
+
+    apr_pool_destroy(pool);
+    apr_thread_exit(thread, APR_SUCCESS);
+
+    return NULL;
+}
+
+/**
+  * \brief write_behind_stop Write the queued states and stop the writer thread when the child exits
+ **/
+static          apr_status_t
+write_behind_stop(void *data)
+{
+    apr_status_t    status;
+
+    apr_thread_mutex_lock(write_behind.mutex);
+    write_behind.stop = 1;
+    apr_thread_cond_signal(write_behind.cond);
+    apr_thread_mutex_unlock(write_behind.mutex);
+
+    apr_thread_join(&status, write_behind.thread);
+    memset(&write_behind, 0, sizeof(write_behind));
+
+    return APR_SUCCESS;
+}
+
+/**
+  * \brief write_behind_child_init Start the writer thread in a child process
+ **/
+static void
+write_behind_child_init(apr_pool_t *p, server_rec *s)
+{
+    totp_auth_server_config_rec *sconf =
+        ap_get_module_config(s->module_config, &authn_totp_module);
+    apr_status_t    status;
+
+    memset(&write_behind, 0, sizeof(write_behind));
+    if (!sconf->write_behind_interval || !state_cache.provider)
+        return;
+
+#if APR_HAS_THREADS
+    write_behind.interval = sconf->write_behind_interval;
+    write_behind.s = s;
+    if ((APR_SUCCESS != (status = apr_pool_create(&write_behind.pools[0], p))) ||
+        (APR_SUCCESS != (status = apr_pool_create(&write_behind.pools[1], p))) ||
+        (APR_SUCCESS !=
+         (status = apr_thread_mutex_create(&write_behind.mutex,
+                                           APR_THREAD_MUTEX_DEFAULT, p))) ||
+        (APR_SUCCESS !=
+         (status = apr_thread_cond_create(&write_behind.cond, p)))) {
+        ap_log_error(APLOG_MARK, APLOG_CRIT, status, s,
+                     "write_behind_child_init: could not set up the write-behind queue");
+        memset(&write_behind, 0, sizeof(write_behind));
+        return;
+    }
+    write_behind.pending = apr_hash_make(write_behind.pools[0]);
+
+    status = apr_thread_create(&write_behind.thread, NULL,
+                               write_behind_thread, NULL, p);
+    if (APR_SUCCESS != status) {
+        ap_log_error(APLOG_MARK, APLOG_CRIT, status, s,
+                     "write_behind_child_init: could not start the writer thread");
+        memset(&write_behind, 0, sizeof(write_behind));
+        return;
+    }
+    /* before the thread's pool, a subpool of p, is destroyed */
+    apr_pool_pre_cleanup_register(p, NULL, write_behind_stop);
+#else
+    ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s,
+                 "write_behind_child_init: TOTPAuthWriteBehind requires thread support");
+#endif
+}
+
+/* Authentication Helpers: Peer Replication */
+
+/*
+ * Changes of the state cache are sent to the TOTPAuthPeers as a single UDP
+ * datagram per user and request, and applied by the receiving nodes to their
+ * own state cache:
+ *
+ *   offset  size  content
+ *   0       4     "TOTP"
+ *   4       1     TOTP_PEER_VERSION
+ *   5       1     number of events
+ *   6       8     sender time (BE64), datagrams older than TOTP_PEER_MAX_AGE are dropped
+ *   14      2     key length (BE16)
+ *   16      n     key, the path of the state files without suffix
+ *   16+n    13*m  events: type | timestamp (BE64) | code (BE32)
+ *   end-20  20    HMAC-SHA1 over everything before, keyed with TOTPAuthPeerSecret
+ */
+#define TOTP_PEER_VERSION       1
+#define TOTP_PEER_HEADER_LEN    16
+#define TOTP_PEER_EVENT_LEN     13
+#define TOTP_PEER_DATAGRAM_MAX  1400
+#define TOTP_PEER_MAX_AGE       apr_time_from_sec(30)
+
+typedef struct {
+    apr_socket_t   *sock;       /* bound to TOTPAuthPeerListen, if any */
+    apr_array_header_t *addrs;  /* apr_sockaddr_t * of TOTPAuthPeers */
+    apr_array_header_t *state_dirs;     /* const char * of TOTPAuthStateDir */
+    const char     *secret;
+    bool            listen;
+    apr_thread_t   *thread;     /* receiving in this child */
+    volatile int    stop;
+} totp_peer_group;
+
+static totp_peer_group peer_group;
+
+/**
+  * \brief walk_dir_configs Call a function for the configuration of each server and of each of their sections
+  * \param s Main server record
+  * \param pool Pool for the section names
+  * \param fn Function called with the server, the section name or NULL for the server, the configuration and data
+  * \param data Data passed to fn
+ **/
+static void
+walk_dir_configs(server_rec *s, apr_pool_t *pool,
+                 void (*fn) (server_rec *vhost, const char *section,
+                             totp_auth_config_rec *conf, void *data),
+                 void *data)
+{
+    core_server_config *core;
+    core_dir_config *section;
+    apr_array_header_t *sections[2];
+    ap_conf_vector_t *section_config;
+    totp_auth_config_rec *conf;
+    server_rec     *vhost;
+    int             i, j;
+
+    for (vhost = s; vhost; vhost = vhost->next) {
+        conf = ap_get_module_config(vhost->lookup_defaults, &authn_totp_module);
+        if (conf)
+            fn(vhost, NULL, conf, data);
+
+        core = ap_get_core_module_config(vhost->module_config);
+        sections[0] = core->sec_dir;
+        sections[1] = core->sec_url;
+        for (i = 0; i < 2; ++i) {
+            for (j = 0; sections[i] && (j < sections[i]->nelts); ++j) {
+                section_config = APR_ARRAY_IDX(sections[i], j, ap_conf_vector_t *);
+                conf = ap_get_module_config(section_config, &authn_totp_module);
+                if (!conf)
+                    continue;
+
+                section = ap_get_core_module_config(section_config);
+                fn(vhost, apr_psprintf(pool, "<%s %s>",
+                                       i ? "Location" : "Directory",
+                                       section->d ? section->d : ""),
+                   conf, data);
+            }
+        }
+    }
+}
+
+/**
+  * \brief add_peer_state_dir Add the TOTPAuthStateDir of a section to the directories peers may name
+  * \param vhost Server record
+  * \param section Section name, NULL for the server
+  * \param conf Configuration of the section
+  * \param data Array of the directories
+ **/
+static void
+add_peer_state_dir(server_rec *vhost, const char *section,
+                   totp_auth_config_rec *conf, void *data)
+{
+    apr_array_header_t *dirs = data;
+    int             i;
+
+    if (!conf->stateDir)
+        return;
+    for (i = 0; i < dirs->nelts; ++i)
+        if (!strcmp(APR_ARRAY_IDX(dirs, i, const char *), conf->stateDir))
+            return;
+    APR_ARRAY_PUSH(dirs, const char *) = conf->stateDir;
+}
+
+/**
+  * \brief is_peer_key Check that a key received from a peer names a user in a configured TOTPAuthStateDir
+  * \param key Key
+  * \param key_len Length of the key
+  * \return true if the key is <dir>/<user> or <dir>/<xx>/<xx>/<user>, false otherwise
+ **/
+static bool
+is_peer_key(const char *key, apr_size_t key_len)
+{
+    const char     *dir;
+    apr_size_t      dir_len, i;
+    int             j, parts;
+
+    for (j = 0; j < peer_group.state_dirs->nelts; ++j) {
+        dir = APR_ARRAY_IDX(peer_group.state_dirs, j, const char *);
+        dir_len = strlen(dir);
+        if ((key_len <= dir_len + 1) || memcmp(key, dir, dir_len) ||
+            (key[dir_len] != '/'))
+            continue;
+
+        /* only alphanumeric names, so nothing like ".." or a suffix */
+        for (i = dir_len + 1, parts = 1; i < key_len; ++i) {
+            if (key[i] == '/') {
+                if ((key[i - 1] == '/') || (i + 1 == key_len) || (++parts > 3))
+                    break;
+            }
+            else if (!apr_isalnum(key[i]))
+                break;
+        }
+        if ((i == key_len) && (parts != 2))
+            return true;
+    }
+
+    return false;
+}
+
+/**
+  * \brief send_peer_events Send the state changes a request made for a user to the peers
+  * \param r Request
+  * \param blob Pointer to the state holding the events
+ **/
+static void
+send_peer_events(request_rec *r, const totp_state_blob *blob)
+{
+    const totp_peer_event *events = (const totp_peer_event *) blob->events->elts;
+    unsigned char   buf[TOTP_PEER_DATAGRAM_MAX];
+    apr_size_t      key_len = strlen(blob->key);
+    apr_size_t      len, sent;
+    apr_status_t    status;
+    int             i, count;
+
+    if (!peer_group.sock || !peer_group.addrs->nelts)
+        return;
+
+    count = min(blob->events->nelts,
+                min(255, (int) ((TOTP_PEER_DATAGRAM_MAX - TOTP_PEER_HEADER_LEN -
+                                 APR_SHA1_DIGESTSIZE - key_len) / TOTP_PEER_EVENT_LEN)));
+    if ((key_len > 0xFFFF) || (count <= 0)) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r,
+                      "send_peer_events: key \"%s\" is too long to replicate",
+                      blob->key);
+        return;
+    }
+
+    memcpy(buf, "TOTP", 4);
+    buf[4] = TOTP_PEER_VERSION;
+    buf[5] = count;
+    put_be64(buf + 6, apr_time_now());
+    buf[14] = key_len >> 8;
+    buf[15] = key_len & 0xFF;
+    memcpy(buf + TOTP_PEER_HEADER_LEN, blob->key, key_len);
+    len = TOTP_PEER_HEADER_LEN + key_len;
+    for (i = 0; i < count; ++i, len += TOTP_PEER_EVENT_LEN) {
+        buf[len] = events[i].type;
+        put_be64(buf + len + 1, events[i].timestamp);
+        put_be32(buf + len + 9, events[i].totp_code);
+    }
+    hmac_sha1((const unsigned char *) peer_group.secret,
+              strlen(peer_group.secret), buf, len, buf + len,
+              APR_SHA1_DIGESTSIZE);
+    len += APR_SHA1_DIGESTSIZE;
+
+    for (i = 0; i < peer_group.addrs->nelts; ++i) {
+        sent = len;
+        status = apr_socket_sendto(peer_group.sock,
+                                   APR_ARRAY_IDX(peer_group.addrs, i,
+                                                 apr_sockaddr_t *),
+                                   0, (const char *) buf, &sent);
+        if (APR_SUCCESS != status)
+            ap_log_rerror(APLOG_MARK, APLOG_WARNING, status, r,
+                          "send_peer_events: could not send state of \"%s\" to peer %d",
+                          blob->key, i + 1);
+    }
+}
+
+/**
+  * \brief apply_peer_events Apply the state changes received from a peer to the state cache
+  * \param s Server record
+  * \param buf Verified datagram
+  * \param len Length of the datagram without its HMAC
+  * \param pool Pool for temporary allocations
+ **/
+static void
+apply_peer_events(server_rec *s, const unsigned char *buf, apr_size_t len,
+                  apr_pool_t *pool)
+{
+    totp_state_blob blob;
+    totp_login_rec  login_data, login_rec;
+    apr_time_t      timestamp;
+    apr_size_t      key_len = (buf[14] << 8) | buf[15];
+    apr_size_t      pos, i, entry_size;
+    apr_status_t    status;
+    const char     *entry;
+    char           *data;
+    int             kind;
+
+    if (TOTP_PEER_HEADER_LEN + key_len + buf[5] * TOTP_PEER_EVENT_LEN != len)
+        return;
+    if (!is_peer_key((const char *) buf + TOTP_PEER_HEADER_LEN, key_len)) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s,
+                     "apply_peer_events: dropping state of a user outside TOTPAuthStateDir");
+        return;
+    }
+
+    memset(&login_data, 0, sizeof(login_data));
+    status = state_cache_retrieve(s, apr_pstrmemdup(pool, (const char *) buf +
+                                                    TOTP_PEER_HEADER_LEN,
+                                                    key_len), &blob, pool);
+    if (APR_SUCCESS != status) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, status, s,
+                     "apply_peer_events: could not retrieve state of \"%s\"",
+                     blob.key);
+        return;
+    }
+
+    for (pos = TOTP_PEER_HEADER_LEN + key_len; pos < len;
+         pos += TOTP_PEER_EVENT_LEN) {
+        timestamp = get_be64(buf + pos + 1);
+        switch (buf[pos]) {
+        case TOTP_PEER_EVENT_CODE:
+            kind = TOTP_STATE_CODES;
+            login_data.timestamp = timestamp;
+            login_data.totp_code = get_be32(buf + pos + 9);
+            entry = (const char *) &login_data;
+            entry_size = sizeof(totp_login_rec);
+            break;
+        case TOTP_PEER_EVENT_LOGIN:
+            kind = TOTP_STATE_LOGINS;
+            entry = (const char *) &timestamp;
+            entry_size = sizeof(apr_time_t);
+            break;
+        case TOTP_PEER_EVENT_SCRATCH:
+            merge_user_state(&blob, (apr_uint32_t) timestamp,
+                             get_be32(buf + pos + 9), pool);
+            continue;
+        case TOTP_PEER_EVENT_CLEAR:
+            /* only attempts up to the login, a replay keeps later ones */
+            data = apr_palloc(pool, blob.len[TOTP_STATE_LOGINS] + 1);
+            entry_size = 0;
+            for (i = 0; i + sizeof(apr_time_t) <= blob.len[TOTP_STATE_LOGINS];
+                 i += sizeof(apr_time_t)) {
+                memcpy(&login_rec.timestamp, blob.data[TOTP_STATE_LOGINS] + i,
+                       sizeof(apr_time_t));
+                if (login_rec.timestamp <= timestamp)
+                    continue;
+                memcpy(data + entry_size, &login_rec.timestamp,
+                       sizeof(apr_time_t));
+                entry_size += sizeof(apr_time_t);
+            }
+            state_blob_set(&blob, TOTP_STATE_LOGINS, data, entry_size,
+                           sizeof(apr_time_t));
+            continue;
+        default:
+            continue;
+        }
+
+        /* entries are appended once, stale ones go with the next local update */
+        for (i = 0; i + entry_size <= blob.len[kind]; i += entry_size) {
+            memcpy(&login_rec, blob.data[kind] + i, entry_size);
+            if ((login_rec.timestamp == timestamp) &&
+                ((kind == TOTP_STATE_LOGINS) ||
+                 (login_rec.totp_code == login_data.totp_code)))
+                break;
+        }
+        if (i + entry_size <= blob.len[kind])
+            continue;
+
+        data = apr_palloc(pool, blob.len[kind] + entry_size);
+        memcpy(data, blob.data[kind], blob.len[kind]);
+        memcpy(data + blob.len[kind], entry, entry_size);
+        state_blob_set(&blob, kind, data, blob.len[kind] + entry_size,
+                       entry_size);
+    }
+
+    if (blob.dirty) {
+        status = state_cache_store(s, &blob, pool);
+        if (APR_SUCCESS != status)
+            ap_log_error(APLOG_MARK, APLOG_ERR, status, s,
+                         "apply_peer_events: could not store state of \"%s\"",
+                         blob.key);
+    }
+}
+
+/**
+  * \brief receive_peer_events Receive state changes from the peers until the child exits
+  * \param thread Thread
+  * \param data Server record
+ **/
+static void    *APR_THREAD_FUNC
+receive_peer_events(apr_thread_t *thread, void *data)
+{
+    server_rec     *s = data;
+    unsigned char   buf[TOTP_PEER_DATAGRAM_MAX];
+    unsigned char   hash[APR_SHA1_DIGESTSIZE];
+    apr_sockaddr_t *from;
+    apr_pool_t     *pool;
+    apr_size_t      len;
+    apr_time_t      sent;
+    apr_status_t    status;
+
+    apr_pool_create(&pool, NULL);
+    apr_sockaddr_info_get(&from, NULL, APR_UNSPEC, 0, 0, pool);
+
+    while (!peer_group.stop) {
+        len = sizeof(buf);
+        status = apr_socket_recvfrom(from, peer_group.sock, 0, (char *) buf,
+                                     &len);
+        if (APR_STATUS_IS_TIMEUP(status) || APR_STATUS_IS_EAGAIN(status))
+            continue;
+        if (APR_SUCCESS != status) {
+            ap_log_error(APLOG_MARK, APLOG_ERR, status, s,
+                         "receive_peer_events: could not receive from peers");
+            apr_sleep(apr_time_from_sec(1));
+            continue;
+        }
+
+        if ((len < TOTP_PEER_HEADER_LEN + APR_SHA1_DIGESTSIZE) ||
+            memcmp(buf, "TOTP", 4) || (buf[4] != TOTP_PEER_VERSION))
+            continue;
+        len -= APR_SHA1_DIGESTSIZE;
+        hmac_sha1((const unsigned char *) peer_group.secret,
+                  strlen(peer_group.secret), buf, len, hash,
+                  APR_SHA1_DIGESTSIZE);
+        if (!digest_equal(hash, buf + len, APR_SHA1_DIGESTSIZE)) {
+            ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s,
+                         "receive_peer_events: dropping datagram with invalid signature");
+            continue;
+        }
+
+        /* replayed datagrams can only re-add entries, but not from long ago */
+        sent = get_be64(buf + 6);
+        if ((sent + TOTP_PEER_MAX_AGE < apr_time_now()) ||
+            (sent > apr_time_now() + TOTP_PEER_MAX_AGE)) {
+            ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s,
+                         "receive_peer_events: dropping stale datagram");
+            continue;
+        }
+
+        apply_peer_events(s, buf, len, pool);
+        apr_pool_clear(pool);
+        apr_sockaddr_info_get(&from, NULL, APR_UNSPEC, 0, 0, pool);
+    }
+
+    apr_pool_destroy(pool);
+    apr_thread_exit(thread, APR_SUCCESS);
+
+    return NULL;
+}
+
+/**
+  * \brief peer_group_init Open the socket for TOTPAuthPeerListen and resolve TOTPAuthPeers
+  * \param pconf Configuration pool
+  * \param s Server record
+  * \return APR_SUCCESS on success, error code otherwise
+ **/
+static          apr_status_t
+peer_group_init(apr_pool_t *pconf, server_rec *s)
+{
+    totp_auth_server_config_rec *sconf =
+        ap_get_module_config(s->module_config, &authn_totp_module);
+    apr_sockaddr_t *listen_addr = NULL, *addr;
+    char           *host, *scope;
+    apr_port_t      port;
+    apr_status_t    status;
+    int             i;
+
+    memset(&peer_group, 0, sizeof(peer_group));
+    if (!sconf->peer_listen && !sconf->peers)
+        return APR_SUCCESS;
+
+    if (!sconf->peer_secret || !state_cache.provider) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, s,
+                     "peer_group_init: TOTPAuthPeers and TOTPAuthPeerListen require "
+                     "TOTPAuthPeerSecret and TOTPAuthStateCache");
+        return APR_EINVAL;
+    }
+    peer_group.secret = sconf->peer_secret;
+    peer_group.addrs = apr_array_make(pconf, 4, sizeof(apr_sockaddr_t *));
+    peer_group.state_dirs = apr_array_make(pconf, 4, sizeof(const char *));
+    walk_dir_configs(s, pconf, add_peer_state_dir, peer_group.state_dirs);
+
+    for (i = 0; sconf->peers && (i < sconf->peers->nelts); ++i) {
+        const char     *peer = APR_ARRAY_IDX(sconf->peers, i, const char *);
+
+        status = apr_parse_addr_port(&host, &scope, &port, peer, pconf);
+        if ((APR_SUCCESS == status) && (!host || !port))
+            status = APR_EINVAL;
+        if (APR_SUCCESS == status)
+            status = apr_sockaddr_info_get(&addr, host, APR_UNSPEC, port, 0,
+                                           pconf);
+        if (APR_SUCCESS != status) {
+            ap_log_error(APLOG_MARK, APLOG_ERR, status, s,
+                         "peer_group_init: invalid peer \"%s\"", peer);
+            return status;
+        }
+        APR_ARRAY_PUSH(peer_group.addrs, apr_sockaddr_t *) = addr;
+    }
+
+    if (sconf->peer_listen) {
+        status = apr_parse_addr_port(&host, &scope, &port, sconf->peer_listen,
+                                     pconf);
+        if ((APR_SUCCESS == status) && !port)
+            status = APR_EINVAL;
+        if (APR_SUCCESS == status)
+            status = apr_sockaddr_info_get(&listen_addr, host,
+                                           host ? APR_UNSPEC : APR_INET,
+                                           port, 0, pconf);
+        if (APR_SUCCESS != status) {
+            ap_log_error(APLOG_MARK, APLOG_ERR, status, s,
+                         "peer_group_init: invalid address \"%s\"",
+                         sconf->peer_listen);
+            return status;
+        }
+    }
+
+    addr = listen_addr ? listen_addr :
+        peer_group.addrs->nelts ? APR_ARRAY_IDX(peer_group.addrs, 0,
+                                                apr_sockaddr_t *) : NULL;
+    if (!addr)
+        return APR_SUCCESS;
+
+    status = apr_socket_create(&peer_group.sock, addr->family, SOCK_DGRAM,
+                               APR_PROTO_UDP, pconf);
+    if ((APR_SUCCESS == status) && listen_addr) {
+        apr_socket_opt_set(peer_group.sock, APR_SO_REUSEADDR, 1);
+        status = apr_socket_bind(peer_group.sock, listen_addr);
+    }
+    if (APR_SUCCESS != status) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, status, s,
+                     "peer_group_init: could not open socket for peers");
+        return status;
+    }
+    peer_group.listen = (listen_addr != NULL);
+
+    return APR_SUCCESS;
+}
+
+/**
+  * \brief peer_group_stop Stop receiving from the peers when the child exits
+ **/
+static          apr_status_t
+peer_group_stop(void *data)
+{
+    apr_status_t    status;
+
+    peer_group.stop = 1;
+    apr_thread_join(&status, peer_group.thread);
+
+    return APR_SUCCESS;
+}
+
+/**
+  * \brief peer_group_child_init Start receiving from the peers in a child process
+ **/
+static void
+peer_group_child_init(apr_pool_t *p, server_rec *s)
+{
+    apr_status_t    status;
+
+    if (!peer_group.listen)
+        return;
+
+#if APR_HAS_THREADS
+    /* all children share the socket, each datagram is received by one of them */
+    apr_socket_timeout_set(peer_group.sock, apr_time_from_sec(1));
+    status = apr_thread_create(&peer_group.thread, NULL, receive_peer_events,
+                               s, p);
+    if (APR_SUCCESS != status) {
+        ap_log_error(APLOG_MARK, APLOG_CRIT, status, s,
+                     "peer_group_child_init: could not start receiving from peers");
+        return;
+    }
+    /* before the thread's pool, a subpool of p, is destroyed */
+    apr_pool_pre_cleanup_register(p, NULL, peer_group_stop);
+#else
+    ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s,
+                 "peer_group_child_init: TOTPAuthPeerListen requires thread support");
+#endif
+}
+
+/* State Cache Provider: totpd */
+
+/*
+ * "TOTPAuthStateCache totpd:/run/totpd.sock" keeps the state in the totpd
+ * daemon (see totpd.c), shared by all children of all servers on the host.
+ * Each child keeps a small pool of connections to it open.
+ */
+#define TOTPD_POOL_SIZE         8
+#define TOTPD_TIMEOUT_SEC       1
+
+struct ap_socache_instance_t {
+    const char     *path;
+    int             idle[TOTPD_POOL_SIZE];
+    int             idle_count;
+#if APR_HAS_THREADS
+    apr_thread_mutex_t *lock;
+#endif
+};
+
+static const char *
+totpd_create(ap_socache_instance_t **instance, const char *arg,
+             apr_pool_t *tmp, apr_pool_t *p)
+{
+    struct sockaddr_un addr;
+
+    if (!arg || (arg[0] != '/'))
+        return "totpd: the path of the daemon's socket is required, e.g. totpd:/run/totpd.sock";
+    if (strlen(arg) >= sizeof(addr.sun_path))
+        return "totpd: socket path is too long";
+
+    *instance = apr_pcalloc(p, sizeof(**instance));
+    (*instance)->path = apr_pstrdup(p, arg);
+
+    return NULL;
+}
+
+static          apr_status_t
+totpd_init(ap_socache_instance_t *instance, const char *namespace,
+           const struct ap_socache_hints *hints, server_rec *s, apr_pool_t *p)
+{
+#if APR_HAS_THREADS
+    return apr_thread_mutex_create(&instance->lock, APR_THREAD_MUTEX_DEFAULT, p);
+#else
+    return APR_SUCCESS;
+#endif
+}
+
+static void
+totpd_destroy(ap_socache_instance_t *instance, server_rec *s)
+{
+    while (instance->idle_count > 0)
+        close(instance->idle[--instance->idle_count]);
+}
+
+/**
+  * \brief totpd_connect Take an idle connection to totpd or open a new one
+  * \param instance Provider instance
+  * \param fresh Whether to open a new connection in any case
+  * \return Socket descriptor, -1 on error
+ **/
+static int
+totpd_connect(ap_socache_instance_t *instance, bool fresh)
+{
+    struct sockaddr_un addr;
+    struct timeval  tv = { TOTPD_TIMEOUT_SEC, 0 };
+    int             fd = -1;
+
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(instance->lock);
+#endif
+    if (!fresh && (instance->idle_count > 0))
+        fd = instance->idle[--instance->idle_count];
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(instance->lock);
+#endif
+    if (fd >= 0)
+        return fd;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, instance->path);
+
+    if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+        return -1;
+    if ((setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0) ||
+        (setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) < 0) ||
+        (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0)) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/**
+  * \brief totpd_release Return a connection to the pool of idle connections
+ **/
+static void
+totpd_release(ap_socache_instance_t *instance, int fd)
+{
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(instance->lock);
+#endif
+    if (instance->idle_count < TOTPD_POOL_SIZE) {
+        instance->idle[instance->idle_count++] = fd;
+        fd = -1;
+    }
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(instance->lock);
+#endif
+    if (fd >= 0)
+        close(fd);
+}
+
+/**
+  * \brief totpd_io Write or read a buffer completely
+  * \return true on success, false otherwise
+ **/
+static bool
+totpd_io(int fd, unsigned char *buf, apr_size_t len, bool writing)
+{
+    ssize_t         n;
+
+    while (len > 0) {
+        n = writing ? write(fd, buf, len) : read(fd, buf, len);
+        if ((n < 0) && (EINTR == errno))
+            continue;
+        if (n <= 0)
+            return false;
+        buf += n;
+        len -= n;
+    }
+    return true;
+}
+
+/**
+  * \brief totpd_request Send a request to totpd and receive its response
+  * \param instance Provider instance
+  * \param s Server record
+  * \param op TOTPD_OP_GET, TOTPD_OP_SET, TOTPD_OP_DELETE or TOTPD_OP_UPDATE
+  * \param key Key
+  * \param key_len Key length in bytes
+  * \param expiry Expiry time of a value to set
+  * \param val Value to send
+  * \param set_len Length of the value to send
+  * \param resp Buffer for the value received, NULL if none is expected
+  * \param resp_len Pointer to the size of the buffer, set to the length of the value received
+  * \param pool Pool for temporary allocations
+  * \return APR_SUCCESS on success, APR_NOTFOUND for an unknown key, error code otherwise
+ **/
+static          apr_status_t
+totpd_request(ap_socache_instance_t *instance, server_rec *s, char op,
+              const unsigned char *key, unsigned int key_len, apr_time_t expiry,
+              const unsigned char *val, unsigned int set_len,
+              unsigned char *resp, unsigned int *resp_len, apr_pool_t *pool)
+{
+    apr_size_t      len = TOTPD_REQUEST_LEN + key_len + set_len;
+    unsigned char  *buf = apr_palloc(pool, len);
+    unsigned char   header[TOTPD_RESPONSE_LEN];
+    unsigned int    value_len;
+    bool            fresh = false;
+    int             fd, tries;
+
+    if (key_len > TOTPD_MAX_KEY_LEN)
+        return APR_EINVAL;
+
+    buf[0] = op;
+    buf[1] = key_len >> 8;
+    buf[2] = key_len & 0xFF;
+    put_be32(buf + 3, set_len);
+    put_be64(buf + 7, expiry);
+    memcpy(buf + TOTPD_REQUEST_LEN, key, key_len);
+    memcpy(buf + TOTPD_REQUEST_LEN + key_len, val, set_len);
+
+    /* a pooled connection may have been closed by a restart of totpd */
+    for (tries = 0; tries < 2; ++tries, fresh = true) {
+        if ((fd = totpd_connect(instance, fresh)) < 0) {
+            ap_log_error(APLOG_MARK, APLOG_ERR, errno, s,
+                         "totpd_request: could not connect to \"%s\"",
+                         instance->path);
+            return APR_FROM_OS_ERROR(errno);
+        }
+        if (totpd_io(fd, buf, len, true) &&
+            totpd_io(fd, header, sizeof(header), false))
+            break;
+        close(fd);
+        fd = -1;
+    }
+    if (fd < 0) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, errno, s,
+                     "totpd_request: no response from \"%s\"", instance->path);
+        return APR_FROM_OS_ERROR(errno);
+    }
+
+    value_len = get_be32(header + 1);
+    if ((value_len > TOTPD_MAX_VALUE_LEN) ||
+        (resp ? (value_len > *resp_len) : (value_len != 0)) ||
+        !totpd_io(fd, resp, value_len, false)) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, s,
+                     "totpd_request: invalid response from \"%s\"",
+                     instance->path);
+        close(fd);
+        return APR_EGENERAL;
+    }
+    totpd_release(instance, fd);
+
+    if (resp)
+        *resp_len = value_len;
+
+    switch (header[0]) {
+    case TOTPD_STATUS_OK:
+        return APR_SUCCESS;
+    case TOTPD_STATUS_NOTFOUND:
+        return APR_NOTFOUND;
+    default:
+        return APR_EGENERAL;
+    }
+}
+
+static          apr_status_t
+totpd_store(ap_socache_instance_t *instance, server_rec *s,
+            const unsigned char *id, unsigned int idlen, apr_time_t expiry,
+            unsigned char *data, unsigned int datalen, apr_pool_t *pool)
+{
+    return totpd_request(instance, s, TOTPD_OP_SET, id, idlen, expiry, data,
+                         datalen, NULL, NULL, pool);
+}
+
+static          apr_status_t
+totpd_retrieve(ap_socache_instance_t *instance, server_rec *s,
+               const unsigned char *id, unsigned int idlen,
+               unsigned char *data, unsigned int *datalen, apr_pool_t *pool)
+{
+    return totpd_request(instance, s, TOTPD_OP_GET, id, idlen, 0, NULL, 0,
+                         data, datalen, pool);
+}
+
+static          apr_status_t
+totpd_remove(ap_socache_instance_t *instance, server_rec *s,
+             const unsigned char *id, unsigned int idlen, apr_pool_t *pool)
+{
+    return totpd_request(instance, s, TOTPD_OP_DELETE, id, idlen, 0, NULL, 0,
+                         NULL, NULL, pool);
+}
+
+/**
+  * \brief totpd_update Change a state in place, see TOTPD_OP_UPDATE
+  * \return APR_SUCCESS on success, error code otherwise
+ **/
+static          apr_status_t
+totpd_update(ap_socache_instance_t *instance, server_rec *s,
+             const unsigned char *key, unsigned int key_len, apr_time_t expiry,
+             const unsigned char *update, unsigned int update_len,
+             unsigned char *state, unsigned int *state_len, apr_pool_t *pool)
+{
+    return totpd_request(instance, s, TOTPD_OP_UPDATE, key, key_len, expiry,
+                         update, update_len, state, state_len, pool);
+}
+
+static void
+totpd_status(ap_socache_instance_t *instance, request_rec *r, int flags)
+{
+    ap_rprintf(r, "totpd: %s, %d idle connections\n", instance->path,
+               instance->idle_count);
+}
+
+static          apr_status_t
+totpd_iterate(ap_socache_instance_t *instance, server_rec *s, void *userctx,
+              ap_socache_iterator_t *iterator, apr_pool_t *pool)
+{
+    return APR_ENOTIMPL;
+}
+
+static const ap_socache_provider_t totpd_socache_provider = {
+    "totpd",
+    0,                          /* MP safe */
+    totpd_create,
+    totpd_init,
+    totpd_destroy,
+    totpd_store,
+    totpd_retrieve,
+    totpd_remove,
+    totpd_status,
+    totpd_iterate
+};
+
+/* Authentication Helpers: Token Authentication */
+
+/*
+ * An authentication token is stored in a single session field. It consists of
+ * TOTP_TOKEN_LEN bytes encoded in unpadded base64url, immediately followed by
+ * the (alphanumeric) user name:
+ *
+ *   offset  size  content
+ *        0     1  token format version
+ *        1     4  TOTP code, big-endian
+ *        5     8  login time in microseconds, big-endian
+ *       13     8  time the token was last issued in microseconds, big-endian
+ *       21    20  HMAC SHA1 over the bytes above and the user name
+ *
+ * Placing the user name last allows handing it out without copying.
+ */
+#define TOTP_TOKEN_VERSION      2
+#define TOTP_TOKEN_DATA_LEN     21
+#define TOTP_TOKEN_LEN          (TOTP_TOKEN_DATA_LEN + APR_SHA1_DIGESTSIZE)
+#define TOTP_TOKEN_ENCODED_LEN  ((TOTP_TOKEN_LEN * 4 + 2) / 3)
+
+typedef struct {
+    unsigned int    totp_code;
+    apr_time_t      timestamp;
+    apr_time_t      renewed;
+    const char     *user;       /* points into the token string */
+    unsigned char   hash[APR_SHA1_DIGESTSIZE];
+} totp_authn_token;
+
+/**
+  * \brief generate_token_hash Generate token hash from TOTP password, timestamps and user name
+  * \param timestamp Unix timestamp of the login
+  * \param renewed Unix timestamp of the token issue
+  * \param totp_code TOTP code
+  * \param user User name
+  * \param totp_config Pointer to structure containing TOTP configuration
+  * \param data Pointer to memory location to store the TOTP_TOKEN_DATA_LEN bytes covered by the hash
+  * \param hash Pointer to memory location to store the SHA1 hash digest
+ **/
+static void
+generate_token_hash(apr_time_t timestamp, apr_time_t renewed,
+                    unsigned int totp_code, const char *user,
+                    const totp_user_config *totp_config,
+                    unsigned char *data, unsigned char *hash)
+{
+    totp_hmac_ctx   ctx;
+
+    data[0] = TOTP_TOKEN_VERSION;
+    put_be32(data + 1, totp_code);
+    put_be64(data + 5, timestamp);
+    put_be64(data + 13, renewed);
+
+    memcpy(&ctx, &totp_config->hmac, sizeof(ctx));
+    hmac_sha1_update(&ctx, data, TOTP_TOKEN_DATA_LEN);
+    hmac_sha1_update(&ctx, (const unsigned char *) user, strlen(user));
+    hmac_sha1_final(&ctx, hash, APR_SHA1_DIGESTSIZE);
+}
+
+/**
+  * \brief generate_authn_token Generate an authentication token
+  * \param r Request
+  * \param timestamp Unix timestamp of the login
+  * \param renewed Unix timestamp of the token issue
+  * \param user User name
+  * \param totp_code TOTP code
+  * \param totp_config Pointer to structure containing TOTP configuration
+  * \return Pointer to string containing the authentication token on success, NULL otherwise
+ **/
+static const char *
+generate_authn_token(request_rec *r, apr_time_t timestamp, apr_time_t renewed,
+                     const char *user, unsigned int totp_code,
+                     const totp_user_config *totp_config)
+{
+    unsigned char   data[TOTP_TOKEN_LEN];
+    char            encoded[TOTP_TOKEN_ENCODED_LEN + 1];
+    apr_size_t      len = 0;
+    apr_status_t    status;
+    const char     *token;
+
+    generate_token_hash(timestamp, renewed, totp_code, user, totp_config,
+                        data, data + TOTP_TOKEN_DATA_LEN);
+
+    status = apr_encode_base64_binary(encoded, data, TOTP_TOKEN_LEN,
+                                      APR_ENCODE_BASE64URL, &len);
+    memset(data, 0, sizeof(data));
+    if ((APR_SUCCESS != status) || (len != TOTP_TOKEN_ENCODED_LEN)) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, status, r,
+                      "generate_authn_token: failed to encode the token");
+        return NULL;
+    }
+
+    encoded[len] = '\0';
+    token = apr_pstrcat(r->pool, encoded, user, NULL);
+
+    ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r,
+                  "generate_authn_token: time %" APR_TIME_T_FMT ", renewed %"
+                  APR_TIME_T_FMT ", TOTP code \"%6.6u\" -> token \"%s\"",
+                  timestamp, renewed, totp_code, token);
+
+    return token;
+}
+
+/**
+  * \brief parse_authn_token Parse an authentication token, no memory is allocated
+  * \param r Request
+  * \param token Pointer to string containing the authentication token
+  * \param parsed Pointer to memory location to store the token contents, parsed->user points into token
+  * \return true on success, false otherwise
+ **/
+static bool
+parse_authn_token(request_rec *r, const char *token, totp_authn_token *parsed)
+{
+    unsigned char   data[TOTP_TOKEN_LEN + 1];
+    apr_size_t      len = 0;
+    apr_status_t    status;
+
+    /* the encoded part has a fixed length and the user name may not be empty */
+    if (strnlen(token, TOTP_TOKEN_ENCODED_LEN + 1) <= TOTP_TOKEN_ENCODED_LEN) {
+        ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r,
+                      "parse_authn_token: token is too short");
+        return false;
+    }
+
+    status = apr_decode_base64_binary(data, token, TOTP_TOKEN_ENCODED_LEN,
+                                      APR_ENCODE_BASE64URL, &len);
+    if ((APR_SUCCESS != status) || (len != TOTP_TOKEN_LEN)) {
+        ap_log_rerror(APLOG_MARK, APLOG_DEBUG, status, r,
+                      "parse_authn_token: failed to decode the token");
+        return false;
+    }
+
+    if (data[0] != TOTP_TOKEN_VERSION) {
+        ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r,
+                      "parse_authn_token: unsupported token version %u",
+                      data[0]);
+        return false;
+    }
+
+    parsed->totp_code = get_be32(data + 1);
+    parsed->timestamp = get_be64(data + 5);
+    parsed->renewed = get_be64(data + 13);
+    memcpy(parsed->hash, data + TOTP_TOKEN_DATA_LEN, APR_SHA1_DIGESTSIZE);
+    parsed->user = token + TOTP_TOKEN_ENCODED_LEN;
+
+    ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r,
+                  "parse_authn_token: token \"%s\" -> user \"%s\", time %"
+                  APR_TIME_T_FMT ", renewed %" APR_TIME_T_FMT, token,
+                  parsed->user, parsed->timestamp, parsed->renewed);
+
+    return true;
+}
+
+/* Session cookie support */
+
+/**
+  * \brief is_session_cookie_available Check if session cookie is available
+  * \return true if all required function have been found, false otherwise
+ **/
+static bool
+is_session_cookie_available()
+{
+    return ap_session_load_fn && ap_session_get_fn && ap_session_set_fn;
+}
+
+/**
+  * \brief get_session_key Get the name of the session field holding the authentication token
+  * \param r Request
+  * \param buf Pointer to a buffer of TOTP_SESSION_KEY_MAX bytes used when the name is not cached
+  * \return Pointer to string containing the field name
+ **/
+static const char *
+get_session_key(request_rec *r, char *buf)
+{
+    totp_auth_config_rec *conf =
+        ap_get_module_config(r->per_dir_config, &authn_totp_module);
+    totp_session_key *key = &conf->session_key;
+    const char     *authname = ap_auth_name(r);
+    apr_size_t      len = strlen(authname);
+
+    if (len + sizeof("-totp") > TOTP_SESSION_KEY_MAX)
+        return apr_pstrcat(r->pool, authname, "-totp", NULL);
+
+    /* the directory configuration is shared between threads, the first
+     * request fills the name in and publishes it */
+    if (apr_atomic_cas32(&key->state, 2, 2) == 2) {
+        if ((key->realm_len == len) && (0 == memcmp(key->name, authname, len)))
+            return key->name;
+    } else if (apr_atomic_cas32(&key->state, 1, 0) == 0) {
+        memcpy(key->name, authname, len);
+        memcpy(key->name + len, "-totp", sizeof("-totp"));
+        key->realm_len = len;
+        apr_atomic_cas32(&key->state, 2, 1);
+        return key->name;
+    }
+
+    /* another realm shares this directory configuration */
+    memcpy(buf, authname, len);
+    memcpy(buf + len, "-totp", sizeof("-totp"));
+    return buf;
+}
+
+/**
+  * \brief set_session_auth Store the authentication token to the session cookie
+  * \param r Request
+  * \param token Pointer to string containing the authentication token
+ **/
+static void
+set_session_auth(request_rec *r, const char *token)
+{
+    char            buf[TOTP_SESSION_KEY_MAX];
+    session_rec    *z = NULL;
+
+    ap_session_load_fn(r, &z);
+    ap_session_set_fn(r, z, get_session_key(r, buf), token);
+}
+
+/**
+  * \brief get_session_auth Get the authentication token from the session cookie
+  * \param r Request
+  * \param token Function returns pointer to string containing the authentication token
+ **/
+static void
+get_session_auth(request_rec *r, const char **token)
+{
+    char            buf[TOTP_SESSION_KEY_MAX];
+    session_rec    *z = NULL;
+
+    ap_session_load_fn(r, &z);
+    ap_session_get_fn(r, z, get_session_key(r, buf), token);
+
+    ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r,
+                  "get_session_auth: token \"%s\"", *token ? *token : "<null>");
+}
+
+/* Authentication Helpers: Disallow TOTP Code Reuse */
+
+bool
+cb_check_code(const void *new, const void *old, totp_file_helper_cb_data *data)
+{
+    if (old) {
+        const apr_time_t timedelta = apr_time_from_sec(data->exp);
+        /* check for an existing login entry with new TOTP code */
+        totp_login_rec *pNew = (totp_login_rec *) new;
+        totp_login_rec *pOld = (totp_login_rec *) old;
+
+        /* check if entry time is within time tolerance */
+        if ((pNew->timestamp - pOld->timestamp) <= timedelta) {
+            /* check if entry code matches current one */
+            if ((pNew->totp_code == pOld->totp_code) && data->conf->disallow_reuse)
+                data->res++;
+            return true;
+        }
+        return false;
+    } else {
+        /* should new entry be appended to the file? */
+        return true;
+    }
+}
+
+/**
+  * \brief mark_code_invalid Mark a TOTP code invalid
+  * \param r Request
+  * \param timestamp Timestamp for login event
+  * \param user Authenticating user name
+  * \param totp_config Pointer to user's TOTP authentication settings
+  * \param totp_code Authenticating TOTP code
+  * \return true upon success, false otherwise
+ **/
+static bool
+mark_code_invalid(request_rec *r, apr_time_t timestamp,
+                  const char *user, totp_user_config *totp_config,
+                  unsigned int totp_code)
+{
+    totp_auth_config_rec *conf =
+        ap_get_module_config(r->per_dir_config, &authn_totp_module);
+    char           *code_filepath;
+    totp_login_rec  login_data;
+    apr_status_t    status;
+    totp_file_helper_cb_data cb_data;
+
+    if (!conf->stateDir) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, status, r,
+                      "mark_code_invalid: TOTPAuthStateDir is not defined");
+        return false;
+    }
+
+    /* set code file path */
+    code_filepath = user_file_path(r, conf->stateDir, user, ".codes");
+
+    /* initialize callback data */
+    cb_data.conf = totp_config;
+    cb_data.exp = conf->expires;
+    cb_data.res = 0;
+
+    /* current login entry */
+    login_data.timestamp = timestamp;
+    login_data.totp_code = totp_code;
+
+    status = check_n_update_state(r, user, TOTP_STATE_CODES, code_filepath,
+                                  &login_data, sizeof(totp_login_rec),
+                                  cb_check_code, &cb_data);
+    if (APR_SUCCESS != status) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, status, r,
+                      "mark_code_invalid: could not update codes file \"%s\"",
+                      code_filepath);
+        return false;
+    }
+
+    return (cb_data.res == 0);
+}
+
+/* Authentication Helpers: Validate TOTP login */
+
+bool
+cb_verify_code(const void *new, const void *old, totp_file_helper_cb_data *data)
+{
+    if (old) {
+        const apr_time_t timedelta = apr_time_from_sec(data->exp);
+        /* check for an existing login entry with new TOTP code */
+        totp_login_rec *pNew = (totp_login_rec *) new;
+        totp_login_rec *pOld = (totp_login_rec *) old;
+
+        /* check if entry time is within time tolerance */
+        if ((pNew->timestamp - pOld->timestamp) <= timedelta) {
+            /* check if entry code matches current one */
+            if ((pOld->timestamp == pNew->timestamp) &&
+                (pOld->totp_code == pNew->totp_code))
+                data->res++;
+            return true;
+        }
+        return false;
+    } else {
+        /* should new entry be appended to the file? */
+        return false;
+    }
+}
+
+/**
+  * \brief verify_totp_code Verify TOTP login data
+  * \param r Request
+  * \param timestamp Timestamp for login event
+  * \param user Authenticating user name
+  * \param totp_config Pointer to user's TOTP authentication settings
+  * \param totp_code Authenticating TOTP code
+  * \return true upon success, false otherwise
+ **/
+static bool
+verify_totp_code(request_rec *r, apr_time_t timestamp,
+                  const char *user, totp_user_config *totp_config,
+                  unsigned int totp_code)
+{
+    totp_auth_config_rec *conf =
+        ap_get_module_config(r->per_dir_config, &authn_totp_module);
+    char           *code_filepath;
+    totp_login_rec  login_data;
+    apr_status_t    status;
+    totp_file_helper_cb_data cb_data;
+
+    if (!conf->stateDir) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, status, r,
+                      "verify_totp_code: TOTPAuthStateDir is not defined");
+        return false;
+    }
+
+    /* set code file path */
+    code_filepath = user_file_path(r, conf->stateDir, user, ".codes");
+
+    /* initialize callback data */
+    cb_data.conf = totp_config;
+    cb_data.exp = conf->expires;
+    cb_data.res = 0;
+
+    /* current login entry */
+    login_data.timestamp = timestamp;
+    login_data.totp_code = totp_code;
+
+    status = check_n_update_state(r, user, TOTP_STATE_CODES, code_filepath,
+                                  &login_data, sizeof(totp_login_rec),
+                                  cb_verify_code, &cb_data);
+    if (APR_SUCCESS != status) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, status, r,
+                      "verify_totp_code: could not update codes file \"%s\"",
+                      code_filepath);
+        return false;
+    }
+
+    return (cb_data.res == 1);
+}
+
+/* Authentication Helpers: User State */
+
+/*
+ * Facts learned from successful logins are kept per user in "<user>.state"
+ * in the state directory, as a single fixed size record. Updates read, change
+ * and replace the record while holding "<user>.state.lock", so concurrent
+ * logins cannot both consume the same scratch code. With TOTPAuthStateCache,
+ * the record is also kept in the state of the user, so the other nodes see
+ * the scratch codes used here.
+ */
+#define TOTP_STATE_VERSION      2
+
+typedef struct {
+    apr_uint32_t    version;
+    apr_int32_t     drift;      /* time step offset of the last login */
+    apr_uint32_t    scratch_fingerprint;    /* of the scratch codes below */
+    apr_uint32_t    scratch_used;   /* bit i set once scratch code i was used */
+} totp_user_state;
+
+/**
+  * \brief scratch_fingerprint Compute a fingerprint of a user's scratch codes
+  * \param totp_config Pointer to user's TOTP authentication settings
+  * \return Fingerprint, never 0
+ **/
+static          apr_uint32_t
+scratch_fingerprint(const totp_user_config *totp_config)
+{
+    apr_uint32_t    hash = 2166136261U;     /* FNV-1a */
+    unsigned char   buf[4];
+    int             i, j;
+
+    for (i = 0; i < totp_config->scratch_codes_count; ++i) {
+        put_be32(buf, totp_config->scratch_codes[i]);
+        for (j = 0; j < 4; ++j)
+            hash = (hash ^ buf[j]) * 16777619U;
+    }
+
+    return hash ? hash : 1;
+}
+
+/**
+  * \brief lock_state_file Take the exclusive lock serializing the updates of a state file
+  * \param filepath Path of the state file
+  * \param pool Pool to open the lock file from
+  * \param lock Pointer to store the lock file, closing it releases the lock
+  * \return APR_SUCCESS on success, error code otherwise
+ **/
+static          apr_status_t
+lock_state_file(const char *filepath, apr_pool_t *pool, apr_file_t **lock)
+{
+    apr_os_file_t   fd;
+    apr_status_t    status;
+
+    status = apr_file_open(lock, apr_pstrcat(pool, filepath, ".lock", NULL),
+                           APR_FOPEN_WRITE | APR_FOPEN_CREATE,
+                           APR_UREAD | APR_UWRITE, pool);
+    if (APR_SUCCESS != status)
+        return status;
+
+    /* unlike the fcntl locks of apr_file_lock, flock also excludes threads */
+    apr_os_file_get(&fd, *lock);
+    while (flock(fd, LOCK_EX) < 0) {
+        if (errno != EINTR) {
+            status = APR_FROM_OS_ERROR(errno);
+            apr_file_close(*lock);
+            return status;
+        }
+    }
+
+    return APR_SUCCESS;
+}
+
+/**
+  * \brief lock_user_state Lock the state of a user for an update
+  * \param r Request
+  * \param user User name
+  * \return Lock file to close once the state was written, NULL on error
+ **/
+static apr_file_t *
+lock_user_state(request_rec *r, const char *user)
+{
+    totp_auth_config_rec *conf =
+        ap_get_module_config(r->per_dir_config, &authn_totp_module);
+    const char     *state_filepath;
+    apr_file_t     *lock;
+    apr_status_t    status;
+
+    if (!conf->stateDir)
+        return NULL;
+
+    state_filepath = user_file_path(r, conf->stateDir, user, ".state");
+
+    status = lock_state_file(state_filepath, r->pool, &lock);
+    if (APR_STATUS_IS_ENOENT(status) &&
+        (APR_SUCCESS == create_parent_dir(r, state_filepath)))
+        status = lock_state_file(state_filepath, r->pool, &lock);
+    if (APR_SUCCESS != status) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, status, r,
+                      "lock_user_state: could not lock state file \"%s\"",
+                      state_filepath);
+        return NULL;
+    }
+
+    return lock;
+}
+
+/**
+  * \brief read_user_state Read the learned state of a user
+  * \param r Request
+  * \param user User name
+  * \param state Pointer to memory location to store the state, reset if none is found
+  * \return true if the state was read, false otherwise
+ **/
+static bool
+read_user_state(request_rec *r, const char *user, totp_user_state *state)
+{
+    totp_auth_config_rec *conf =
+        ap_get_module_config(r->per_dir_config, &authn_totp_module);
+    const char     *state_filepath;
+    apr_file_t     *state_file;
+    apr_status_t    status;
+    totp_state_blob *blob;
+    totp_user_state cached;
+    bool            found = false;
+
+    memset(state, 0, sizeof(*state));
+    state->version = TOTP_STATE_VERSION;
+
+    if (!conf->stateDir)
+        return false;
+
+    state_filepath = user_file_path(r, conf->stateDir, user, ".state");
+
+    status = user_file_open(r, conf->stateDir, state_filepath, APR_FOPEN_READ,
+                            APR_FPROT_OS_DEFAULT, &state_file);
+    if (APR_SUCCESS == status) {
+        status = apr_file_read_full(state_file, state, sizeof(*state), NULL);
+        apr_file_close(state_file);
+
+        if ((APR_SUCCESS != status) || (state->version != TOTP_STATE_VERSION)) {
+            ap_log_rerror(APLOG_MARK, APLOG_INFO, status, r,
+                          "read_user_state: ignoring outdated or invalid state file \"%s\"",
+                          state_filepath);
+            memset(state, 0, sizeof(*state));
+            state->version = TOTP_STATE_VERSION;
+        } else {
+            found = true;
+        }
+    } else if (!APR_STATUS_IS_ENOENT(status)) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, status, r,
+                      "read_user_state: could not open state file \"%s\"",
+                      state_filepath);
+    }
+
+    /* the record shared by the state cache wins, plus the scratch codes used here */
+    if (state_cache.provider && (blob = get_state_blob(r, user)) &&
+        (blob->len[TOTP_STATE_USER] == sizeof(cached))) {
+        memcpy(&cached, blob->data[TOTP_STATE_USER], sizeof(cached));
+        if (cached.version == TOTP_STATE_VERSION) {
+            if (found &&
+                (cached.scratch_fingerprint == state->scratch_fingerprint))
+                cached.scratch_used |= state->scratch_used;
+            *state = cached;
+            found = true;
+        }
+    }
+
+    return found;
+}
+
+/**
+  * \brief write_user_state Replace the learned state of a user
+  * \param r Request
+  * \param timestamp Timestamp for login event
+  * \param user User name
+  * \param state Pointer to the state
+  * \return true upon success, false otherwise
+ **/
+static bool
+write_user_state(request_rec *r, apr_time_t timestamp, const char *user,
+                 const totp_user_state *state)
+{
+    totp_auth_config_rec *conf =
+        ap_get_module_config(r->per_dir_config, &authn_totp_module);
+    const char     *state_filepath, *tmp_filepath;
+    totp_state_blob *blob;
+    apr_file_t     *tmp_file;
+    apr_status_t    status;
+
+    if (!conf->stateDir)
+        return false;
+
+    state_filepath = user_file_path(r, conf->stateDir, user, ".state");
+    tmp_filepath = apr_psprintf(r->pool, "%s.%" APR_TIME_T_FMT, state_filepath,
+                                timestamp);
+
+    status = user_file_open(r, conf->stateDir, tmp_filepath,
+                            APR_FOPEN_EXCL | APR_FOPEN_WRITE | APR_FOPEN_CREATE |
+                            APR_FOPEN_TRUNCATE, APR_UREAD | APR_UWRITE,
+                            &tmp_file);
+    if (APR_STATUS_IS_ENOENT(status) &&
+        (APR_SUCCESS == create_parent_dir(r, state_filepath)))
+        status = user_file_open(r, conf->stateDir, tmp_filepath,
+                                APR_FOPEN_EXCL | APR_FOPEN_WRITE |
+                                APR_FOPEN_CREATE | APR_FOPEN_TRUNCATE,
+                                APR_UREAD | APR_UWRITE, &tmp_file);
+    if (APR_SUCCESS != status) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, status, r,
+                      "write_user_state: could not create temporary file \"%s\"",
+                      tmp_filepath);
+        return false;
+    }
+
+    status = apr_file_write_full(tmp_file, state, sizeof(*state), NULL);
+    apr_file_close(tmp_file);
+    if (APR_SUCCESS == status)
+        status = user_file_rename(r, conf->stateDir, tmp_filepath,
+                                  state_filepath);
+    if (APR_SUCCESS != status) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, status, r,
+                      "write_user_state: could not replace state file \"%s\"",
+                      state_filepath);
+        user_file_remove(r, conf->stateDir, tmp_filepath);
+        return false;
+    }
+
+    /* the state cache shares the record, the peers merge the used scratch codes */
+    if (state_cache.provider && (blob = get_state_blob(r, user))) {
+        if (!state_cache.updates)
+            state_blob_set(blob, TOTP_STATE_USER,
+                           apr_pmemdup(r->pool, state, sizeof(*state)),
+                           sizeof(*state), sizeof(*state));
+        else if (APR_SUCCESS != state_cache_update(r, blob, TOTP_STATE_USER,
+                                                   TOTPD_UPDATE_REPLACE, 0,
+                                                   state, sizeof(*state),
+                                                   NULL))
+            ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r,
+                          "write_user_state: could not store state of \"%s\"",
+                          blob->key);
+        if (state->scratch_used)
+            state_blob_add_event(r, blob, TOTP_PEER_EVENT_SCRATCH,
+                                 state->scratch_fingerprint,
+                                 state->scratch_used);
+    }
+
+    return true;
+}
+
+/**
+  * \brief merge_user_state Merge the scratch codes a peer saw used into the record in a state
+  * \param blob Pointer to the state
+  * \param fingerprint Fingerprint of the peer's scratch codes
+  * \param scratch_used Scratch codes used on the peer
+  * \param pool Pool to allocate the record from
+ **/
+static void
+merge_user_state(totp_state_blob *blob, apr_uint32_t fingerprint,
+                 apr_uint32_t scratch_used, apr_pool_t *pool)
+{
+    totp_user_state *state = apr_pcalloc(pool, sizeof(*state));
+
+    if (blob->len[TOTP_STATE_USER] == sizeof(*state))
+        memcpy(state, blob->data[TOTP_STATE_USER], sizeof(*state));
+    if (state->version != TOTP_STATE_VERSION)
+        memset(state, 0, sizeof(*state));
+
+    /* a new set of scratch codes starts with the ones used on the peer */
+    if (state->scratch_fingerprint != fingerprint)
+        state->scratch_used = 0;
+    state->version = TOTP_STATE_VERSION;
+    state->scratch_fingerprint = fingerprint;
+    state->scratch_used |= scratch_used;
+
+    state_blob_set(blob, TOTP_STATE_USER, (char *) state, sizeof(*state),
+                   sizeof(*state));
+}
+
+/* Authentication Helpers: Rate Limiting User Logins */
+
+bool
+cb_rate_limit(const void *new, const void *old, totp_file_helper_cb_data *data)
+{
+    if (old) {
+        apr_time_t      curr = *((apr_time_t *) new);
+        apr_time_t      prev = *((apr_time_t *) old);
+
+        if (curr > prev) {
+            /* check if entry time is within time tolerance */
+            if ((curr - prev) <= apr_time_from_sec(data->conf->rate_limit_seconds)) {
+                data->res++;
+                return true;
+            }
+        }
+        return false;
+    } else {
+        return true;
+    }
+}
+
+/**
+  * \brief check_rate_limit Check if a user's login attempt is still within the rate limit
+  * \param r Request
+  * \param timestamp Timestamp for login event
+  * \param user Authenticating user name
+  * \param totp_config Pointer to user's TOTP authentication settings
+  * \param totp_code Authenticating TOTP code
+  * \return true upon success, false otherwise
+ **/
+static bool
+check_rate_limit(request_rec *r, apr_time_t timestamp,
+                 const char *user, totp_user_config *totp_config)
+{
+    totp_auth_config_rec *conf =
+        ap_get_module_config(r->per_dir_config, &authn_totp_module);
+    apr_status_t    status;
+    char           *login_filepath;
+    totp_file_helper_cb_data cb_data;
+
+    /* return immediately if no rate limit is defined */
+    if (totp_config->rate_limit_count == 0)
+        return true;
+
+    if (!conf->stateDir) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, status, r,
+                      "check_rate_limit: TOTPAuthStateDir is not defined");
+        return false;
+    }
+
+    /* set code file path */
+    login_filepath = user_file_path(r, conf->stateDir, user, ".logins");
+
+    /* initialize callback data */
+    cb_data.conf = totp_config;
+    cb_data.res = 0;
+
+    status = check_n_update_state(r, user, TOTP_STATE_LOGINS, login_filepath,
+                                  &timestamp, sizeof(apr_time_t),
+                                  cb_rate_limit, &cb_data);
+    if (APR_SUCCESS != status) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, status, r,
+                      "check_rate_limit: could not update logins file \"%s\"",
+                      login_filepath);
+        return false;
+    }
+
+    return (cb_data.res <= totp_config->rate_limit_count);
+}
+
+/**
+  * \brief check_failed_logins Check if a user's failed login attempts are still within the rate limit
+  * \param r Request
+  * \param timestamp Timestamp for login event
+  * \param user Authenticating user name
+  * \param totp_config Pointer to user's TOTP authentication settings
+  * \param retry_after Pointer to memory location to store the number of seconds until the next attempt is allowed
+  * \return true if within the rate limit, false otherwise
+ **/
+static bool
+check_failed_logins(request_rec *r, apr_time_t timestamp, const char *user,
+                    const totp_user_config *totp_config,
+                    unsigned int *retry_after)
+{
+    totp_auth_config_rec *conf =
+        ap_get_module_config(r->per_dir_config, &authn_totp_module);
+    apr_time_t      window = apr_time_from_sec(totp_config->rate_limit_seconds);
+    apr_time_t      entries[64];
+    apr_time_t      oldest = 0;
+    apr_status_t    status;
+    apr_file_t     *login_file = NULL;
+    apr_size_t      bytes_read, i, pos = 0;
+    unsigned int    failures = 0;
+    char           *login_filepath;
+    totp_state_blob *blob = NULL;
+
+    /* return immediately if no rate limit is defined */
+    if (totp_config->rate_limit_count == 0)
+        return true;
+
+    if (!conf->stateDir) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r,
+                      "check_failed_logins: TOTPAuthStateDir is not defined");
+        return false;
+    }
+
+    login_filepath = user_file_path(r, conf->stateDir, user, ".logins");
+
+    if (state_cache.provider) {
+        if (!(blob = get_state_blob(r, user)))
+            return false;
+    } else {
+        status = user_file_open(r, conf->stateDir, login_filepath,
+                                APR_FOPEN_READ | APR_FOPEN_BUFFERED,
+                                APR_FPROT_OS_DEFAULT, &login_file);
+        if (APR_STATUS_IS_ENOENT(status))
+            return true;
+        if (APR_SUCCESS != status) {
+            ap_log_rerror(APLOG_MARK, APLOG_ERR, status, r,
+                          "check_failed_logins: could not open logins file \"%s\"",
+                          login_filepath);
+            return false;
+        }
+    }
+
+    /* entries are appended in time order, stale ones are dropped on update */
+    do {
+        bytes_read = sizeof(entries);
+        if (blob) {
+            bytes_read = min(bytes_read, blob->len[TOTP_STATE_LOGINS] - pos);
+            memcpy(entries, blob->data[TOTP_STATE_LOGINS] + pos, bytes_read);
+            pos += bytes_read;
+            status = bytes_read ? APR_SUCCESS : APR_EOF;
+        } else {
+            status = apr_file_read(login_file, entries, &bytes_read);
+        }
+        for (i = 0; i < bytes_read / sizeof(apr_time_t); ++i) {
+            if ((entries[i] <= timestamp) && (timestamp - entries[i] <= window)) {
+                if (!failures++)
+                    oldest = entries[i];
+            }
+        }
+    } while (APR_SUCCESS == status);
+    if (login_file)
+        apr_file_close(login_file);
+
+    if (failures < totp_config->rate_limit_count)
+        return true;
+
+    /* the limit is lifted once the oldest failure leaves the window */
+    *retry_after = max(1, apr_time_sec(oldest + window - timestamp +
+                                       APR_USEC_PER_SEC - 1));
+
+    return false;
+}
+
+/**
+  * \brief update_failed_logins Record a failed login attempt or clear the failures after a success
+  * \param r Request
+  * \param timestamp Timestamp for login event
+  * \param user Authenticating user name
+  * \param totp_config Pointer to user's TOTP authentication settings
+  * \param success Whether the login attempt succeeded
+ **/
+static void
+update_failed_logins(request_rec *r, apr_time_t timestamp, const char *user,
+                     totp_user_config *totp_config, bool success)
+{
+    totp_auth_config_rec *conf =
+        ap_get_module_config(r->per_dir_config, &authn_totp_module);
+    apr_status_t    status;
+    char           *login_filepath;
+    totp_file_helper_cb_data cb_data;
+
+    if (!conf->rate_limit_failures || (totp_config->rate_limit_count == 0) ||
+        !conf->stateDir)
+        return;
+
+    login_filepath = user_file_path(r, conf->stateDir, user, ".logins");
+
+    if (success) {
+        status = clear_state(r, user, TOTP_STATE_LOGINS, login_filepath);
+        if (APR_SUCCESS != status)
+            ap_log_rerror(APLOG_MARK, APLOG_ERR, status, r,
+                          "update_failed_logins: could not remove logins file \"%s\"",
+                          login_filepath);
+        return;
+    }
+
+    cb_data.conf = totp_config;
+    cb_data.res = 0;
+
+    status = check_n_update_state(r, user, TOTP_STATE_LOGINS, login_filepath,
+                                  &timestamp, sizeof(apr_time_t),
+                                  cb_rate_limit, &cb_data);
+    if (APR_SUCCESS != status)
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, status, r,
+                      "update_failed_logins: could not update logins file \"%s\"",
+                      login_filepath);
+}
+
+/* Authentication Helpers: Rate Limiting Clients */
+
+/*
+ * Login attempts are counted per client address and per network prefix in a
+ * shared memory hash table, before the user is looked up. Each entry keeps the
+ * counts of the current and the previous window; the attempts within the
+ * last window are estimated by weighting the previous count with the part of
+ * the previous window that is still covered.
+ */
+#define TOTP_CLIENT_LIMIT_SIZE      16384
+#define TOTP_CLIENT_LIMIT_PROBES    8
+
+typedef struct {
+    unsigned char   prefix_len;     /* 0 if the slot is empty */
+    unsigned char   family;
+    unsigned char   addr[16];
+} totp_client_key;
+
+typedef struct {
+    totp_client_key key;
+    unsigned int    prev_count;
+    unsigned int    count;
+    apr_time_t      window_start;
+} totp_client_limit_rec;
+
+typedef struct {
+    unsigned int    size;
+    totp_client_limit_rec entries[];
+} totp_client_limit_table;
+
+static totp_shm_zone client_limit_zone = { "authn-totp-client-limit" };
+
+/**
+  * \brief get_client_keys Build the client address and network prefix keys of a request
+  * \param r Request
+  * \param client Pointer to memory location to store the client address key
+  * \param subnet Pointer to memory location to store the network prefix key
+  * \return true on success, false if the client address is unknown
+ **/
+static bool
+get_client_keys(request_rec *r, totp_client_key *client, totp_client_key *subnet)
+{
+    static const unsigned char v4mapped[12] =
+        { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff };
+    apr_sockaddr_t *addr = r->useragent_addr;
+    const unsigned char *ip;
+
+    if (!addr || !addr->ipaddr_ptr)
+        return false;
+
+    memset(client, 0, sizeof(*client));
+    memset(subnet, 0, sizeof(*subnet));
+    ip = addr->ipaddr_ptr;
+
+    if ((addr->family == APR_INET) && (addr->ipaddr_len == 4)) {
+        client->family = 4;
+        memcpy(client->addr, ip, 4);
+    }
+#if APR_HAVE_IPV6
+    else if ((addr->family == APR_INET6) && (addr->ipaddr_len == 16)) {
+        if (0 == memcmp(ip, v4mapped, sizeof(v4mapped))) {
+            client->family = 4;
+            memcpy(client->addr, ip + 12, 4);
+        } else {
+            client->family = 6;
+            memcpy(client->addr, ip, 16);
+        }
+    }
+#endif
+    else
+        return false;
+
+    memcpy(subnet, client, sizeof(*subnet));
+    if (client->family == 4) {
+        client->prefix_len = 32;
+        subnet->prefix_len = 24;
+        subnet->addr[3] = 0;
+    } else {
+        client->prefix_len = 128;
+        subnet->prefix_len = 64;
+        memset(subnet->addr + 8, 0, 8);
+    }
+
+    return true;
+}
+
+/**
+  * \brief client_limit_attempt Count a login attempt of a client key, the zone must be locked
+  * \param table Pointer to the client rate limit table
+  * \param key Pointer to the client key
+  * \param limit_count Maximum number of attempts per window
+  * \param limit_seconds Window length in seconds
+  * \param timestamp Current time
+  * \return true if the attempt is within the limit, false otherwise
+ **/
+static bool
+client_limit_attempt(totp_client_limit_table *table, const totp_client_key *key,
+                     unsigned int limit_count, apr_time_t limit_seconds,
+                     apr_time_t timestamp)
+{
+    const apr_time_t window = apr_time_from_sec(limit_seconds);
+    totp_client_limit_rec *entry, *victim = NULL;
+    apr_uint32_t    hash = 2166136261U;     /* FNV-1a */
+    apr_time_t      elapsed;
+    apr_uint64_t    estimate;
+    unsigned int    i;
+
+    for (i = 0; i < sizeof(*key); ++i)
+        hash = (hash ^ ((const unsigned char *) key)[i]) * 16777619U;
+
+    /* find the key, or replace the least recently started entry */
+    for (i = 0; i < TOTP_CLIENT_LIMIT_PROBES; ++i) {
+        entry = &table->entries[(hash + i) % table->size];
+        if (0 == memcmp(&entry->key, key, sizeof(*key))) {
+            victim = NULL;
+            break;
+        }
+        if (!victim || (entry->window_start < victim->window_start))
+            victim = entry;
+    }
+    if (victim) {
+        entry = victim;
+        memcpy(&entry->key, key, sizeof(*key));
+        entry->prev_count = 0;
+        entry->count = 0;
+        entry->window_start = timestamp;
+    }
+
+    /* advance the windows */
+    elapsed = timestamp - entry->window_start;
+    if ((elapsed >= 2 * window) || (elapsed < 0)) {
+        entry->prev_count = 0;
+        entry->count = 0;
+        entry->window_start = timestamp;
+        elapsed = 0;
+    } else if (elapsed >= window) {
+        entry->prev_count = entry->count;
+        entry->count = 0;
+        entry->window_start += window;
+        elapsed -= window;
+    }
+
+    estimate = entry->count +
+        (apr_uint64_t) entry->prev_count * (window - elapsed) / window;
+
+    /* denied attempts are counted as well, a client has to back off */
+    entry->count++;
+
+    return (estimate < limit_count);
+}
+
+/**
+  * \brief check_client_rate_limit Check if a client's login attempt is still within the rate limits
+  * \param r Request
+  * \param timestamp Timestamp for login event
+  * \return true upon success, false otherwise
+ **/
+static bool
+check_client_rate_limit(request_rec *r, apr_time_t timestamp)
+{
+    totp_auth_server_config_rec *sconf =
+        ap_get_module_config(r->server->module_config, &authn_totp_module);
+    totp_client_limit_table *table = client_limit_zone.base;
+    totp_client_key client, subnet;
+    bool            allowed = true;
+
+    if (!table || !get_client_keys(r, &client, &subnet))
+        return true;
+
+    if (!totp_shm_zone_lock(&client_limit_zone, r))
+        return true;
+
+    if (sconf->client_limit_count &&
+        !client_limit_attempt(table, &client, sconf->client_limit_count,
+                              sconf->client_limit_seconds, timestamp))
+        allowed = false;
+    if (sconf->subnet_limit_count &&
+        !client_limit_attempt(table, &subnet, sconf->subnet_limit_count,
+                              sconf->subnet_limit_seconds, timestamp))
+        allowed = false;
+
+    totp_shm_zone_unlock(&client_limit_zone);
+
+    return allowed;
+}
+
+/* Authentication Helpers: User Lockout */
+
+/*
+ * Users are locked out after a number of consecutive failed logins; every
+ * further lockout doubles in length up to a day until the user logs in
+ * successfully. The records live in a set-associative table in shared memory
+ * keyed by a salted digest of token directory and user name, so a locked
+ * account is rejected with a single table lookup.
+ */
+#define TOTP_LOCKOUT_WAYS       4
+#define TOTP_LOCKOUT_MAX        apr_time_from_sec(86400)
+
+typedef struct {
+    unsigned char   key[APR_SHA1_DIGESTSIZE];
+    unsigned int    failures;       /* failed logins since the last lockout */
+    unsigned int    level;          /* number of lockouts so far */
+    apr_time_t      locked_until;
+} totp_lockout_rec;
+
+typedef struct {
+    unsigned char   salt[16];
+    unsigned int    sets;
+    totp_lockout_rec entries[];
+} totp_lockout_table;
+
+static totp_shm_zone lockout_zone = { "authn-totp-lockout" };
+
+/**
+  * \brief lockout_find Find the record of a user, the zone must be locked
+  * \param r Request
+  * \param conf Pointer to the directory configuration
+  * \param user User name
+  * \param create Whether to replace the least useful record of the set if the user has none
+  * \return Pointer to the record, NULL if not found
+ **/
+static totp_lockout_rec *
+lockout_find(request_rec *r, const totp_auth_config_rec *conf,
+             const char *user, bool create)
+{
+    totp_lockout_table *table = lockout_zone.base;
+    totp_lockout_rec *set, *victim;
+    unsigned char   key[APR_SHA1_DIGESTSIZE];
+    const char     *token_dir = secret_source(conf);
+    apr_sha1_ctx_t  ctx;
+    unsigned int    i;
+
+    if (!token_dir)
+        token_dir = "";
+
+    apr_sha1_init(&ctx);
+    apr_sha1_update_binary(&ctx, table->salt, sizeof(table->salt));
+    apr_sha1_update(&ctx, token_dir, strlen(token_dir) + 1);
+    apr_sha1_update(&ctx, user, strlen(user));
+    apr_sha1_final(key, &ctx);
+
+    set = &table->entries[(get_be32(key) % table->sets) * TOTP_LOCKOUT_WAYS];
+    for (i = 0; i < TOTP_LOCKOUT_WAYS; ++i) {
+        if (0 == memcmp(set[i].key, key, APR_SHA1_DIGESTSIZE))
+            return &set[i];
+    }
+    if (!create)
+        return NULL;
+
+    /* replace the record whose lockout ended first, keeping active ones */
+    victim = &set[0];
+    for (i = 1; i < TOTP_LOCKOUT_WAYS; ++i) {
+        if (set[i].locked_until < victim->locked_until ||
+            (set[i].locked_until == victim->locked_until &&
+             set[i].failures < victim->failures))
+            victim = &set[i];
+    }
+    memcpy(victim->key, key, APR_SHA1_DIGESTSIZE);
+    victim->failures = 0;
+    victim->level = 0;
+    victim->locked_until = 0;
+
+    return victim;
+}
+
+/**
+  * \brief check_lockout Check if a user is locked out
+  * \param r Request
+  * \param conf Pointer to the directory configuration
+  * \param user User name
+  * \param timestamp Current time
+  * \param retry_after Pointer to memory location to store the number of seconds until the lockout ends
+  * \return true if the user may log in, false if locked out
+ **/
+static bool
+check_lockout(request_rec *r, const totp_auth_config_rec *conf,
+              const char *user, apr_time_t timestamp, unsigned int *retry_after)
+{
+    totp_lockout_rec *entry;
+    apr_time_t      locked_until = 0;
+
+    if (!totp_shm_zone_lock(&lockout_zone, r))
+        return true;
+
+    if ((entry = lockout_find(r, conf, user, false)))
+        locked_until = entry->locked_until;
+
+    totp_shm_zone_unlock(&lockout_zone);
+
+    if (timestamp >= locked_until)
+        return true;
+
+    *retry_after = apr_time_sec(locked_until - timestamp + APR_USEC_PER_SEC - 1);
+
+    return false;
+}
+
+/**
+  * \brief update_lockout Count a failed login and lock the user out once too many failed, or clear the record after a success
+  * \param r Request
+  * \param conf Pointer to the directory configuration
+  * \param user User name
+  * \param timestamp Timestamp for login event
+  * \param success Whether the login attempt succeeded
+ **/
+static void
+update_lockout(request_rec *r, const totp_auth_config_rec *conf,
+               const char *user, apr_time_t timestamp, bool success)
+{
+    totp_auth_server_config_rec *sconf =
+        ap_get_module_config(r->server->module_config, &authn_totp_module);
+    totp_lockout_rec *entry;
+    apr_time_t      duration;
+
+    if (!totp_shm_zone_lock(&lockout_zone, r))
+        return;
+
+    entry = lockout_find(r, conf, user, !success);
+    if (entry && success) {
+        memset(entry, 0, sizeof(*entry));
+    } else if (entry && (++entry->failures >= sconf->lockout_failures)) {
+        duration = min(apr_time_from_sec(sconf->lockout_seconds) <<
+                       min(entry->level, 16), TOTP_LOCKOUT_MAX);
+        entry->locked_until = timestamp + duration;
+        entry->failures = 0;
+        entry->level++;
+        ap_log_rerror(APLOG_MARK, APLOG_WARNING, 0, r,
+                      "update_lockout: user \"%s\" locked out for %" APR_TIME_T_FMT
+                      " seconds", user, apr_time_sec(duration));
+    }
+
+    totp_shm_zone_unlock(&lockout_zone);
+}
+
+/* Authentication Helpers: Heavy Hitters */
+
+/*
+ * Login attempts and failures are counted per user name and per client
+ * address in a count-min sketch kept for the current and the previous
+ * window, weighted like the client rate limiter. The heaviest users and
+ * clients are kept in a small table next to the sketch; a new key replaces
+ * the lightest entry once its estimate is higher.
+ *
+ * The cells are counted with atomic increments and read without the lock,
+ * the estimates are approximate anyway. The lock is only taken to start a new
+ * window and to replace an entry of the table.
+ */
+#define TOTP_SKETCH_DEPTH       4
+#define TOTP_SKETCH_WIDTH       4096
+
+#define TOTP_HITTER_USER        1
+#define TOTP_HITTER_CLIENT      2
+
+typedef struct {
+    apr_uint32_t    attempts;
+    apr_uint32_t    failures;
+} totp_sketch_cell;
+
+typedef struct {
+    unsigned char   kind;       /* 0 if the entry is empty */
+    apr_uint32_t    hash;       /* of kind and name, see hitters_index */
+    char            name[TOTP_MAX_USER_LEN];
+    apr_uint32_t    attempts;   /* estimates at the last update */
+    apr_uint32_t    failures;
+} totp_hitter_rec;
+
+typedef struct {
+    apr_uint32_t    salt;
+    unsigned int    size;
+    unsigned int    current;    /* sketch of the current window */
+    unsigned int    lightest;   /* entry of top when it last changed */
+    apr_time_t      window;
+    apr_time_t      window_start;
+    totp_sketch_cell cells[2][TOTP_SKETCH_DEPTH][TOTP_SKETCH_WIDTH];
+    totp_hitter_rec top[];
+} totp_hitters_table;
+
+static totp_shm_zone hitters_zone = { "authn-totp-heavy-hitters" };
+
+/**
+  * \brief hitters_index Compute the sketch columns of a key
+  * \param table Pointer to the heavy hitters table
+  * \param kind Key kind, TOTP_HITTER_USER or TOTP_HITTER_CLIENT
+  * \param name Key name
+  * \param idx Pointer to TOTP_SKETCH_DEPTH columns
+  * \return Hash of the key
+ **/
+static          apr_uint32_t
+hitters_index(const totp_hitters_table *table, unsigned char kind,
+              const char *name, unsigned int *idx)
+{
+    apr_uint32_t    h1 = 2166136261U ^ table->salt;     /* FNV-1a */
+    apr_uint32_t    h2;
+    unsigned int    i;
+
+    h1 = (h1 ^ kind) * 16777619U;
+    for (; *name; ++name)
+        h1 = (h1 ^ (unsigned char) *name) * 16777619U;
+
+    /* derive the rows by double hashing */
+    h2 = ((h1 >> 16) | (h1 << 16)) * 0x45d9f3bU | 1;
+    for (i = 0; i < TOTP_SKETCH_DEPTH; ++i)
+        idx[i] = (h1 + i * h2) % TOTP_SKETCH_WIDTH;
+
+    return h1;
+}
+
+/**
+  * \brief hitters_find Find the entry of a key in the table of the heaviest keys
+  * \return Pointer to the entry, NULL if the key is not tracked
+ **/
+static totp_hitter_rec *
+hitters_find(totp_hitters_table *table, unsigned char kind, const char *name,
+             apr_uint32_t hash)
+{
+    unsigned int    i;
+
+    for (i = 0; i < table->size; ++i) {
+        if ((table->top[i].hash == hash) && (table->top[i].kind == kind) &&
+            !strcmp(table->top[i].name, name))
+            return &table->top[i];
+    }
+    return NULL;
+}
+
+/**
+  * \brief hitters_rotate Start a new window once the current one is over, the zone must be locked
+ **/
+static void
+hitters_rotate(totp_hitters_table *table, apr_time_t timestamp)
+{
+    if (timestamp - table->window_start < table->window)
+        return;
+
+    if (timestamp - table->window_start >= 2 * table->window) {
+        memset(table->cells, 0, sizeof(table->cells));
+        table->window_start = timestamp;
+    } else {
+        table->current ^= 1;
+        memset(table->cells[table->current], 0,
+               sizeof(table->cells[table->current]));
+        table->window_start += table->window;
+    }
+}
+
+/**
+  * \brief hitters_estimate Estimate the attempts and failures of a key within the last window
+ **/
+static void
+hitters_estimate(const totp_hitters_table *table, const unsigned int *idx,
+                 apr_time_t timestamp, apr_uint32_t *attempts,
+                 apr_uint32_t *failures)
+{
+    const totp_sketch_cell *cur, *prev;
+    apr_uint64_t    weight = table->window -
+        min(table->window, timestamp - table->window_start);
+    apr_uint32_t    a, f;
+    unsigned int    i;
+
+    *attempts = *failures = APR_UINT32_MAX;
+    for (i = 0; i < TOTP_SKETCH_DEPTH; ++i) {
+        cur = &table->cells[table->current][i][idx[i]];
+        prev = &table->cells[table->current ^ 1][i][idx[i]];
+        a = cur->attempts + prev->attempts * weight / table->window;
+        f = cur->failures + prev->failures * weight / table->window;
+        *attempts = min(*attempts, a);
+        *failures = min(*failures, f);
+    }
+}
+
+/**
+  * \brief record_hitter Count a login attempt or failure of a user or client
+  * \param r Request
+  * \param kind Key kind, TOTP_HITTER_USER or TOTP_HITTER_CLIENT
+  * \param name Key name
+  * \param failure Whether a failure is counted instead of an attempt
+ **/
+static void
+record_hitter(request_rec *r, unsigned char kind, const char *name,
+              bool failure)
+{
+    totp_hitters_table *table = hitters_zone.base;
+    totp_hitter_rec *entry, *lightest;
+    totp_sketch_cell *cell;
+    apr_time_t      timestamp = apr_time_now();
+    apr_uint32_t    attempts, failures, hash;
+    unsigned int    idx[TOTP_SKETCH_DEPTH];
+    unsigned int    i;
+
+    if (!table || !name || (strlen(name) >= TOTP_MAX_USER_LEN))
+        return;
+
+    hash = hitters_index(table, kind, name, idx);
+
+    if ((timestamp - table->window_start >= table->window) &&
+        totp_shm_zone_lock(&hitters_zone, r)) {
+        hitters_rotate(table, timestamp);
+        totp_shm_zone_unlock(&hitters_zone);
+    }
+    for (i = 0; i < TOTP_SKETCH_DEPTH; ++i) {
+        cell = &table->cells[table->current][i][idx[i]];
+        apr_atomic_inc32(failure ? &cell->failures : &cell->attempts);
+    }
+    hitters_estimate(table, idx, timestamp, &attempts, &failures);
+
+    /* a key no heavier than the lightest entry stays out or is evicted first */
+    lightest = &table->top[table->lightest];
+    if (attempts + failures <= lightest->attempts + lightest->failures)
+        return;
+
+    if ((entry = hitters_find(table, kind, name, hash))) {
+        entry->attempts = attempts;
+        entry->failures = failures;
+        return;
+    }
+
+    if (!totp_shm_zone_lock(&hitters_zone, r))
+        return;
+
+    /* another process may have added the key or changed the table meanwhile */
+    if (!hitters_find(table, kind, name, hash)) {
+        for (i = 0, lightest = &table->top[0]; i < table->size; ++i) {
+            if (table->top[i].attempts + table->top[i].failures <
+                lightest->attempts + lightest->failures)
+                lightest = &table->top[i];
+        }
+        if (attempts + failures > lightest->attempts + lightest->failures) {
+            lightest->kind = 0;
+            lightest->hash = hash;
+            apr_cpystrn(lightest->name, name, sizeof(lightest->name));
+            lightest->attempts = attempts;
+            lightest->failures = failures;
+            lightest->kind = kind;
+        }
+        for (i = 0, table->lightest = 0; i < table->size; ++i) {
+            if (table->top[i].attempts + table->top[i].failures <
+                table->top[table->lightest].attempts +
+                table->top[table->lightest].failures)
+                table->lightest = i;
+        }
+    }
+
+    totp_shm_zone_unlock(&hitters_zone);
+}
+
+/**
+  * \brief check_hitter Check if a user or client failed too often within the last window
+  * \param r Request
+  * \param kind Key kind, TOTP_HITTER_USER or TOTP_HITTER_CLIENT
+  * \param name Key name
+  * \param retry_after Pointer to memory location to store the number of seconds until the window moves on
+  * \return true if within the limit, false otherwise
+ **/
+static bool
+check_hitter(request_rec *r, unsigned char kind, const char *name,
+             unsigned int *retry_after)
+{
+    totp_auth_server_config_rec *sconf =
+        ap_get_module_config(r->server->module_config, &authn_totp_module);
+    totp_hitters_table *table = hitters_zone.base;
+    apr_time_t      timestamp = apr_time_now();
+    apr_uint32_t    attempts, failures;
+    unsigned int    idx[TOTP_SKETCH_DEPTH];
+
+    if (!table || !sconf->hitters_max_failures || !name)
+        return true;
+
+    hitters_index(table, kind, name, idx);
+
+    if ((timestamp - table->window_start >= table->window) &&
+        totp_shm_zone_lock(&hitters_zone, r)) {
+        hitters_rotate(table, timestamp);
+        totp_shm_zone_unlock(&hitters_zone);
+    }
+    hitters_estimate(table, idx, timestamp, &attempts, &failures);
+    *retry_after = max(1, apr_time_sec(table->window_start + table->window -
+                                       timestamp));
+
+    return failures < sconf->hitters_max_failures;
+}
+
+/* Authentication Helpers: Verification Budget */
+
+/*
+ * Every TOTP code candidate costs one HMAC computation, a wrong guess against
+ * a window of size w costs 2w + 1 of them. The server-wide budget per second
+ * is kept in shared memory; once it runs short the window of further logins
+ * is narrowed as far as needed, down to the current time step alone, until
+ * the next second starts.
+ */
+typedef struct {
+    apr_time_t      second;     /* second the budget is spent in */
+    apr_uint32_t    used;
+    apr_uint64_t    full;       /* logins verified with their whole window */
+    apr_uint64_t    narrowed;   /* logins verified with a narrowed window */
+    apr_uint64_t    centered;   /* logins verified with the current step only */
+} totp_hmac_budget;
+
+static totp_shm_zone budget_zone = { "authn-totp-hmac-budget" };
+
+/**
+  * \brief reserve_hmac_budget Reserve the code computations for a login from the server-wide budget
+  * \param r Request
+  * \param window_size Configured window size of the user
+  * \return Window size that may be used for this login
+ **/
+static int
+reserve_hmac_budget(request_rec *r, int window_size)
+{
+    totp_auth_server_config_rec *sconf =
+        ap_get_module_config(r->server->module_config, &authn_totp_module);
+    totp_hmac_budget *budget = budget_zone.base;
+    apr_time_t      second = apr_time_sec(apr_time_now());
+    apr_uint32_t    remaining;
+    int             effective = window_size;
+
+    if (!budget || !totp_shm_zone_lock(&budget_zone, r))
+        return window_size;
+
+    if (budget->second != second) {
+        budget->second = second;
+        budget->used = 0;
+    }
+    remaining = (budget->used < sconf->hmac_budget) ?
+        sconf->hmac_budget - budget->used : 0;
+
+    /* the current time step is always checked */
+    if (remaining < (apr_uint32_t) (2 * window_size + 1))
+        effective = remaining ? (remaining - 1) / 2 : 0;
+
+    budget->used += 2 * effective + 1;
+    if (effective == window_size)
+        budget->full++;
+    else if (effective)
+        budget->narrowed++;
+    else
+        budget->centered++;
+
+    totp_shm_zone_unlock(&budget_zone);
+
+    if (effective != window_size)
+        ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r,
+                      "reserve_hmac_budget: code window narrowed from %d to %d steps",
+                      window_size, effective);
+
+    return effective;
+}
+
+/* Authentication Helpers: Login Admission Control */
+
+/*
+ * Full TOTP verifications are admitted through token buckets in shared memory:
+ * bucket 0 is server-wide, every virtual host with a TOTPAuthLoginRate has
+ * its own. Tokens are kept in millionths so that refills are exact.
+ */
+#define TOTP_BUCKET_UNIT        1000000
+
+typedef struct {
+    apr_uint64_t    tokens;     /* in millionths of a token */
+    apr_time_t      refilled;
+} totp_token_bucket;
+
+typedef struct {
+    unsigned int    count;
+    totp_token_bucket buckets[];
+} totp_admission_table;
+
+static totp_shm_zone admission_zone = { "authn-totp-admission" };
+
+/**
+  * \brief bucket_refill Refill a token bucket, the zone must be locked
+  * \param bucket Pointer to the token bucket
+  * \param rate Number of tokens per second
+  * \param burst Bucket capacity
+  * \param timestamp Current time
+ **/
+static void
+bucket_refill(totp_token_bucket *bucket, unsigned int rate,
+              unsigned int burst, apr_time_t timestamp)
+{
+    const apr_uint64_t capacity = (apr_uint64_t) burst * TOTP_BUCKET_UNIT;
+
+    /* elapsed microseconds times tokens per second are millionths of tokens */
+    if (!bucket->refilled)
+        bucket->tokens = capacity;
+    else if (timestamp > bucket->refilled)
+        bucket->tokens = min(capacity, bucket->tokens +
+                             (apr_uint64_t) (timestamp - bucket->refilled) * rate);
+    bucket->refilled = timestamp;
+}
+
+/**
+  * \brief bucket_retry_after Get the number of seconds until a token bucket holds a token again
+ **/
+static unsigned int
+bucket_retry_after(const totp_token_bucket *bucket, unsigned int rate)
+{
+    apr_uint64_t    missing = TOTP_BUCKET_UNIT - bucket->tokens;
+
+    if (!rate)
+        return 60;
+
+    return (missing + (apr_uint64_t) rate * TOTP_BUCKET_UNIT - 1)
+        / ((apr_uint64_t) rate * TOTP_BUCKET_UNIT);
+}
+
+/**
+  * \brief admit_login Take a token from the server-wide and the virtual host bucket
+  * \param r Request
+  * \param retry_after Pointer to memory location to store the number of seconds to wait when denied
+  * \return true if the login is admitted, false otherwise
+ **/
+static bool
+admit_login(request_rec *r, unsigned int *retry_after)
+{
+    totp_auth_server_config_rec *sconf =
+        ap_get_module_config(r->server->module_config, &authn_totp_module);
+    totp_admission_table *table = admission_zone.base;
+    totp_token_bucket *global = NULL, *vhost = NULL;
+    apr_time_t      timestamp = apr_time_now();
+    bool            admitted = true;
+
+    if (!table || !totp_shm_zone_lock(&admission_zone, r))
+        return true;
+
+    if (sconf->global_login_rate || sconf->global_login_burst) {
+        global = &table->buckets[0];
+        bucket_refill(global, sconf->global_login_rate,
+                      sconf->global_login_burst, timestamp);
+        if (global->tokens < TOTP_BUCKET_UNIT) {
+            *retry_after = bucket_retry_after(global, sconf->global_login_rate);
+            admitted = false;
+        }
+    }
+    if (admitted && sconf->admission_index) {
+        vhost = &table->buckets[sconf->admission_index];
+        bucket_refill(vhost, sconf->login_rate, sconf->login_burst, timestamp);
+        if (vhost->tokens < TOTP_BUCKET_UNIT) {
+            *retry_after = bucket_retry_after(vhost, sconf->login_rate);
+            admitted = false;
+        }
+    }
+    if (admitted) {
+        if (global)
+            global->tokens -= TOTP_BUCKET_UNIT;
+        if (vhost)
+            vhost->tokens -= TOTP_BUCKET_UNIT;
+    }
+
+    totp_shm_zone_unlock(&admission_zone);
+
+    return admitted;
+}
+
+/* Authentication Helpers: Session Revocation */
+
+/*
+ * Revocations are kept in an open addressing table in shared memory. A blocked
+ * Bloom filter in front of the table keeps the common not-revoked check to one
+ * cache line per key without taking the zone lock. Two kinds of keys exist:
+ *
+ *   user     revokes all logins of a user up to the revocation time
+ *   session  revokes a single login, identified by user and login time
+ *
+ * Entries expire once every token they cover would have expired anyway.
+ */
+#define TOTP_BLOOM_BLOCK_SIZE   64
+#define TOTP_BLOOM_PROBES       4
+#define TOTP_REVOCATION_PROBES  32
+
+typedef struct {
+    unsigned char   key[APR_SHA1_DIGESTSIZE];
+    apr_time_t      revoked;    /* logins up to this time are revoked */
+    apr_time_t      expires;    /* 0 if the slot is empty */
+} totp_revocation_rec;
+
+typedef struct {
+    volatile apr_uint32_t generation; /* odd while the filter is rebuilt */
+    unsigned int    size;
+    unsigned int    count;
+    unsigned int    blocks;
+    apr_time_t      next_expiry;
+    apr_time_t      lifetime;
+    /* followed by the Bloom filter blocks and the table entries */
+} totp_revocation_list;
+
+static totp_shm_zone revocation_zone = { "authn-totp-revocation-list" };
+
+static unsigned char *
+revocation_bloom(totp_revocation_list *list)
+{
+    return (unsigned char *) (list + 1);
+}
+
+static totp_revocation_rec *
+revocation_entries(totp_revocation_list *list)
+{
+    return (totp_revocation_rec *) (revocation_bloom(list) +
+                                    list->blocks * TOTP_BLOOM_BLOCK_SIZE);
+}
+
+/**
+  * \brief revocation_key_user Compute the revocation key covering all logins of a user
+ **/
+static void
+revocation_key_user(const char *user, unsigned char *key)
+{
+    apr_sha1_ctx_t  ctx;
+
+    apr_sha1_init(&ctx);
+    apr_sha1_update(&ctx, "user", sizeof("user"));
+    apr_sha1_update(&ctx, user, strlen(user));
+    apr_sha1_final(key, &ctx);
+}
+
+/**
+  * \brief revocation_key_session Compute the revocation key covering a single login of a user
+ **/
+static void
+revocation_key_session(const char *user, apr_time_t timestamp,
+                       unsigned char *key)
+{
+    apr_sha1_ctx_t  ctx;
+    unsigned char   data[8];
+
+    put_be64(data, timestamp);
+
+    apr_sha1_init(&ctx);
+    apr_sha1_update(&ctx, "session", sizeof("session"));
+    apr_sha1_update_binary(&ctx, data, sizeof(data));
+    apr_sha1_update(&ctx, user, strlen(user));
+    apr_sha1_final(key, &ctx);
+}
+
+/**
+  * \brief revocation_bloom_probe Set or test the Bloom filter bits of a key
+  * \param list Pointer to the revocation list
+  * \param key Revocation key
+  * \param set If true the bits are set, otherwise they are tested
+  * \return true if all bits of the key are set
+ **/
+static bool
+revocation_bloom_probe(totp_revocation_list *list, const unsigned char *key,
+                       bool set)
+{
+    unsigned char  *block = revocation_bloom(list) +
+        (get_be32(key) % list->blocks) * TOTP_BLOOM_BLOCK_SIZE;
+    unsigned int    bit;
+    int             i;
+    bool            found = true;
+
+    for (i = 0; i < TOTP_BLOOM_PROBES; ++i) {
+        bit = ((key[4 + 2 * i] << 8) | key[5 + 2 * i]) %
+            (TOTP_BLOOM_BLOCK_SIZE * 8);
+        if (set)
+            block[bit >> 3] |= 1 << (bit & 7);
+        else if (!(block[bit >> 3] & (1 << (bit & 7))))
+            found = false;
+    }
+
+    return found;
+}
+
+/**
+  * \brief revocation_find Find the table slot of a key, the zone must be locked
+  * \param list Pointer to the revocation list
+  * \param key Revocation key
+  * \param empty If not NULL, function returns the first empty slot in the probe sequence
+  * \return Pointer to the entry of the key if found, NULL otherwise
+ **/
+static totp_revocation_rec *
+revocation_find(totp_revocation_list *list, const unsigned char *key,
+                totp_revocation_rec **empty)
+{
+    totp_revocation_rec *entries = revocation_entries(list);
+    totp_revocation_rec *entry;
+    unsigned int    idx = get_be32(key + 12) % list->size;
+    int             i;
+
+    if (empty)
+        *empty = NULL;
+
+    for (i = 0; i < TOTP_REVOCATION_PROBES; ++i) {
+        entry = &entries[(idx + i) % list->size];
+        if (!entry->expires) {
+            if (empty)
+                *empty = entry;
+            return NULL;
+        }
+        if (0 == memcmp(entry->key, key, APR_SHA1_DIGESTSIZE))
+            return entry;
+    }
+
+    return NULL;
+}
+
+/**
+  * \brief revocation_rebuild Drop expired entries and rebuild the Bloom filter, the zone must be locked
+  * \param r Request
+  * \param list Pointer to the revocation list
+  * \param timestamp Current time
+ **/
+static void
+revocation_rebuild(request_rec *r, totp_revocation_list *list,
+                   apr_time_t timestamp)
+{
+    totp_revocation_rec *entries = revocation_entries(list);
+    totp_revocation_rec *live, *slot;
+    unsigned int    i, count = 0;
+
+    live = apr_palloc(r->pool, list->count * sizeof(*live) + 1);
+    for (i = 0; i < list->size; ++i)
+        if (entries[i].expires > timestamp)
+            live[count++] = entries[i];
+
+    /* readers of the filter fall back to the table while it is rebuilt */
+    apr_atomic_inc32(&list->generation);
+
+    memset(revocation_bloom(list), 0, list->blocks * TOTP_BLOOM_BLOCK_SIZE);
+    memset(entries, 0, list->size * sizeof(*entries));
+    list->count = 0;
+    list->next_expiry = 0;
+
+    for (i = 0; i < count; ++i) {
+        revocation_find(list, live[i].key, &slot);
+        if (!slot)
+            continue;
+        *slot = live[i];
+        revocation_bloom_probe(list, slot->key, true);
+        list->count++;
+        if (!list->next_expiry || (slot->expires < list->next_expiry))
+            list->next_expiry = slot->expires;
+    }
+
+    apr_atomic_inc32(&list->generation);
+}
+
+/**
+  * \brief revoke_key Add a revocation key to the list
+  * \param r Request
+  * \param key Revocation key
+  * \param timestamp Logins up to this time are revoked
+  * \return true on success, false if the list is unavailable or full
+ **/
+static bool
+revoke_key(request_rec *r, const unsigned char *key, apr_time_t timestamp)
+{
+    totp_revocation_list *list = revocation_zone.base;
+    totp_revocation_rec *entry, *empty;
+    apr_time_t      now = apr_time_now();
+
+    if (!list || !totp_shm_zone_lock(&revocation_zone, r))
+        return false;
+
+    if (list->next_expiry && (list->next_expiry <= now))
+        revocation_rebuild(r, list, now);
+
+    entry = revocation_find(list, key, &empty);
+    if (!entry && empty && (list->count < list->size)) {
+        entry = empty;
+        memcpy(entry->key, key, APR_SHA1_DIGESTSIZE);
+        entry->revoked = 0;
+        list->count++;
+    }
+    if (entry) {
+        entry->revoked = max(entry->revoked, timestamp);
+        entry->expires = now + list->lifetime;
+        revocation_bloom_probe(list, key, true);
+        if (!list->next_expiry || (entry->expires < list->next_expiry))
+            list->next_expiry = entry->expires;
+    }
+
+    totp_shm_zone_unlock(&revocation_zone);
+
+    if (!entry)
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r,
+                      "revoke_key: revocation list is full");
+
+    return (entry != NULL);
+}
+
+/**
+  * \brief is_key_revoked Check if a login is covered by a revocation key
+  * \param r Request
+  * \param list Pointer to the revocation list
+  * \param key Revocation key
+  * \param timestamp Login time
+  * \return true if the login is revoked, false otherwise
+ **/
+static bool
+is_key_revoked(request_rec *r, totp_revocation_list *list,
+               const unsigned char *key, apr_time_t timestamp)
+{
+    totp_revocation_rec *entry;
+    apr_uint32_t    generation = apr_atomic_read32(&list->generation);
+    bool            revoked = false;
+
+    /* common case: the filter rules the key out without locking */
+    if (!(generation & 1) && !revocation_bloom_probe(list, key, false) &&
+        (apr_atomic_read32(&list->generation) == generation))
+        return false;
+
+    if (!totp_shm_zone_lock(&revocation_zone, r))
+        return false;
+
+    entry = revocation_find(list, key, NULL);
+    if (entry && (timestamp <= entry->revoked) &&
+        (r->request_time < entry->expires))
+        revoked = true;
+
+    totp_shm_zone_unlock(&revocation_zone);
+
+    return revoked;
+}
+
+/**
+  * \brief is_login_revoked Check if a user's login was revoked
+  * \param r Request
+  * \param user User name
+  * \param timestamp Login time
+  * \return true if the login is revoked, false otherwise
+ **/
+static bool
+is_login_revoked(request_rec *r, const char *user, apr_time_t timestamp)
+{
+    totp_revocation_list *list = revocation_zone.base;
+    unsigned char   key[APR_SHA1_DIGESTSIZE];
+
+    if (!list || !list->count)
+        return false;
+
+    revocation_key_user(user, key);
+    if (is_key_revoked(r, list, key, timestamp))
+        return true;
+
+    revocation_key_session(user, timestamp, key);
+    return is_key_revoked(r, list, key, timestamp);
+}
+
+/* Authentication Helpers: Basic Authentication Verdict Cache */
+
+typedef struct {
+    unsigned char   digest[APR_SHA1_DIGESTSIZE];
+    apr_time_t      issued;
+    apr_time_t      expires;
+} totp_verdict_rec;
+
+typedef struct {
+    unsigned char   salt[16];
+    unsigned int    size;
+    totp_verdict_rec entries[];
+} totp_verdict_cache;
+
+static totp_shm_zone verdict_zone = { "authn-totp-verdict-cache" };
+
+/**
+  * \brief verdict_digest Compute the salted digest identifying a set of Basic authentication credentials
+  * \param r Request
+  * \param cache Pointer to the verdict cache
+  * \param conf Pointer to the directory configuration
+  * \param user User name
+  * \param password Password
+  * \param digest Pointer to memory location that can hold a SHA1 hash digest
+  * \return Index of the cache entry for these credentials
+ **/
+static unsigned int
+verdict_digest(request_rec *r, const totp_verdict_cache *cache,
+               const totp_auth_config_rec *conf, const char *user,
+               const char *password, unsigned char *digest)
+{
+    const char     *realm = ap_auth_name(r);
+    const char     *token_dir = secret_source(conf);
+    apr_sha1_ctx_t  ctx;
+
+    if (!realm)
+        realm = "";
+    if (!token_dir)
+        token_dir = "";
+
+    /* separate the fields with their terminating NUL characters */
+    apr_sha1_init(&ctx);
+    apr_sha1_update_binary(&ctx, cache->salt, sizeof(cache->salt));
+    apr_sha1_update(&ctx, realm, strlen(realm) + 1);
+    apr_sha1_update(&ctx, token_dir, strlen(token_dir) + 1);
+    apr_sha1_update(&ctx, user, strlen(user) + 1);
+    apr_sha1_update(&ctx, password, strlen(password));
+    apr_sha1_final(digest, &ctx);
+
+    return ((digest[0] << 24) | (digest[1] << 16) | (digest[2] << 8) | digest[3])
+        % cache->size;
+}
+
+/**
+  * \brief lookup_verdict Check if the given credentials were successfully verified and are still valid
+  * \param r Request
+  * \param conf Pointer to the directory configuration
+  * \param user User name
+  * \param password Password
+  * \param timestamp Current time
+  * \return true if a valid verdict was found, false otherwise
+ **/
+static bool
+lookup_verdict(request_rec *r, const totp_auth_config_rec *conf,
+               const char *user, const char *password, apr_time_t timestamp)
+{
+    totp_verdict_cache *cache = verdict_zone.base;
+    totp_verdict_rec *entry;
+    unsigned char   digest[APR_SHA1_DIGESTSIZE];
+    unsigned int    idx;
+    apr_time_t      issued = 0;
+    bool            found = false;
+
+    if (!cache)
+        return false;
+
+    idx = verdict_digest(r, cache, conf, user, password, digest);
+
+    if (!totp_shm_zone_lock(&verdict_zone, r))
+        return false;
+
+    entry = &cache->entries[idx];
+    if (digest_equal(entry->digest, digest, APR_SHA1_DIGESTSIZE) &&
+        (entry->issued <= timestamp) && (timestamp < entry->expires)) {
+        issued = entry->issued;
+        found = true;
+    }
+
+    totp_shm_zone_unlock(&verdict_zone);
+
+    memset(digest, 0, sizeof(digest));
+
+    return found && !is_login_revoked(r, user, issued);
+}
+
+/**
+  * \brief store_verdict Remember successfully verified credentials until the TOTP authentication expires
+  * \param r Request
+  * \param conf Pointer to the directory configuration
+  * \param user User name
+  * \param password Password
+  * \param timestamp Timestamp for login event
+ **/
+static void
+store_verdict(request_rec *r, const totp_auth_config_rec *conf,
+              const char *user, const char *password, apr_time_t timestamp)
+{
+    totp_verdict_cache *cache = verdict_zone.base;
+    totp_verdict_rec *entry;
+    unsigned char   digest[APR_SHA1_DIGESTSIZE];
+    unsigned int    idx;
+
+    if (!cache)
+        return;
+
+    idx = verdict_digest(r, cache, conf, user, password, digest);
+
+    if (!totp_shm_zone_lock(&verdict_zone, r))
+        return;
+
+    /* the cache is direct-mapped: newer verdicts replace older ones */
+    entry = &cache->entries[idx];
+    memcpy(entry->digest, digest, APR_SHA1_DIGESTSIZE);
+    entry->issued = timestamp;
+    entry->expires = timestamp + apr_time_from_sec(conf->expires);
+
+    totp_shm_zone_unlock(&verdict_zone);
+
+    memset(digest, 0, sizeof(digest));
+}
+
+/* Authentication Helpers: mod_authn_socache */
+
+/**
+  * \brief store_socache_credentials Offer a verified TOTP code to mod_authn_socache
+  * \param r Request
+  * \param conf Pointer to the directory configuration
+  * \param user User name
+  * \param password Verified TOTP code
+ **/
+static void
+store_socache_credentials(request_rec *r, const totp_auth_config_rec *conf,
+                          const char *user, const char *password)
+{
+    unsigned char   rnd[6];
+    char            salt[9];
+    char            hash[120];
+
+    if (!conf->socache || !authn_cache_store_fn)
+        return;
+
+    /* mod_authn_socache validates cached credentials with ap_password_validate */
+    if ((APR_SUCCESS != apr_generate_random_bytes(rnd, sizeof(rnd))) ||
+        (APR_SUCCESS != apr_encode_base64_binary(salt, rnd, sizeof(rnd),
+                                                 APR_ENCODE_NONE, NULL)) ||
+        (APR_SUCCESS != apr_md5_encode(password, salt, hash, sizeof(hash)))) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r,
+                      "store_socache_credentials: could not hash code of user \"%s\"",
+                      user);
+        return;
+    }
+
+    authn_cache_store_fn(r, "totp", user, NULL, hash);
+}
+
+/* Authentication Functions */
+
+/**
+  * \brief verify_login Verify and consume the TOTP code or scratch code of a login
+  * \param r Request
+  * \param user User name
+  * \param password TOTP code or scratch code
+  * \param cached Whether credentials found in the verdict cache are accepted
+  * \param token Function returns pointer to a new authentication token upon success, may be NULL
+  * \return Authentication status
+ **/
+static          authn_status
+verify_login(request_rec *r, const char *user, const char *password,
+             bool cached, const char **token)
+{
+    totp_auth_config_rec *conf =
+        ap_get_module_config(r->per_dir_config, &authn_totp_module);
+    totp_request_rec *req = get_request_rec(r, false);
+    totp_user_config user_config;
+    totp_user_config *totp_config = &user_config;
+    unsigned int    password_len = strlen(password);
+    apr_time_t      timestamp = apr_time_now();
+    apr_time_t      totp_timestamp = to_totp_timestamp(timestamp);
+    const char     *tmp;
+    unsigned int    totp_code = 0, user_code = 0;
+    unsigned int    retry_after;
+    totp_user_state user_state;
+    apr_file_t     *state_lock;
+    bool            consumed;
+    int             i, k, drift, reach, window_size;
+
+    ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r,
+                  "TOTP BASIC AUTH at timestamp=%" APR_TIME_T_FMT " totp_timestamp=%"
+                  APR_TIME_T_FMT, timestamp, totp_timestamp);
+
+    /* validate user name */
+    if (!is_alnum_str(user)) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r,
+                      "user name contains non-alphanumeric characters");
+        return AUTH_USER_NOT_FOUND;
+    }
+
+    /* validate password */
+    if ((password_len == 6) || (password_len == 8)) {
+        if (!is_digit_str(password)) {
+            ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r,
+                          "password contains non-digit characters");
+            return AUTH_DENIED;
+        }
+    } else {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r,
+                      "password is not recognized as a TOTP (6 digits) or a scratch code (8 digits)");
+        return AUTH_DENIED;
+    }
+
+    if (token)
+        *token = NULL;
+
+    /* what check_login_admission() found out about the same credentials */
+    if (req && (!req->user || strcmp(req->user, user) ||
+                strcmp(req->password, password)))
+        req = NULL;
+
+    /* resent credentials that were verified already */
+    if (cached && (req ? req->verdict :
+                   lookup_verdict(r, conf, user, password, timestamp))) {
+        ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r,
+                      "access granted for user \"%s\" based on cached verdict",
+                      user);
+        return AUTH_GRANTED;
+    }
+
+    record_hitter(r, TOTP_HITTER_USER, user, false);
+    record_hitter(r, TOTP_HITTER_CLIENT, r->useragent_ip, false);
+
+    /* check if the client is within its rate limits before any file access */
+    if (!check_client_rate_limit(r, timestamp)) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r,
+                      "login attempt for user \"%s\" from %s exceeds client rate limit",
+                      user, r->useragent_ip);
+        return AUTH_DENIED;
+    }
+
+    /* locked out users are rejected before any file access */
+    if (!check_lockout(r, conf, user, timestamp, &retry_after)) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r,
+                      "login attempt for user \"%s\" during lockout, %u seconds left",
+                      user, retry_after);
+        return AUTH_DENIED;
+    }
+
+    if (req && req->user_config) {
+        totp_config = req->user_config;
+    } else if (!get_user_config(r, user, totp_config)) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r,
+                      "could not find TOTP configuration for user \"%s\"", user);
+        return AUTH_USER_NOT_FOUND;
+    }
+#ifdef DEBUG_TOTP_AUTH
+    tmp =
+        apr_pencode_base16_binary(r->pool, totp_config->shared_key,
+                                  totp_config->shared_key_len,
+                                  APR_ENCODE_COLON, NULL);
+    ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r,
+                  "secret key is \"%s\", secret length: %ld",
+                  tmp, totp_config->shared_key_len);
+#endif
+
+    /* check if user login count is within the rate limit */
+    if (conf->rate_limit_failures ?
+        !((req && req->logins_checked) ||
+          check_failed_logins(r, timestamp, user, totp_config, &retry_after)) :
+        !check_rate_limit(r, timestamp, user, totp_config)) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r,
+                      "login attemp for user \"%s\" exceeds rate limit", user);
+        return AUTH_DENIED;
+    }
+
+    /* TOTP Authentication */
+    user_code = (unsigned int) apr_atoi64(password);
+    /* TOTP codes */
+    if (password_len == 6) {
+        read_user_state(r, user, &user_state);
+        drift = max(-(int) totp_config->window_size,
+                    min(user_state.drift, (int) totp_config->window_size));
+        window_size = reserve_hmac_budget(r, totp_config->window_size);
+
+        /*
+         * start at the learned drift and search outward, the whole window is
+         * covered unless it was narrowed around the drift
+         */
+        reach = (window_size == totp_config->window_size) ?
+            2 * window_size : window_size;
+        for (k = 0; (k + 1) / 2 <= reach; ++k) {
+            i = drift + ((k & 1) ? (k + 1) / 2 : -(k / 2));
+            if ((i < -totp_config->window_size) || (i > totp_config->window_size))
+                continue;
+            totp_code = generate_totp_code(totp_timestamp + i, totp_config);
+
+            ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r,
+                          "validating code timestamp=%" APR_TIME_T_FMT
+                          ", expected=\"%6.6u\", input=\"%6.6u\"", timestamp,
+                          totp_code, user_code);
+
+            if (totp_code == user_code) {
+                if (mark_code_invalid(r, timestamp, user, totp_config, user_code)) {
+                    if (token)
+                        *token =
+                            generate_authn_token(r, timestamp, timestamp, user,
+                                                 user_code, totp_config);
+
+                    store_verdict(r, conf, user, password, timestamp);
+                    update_failed_logins(r, timestamp, user, totp_config, true);
+                    update_lockout(r, conf, user, timestamp, true);
+
+                    store_socache_credentials(r, conf, user, password);
+
+                    /* re-read, a scratch code may have been used meanwhile */
+                    if ((i != user_state.drift) &&
+                        (state_lock = lock_user_state(r, user))) {
+                        read_user_state(r, user, &user_state);
+                        user_state.drift = i;
+                        write_user_state(r, timestamp, user, &user_state);
+                        apr_file_close(state_lock);
+                    }
+
+                    ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r,
+                                  "access granted for user \"%s\" based on code \"%6.6u\" at step offset %d",
+                                  user, user_code, i);
+                    return AUTH_GRANTED;
+                } else
+                    /* fail authentication attempt */
+                    break;
+            }
+
+        }
+    }
+    /* Scratch codes */
+    else {
+        parse_scratch_codes(r, totp_config);
+
+        for (i = 0; i < totp_config->scratch_codes_count; ++i) {
+
+            ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r,
+                          "validating scratch code expected=\"%8.8u\", input=\"%8.8u\"",
+                          totp_config->scratch_codes[i], user_code);
+
+            if (totp_config->scratch_codes[i] == user_code) {
+                /* held until the used scratch code is written */
+                if (!(state_lock = lock_user_state(r, user)))
+                    break;
+
+                /* a new set of scratch codes starts unused */
+                read_user_state(r, user, &user_state);
+                if (user_state.scratch_fingerprint !=
+                    scratch_fingerprint(totp_config)) {
+                    user_state.scratch_fingerprint =
+                        scratch_fingerprint(totp_config);
+                    user_state.scratch_used = 0;
+                }
+
+                if (user_state.scratch_used & (1U << i)) {
+                    ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r,
+                                  "scratch code of user \"%s\" was used before",
+                                  user);
+                    apr_file_close(state_lock);
+                    break;
+                }
+
+                /* scratch codes are consumed for good before they are accepted */
+                user_state.scratch_used |= 1U << i;
+                consumed = write_user_state(r, timestamp, user, &user_state);
+                apr_file_close(state_lock);
+
+                if (consumed && mark_code_invalid(r, timestamp, user, totp_config, user_code)) {
+                    if (token)
+                        *token =
+                            generate_authn_token(r, timestamp, timestamp, user,
+                                                 user_code, totp_config);
+
+                    store_verdict(r, conf, user, password, timestamp);
+                    update_failed_logins(r, timestamp, user, totp_config, true);
+                    update_lockout(r, conf, user, timestamp, true);
+
+                    ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r,
+                                  "access granted for user \"%s\" based on scratch code \"%8.8u\"",
+                                  user, user_code);
+                    return AUTH_GRANTED;
+                } else
+                    /* fail authentication attempt */
+                    break;
+            }
+        }
+    }
+
+    update_failed_logins(r, timestamp, user, totp_config, false);
+    update_lockout(r, conf, user, timestamp, false);
+    record_hitter(r, TOTP_HITTER_USER, user, true);
+    record_hitter(r, TOTP_HITTER_CLIENT, r->useragent_ip, true);
+
+    ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r,
+                  "access denied for user \"%s\" based on password \"%s\"",
+                  user, password);
+
+    return AUTH_DENIED;
+}
+
+/**
+  * \brief check_login Verify a login and store the state it changed
+ **/
+static          authn_status
+check_login(request_rec *r, const char *user, const char *password,
+            bool cached, const char **token)
+{
+    authn_status    status = verify_login(r, user, password, cached, token);
+
+    commit_user_state(r);
+
+    return status;
+}
+
+static          authn_status
+authn_totp_check_password(request_rec *r, const char *user, const char *password)
+{
+    const char     *token = NULL;
+    authn_status    status;
+
+    status = check_login(r, user, password, true,
+                         is_session_cookie_available() ? &token : NULL);
+    if (token)
+        set_session_auth(r, token);
+
+    return status;
+}
+
+/**
+  * \brief renew_session_auth Re-issue a verified authentication token once the renewal interval has passed
+  * \param r Request
+  * \param conf Pointer to the directory configuration
+  * \param parsed Pointer to the verified token contents
+  * \param totp_config Pointer to user's TOTP authentication settings
+ **/
+static void
+renew_session_auth(request_rec *r, const totp_auth_config_rec *conf,
+                   const totp_authn_token *parsed,
+                   const totp_user_config *totp_config)
+{
+    apr_time_t      timestamp = r->request_time;
+    const char     *token;
+
+    /* the session cookie is only rewritten when the token changes */
+    if (!conf->session_renew ||
+        (timestamp - parsed->renewed < apr_time_from_sec(conf->session_renew)))
+        return;
+
+    token = generate_authn_token(r, parsed->timestamp, timestamp, parsed->user,
+                                 parsed->totp_code, totp_config);
+    if (token) {
+        set_session_auth(r, token);
+        ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r,
+                      "renew_session_auth: renewed token of user \"%s\"",
+                      parsed->user);
+    }
+}
+
+/**
+  * \brief get_basic_credentials Get the user name and password sent with Basic authentication
+  * \param r Request
+  * \param user Function returns pointer to string containing the username
+  * \param password Function returns pointer to string containing the password
+  * \return true if Basic authentication credentials were sent, false otherwise
+ **/
+static bool
+get_basic_credentials(request_rec *r, const char **user, const char **password)
+{
+    const char     *auth_line = apr_table_get(r->headers_in, "Authorization");
+    char           *decoded;
+
+    if (!auth_line || strcasecmp(ap_getword(r->pool, &auth_line, ' '), "Basic"))
+        return false;
+
+    while (apr_isspace(*auth_line))
+        auth_line++;
+
+    decoded = ap_pbase64decode(r->pool, auth_line);
+    *user = ap_getword_nc(r->pool, &decoded, ':');
+    *password = decoded;
+
+    return true;
+}
+
+/**
+  * \brief check_login_admission Shed login attempts when the login token buckets are exhausted
+  * \param r Request
+  * \return DECLINED if the request may proceed, HTTP status code otherwise
+ **/
+static int
+check_login_admission(request_rec *r)
+{
+    totp_auth_config_rec *conf =
+        ap_get_module_config(r->per_dir_config, &authn_totp_module);
+    totp_request_rec *req;
+    totp_user_config *user_config;
+    const char     *user, *password;
+    unsigned int    retry_after = 1;
+
+    if ((!admission_zone.base && !lockout_zone.base && !hitters_zone.base &&
+         !conf->rate_limit_failures) ||
+        !ap_is_initial_req(r) || !get_basic_credentials(r, &user, &password))
+        return DECLINED;
+
+    /* verify_login() takes over what is found here */
+    req = get_request_rec(r, true);
+    req->user = user;
+    req->password = password;
+
+    /* resent credentials are cheap, only logins are admitted */
+    if ((req->verdict = lookup_verdict(r, conf, user, password,
+                                       r->request_time)))
+        return DECLINED;
+
+    /* guesses against a locked account cost a single table lookup */
+    if (!check_lockout(r, conf, user, r->request_time, &retry_after)) {
+        apr_table_setn(r->err_headers_out, "Retry-After",
+                       apr_psprintf(r->pool, "%u", retry_after));
+        ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r,
+                      "check_login_admission: user \"%s\" is locked out, retry after %u seconds",
+                      user, retry_after);
+        return HTTP_TOO_MANY_REQUESTS;
+    }
+
+    /* heavy hitters failing more than allowed within the window */
+    if (!check_hitter(r, TOTP_HITTER_USER, user, &retry_after) ||
+        !check_hitter(r, TOTP_HITTER_CLIENT, r->useragent_ip, &retry_after)) {
+        apr_table_setn(r->err_headers_out, "Retry-After",
+                       apr_psprintf(r->pool, "%u", retry_after));
+        ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r,
+                      "check_login_admission: too many failures of user \"%s\" or client %s, retry after %u seconds",
+                      user, r->useragent_ip, retry_after);
+        return HTTP_TOO_MANY_REQUESTS;
+    }
+
+    /* throttled users are told when to come back instead of re-prompted */
+    if (conf->rate_limit_failures && conf->stateDir && is_alnum_str(user)) {
+        user_config = apr_palloc(r->pool, sizeof(*user_config));
+        if (get_user_config(r, user, user_config)) {
+            req->user_config = user_config;
+            if (!check_failed_logins(r, r->request_time, user, user_config,
+                                     &retry_after)) {
+                apr_table_setn(r->err_headers_out, "Retry-After",
+                               apr_psprintf(r->pool, "%u", retry_after));
+                ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r,
+                              "check_login_admission: too many failed logins for user \"%s\", retry after %u seconds",
+                              user, retry_after);
+                return HTTP_TOO_MANY_REQUESTS;
+            }
+            req->logins_checked = true;
+        }
+    }
+
+    if (!admission_zone.base)
+        return DECLINED;
+
+    if (admit_login(r, &retry_after))
+        return DECLINED;
+
+    apr_table_setn(r->err_headers_out, "Retry-After",
+                   apr_psprintf(r->pool, "%u", retry_after));
+    ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r,
+                  "check_login_admission: login attempt for user \"%s\" shed, retry after %u seconds",
+                  user, retry_after);
+
+    return HTTP_SERVICE_UNAVAILABLE;
+}
+
+/**
+  * \brief verify_authn_token Verify an authentication token
+  * \param r Request
+  * \param token Pointer to string containing the authentication token
+  * \param parsed Pointer to memory location to store the token contents, parsed->user is NULL if the token could not be parsed
+  * \param totp_config Pointer to memory location to store the TOTP settings of the token user
+  * \return true if the token is valid, false otherwise
+ **/
+static bool
+verify_authn_token(request_rec *r, const char *token, totp_authn_token *parsed,
+                   totp_user_config *totp_config)
+{
+    totp_auth_config_rec *conf =
+        ap_get_module_config(r->per_dir_config, &authn_totp_module);
+    const char     *tmp;
+    apr_time_t      timestamp = r->request_time;
+    unsigned char   data[TOTP_TOKEN_DATA_LEN];
+    unsigned char   hash[APR_SHA1_DIGESTSIZE];
+
+    if (!token || !parse_authn_token(r, token, parsed)) {
+        parsed->user = NULL;
+        return false;
+    }
+
+    /* validate username */
+    if (!is_alnum_str(parsed->user)) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r,
+                      "verify_authn_token: username contains non-alphanumeric characters");
+        parsed->user = NULL;
+        return false;
+    }
+
+    /* validate password */
+    if (parsed->totp_code > 99999999) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r,
+                      "verify_authn_token: password is not recognized as a TOTP (6 digits) or a scratch code (8 digits)");
+        return false;
+    }
+
+    /* reject tokens that expired or were issued in the future */
+    if ((parsed->timestamp > parsed->renewed) || (parsed->renewed > timestamp) ||
+        (timestamp - parsed->renewed > apr_time_from_sec(conf->expires))) {
+        ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r,
+                      "verify_authn_token: token of user \"%s\" expired",
+                      parsed->user);
+        return false;
+    }
+
+    /* get the TOTP configuration of the user */
+    if (!get_user_config(r, parsed->user, totp_config)) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r,
+                      "verify_authn_token: could not find TOTP configuration for user \"%s\"",
+                      parsed->user);
+        return false;
+    }
+#ifdef DEBUG_TOTP_AUTH
+    /* not at debug level, check_session_token() counts allocations there */
+    if (APLOGrtrace8(r)) {
+        tmp =
+            apr_pencode_base16_binary(r->pool, totp_config->shared_key,
+                                      totp_config->shared_key_len,
+                                      APR_ENCODE_COLON, NULL);
+        ap_log_rerror(APLOG_MARK, APLOG_TRACE8, 0, r,
+                      "verify_authn_token: secret key is \"%s\", secret length: %ld",
+                      tmp, totp_config->shared_key_len);
+    }
+#endif
+
+    /* generate expected token hash */
+    generate_token_hash(parsed->timestamp, parsed->renewed, parsed->totp_code,
+                        parsed->user, totp_config, data, hash);
+
+    if (!digest_equal(hash, parsed->hash, APR_SHA1_DIGESTSIZE)) {
+        ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r,
+                      "verify_authn_token: hash mismatch for user \"%s\"",
+                      parsed->user);
+        return false;
+    }
+    if (is_login_revoked(r, parsed->user, parsed->timestamp)) {
+        ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r,
+                      "verify_authn_token: session of user \"%s\" was revoked",
+                      parsed->user);
+        return false;
+    }
+    if (conf->session_state_check &&
+        !verify_totp_code(r, parsed->timestamp, parsed->user, totp_config,
+                          parsed->totp_code)) {
+        ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r,
+                      "verify_authn_token: TOTP verification failed user \"%s\"",
+                      parsed->user);
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * Check user's TOTP authentication token
+ */
+static int
+check_session_token(request_rec *r)
+{
+    totp_auth_config_rec *conf =
+        ap_get_module_config(r->per_dir_config, &authn_totp_module);
+    totp_user_config user_config;
+    const char     *sent_token = NULL;
+    totp_authn_token parsed;
+    bool            valid;
+#ifdef DEBUG_TOTP_AUTH
+    char           *pool_mark;
+#endif
+
+    /* check if authentication realm is set */
+    if (!ap_auth_name(r)) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r,
+                      "check_session_token: AuthName is not set");
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    /* get data from session cookie */
+    get_session_auth(r, &sent_token);
+    if (!sent_token)
+        return DECLINED;
+
+#ifdef DEBUG_TOTP_AUTH
+    /* a zero-sized allocation returns the next free byte without taking it */
+    pool_mark = apr_palloc(r->pool, 0);
+#endif
+    valid = verify_authn_token(r, sent_token, &parsed, &user_config);
+    commit_user_state(r);
+#ifdef DEBUG_TOTP_AUTH
+    ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r,
+                  "check_session_token: verification allocated %s from r->pool",
+                  (apr_palloc(r->pool, 0) == pool_mark) ? "nothing" : "memory");
+#endif
+
+    /* set the user, even though the user may be unauthenticated at this point */
+    if (parsed.user)
+        r->user = (char *) parsed.user;
+
+    if (!valid)
+        return DECLINED;
+
+    ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r,
+                  "check_session_token: access granted to user \"%s\"",
+                  parsed.user);
+    renew_session_auth(r, conf, &parsed, &user_config);
+
+    return OK;
+}
+
+/**
+ * Check user's TOTP authentication token and admit login attempts
+ */
+static int
+authn_totp_check_authn(request_rec *r)
+{
+    totp_auth_config_rec *conf =
+        ap_get_module_config(r->per_dir_config, &authn_totp_module);
+    int             status;
+
+    /* TOTP authentication is not configured here */
+    if (!secret_source(conf))
+        return DECLINED;
+
+    if (is_session_cookie_available()) {
+        status = check_session_token(r);
+        if (status != DECLINED)
+            return status;
+    }
+
+    return check_login_admission(r);
+}
+
+/* Exported Functions */
+
+static          authn_status
+authn_totp_check_code(request_rec *r, const char *user, const char *code)
+{
+    /* codes are consumed, a cached verdict would accept them again */
+    return check_login(r, user, code, false, NULL);
+}
+
+static void
+authn_totp_check_codes(request_rec *r, int count, const char *const *users,
+                       const char *const *codes, authn_status *results)
+{
+    int             i;
+
+    for (i = 0; i < count; ++i)
+        results[i] = check_login(r, users[i], codes[i], false, NULL);
+}
+
 static const char *
-generate_authn_token(request_rec *r, apr_time_t timestamp, unsigned int totp_code,
-                     const totp_user_config *totp_config)
+authn_totp_issue_token(request_rec *r, const char *user, const char *code)
 {
-    const char     *challenge;
-    const char     *token;
-    const char     *hash;
+    const char     *token = NULL;
+
+    /* a cached verdict carries no login to issue a token for */
+    if (AUTH_GRANTED != check_login(r, user, code, false, &token))
+        return NULL;
+
+    return token;
+}
 
-    hash = generate_token_hash(r->pool, timestamp, totp_code, totp_config);
+static          authn_status
+authn_totp_verify_token(request_rec *r, const char *token, const char **user)
+{
+    totp_user_config user_config;
+    totp_authn_token parsed;
+    bool            valid;
 
-    token =
-        apr_pencode_base64_binary(r->pool, hash, APR_SHA1_DIGESTSIZE,
-                                  APR_ENCODE_NONE, NULL);
-    challenge =
-        apr_pencode_base64_binary(r->pool, (unsigned char *) &timestamp,
-                                  sizeof(apr_time_t), APR_ENCODE_NONE, NULL);
+    valid = verify_authn_token(r, token, &parsed, &user_config);
+    commit_user_state(r);
+    if (user)
+        *user = valid ? parsed.user : NULL;
 
-    token = apr_pstrcat(r->pool, challenge, ".", token, NULL);
+    return valid ? AUTH_GRANTED : AUTH_DENIED;
+}
 
-    ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r,
-                  "generate_authn_token: time %" APR_TIME_T_FMT
-                  ", TOTP code \"%6.6u\" -> token \"%s\"",
-                  timestamp, totp_code, token);
+static void
+authn_totp_verify_tokens(request_rec *r, int count, const char *const *tokens,
+                         const char **users, authn_status *results)
+{
+    int             i;
 
-    return token;
+    for (i = 0; i < count; ++i)
+        results[i] = authn_totp_verify_token(r, tokens[i],
+                                             users ? &users[i] : NULL);
 }
 
+/* Session Revocation Handler */
+
 /**
-  * \brief parse_authn_token Parse an authentication token
-  * \param r Request
-  * \param token Pointer to string containing the authentication token
-  * \param timestamp Either NULL or pointer to memory location to store the Unix timestamp
-  * \param hash Either NULL or pointer to memory location that can hold the corresponding SHA1 hash digest
-  * \return true on success, false otherwise
- **/
-static bool
-parse_authn_token(request_rec *r, const char *token,
-                  apr_time_t *timestamp, unsigned char **hash)
+ * Revoke sessions: POST ?user=<name> revokes all logins of a user so far,
+ * POST ?token=<token> revokes the login of a session token, GET reports
+ * the list usage.
+ */
+static int
+authn_totp_revocation_handler(request_rec *r)
 {
-    char           *input = apr_pmemdup(r->pool, token, strlen(token) + 1);
-    char           *value, *last;
-    const char     *psep = ".";
-    const char     *tmp;
-    apr_size_t      len = 0;
-    apr_status_t    status;
+    totp_revocation_list *list = revocation_zone.base;
+    totp_authn_token parsed;
+    unsigned char   key[APR_SHA1_DIGESTSIZE];
+    const char     *user = NULL, *token = NULL;
+    char           *args, *value, *name;
+    apr_time_t      timestamp;
 
+    if (!r->handler || strcmp(r->handler, "authn-totp-revocation"))
+        return DECLINED;
 
-    ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r,
-                  "parse_authn_token: parsing token \"%s\"", token);
-
-    value = apr_strtok(input, psep, &last);
-    if (value != NULL) {
-        if (timestamp) {
-            status =
-                apr_decode_base64_binary(NULL, value, APR_ENCODE_STRING,
-                                         APR_ENCODE_NONE, &len);
-            if (len == sizeof(apr_time_t))
-                status =
-                    apr_decode_base64_binary((unsigned char *) timestamp, value,
-                                             APR_ENCODE_STRING, APR_ENCODE_NONE,
-                                             &len);
-
-            if ((status != APR_SUCCESS) || (len != sizeof(apr_time_t))) {
-                ap_log_rerror(APLOG_MARK,
-                              APLOG_ERR,
-                              status, r,
-                              "parse_authn_token: failed to decode the timestamp");
-                return false;
-            }
-        }
+    if (!list) {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r,
+                      "authn_totp_revocation_handler: TOTPAuthRevocationList is not set");
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
 
-        value = apr_strtok(NULL, psep, &last);
-        if (!value) {
-            ap_log_rerror(APLOG_MARK,
-                          APLOG_ERR,
-                          0, r, "parse_authn_token: hash string is absent");
-            return false;
-        } else if (hash) {
-            status =
-                apr_decode_base64_binary(NULL, value, APR_ENCODE_STRING,
-                                         APR_ENCODE_NONE, &len);
-            if (len == APR_SHA1_DIGESTSIZE)
-                status =
-                    apr_decode_base64_binary(*hash, value, APR_ENCODE_STRING,
-                                             APR_ENCODE_NONE, &len);
-
-            if ((status != APR_SUCCESS) || (len != APR_SHA1_DIGESTSIZE)) {
-                ap_log_rerror(APLOG_MARK,
-                              APLOG_ERR,
-                              status, r,
-                              "parse_authn_token: failed to decode the hash");
-                return false;
-            }
-        }
-    } else {
-        ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r,
-                      "parse_authn_token: token \"%s\" could not be split", token);
-        return false;
+    ap_set_content_type(r, "text/plain");
+
+    if (r->method_number == M_GET) {
+        ap_rprintf(r, "entries: %u\nsize: %u\n", list->count, list->size);
+        return OK;
+    }
+    if (r->method_number != M_POST)
+        return HTTP_METHOD_NOT_ALLOWED;
+
+    args = apr_pstrdup(r->pool, r->args ? r->args : "");
+    while (*args) {
+        value = ap_getword_nc(r->pool, &args, '&');
+        name = ap_getword_nc(r->pool, &value, '=');
+        ap_unescape_url(value);
+        if (0 == strcmp(name, "user"))
+            user = value;
+        else if (0 == strcmp(name, "token"))
+            token = value;
     }
 
-    tmp =
-        apr_pencode_base16_binary(r->pool, *hash, APR_SHA1_DIGESTSIZE,
-                                  APR_ENCODE_COLON, NULL);
-    ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r,
-                  "parse_authn_token: token \"%s\" -> time %" APR_TIME_T_FMT
-                  ", hash \"%s\"", token, timestamp ? *timestamp : 0L,
-                  hash ? tmp : "<NULL>");
+    if (user && is_alnum_str(user)) {
+        timestamp = apr_time_now();
+        revocation_key_user(user, key);
+    } else if (token && parse_authn_token(r, token, &parsed) &&
+               is_alnum_str(parsed.user)) {
+        user = parsed.user;
+        timestamp = parsed.timestamp;
+        revocation_key_session(user, timestamp, key);
+    } else {
+        ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r,
+                      "authn_totp_revocation_handler: expected a valid user or token argument");
+        return HTTP_BAD_REQUEST;
+    }
 
-    return true;
-}
+    if (!revoke_key(r, key, timestamp))
+        return HTTP_SERVICE_UNAVAILABLE;
 
-/* Session cookie support */
+    ap_log_rerror(APLOG_MARK, APLOG_NOTICE, 0, r,
+                  "authn_totp_revocation_handler: revoked %s of user \"%s\" up to %"
+                  APR_TIME_T_FMT, token ? "session" : "logins", user, timestamp);
+    ap_rprintf(r, "revoked: %s\n", user);
 
-/**
-  * \brief is_session_cookie_available Check if session cookie is available
-  * \return true if all required function have been found, false otherwise
- **/
-static bool
-is_session_cookie_available()
-{
-    return ap_session_load_fn && ap_session_get_fn && ap_session_set_fn;
+    return OK;
 }
 
+/* Status Handler */
+
 /**
-  * \brief set_session_auth Store username, TOTP password and authentication token to the session cookie
-  * \param r Request
-  * \param user Pointer to string containing the username
-  * \param password Pointer to string containing the password
-  * \param token Pointer to string containing the authentication token
+  * \brief print_hitters Print the tracked users or clients of a kind, the zone must be locked
  **/
 static void
-set_session_auth(request_rec *r, const char *user, const char *password,
-                 const char *token)
+print_hitters(request_rec *r, totp_hitters_table *table, unsigned char kind,
+              apr_time_t timestamp)
 {
-    const char     *authname = ap_auth_name(r);
-    session_rec    *z = NULL;
+    unsigned int    idx[TOTP_SKETCH_DEPTH];
+    apr_uint32_t    attempts, failures;
+    unsigned int    i;
 
-    ap_session_load_fn(r, &z);
-    ap_session_set_fn(r, z,
-                      apr_pstrcat(r->pool, authname, "-" MOD_SESSION_USER, NULL),
-                      user);
-    ap_session_set_fn(r, z,
-                      apr_pstrcat(r->pool, authname, "-" MOD_SESSION_PW, NULL),
-                      password);
-    ap_session_set_fn(r, z, apr_pstrcat(r->pool, authname, "-totp-token", NULL),
-                      token);
+    for (i = 0; i < table->size; ++i) {
+        if (table->top[i].kind != kind)
+            continue;
+        hitters_index(table, kind, table->top[i].name, idx);
+        hitters_estimate(table, idx, timestamp, &attempts, &failures);
+        if (attempts || failures)
+            ap_rprintf(r, "  %s attempts=%u failures=%u\n",
+                       table->top[i].name, attempts, failures);
+    }
 }
 
 /**
-  * \brief set_session_auth Get username, TOTP password and authentication token from the session cookie
-  * \param r Request
-  * \param user If not NULL, function returns pointer to a string containing the username
-  * \param password If not NULL, function returns pointer to string containing the password
-  * \param token If not NULL, function returns pointer to string containing the authentication token
- **/
-static void
-get_session_auth(request_rec *r, const char **user, const char **password,
-                 const char **token)
+ * Report the code computation budget and the heaviest users and clients
+ * within the current window.
+ */
+static int
+authn_totp_status_handler(request_rec *r)
 {
-    const char     *authname = ap_auth_name(r);
-    session_rec    *z = NULL;
+    totp_auth_server_config_rec *sconf =
+        ap_get_module_config(r->server->module_config, &authn_totp_module);
+    totp_hitters_table *table = hitters_zone.base;
+    totp_hmac_budget *budget = budget_zone.base;
+    apr_time_t      timestamp = apr_time_now();
 
-    ap_session_load_fn(r, &z);
+    if (!r->handler || strcmp(r->handler, "authn-totp-status"))
+        return DECLINED;
 
-    if (user) {
-        ap_session_get_fn(r, z,
-                          apr_pstrcat(r->pool, authname, "-" MOD_SESSION_USER, NULL),
-                          user);
-    }
-    if (password) {
-        ap_session_get_fn(r, z,
-                          apr_pstrcat(r->pool, authname, "-" MOD_SESSION_PW, NULL),
-                          password);
-    }
-    if (token) {
-        ap_session_get_fn(r, z, apr_pstrcat(r->pool, authname, "-totp-token", NULL),
-                          token);
+    if (r->method_number != M_GET)
+        return HTTP_METHOD_NOT_ALLOWED;
+
+    ap_set_content_type(r, "text/plain");
+    if (r->header_only)
+        return OK;
+
+    if (budget && totp_shm_zone_lock(&budget_zone, r)) {
+        ap_rprintf(r, "hmac budget: %u\nhmac used: %u\n"
+                   "logins full window: %" APR_UINT64_T_FMT "\n"
+                   "logins narrowed window: %" APR_UINT64_T_FMT "\n"
+                   "logins current step only: %" APR_UINT64_T_FMT "\n",
+                   sconf->hmac_budget,
+                   (budget->second == apr_time_sec(timestamp)) ? budget->used : 0,
+                   budget->full, budget->narrowed, budget->centered);
+        totp_shm_zone_unlock(&budget_zone);
     }
 
-    /* set the user, even though the user is unauthenticated at this point */
-    if (user && *user) {
-        r->user = (char *) *user;
+    if (table && totp_shm_zone_lock(&hitters_zone, r)) {
+        hitters_rotate(table, timestamp);
+        ap_rprintf(r, "window: %" APR_TIME_T_FMT "\nusers:\n",
+                   apr_time_sec(table->window));
+        print_hitters(r, table, TOTP_HITTER_USER, timestamp);
+        ap_rputs("clients:\n", r);
+        print_hitters(r, table, TOTP_HITTER_CLIENT, timestamp);
+        totp_shm_zone_unlock(&hitters_zone);
     }
 
-    ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r,
-                  "get_session_auth: " MOD_SESSION_USER " \"%s\", "
-                  MOD_SESSION_PW " \"%s\", token \"%s\"", user ? *user : "<null>",
-                  password ? *password : "<null>", token ? *token : "<null>");
+    return OK;
 }
 
-/* Authentication Helpers: Disallow TOTP Code Reuse */
+/**
+  * \brief destroy_state_cache Release the state cache with the configuration
+ **/
+static          apr_status_t
+destroy_state_cache(void *data)
+{
+    if (state_cache.provider)
+        state_cache.provider->destroy(state_cache.instance, state_cache.s);
+    memset(&state_cache, 0, sizeof(state_cache));
 
-typedef struct {
-    apr_time_t      timestamp;
-    unsigned int    totp_code;
-} totp_login_rec;
+    return APR_SUCCESS;
+}
 
-bool
-cb_check_code(const void *new, const void *old, totp_file_helper_cb_data *data)
+/**
+  * \brief state_cache_init Initialize the state cache configured by TOTPAuthStateCache
+  * \param pconf Configuration pool
+  * \param s Server record
+  * \return APR_SUCCESS on success, error code otherwise
+ **/
+static          apr_status_t
+state_cache_init(apr_pool_t *pconf, server_rec *s)
 {
-    if (old) {
-        const apr_time_t timedelta = apr_time_from_sec(data->exp);
-        /* check for an existing login entry with new TOTP code */
-        totp_login_rec *pNew = (totp_login_rec *) new;
-        totp_login_rec *pOld = (totp_login_rec *) old;
+    totp_auth_server_config_rec *sconf =
+        ap_get_module_config(s->module_config, &authn_totp_module);
+    struct ap_socache_hints hints = { 0 };
+    apr_status_t    status;
 
-        /* check if entry time is within time tolerance */
-        if ((pNew->timestamp - pOld->timestamp) <= timedelta) {
-            /* check if entry code matches current one */
-            if ((pNew->totp_code == pOld->totp_code) && data->conf->disallow_reuse)
-                data->res++;
-            return true;
+    memset(&state_cache, 0, sizeof(state_cache));
+    if (!sconf->state_cache_provider)
+        return APR_SUCCESS;
+
+    hints.avg_id_len = 64;
+    hints.avg_obj_size = 512;
+    hints.expiry_interval = apr_time_from_sec(60);
+
+    status = sconf->state_cache_provider->init(sconf->state_cache,
+                                               "authn-totp-state", &hints,
+                                               s, pconf);
+    if (APR_SUCCESS != status) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, status, s,
+                     "state_cache_init: could not initialize TOTPAuthStateCache");
+        return status;
+    }
+
+    state_cache.provider = sconf->state_cache_provider;
+    state_cache.instance = sconf->state_cache;
+    state_cache.updates = (state_cache.provider == &totpd_socache_provider);
+    state_cache.s = s;
+    apr_pool_cleanup_register(pconf, NULL, destroy_state_cache,
+                              apr_pool_cleanup_null);
+
+    if (state_cache.provider->flags & AP_SOCACHE_FLAG_NOTMPSAFE) {
+        status = ap_global_mutex_create(&state_cache.mutex, NULL,
+                                        state_cache_mutex_type, NULL, s,
+                                        pconf, 0);
+        if (APR_SUCCESS != status) {
+            ap_log_error(APLOG_MARK, APLOG_ERR, status, s,
+                         "state_cache_init: could not create mutex for TOTPAuthStateCache");
+            return status;
         }
-        return false;
-    } else {
-        /* should new entry be appended to the file? */
-        return true;
     }
+
+    return APR_SUCCESS;
 }
 
 /**
-  * \brief mark_code_invalid Mark a TOTP code invalid
-  * \param r Request
-  * \param timestamp Timestamp for login event
-  * \param user Authenticating user name
-  * \param totp_config Pointer to user's TOTP authentication settings
-  * \param totp_code Authenticating TOTP code
-  * \return true upon success, false otherwise
+  * \brief state_cache_child_init Re-open the state cache mutex in a child process
  **/
-static bool
-mark_code_invalid(request_rec *r, apr_time_t timestamp,
-                  const char *user, totp_user_config *totp_config,
-                  unsigned int totp_code)
+static void
+state_cache_child_init(apr_pool_t *p, server_rec *s)
 {
-    totp_auth_config_rec *conf =
-        ap_get_module_config(r->per_dir_config, &authn_totp_module);
-    char           *code_filepath;
-    totp_login_rec  login_data;
     apr_status_t    status;
-    totp_file_helper_cb_data cb_data;
 
-    if (!conf->stateDir) {
-        ap_log_rerror(APLOG_MARK, APLOG_ERR, status, r,
-                      "mark_code_invalid: TOTPAuthStateDir is not defined");
-        return false;
-    }
+    if (!state_cache.mutex)
+        return;
 
-    /* set code file path */
-    code_filepath = apr_psprintf(r->pool, "%s/%s.codes", conf->stateDir, user);
+    status = apr_global_mutex_child_init(&state_cache.mutex,
+                                         apr_global_mutex_lockfile(state_cache.mutex),
+                                         p);
+    if (APR_SUCCESS != status)
+        ap_log_error(APLOG_MARK, APLOG_CRIT, status, s,
+                     "state_cache_child_init: could not re-open mutex for TOTPAuthStateCache");
+}
 
-    /* initialize callback data */
-    cb_data.conf = totp_config;
-    cb_data.exp = conf->expires;
-    cb_data.res = 0;
+/* Snapshots */
 
-    /* current login entry */
-    login_data.timestamp = timestamp;
-    login_data.totp_code = totp_code;
+/*
+ * With TOTPAuthSnapshot, the lockouts, revocations, client rate limits,
+ * heavy hitters and the entries of the state cache are written to a file
+ * periodically by one of the children and by the parent when it stops or
+ * restarts, and read back by post_config:
+ *
+ *   "TOTPSNAP" | TOTP_SNAPSHOT_VERSION (BE32) | sections
+ *   section: name length (BE16) | name | data length (BE64) | data
+ *
+ * A zone's section holds a copy of its memory and is only restored into a
+ * zone of the same size, i.e. the same configuration. The state cache
+ * section holds "key length (BE32) | value length (BE32) | key | value"
+ * records of providers that can iterate their entries, e.g. shmcb.
+ * Snapshots are written to a temporary file that replaces the previous one
+ * once complete, so a crash while writing leaves the previous one intact.
+ */
+#define TOTP_SNAPSHOT_MAGIC     "TOTPSNAP"
+#define TOTP_SNAPSHOT_VERSION   1
+#define TOTP_SNAPSHOT_STATE     "state-cache"
 
-    status = check_n_update_file_helper(r, code_filepath,
-                                        &login_data, sizeof(totp_login_rec),
-                                        cb_check_code, &cb_data);
-    if (APR_SUCCESS != status) {
-        ap_log_rerror(APLOG_MARK, APLOG_ERR, status, r,
-                      "mark_code_invalid: could not update codes file \"%s\"",
-                      code_filepath);
-        return false;
-    }
+typedef struct {
+    apr_uint32_t    next;       /* second of the next snapshot */
+} totp_snapshot_control;
 
-    return (cb_data.res == 0);
-}
+static totp_shm_zone snapshot_zone = { "authn-totp-snapshot" };
 
-/* Authentication Helpers: Validate TOTP login */
+/* zones kept across restarts */
+static totp_shm_zone *const snapshot_zones[] = {
+    &lockout_zone, &revocation_zone, &client_limit_zone, &hitters_zone
+};
 
-bool
-cb_verify_code(const void *new, const void *old, totp_file_helper_cb_data *data)
-{
-    if (old) {
-        const apr_time_t timedelta = apr_time_from_sec(data->exp);
-        /* check for an existing login entry with new TOTP code */
-        totp_login_rec *pNew = (totp_login_rec *) new;
-        totp_login_rec *pOld = (totp_login_rec *) old;
+typedef struct {
+    apr_mmap_t     *mmap;       /* snapshot read by post_config */
+    apr_hash_t     *sections;   /* name to section data, length in front */
+    const char     *path;
+    apr_time_t      interval;
+    pid_t           parent;
+    apr_thread_t   *thread;     /* writing periodic snapshots in this child */
+    volatile int    stop;
+} totp_snapshot;
 
-        /* check if entry time is within time tolerance */
-        if ((pNew->timestamp - pOld->timestamp) <= timedelta) {
-            /* check if entry code matches current one */
-            if ((pOld->timestamp == pNew->timestamp) &&
-                (pOld->totp_code == pNew->totp_code))
-                data->res++;
-            return true;
-        }
-        return false;
-    } else {
-        /* should new entry be appended to the file? */
-        return false;
-    }
-}
+static totp_snapshot snapshot;
 
 /**
-  * \brief verify_totp_code Verify TOTP login data
-  * \param r Request
-  * \param timestamp Timestamp for login event
-  * \param user Authenticating user name
-  * \param totp_config Pointer to user's TOTP authentication settings
-  * \param totp_code Authenticating TOTP code
-  * \return true upon success, false otherwise
+  * \brief snapshot_read Read the sections of the snapshot file into memory
+  * \param pconf Configuration pool
+  * \param s Server record
  **/
-static bool
-verify_totp_code(request_rec *r, apr_time_t timestamp,
-                  const char *user, totp_user_config *totp_config,
-                  unsigned int totp_code)
+static void
+snapshot_read(apr_pool_t *pconf, server_rec *s)
 {
-    totp_auth_config_rec *conf =
-        ap_get_module_config(r->per_dir_config, &authn_totp_module);
-    char           *code_filepath;
-    totp_login_rec  login_data;
+    apr_file_t     *file = NULL;
+    apr_finfo_t     finfo;
     apr_status_t    status;
-    totp_file_helper_cb_data cb_data;
-
-    if (!conf->stateDir) {
-        ap_log_rerror(APLOG_MARK, APLOG_ERR, status, r,
-                      "verify_totp_code: TOTPAuthStateDir is not defined");
-        return false;
+    const unsigned char *data, *end;
+    apr_uint64_t    len;
+    apr_size_t      name_len;
+
+    snapshot.mmap = NULL;
+    snapshot.sections = apr_hash_make(pconf);
+
+    status = apr_file_open(&file, snapshot.path, APR_FOPEN_READ,
+                           APR_FPROT_OS_DEFAULT, pconf);
+    if (APR_STATUS_IS_ENOENT(status))
+        return;
+    if ((APR_SUCCESS == status) &&
+        (APR_SUCCESS == (status = apr_file_info_get(&finfo, APR_FINFO_SIZE,
+                                                    file))) &&
+        (finfo.size > 12))
+        status = apr_mmap_create(&snapshot.mmap, file, 0, finfo.size,
+                                 APR_MMAP_READ, pconf);
+    if (file)
+        apr_file_close(file);
+    if ((APR_SUCCESS != status) || !snapshot.mmap) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, status, s,
+                     "snapshot_read: could not read snapshot \"%s\"",
+                     snapshot.path);
+        snapshot.mmap = NULL;
+        return;
     }
 
-    /* set code file path */
-    code_filepath = apr_psprintf(r->pool, "%s/%s.codes", conf->stateDir, user);
-
-    /* initialize callback data */
-    cb_data.conf = totp_config;
-    cb_data.exp = conf->expires;
-    cb_data.res = 0;
-
-    /* current login entry */
-    login_data.timestamp = timestamp;
-    login_data.totp_code = totp_code;
-
-    status = check_n_update_file_helper(r, code_filepath,
-                                        &login_data, sizeof(totp_login_rec),
-                                        cb_verify_code, &cb_data);
-    if (APR_SUCCESS != status) {
-        ap_log_rerror(APLOG_MARK, APLOG_ERR, status, r,
-                      "verify_totp_code: could not update codes file \"%s\"",
-                      code_filepath);
-        return false;
+    data = snapshot.mmap->mm;
+    end = data + snapshot.mmap->size;
+    if (memcmp(data, TOTP_SNAPSHOT_MAGIC, 8) ||
+        (get_be32(data + 8) != TOTP_SNAPSHOT_VERSION)) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s,
+                     "snapshot_read: ignoring invalid snapshot \"%s\"",
+                     snapshot.path);
+        return;
     }
 
-    return (cb_data.res == 1);
+    for (data += 12; end - data >= 2;) {
+        name_len = (data[0] << 8) | data[1];
+        if ((apr_size_t) (end - data) < 2 + name_len + 8)
+            break;
+        len = get_be64(data + 2 + name_len);
+        if ((apr_uint64_t) (end - data) - 2 - name_len - 8 < len)
+            break;
+        apr_hash_set(snapshot.sections,
+                     apr_pstrmemdup(pconf, (const char *) data + 2, name_len),
+                     APR_HASH_KEY_STRING, data + 2 + name_len);
+        data += 2 + name_len + 8 + len;
+    }
+    if (data != end)
+        ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s,
+                     "snapshot_read: snapshot \"%s\" is truncated",
+                     snapshot.path);
 }
 
-/* Authentication Helpers: Rate Limiting User Logins */
-
-bool
-cb_rate_limit(const void *new, const void *old, totp_file_helper_cb_data *data)
+/**
+  * \brief snapshot_restore_zone Restore a zone from the snapshot if it was saved with the same size
+  * \param zone Pointer to the created zone
+  * \return true if the zone was restored, false otherwise
+ **/
+static bool
+snapshot_restore_zone(totp_shm_zone *zone)
 {
-    if (old) {
-        apr_time_t      curr = *((apr_time_t *) new);
-        apr_time_t      prev = *((apr_time_t *) old);
+    const unsigned char *section;
 
-        if (curr > prev) {
-            /* check if entry time is within time tolerance */
-            if ((curr - prev) <= apr_time_from_sec(data->conf->rate_limit_seconds)) {
-                data->res++;
-                return true;
-            }
-        }
+    if (!snapshot.sections ||
+        !(section = apr_hash_get(snapshot.sections, zone->mutex_type,
+                                 APR_HASH_KEY_STRING)) ||
+        (get_be64(section) != zone->size))
         return false;
-    } else {
-        return true;
-    }
+
+    memcpy(zone->base, section + 8, zone->size);
+
+    return true;
 }
 
 /**
-  * \brief check_rate_limit Check if a user's login attempt is still within the rate limit
-  * \param r Request
-  * \param timestamp Timestamp for login event
-  * \param user Authenticating user name
-  * \param totp_config Pointer to user's TOTP authentication settings
-  * \param totp_code Authenticating TOTP code
-  * \return true upon success, false otherwise
+  * \brief snapshot_restore_state Store the state cache entries of the snapshot
+  * \param s Server record
+  * \param pool Pool for temporary allocations
  **/
-static bool
-check_rate_limit(request_rec *r, apr_time_t timestamp,
-                 const char *user, totp_user_config *totp_config)
+static void
+snapshot_restore_state(server_rec *s, apr_pool_t *pool)
 {
-    totp_auth_config_rec *conf =
-        ap_get_module_config(r->per_dir_config, &authn_totp_module);
+    const unsigned char *section, *data, *end;
+    apr_uint32_t    key_len, val_len;
+    apr_time_t      expiry;
     apr_status_t    status;
-    char           *login_filepath;
-    totp_file_helper_cb_data cb_data;
-
-    /* return immediately if no rate limit is defined */
-    if (totp_config->rate_limit_count == 0)
-        return true;
-
-    if (!conf->stateDir) {
-        ap_log_rerror(APLOG_MARK, APLOG_ERR, status, r,
-                      "check_rate_limit: TOTPAuthStateDir is not defined");
-        return false;
+    unsigned int    count = 0;
+
+    if (!state_cache.provider || !snapshot.sections ||
+        !(section = apr_hash_get(snapshot.sections, TOTP_SNAPSHOT_STATE,
+                                 APR_HASH_KEY_STRING)))
+        return;
+
+    /* the providers do not report the expiry of an entry */
+    expiry = apr_time_now() + apr_time_from_sec(max(totp_max_expires, 300));
+
+    data = section + 8;
+    end = data + get_be64(section);
+    while (end - data >= 8) {
+        key_len = get_be32(data);
+        val_len = get_be32(data + 4);
+        if ((apr_uint64_t) (end - data) - 8 < (apr_uint64_t) key_len + val_len)
+            break;
+
+        if (state_cache.mutex)
+            apr_global_mutex_lock(state_cache.mutex);
+        status = state_cache.provider->store(state_cache.instance, s,
+                                             data + 8, key_len, expiry,
+                                             (unsigned char *) data + 8 +
+                                             key_len, val_len, pool);
+        if (state_cache.mutex)
+            apr_global_mutex_unlock(state_cache.mutex);
+        if (APR_SUCCESS != status) {
+            ap_log_error(APLOG_MARK, APLOG_WARNING, status, s,
+                         "snapshot_restore_state: could not restore all entries");
+            break;
+        }
+        ++count;
+        data += 8 + key_len + val_len;
     }
 
-    /* set code file path */
-    login_filepath = apr_psprintf(r->pool, "%s/%s.logins", conf->stateDir, user);
+    ap_log_error(APLOG_MARK, APLOG_INFO, 0, s,
+                 "snapshot_restore_state: restored %u entries of the state cache",
+                 count);
+}
 
-    /* initialize callback data */
-    cb_data.conf = totp_config;
-    cb_data.res = 0;
+/**
+  * \brief snapshot_write_section Write the header of a section
+ **/
+static          apr_status_t
+snapshot_write_section(apr_file_t *file, const char *name, apr_uint64_t len)
+{
+    unsigned char   header[2 + 64 + 8];
+    apr_size_t      name_len = strlen(name);
 
-    status = check_n_update_file_helper(r, login_filepath,
-                                        &timestamp, sizeof(apr_time_t),
-                                        cb_rate_limit, &cb_data);
-    if (APR_SUCCESS != status) {
-        ap_log_rerror(APLOG_MARK, APLOG_ERR, status, r,
-                      "check_rate_limit: could not update logins file \"%s\"",
-                      login_filepath);
-        return false;
-    }
+    header[0] = name_len >> 8;
+    header[1] = name_len & 0xFF;
+    memcpy(header + 2, name, name_len);
+    put_be64(header + 2 + name_len, len);
 
-    return (cb_data.res <= totp_config->rate_limit_count);
+    return apr_file_write_full(file, header, 2 + name_len + 8, NULL);
 }
 
-/* Authentication Functions */
+/**
+  * \brief snapshot_write_entry Append a state cache entry to the snapshot
+ **/
+static          apr_status_t
+snapshot_write_entry(ap_socache_instance_t *instance, server_rec *s,
+                     void *userctx, const unsigned char *id, unsigned int idlen,
+                     const unsigned char *data, unsigned int datalen,
+                     apr_pool_t *pool)
+{
+    apr_file_t     *file = userctx;
+    unsigned char   header[8];
+    apr_status_t    status;
 
-static          authn_status
-authn_totp_check_password(request_rec *r, const char *user, const char *password)
+    put_be32(header, idlen);
+    put_be32(header + 4, datalen);
+    if ((APR_SUCCESS != (status = apr_file_write_full(file, header, 8, NULL))) ||
+        (APR_SUCCESS != (status = apr_file_write_full(file, id, idlen, NULL))))
+        return status;
+
+    return apr_file_write_full(file, data, datalen, NULL);
+}
+
+/**
+  * \brief snapshot_write Write a snapshot of the zones and the state cache
+  * \param s Server record
+  * \param pool Pool for temporary allocations
+  * \return APR_SUCCESS on success, error code otherwise
+ **/
+static          apr_status_t
+snapshot_write(server_rec *s, apr_pool_t *pool)
 {
-    totp_auth_config_rec *conf =
-        ap_get_module_config(r->per_dir_config, &authn_totp_module);
-    totp_user_config *totp_config = NULL;
-    unsigned int    password_len = strlen(password);
-    apr_time_t      timestamp = apr_time_now();
-    apr_time_t      totp_timestamp = to_totp_timestamp(timestamp);
-    const char     *token, *tmp;
-    unsigned int    totp_code = 0, user_code = 0;
+    const char     *tmp_path;
+    apr_file_t     *file;
+    apr_status_t    status;
+    apr_off_t       start, end;
+    unsigned char   header[12];
+    totp_shm_zone  *zone;
+    void           *copy;
     int             i;
 
-    ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r,
-                  "TOTP BASIC AUTH at timestamp=%" APR_TIME_T_FMT " totp_timestamp=%"
-                  APR_TIME_T_FMT, timestamp, totp_timestamp);
+    tmp_path = apr_psprintf(pool, "%s.%" APR_PID_T_FMT, snapshot.path,
+                            getpid());
+    status = apr_file_open(&file, tmp_path,
+                           APR_FOPEN_WRITE | APR_FOPEN_CREATE |
+                           APR_FOPEN_TRUNCATE | APR_FOPEN_BUFFERED,
+                           APR_UREAD | APR_UWRITE, pool);
+    if (APR_SUCCESS != status) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, status, s,
+                     "snapshot_write: could not create \"%s\"", tmp_path);
+        return status;
+    }
 
-    /* validate user name */
-    if (!is_alnum_str(user)) {
-        ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r,
-                      "user name contains non-alphanumeric characters");
-        return AUTH_USER_NOT_FOUND;
+    memcpy(header, TOTP_SNAPSHOT_MAGIC, 8);
+    put_be32(header + 8, TOTP_SNAPSHOT_VERSION);
+    status = apr_file_write_full(file, header, sizeof(header), NULL);
+
+    /* copy each zone under its lock, write the copy without holding it */
+    for (i = 0; (APR_SUCCESS == status) &&
+         (i < sizeof(snapshot_zones) / sizeof(snapshot_zones[0])); ++i) {
+        zone = snapshot_zones[i];
+        if (!zone->base)
+            continue;
+        copy = apr_palloc(pool, zone->size);
+        if (APR_SUCCESS != (status = apr_global_mutex_lock(zone->mutex)))
+            break;
+        memcpy(copy, zone->base, zone->size);
+        apr_global_mutex_unlock(zone->mutex);
+
+        if (APR_SUCCESS ==
+            (status = snapshot_write_section(file, zone->mutex_type,
+                                             zone->size)))
+            status = apr_file_write_full(file, copy, zone->size, NULL);
     }
 
-    /* validate password */
-    if ((password_len == 6) || (password_len == 8)) {
-        if (!is_digit_str(password)) {
-            ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r,
-                          "password contains non-digit characters");
-            return AUTH_DENIED;
+    /* the length of the state cache section is filled in once known */
+    if ((APR_SUCCESS == status) && state_cache.provider &&
+        (APR_SUCCESS ==
+         (status = snapshot_write_section(file, TOTP_SNAPSHOT_STATE, 0)))) {
+        start = 0;
+        apr_file_seek(file, APR_CUR, &start);
+
+        if (state_cache.mutex)
+            apr_global_mutex_lock(state_cache.mutex);
+        status = state_cache.provider->iterate(state_cache.instance, s, file,
+                                               snapshot_write_entry, pool);
+        if (state_cache.mutex)
+            apr_global_mutex_unlock(state_cache.mutex);
+
+        if (APR_ENOTIMPL == status)
+            status = APR_SUCCESS;
+        end = 0;
+        if ((APR_SUCCESS == status) &&
+            (APR_SUCCESS == (status = apr_file_seek(file, APR_CUR, &end)))) {
+            put_be64(header, end - start);
+            start -= 8;
+            if ((APR_SUCCESS ==
+                 (status = apr_file_seek(file, APR_SET, &start))) &&
+                (APR_SUCCESS ==
+                 (status = apr_file_write_full(file, header, 8, NULL))))
+                status = apr_file_seek(file, APR_SET, &end);
         }
-    } else {
-        ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r,
-                      "password is not recognized as a TOTP (6 digits) or a scratch code (8 digits)");
-        return AUTH_DENIED;
     }
 
-    totp_config = get_user_config(r, user);
-    if (!totp_config) {
-        ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r,
-                      "could not find TOTP configuration for user \"%s\"", user);
-        return AUTH_USER_NOT_FOUND;
-    }
-#ifdef DEBUG_TOTP_AUTH
-    tmp =
-        apr_pencode_base16_binary(r->pool, totp_config->shared_key,
-                                  totp_config->shared_key_len,
-                                  APR_ENCODE_COLON, NULL);
-    ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r,
-                  "secret key is \"%s\", secret length: %ld",
-                  tmp, totp_config->shared_key_len);
-#endif
+    if (APR_SUCCESS == status)
+        status = apr_file_flush(file);
+    if (APR_SUCCESS == status)
+        status = apr_file_sync(file);
+    apr_file_close(file);
+    if (APR_SUCCESS == status)
+        status = apr_file_rename(tmp_path, snapshot.path, pool);
 
-    /* check if user login count is within the rate limit */
-    if (!check_rate_limit(r, timestamp, user, totp_config)) {
-        ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r,
-                      "login attemp for user \"%s\" exceeds rate limit", user);
-        return AUTH_DENIED;
+    if (APR_SUCCESS != status) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, status, s,
+                     "snapshot_write: could not write snapshot \"%s\"",
+                     snapshot.path);
+        apr_file_remove(tmp_path, pool);
     }
 
-    /* TOTP Authentication */
-    user_code = (unsigned int) apr_atoi64(password);
-    /* TOTP codes */
-    if (password_len == 6) {
-        for (i = -(totp_config->window_size); i <= (totp_config->window_size); ++i) {
-            totp_code = generate_totp_code(totp_timestamp + i, totp_config);
-
-            ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r,
-                          "validating code timestamp=%" APR_TIME_T_FMT
-                          ", expected=\"%6.6u\", input=\"%6.6u\"", timestamp,
-                          totp_code, user_code);
+    return status;
+}
 
-            if (totp_code == user_code) {
-                if (mark_code_invalid(r, timestamp, user, totp_config, user_code)) {
-                    if (is_session_cookie_available()) {
-                        token =
-                            generate_authn_token(r, timestamp, user_code,
-                                                 totp_config);
-                        tmp = apr_psprintf(r->pool, "%6.6u", user_code);
-                        if (token && tmp)
-                            set_session_auth(r, user, tmp, token);
-                    }
+/**
+  * \brief snapshot_write_final Write a snapshot when the parent stops or restarts
+ **/
+static          apr_status_t
+snapshot_write_final(void *data)
+{
+    server_rec     *s = data;
+    apr_pool_t     *pool;
 
-                    ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r,
-                                  "access granted for user \"%s\" based on code \"%6.6u\"",
-                                  user, user_code);
-                    return AUTH_GRANTED;
-                } else
-                    /* fail authentication attempt */
-                    break;
-            }
+    /* children inherit the cleanup, but only the parent owns the state */
+    if (getpid() != snapshot.parent)
+        return APR_SUCCESS;
 
-        }
+    if (APR_SUCCESS == apr_pool_create(&pool, NULL)) {
+        snapshot_write(s, pool);
+        apr_pool_destroy(pool);
     }
-    /* Scratch codes */
-    else {
-        for (i = 0; i < totp_config->scratch_codes_count; ++i) {
 
-            ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r,
-                          "validating scratch code expected=\"%8.8u\", input=\"%8.8u\"",
-                          totp_config->scratch_codes[i], user_code);
+    return APR_SUCCESS;
+}
 
-            if (totp_config->scratch_codes[i] == user_code) {
-                if (mark_code_invalid(r, timestamp, user, totp_config, user_code)) {
-                    if (is_session_cookie_available()) {
-                        token =
-                            generate_authn_token(r, timestamp, user_code,
-                                                 totp_config);
-                        tmp = apr_psprintf(r->pool, "%8.8u", user_code);
-                        if (token && tmp)
-                            set_session_auth(r, user, tmp, token);
-                    }
+/**
+  * \brief snapshot_periodic Write a snapshot every TOTPAuthSnapshot interval from one of the children
+ **/
+static void    *APR_THREAD_FUNC
+snapshot_periodic(apr_thread_t *thread, void *data)
+{
+    server_rec     *s = data;
+    totp_snapshot_control *control = snapshot_zone.base;
+    apr_uint32_t    now, next;
+    apr_pool_t     *pool;
+
+    apr_pool_create(&pool, NULL);
+
+    while (!snapshot.stop) {
+        apr_sleep(apr_time_from_sec(1));
+
+        /* the child that moves the next snapshot time writes the snapshot */
+        now = apr_time_sec(apr_time_now());
+        next = control->next;
+        if ((now < next) ||
+            (apr_atomic_cas32(&control->next,
+                              now + apr_time_sec(snapshot.interval),
+                              next) != next))
+            continue;
 
-                    ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r,
-                                  "access granted for user \"%s\" based on scratch code \"%8.8u\"",
-                                  user, user_code);
-                    return AUTH_GRANTED;
-                } else
-                    /* fail authentication attempt */
-                    break;
-            }
-        }
+        snapshot_write(s, pool);
+        apr_pool_clear(pool);
     }
 
-    ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r,
-                  "access denied for user \"%s\" based on password \"%s\"",
-                  user, password);
+    apr_pool_destroy(pool);
+    apr_thread_exit(thread, APR_SUCCESS);
 
-    return AUTH_DENIED;
+    return NULL;
 }
 
 /**
- * Check user's TOTP authentication token
- */
-static int
-authn_totp_check_authn(request_rec *r)
+  * \brief snapshot_init Restore the state cache and set up writing snapshots
+  * \param pconf Configuration pool
+  * \param ptemp Temporary pool
+  * \param s Server record
+  * \return APR_SUCCESS on success, error code otherwise
+ **/
+static          apr_status_t
+snapshot_init(apr_pool_t *pconf, apr_pool_t *ptemp, server_rec *s)
 {
-    totp_auth_config_rec *conf =
-        ap_get_module_config(r->per_dir_config, &authn_totp_module);
+    totp_snapshot_control *control;
 
-    totp_user_config *totp_config = NULL;
-    const char     *sent_user = NULL, *sent_password = NULL,
-                   *sent_token = NULL, *tmp;
-    unsigned char  *hash, *sent_hash;
-    unsigned int    sent_totp_code;
-    unsigned int    password_len;
-    apr_time_t      sent_timestamp;
+    if (!snapshot.path)
+        return APR_SUCCESS;
 
-    /* check if session cookie support is available */
-    if (!is_session_cookie_available())
-        return DECLINED;
+    snapshot_restore_state(s, ptemp);
 
-    /* check if authentication realm is set */
-    if (!ap_auth_name(r)) {
-        ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r,
-                      "authn_totp_check_authn: AuthName is not set");
-        return HTTP_INTERNAL_SERVER_ERROR;
-    }
+    /* the zones were restored when they were created, release the file */
+    if (snapshot.mmap)
+        apr_mmap_delete(snapshot.mmap);
+    snapshot.mmap = NULL;
+    snapshot.sections = NULL;
 
-    /* get data from session cookie */
-    get_session_auth(r, &sent_user, &sent_password, &sent_token);
+    snapshot_zone.size = sizeof(totp_snapshot_control);
+    if (APR_SUCCESS != totp_shm_zone_create(&snapshot_zone, pconf, s))
+        return APR_EGENERAL;
+    control = snapshot_zone.base;
+    control->next = apr_time_sec(apr_time_now() + snapshot.interval);
 
-    if (sent_user && sent_password && sent_token) {
-        sent_hash = apr_palloc(r->pool, APR_SHA1_DIGESTSIZE);
-        if (parse_authn_token(r, sent_token, &sent_timestamp, &sent_hash)) {
+    /* registered last, so it runs before the zones are destroyed */
+    snapshot.parent = getpid();
+    apr_pool_cleanup_register(pconf, s, snapshot_write_final,
+                              apr_pool_cleanup_null);
 
-            /* validate username */
-            if (!is_alnum_str(sent_user)) {
-                ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r,
-                              "authn_totp_check_authn: username contains non-alphanumeric characters");
-                return DECLINED;
-            }
+    return APR_SUCCESS;
+}
 
-            /* validate password */
-            password_len = strlen(sent_password);
-            if ((password_len == 6) || (password_len == 8)) {
-                if (!is_digit_str(sent_password)) {
-                    ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r,
-                                  "authn_totp_check_authn: password contains non-digit characters");
-                    return DECLINED;
-                }
-            } else {
-                ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r,
-                              "authn_totp_check_authn: password is not recognized as a TOTP (6 digits) or a scratch code (8 digits)");
-                return DECLINED;
-            }
+/**
+  * \brief snapshot_stop Stop writing snapshots when the child exits
+ **/
+static          apr_status_t
+snapshot_stop(void *data)
+{
+    apr_status_t    status;
 
-            /* get the TOTP code sent by user */
-            totp_config = get_user_config(r, sent_user);
-            if (!totp_config) {
-                ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r,
-                              "authn_totp_check_authn: could not find TOTP configuration for user \"%s\"",
-                              sent_user);
-                return DECLINED;
-            }
-#ifdef DEBUG_TOTP_AUTH
-            tmp =
-                apr_pencode_base16_binary(r->pool, totp_config->shared_key,
-                                          totp_config->shared_key_len,
-                                          APR_ENCODE_COLON, NULL);
-            ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r,
-                          "authn_totp_check_authn: secret key is \"%s\", secret length: %ld",
-                          tmp, totp_config->shared_key_len);
-#endif
+    snapshot.stop = 1;
+    apr_thread_join(&status, snapshot.thread);
 
-            /* get the TOTP code sent by user */
-            sent_totp_code = (unsigned int) apr_atoi64(sent_password);
+    return APR_SUCCESS;
+}
 
-            /* generate expected TOTP code */
-            hash =
-                generate_token_hash(r->pool, sent_timestamp, sent_totp_code,
-                                    totp_config);
+/**
+  * \brief snapshot_child_init Start writing periodic snapshots in a child process
+ **/
+static void
+snapshot_child_init(apr_pool_t *p, server_rec *s)
+{
+    apr_status_t    status;
 
-            if (0 == memcmp(hash, sent_hash, APR_SHA1_DIGESTSIZE)) {
-                if(verify_totp_code(r, sent_timestamp, sent_user, totp_config, sent_totp_code)) {
-                    ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r,
-                                "authn_totp_check_authn: access granted to user \"%s\"",
-                                sent_user);
-                    return OK;
-                }
-                ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r,
-                              "authn_totp_check_authn: TOTP verification failed user \"%s\"",
-                              sent_user);
-            } else {
-                ap_log_rerror(APLOG_MARK, APLOG_DEBUG, 0, r,
-                              "authn_totp_check_authn: hash mismatch for user \"%s\"",
-                              sent_user);
-            }
-        }
+    if (!snapshot_zone.base)
+        return;
+
+#if APR_HAS_THREADS
+    snapshot.stop = 0;
+    status = apr_thread_create(&snapshot.thread, NULL, snapshot_periodic, s, p);
+    if (APR_SUCCESS != status) {
+        ap_log_error(APLOG_MARK, APLOG_CRIT, status, s,
+                     "snapshot_child_init: could not start writing snapshots");
+        return;
     }
+    /* before the thread's pool, a subpool of p, is destroyed */
+    apr_pool_pre_cleanup_register(p, NULL, snapshot_stop);
+#else
+    ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s,
+                 "snapshot_child_init: periodic snapshots require thread support");
+#endif
+}
+
+static int
+authn_totp_pre_config(apr_pool_t *pconf, apr_pool_t *plog, apr_pool_t *ptemp)
+{
+    totp_max_expires = 3600;
+
+    if ((APR_SUCCESS != totp_shm_zone_register(&verdict_zone, pconf)) ||
+        (APR_SUCCESS != totp_shm_zone_register(&revocation_zone, pconf)) ||
+        (APR_SUCCESS != totp_shm_zone_register(&client_limit_zone, pconf)) ||
+        (APR_SUCCESS != totp_shm_zone_register(&admission_zone, pconf)) ||
+        (APR_SUCCESS != totp_shm_zone_register(&lockout_zone, pconf)) ||
+        (APR_SUCCESS != totp_shm_zone_register(&hitters_zone, pconf)) ||
+        (APR_SUCCESS != totp_shm_zone_register(&budget_zone, pconf)) ||
+        (APR_SUCCESS != totp_shm_zone_register(&snapshot_zone, pconf)) ||
+        (APR_SUCCESS != ap_mutex_register(pconf, state_cache_mutex_type, NULL,
+                                          APR_LOCK_DEFAULT, 0)))
+        return !OK;
+
+    return OK;
+}
 
-    /* pass on */
-    return DECLINED;
+/**
+  * \brief check_session_renew Warn about a section where TOTPAuthSessionRenew cannot extend sessions
+  * \param vhost Server record
+  * \param section Section name, NULL for the server
+  * \param conf Configuration of the section
+  * \param data Unused
+ **/
+static void
+check_session_renew(server_rec *vhost, const char *section,
+                    totp_auth_config_rec *conf, void *data)
+{
+    /* the login a token is checked against is pruned after TOTPExpires */
+    if (conf->session_renew && conf->session_state_check)
+        ap_log_error(APLOG_MARK, APLOG_WARNING, 0, vhost,
+                     "TOTPAuthSessionRenew%s%s cannot extend sessions beyond "
+                     "TOTPExpires unless TOTPAuthSessionStateCheck is Off",
+                     section ? " in " : "", section ? section : "");
 }
 
 static int
 authn_totp_post_config(apr_pool_t *pconf, apr_pool_t *plog,
                        apr_pool_t *ptemp, server_rec *s)
 {
+    totp_auth_server_config_rec *sconf =
+        ap_get_module_config(s->module_config, &authn_totp_module);
+    totp_verdict_cache *cache;
+    totp_revocation_list *list;
+    totp_client_limit_table *table;
+    totp_admission_table *admission;
+    totp_lockout_table *lockout;
+    totp_hitters_table *hitters;
+    totp_auth_server_config_rec *vconf;
+    server_rec     *vhost;
+    unsigned int    blocks, buckets;
+    bool            restored;
+    const char     *userdata_key = "authn_totp_post_config";
+    void           *data = NULL;
+
+    authn_cache_store_fn = APR_RETRIEVE_OPTIONAL_FN(ap_authn_cache_store);
 
     if (!is_session_cookie_available()) {
         ap_session_load_fn = APR_RETRIEVE_OPTIONAL_FN(ap_session_load);
@@ -1310,9 +7612,166 @@ authn_totp_post_config(apr_pool_t *pconf, apr_pool_t *plog,
         }
     }
 
+    /* shared memory is only set up once the configuration was loaded twice */
+    apr_pool_userdata_get(&data, userdata_key, s->process->pool);
+    if (!data) {
+        apr_pool_userdata_set((const void *) 1, userdata_key,
+                              apr_pool_cleanup_null, s->process->pool);
+        return OK;
+    }
+
+    walk_dir_configs(s, ptemp, check_session_renew, NULL);
+
+    snapshot.path = sconf->snapshot_path;
+    snapshot.interval = sconf->snapshot_interval;
+    snapshot.sections = NULL;
+    if (snapshot.path)
+        snapshot_read(pconf, s);
+
+    if (sconf->verdict_cache_size) {
+        verdict_zone.size = sizeof(totp_verdict_cache) +
+            sconf->verdict_cache_size * sizeof(totp_verdict_rec);
+        if (APR_SUCCESS != totp_shm_zone_create(&verdict_zone, pconf, s))
+            return HTTP_INTERNAL_SERVER_ERROR;
+
+        cache = verdict_zone.base;
+        cache->size = sconf->verdict_cache_size;
+        if (APR_SUCCESS !=
+            apr_generate_random_bytes(cache->salt, sizeof(cache->salt))) {
+            ap_log_error(APLOG_MARK, APLOG_ERR, 0, s,
+                         "Failed to generate verdict cache salt");
+            return HTTP_INTERNAL_SERVER_ERROR;
+        }
+    }
+
+    if (sconf->revocation_list_size) {
+        /* 16 filter bits per entry */
+        blocks = (sconf->revocation_list_size * 2 + TOTP_BLOOM_BLOCK_SIZE - 1)
+            / TOTP_BLOOM_BLOCK_SIZE;
+        revocation_zone.size = sizeof(totp_revocation_list) +
+            blocks * TOTP_BLOOM_BLOCK_SIZE +
+            sconf->revocation_list_size * sizeof(totp_revocation_rec);
+        if (APR_SUCCESS != totp_shm_zone_create(&revocation_zone, pconf, s))
+            return HTTP_INTERNAL_SERVER_ERROR;
+
+        list = revocation_zone.base;
+        snapshot_restore_zone(&revocation_zone);
+        list->size = sconf->revocation_list_size;
+        list->blocks = blocks;
+        list->lifetime = apr_time_from_sec(totp_max_expires);
+    }
+
+    if (sconf->client_limit_count || sconf->subnet_limit_count) {
+        client_limit_zone.size = sizeof(totp_client_limit_table) +
+            TOTP_CLIENT_LIMIT_SIZE * sizeof(totp_client_limit_rec);
+        if (APR_SUCCESS != totp_shm_zone_create(&client_limit_zone, pconf, s))
+            return HTTP_INTERNAL_SERVER_ERROR;
+
+        table = client_limit_zone.base;
+        snapshot_restore_zone(&client_limit_zone);
+        table->size = TOTP_CLIENT_LIMIT_SIZE;
+    }
+
+    /* bucket 0 is server-wide, then one per server limiting its logins */
+    buckets = 1;
+    for (vhost = s; vhost; vhost = vhost->next) {
+        vconf = ap_get_module_config(vhost->module_config, &authn_totp_module);
+        vconf->admission_index = vconf->login_rate_set ? buckets++ : 0;
+    }
+    if (sconf->global_login_rate || sconf->global_login_burst || buckets > 1) {
+        admission_zone.size = sizeof(totp_admission_table) +
+            buckets * sizeof(totp_token_bucket);
+        if (APR_SUCCESS != totp_shm_zone_create(&admission_zone, pconf, s))
+            return HTTP_INTERNAL_SERVER_ERROR;
+
+        admission = admission_zone.base;
+        admission->count = buckets;
+    }
+
+    if (sconf->lockout_size) {
+        blocks = (sconf->lockout_size + TOTP_LOCKOUT_WAYS - 1) / TOTP_LOCKOUT_WAYS;
+        lockout_zone.size = sizeof(totp_lockout_table) +
+            blocks * TOTP_LOCKOUT_WAYS * sizeof(totp_lockout_rec);
+        if (APR_SUCCESS != totp_shm_zone_create(&lockout_zone, pconf, s))
+            return HTTP_INTERNAL_SERVER_ERROR;
+
+        lockout = lockout_zone.base;
+        lockout->sets = blocks;
+        /* a restored table keeps its salt, its entries are keyed with it */
+        if (!snapshot_restore_zone(&lockout_zone) && (APR_SUCCESS !=
+            apr_generate_random_bytes(lockout->salt, sizeof(lockout->salt)))) {
+            ap_log_error(APLOG_MARK, APLOG_ERR, 0, s,
+                         "Failed to generate lockout table salt");
+            return HTTP_INTERNAL_SERVER_ERROR;
+        }
+    }
+
+    if (sconf->hitters_size) {
+        hitters_zone.size = sizeof(totp_hitters_table) +
+            sconf->hitters_size * sizeof(totp_hitter_rec);
+        if (APR_SUCCESS != totp_shm_zone_create(&hitters_zone, pconf, s))
+            return HTTP_INTERNAL_SERVER_ERROR;
+
+        hitters = hitters_zone.base;
+        restored = snapshot_restore_zone(&hitters_zone);
+        hitters->size = sconf->hitters_size;
+        hitters->window = apr_time_from_sec(sconf->hitters_window);
+        if (!restored && (APR_SUCCESS !=
+            apr_generate_random_bytes((unsigned char *) &hitters->salt,
+                                      sizeof(hitters->salt)))) {
+            ap_log_error(APLOG_MARK, APLOG_ERR, 0, s,
+                         "Failed to generate heavy hitters salt");
+            return HTTP_INTERNAL_SERVER_ERROR;
+        }
+    }
+
+    if (sconf->hmac_budget) {
+        budget_zone.size = sizeof(totp_hmac_budget);
+        if (APR_SUCCESS != totp_shm_zone_create(&budget_zone, pconf, s))
+            return HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    if (APR_SUCCESS != state_cache_init(pconf, s))
+        return HTTP_INTERNAL_SERVER_ERROR;
+
+    if (sconf->write_behind_interval && !state_cache.provider) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, s,
+                     "TOTPAuthWriteBehind requires TOTPAuthStateCache");
+        return HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    if (APR_SUCCESS != peer_group_init(pconf, s))
+        return HTTP_INTERNAL_SERVER_ERROR;
+
+    if (APR_SUCCESS != snapshot_init(pconf, ptemp, s))
+        return HTTP_INTERNAL_SERVER_ERROR;
+
+    if (APR_SUCCESS != master_key_init(pconf, ptemp, s))
+        return HTTP_INTERNAL_SERVER_ERROR;
+
     return OK;
 }
 
+static void
+authn_totp_child_init(apr_pool_t *p, server_rec *s)
+{
+    totp_shm_zone_child_init(&verdict_zone, p, s);
+    totp_shm_zone_child_init(&revocation_zone, p, s);
+    totp_shm_zone_child_init(&client_limit_zone, p, s);
+    totp_shm_zone_child_init(&admission_zone, p, s);
+    totp_shm_zone_child_init(&lockout_zone, p, s);
+    totp_shm_zone_child_init(&hitters_zone, p, s);
+    totp_shm_zone_child_init(&budget_zone, p, s);
+    totp_shm_zone_child_init(&snapshot_zone, p, s);
+    state_cache_child_init(p, s);
+    peer_group_child_init(p, s);
+    write_behind_child_init(p, s);
+    snapshot_child_init(p, s);
+    master_key_child_init(p, s);
+    config_cache_child_init(p, s);
+    dir_cache_child_init(p, s);
+}
+
 /* Module Declaration */
 
 static const authn_provider authn_totp_provider =
@@ -1324,7 +7783,29 @@ register_hooks(apr_pool_t *p)
     ap_hook_check_authn(authn_totp_check_authn, NULL, NULL, APR_HOOK_FIRST,
                         AP_AUTH_INTERNAL_PER_CONF);
 
+    ap_hook_pre_config(authn_totp_pre_config, NULL, NULL, APR_HOOK_MIDDLE);
     ap_hook_post_config(authn_totp_post_config, NULL, NULL, APR_HOOK_MIDDLE);
+    ap_hook_child_init(authn_totp_child_init, NULL, NULL, APR_HOOK_MIDDLE);
+    ap_hook_handler(authn_totp_revocation_handler, NULL, NULL, APR_HOOK_MIDDLE);
+    ap_hook_handler(authn_totp_status_handler, NULL, NULL, APR_HOOK_MIDDLE);
+
+    APR_REGISTER_OPTIONAL_FN(authn_totp_check_code);
+    APR_REGISTER_OPTIONAL_FN(authn_totp_check_codes);
+    APR_REGISTER_OPTIONAL_FN(authn_totp_issue_token);
+    APR_REGISTER_OPTIONAL_FN(authn_totp_verify_token);
+    APR_REGISTER_OPTIONAL_FN(authn_totp_verify_tokens);
+
+    ap_register_provider(p, AUTHN_TOTP_SECRET_PROVIDER_GROUP, "file",
+                         AUTHN_TOTP_SECRET_PROVIDER_VERSION,
+                         &file_secret_provider);
+    ap_register_provider(p, AUTHN_TOTP_SECRET_PROVIDER_GROUP, "dbm",
+                         AUTHN_TOTP_SECRET_PROVIDER_VERSION,
+                         &dbm_secret_provider);
+    ap_register_provider(p, AUTHN_TOTP_SECRET_PROVIDER_GROUP, "dbd",
+                         AUTHN_TOTP_SECRET_PROVIDER_VERSION,
+                         &dbd_secret_provider);
+    ap_register_provider(p, AP_SOCACHE_PROVIDER_GROUP, "totpd",
+                         AP_SOCACHE_PROVIDER_VERSION, &totpd_socache_provider);
 
     ap_register_auth_provider(p, AUTHN_PROVIDER_GROUP, "totp",
                               AUTHN_PROVIDER_VERSION, &authn_totp_provider,
@@ -1335,8 +7816,8 @@ AP_DECLARE_MODULE(authn_totp) = {
     STANDARD20_MODULE_STUFF,
     create_authn_totp_config,   /* dir config creater */
     NULL,                       /* dir merger --- default is to override */
-    NULL,                       /* server config */
-    NULL,                       /* merge server config */
+    create_authn_totp_server_config, /* server config */
+    merge_authn_totp_server_config, /* merge server config */
     authn_totp_cmds,            /* command apr_table_t */
     register_hooks              /* register hooks */
 };
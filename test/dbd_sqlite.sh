@@ -0,0 +1,57 @@
+#!/bin/sh
+#
+# Licensed to the Apache Software Foundation (ASF) under one or more
+# contributor license agreements.  See the NOTICE file distributed with
+# this work for additional information regarding copyright ownership.
+# The ASF licenses this file to You under the Apache License, Version 2.0
+# (the "License"); you may not use this file except in compliance with
+# the License.  You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+# TOTPAuthSecretProvider dbd: user configurations, with their option lines
+# and scratch codes, are fetched from an SQLite database through mod_dbd
+# instead of TOTPAuthTokenDir, which stays empty.
+
+. "$(dirname "$0")/lib.sh"
+
+require sqlite3
+require_module mod_dbd.so
+
+sqlite3 "$WORK/secrets.db" <<EOT || fail "could not create the database"
+CREATE TABLE totp_users (name TEXT PRIMARY KEY, config TEXT NOT NULL);
+INSERT INTO totp_users VALUES ('alice', '$SECRET
+" WINDOW_SIZE 1
+" DISALLOW_REUSE
+$SCRATCH1
+$SCRATCH2
+');
+EOT
+chmod 644 "$WORK/secrets.db"
+
+LOCATION='    TOTPAuthSecretProvider dbd "SELECT config FROM totp_users WHERE name = %s"'
+start_httpd a $PORT <<EOT
+$(load_module dbd_module mod_dbd.so)
+DBDriver sqlite3
+DBDParams $WORK/secrets.db
+EOT
+
+CODE=$(fresh_code)
+status=$(login $PORT alice "$CODE")
+if [ "$status" != 200 ] &&
+    grep -q -i "driver" "$WORK/a/logs/error.log"; then
+    skip "the sqlite3 driver of apr-util is not installed"
+fi
+[ "$status" = 200 ] || fail "code of a user in the database: expected 200, got $status"
+pass "code of a user in the database accepted"
+
+expect 401 $PORT alice "$CODE" "used code rejected, DISALLOW_REUSE read from the database"
+expect 200 $PORT alice $SCRATCH2 "scratch code from the database accepted"
+expect 401 $PORT alice 12345678 "unknown scratch code rejected"
+expect 401 $PORT bob "$CODE" "user missing from the database rejected"
@@ -0,0 +1,183 @@
+#!/bin/sh
+#
+# Licensed to the Apache Software Foundation (ASF) under one or more
+# contributor license agreements.  See the NOTICE file distributed with
+# this work for additional information regarding copyright ownership.
+# The ASF licenses this file to You under the Apache License, Version 2.0
+# (the "License"); you may not use this file except in compliance with
+# the License.  You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+# Helpers of the tests in this directory, sourced by each of them.
+#
+# A test starts one or more httpd instances on 127.0.0.1 in a scratch
+# directory, each protecting /private with the installed mod_authn_totp, and
+# talks to them with curl. Codes are computed with oathtool. A test that lacks
+# one of its tools or modules is skipped with exit code 77.
+#
+#   APXS     apxs of the httpd to test against (default apxs)
+#   HTTPD    httpd binary (default from apxs)
+#   MODULES  directory of the shared modules (default from apxs)
+#   PORT     first port to listen on (default 18080)
+#   LOCATION configuration added to <Location /private> by start_httpd
+
+APXS=${APXS:-apxs}
+HTTPD=${HTTPD:-$($APXS -q SBINDIR 2>/dev/null)/$($APXS -q TARGET 2>/dev/null)}
+MODULES=${MODULES:-$($APXS -q LIBEXECDIR 2>/dev/null)}
+PORT=${PORT:-18080}
+
+SECRET=JBSWY3DPEHPK3PXP
+SCRATCH1=11223344
+SCRATCH2=55667788
+
+WORK=$(mktemp -d /tmp/totp-test.XXXXXX) || exit 1
+# the children may run as another user when started as root
+chmod 755 "$WORK"
+mkdir -m 1777 "$WORK/state"
+INSTANCES=
+DAEMONS=
+
+cleanup() {
+    for name in $INSTANCES; do
+        "$HTTPD" -f "$WORK/$name/httpd.conf" -k stop 2>/dev/null
+    done
+    for pid in $DAEMONS; do
+        kill "$pid" 2>/dev/null
+    done
+    sleep 1
+    rm -rf "$WORK"
+}
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+fail() {
+    echo "FAIL: $*"
+    for name in $INSTANCES; do
+        echo "--- $name/logs/error.log"
+        tail -n 20 "$WORK/$name/logs/error.log" 2>/dev/null
+    done
+    exit 1
+}
+
+pass() {
+    echo "ok: $*"
+}
+
+skip() {
+    echo "skipped: $*"
+    exit 77
+}
+
+# require <tool>...: skip the test unless all tools are installed
+require() {
+    for tool in "$@"; do
+        command -v "$tool" >/dev/null 2>&1 || skip "$tool is not installed"
+    done
+}
+
+# require_module <file>: skip the test unless the shared module is installed
+require_module() {
+    [ -f "$MODULES/$1" ] || skip "$1 is not installed in $MODULES"
+}
+
+# load_module <name> <file>: LoadModule line of a shared module, nothing if
+# the module is compiled in
+load_module() {
+    if [ -f "$MODULES/$2" ]; then
+        echo "LoadModule $1 $MODULES/$2"
+    fi
+}
+
+# add_user <name> [option]: token file of a user with the test secret, the
+# option, e.g. DISALLOW_REUSE, and two scratch codes
+add_user() {
+    mkdir -p "$WORK/tokens"
+    printf '%s\n" WINDOW_SIZE 1\n" %s\n%s\n%s\n' \
+        "$SECRET" "${2:-}" "$SCRATCH1" "$SCRATCH2" > "$WORK/tokens/$1"
+}
+
+# fresh_code: wait until the current time step has at least 10 seconds left,
+# so the code stays valid while the test uses it, and print the code
+fresh_code() {
+    while [ $(($(date +%s) % 30)) -gt 20 ]; do
+        sleep 1
+    done
+    oathtool --totp -b "$SECRET"
+}
+
+# start_httpd <name> <port>: start an instance; configuration read from stdin
+# is added to the main server
+start_httpd() {
+    dir="$WORK/$1"
+    mkdir -p "$dir/logs"
+    echo ok > "$dir/private"
+
+    {
+        echo "ServerRoot $dir"
+        echo "ServerName 127.0.0.1"
+        echo "Listen 127.0.0.1:$2"
+        echo "PidFile $dir/httpd.pid"
+        echo "ErrorLog $dir/logs/error.log"
+        echo "LogLevel warn authn_totp:debug"
+        echo "DefaultRuntimeDir $dir"
+        echo "Mutex file:$dir default"
+        "$HTTPD" -l | grep -q -e 'event\.c' -e 'worker\.c' -e 'prefork\.c' ||
+            load_module mpm_event_module mod_mpm_event.so
+        load_module unixd_module mod_unixd.so
+        load_module authn_core_module mod_authn_core.so
+        load_module authz_core_module mod_authz_core.so
+        load_module authz_user_module mod_authz_user.so
+        load_module auth_basic_module mod_auth_basic.so
+        load_module authn_totp_module mod_authn_totp.so
+        echo "DocumentRoot $dir"
+        cat
+        echo "<Location /private>"
+        echo "    AuthType Basic"
+        echo "    AuthName totp"
+        echo "    AuthBasicProvider totp"
+        echo "    Require valid-user"
+        echo "    TOTPAuthTokenDir $WORK/tokens"
+        echo "    TOTPAuthStateDir $WORK/state"
+        [ -z "${LOCATION:-}" ] || echo "$LOCATION"
+        echo "</Location>"
+    } > "$dir/httpd.conf"
+
+    "$HTTPD" -f "$dir/httpd.conf" -k start || fail "could not start $1"
+    INSTANCES="$INSTANCES $1"
+
+    for i in 1 2 3 4 5 6 7 8 9 10; do
+        curl -s -o /dev/null "http://127.0.0.1:$2/" && return 0
+        sleep 0.5
+    done
+    fail "$1 does not answer on port $2"
+}
+
+# login <port> <user> <password>: HTTP status of a request to /private
+login() {
+    curl -s -o /dev/null -w '%{http_code}' -u "$2:$3" \
+        "http://127.0.0.1:$1/private"
+}
+
+# expect <status> <port> <user> <password> <what>
+expect() {
+    status=$(login "$2" "$3" "$4")
+    [ "$status" = "$1" ] || fail "$5: expected $1, got $status"
+    pass "$5"
+}
+
+# forget_local_state <user>: remove the state files of a user, as if the next
+# request went to a node that never saw the user
+forget_local_state() {
+    rm -f "$WORK/state/$1.state" "$WORK/state/$1.codes" \
+        "$WORK/state/$1.logins"
+}
+
+require "$HTTPD" curl oathtool
+require_module mod_authn_totp.so
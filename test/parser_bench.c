@@ -0,0 +1,455 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * parser_bench - throughput of read_user_config's parsing loop
+ *
+ * Parses a Google Authenticator configuration over and over with the single
+ * pass loop of read_user_config, with and without parse_scratch_codes, next
+ * to the loop it replaced, which copied every line with ap_cfg_getline,
+ * tokenized it with apr_strtok and copied each scratch code to the pool.
+ *
+ * Both loops are copied from mod_authn_totp.c with the APR calls they make
+ * mapped to libc below, so the driver builds without httpd and APR. Keep
+ * parse_single_pass() and parse_scratch() in step with read_user_config()
+ * and parse_scratch_codes(). Logging is left out, the sample has nothing to
+ * log.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+
+#define max(a, b)       ((a) > (b) ? (a) : (b))
+#define min(a, b)       ((a) < (b) ? (a) : (b))
+
+#define apr_isspace(c)  isspace((unsigned char) (c))
+#define apr_isdigit(c)  isdigit((unsigned char) (c))
+#define apr_atoi64(s)   strtoll(s, NULL, 10)
+
+#define MAX_STRING_LEN          8192
+#define TOTP_MAX_SECRET_LEN     128
+#define TOTP_MAX_SCRATCH_TEXT   128
+
+typedef size_t  apr_size_t;
+typedef int64_t apr_int64_t;
+
+typedef struct {
+    bool            disallow_reuse;
+    unsigned char   window_size;
+    unsigned char   rate_limit_count;
+    unsigned short  rate_limit_seconds;
+    unsigned char   shared_key[TOTP_MAX_SECRET_LEN];
+    apr_size_t      shared_key_len;
+    apr_int64_t     scratch_codes[10];
+    unsigned char   scratch_codes_count;
+    bool            scratch_parsed;
+    apr_size_t      scratch_text_len;
+    char            scratch_text[TOTP_MAX_SCRATCH_TEXT];
+} bench_user_config;
+
+/* what a token file written by google-authenticator looks like */
+static const char sample[] =
+    "JBSWY3DPEHPK3PXPJBSWY3DPEHPK3PXP\n"
+    "\" RATE_LIMIT 3 30\n"
+    "\" WINDOW_SIZE 3\n"
+    "\" DISALLOW_REUSE\n"
+    "\" TOTP_AUTH\n"
+    "11223344\n" "55667788\n" "99001122\n" "33445566\n" "77889900\n";
+
+/* r->pool, a bump allocator reset before every parse */
+static char     pool[MAX_STRING_LEN];
+static apr_size_t pool_used;
+
+static char    *
+apr_pstrdup(const char *s)
+{
+    apr_size_t      len = strlen(s) + 1;
+    char           *p = pool + pool_used;
+
+    if (pool_used + len > sizeof(pool))
+        abort();
+    memcpy(p, s, len);
+    pool_used += len;
+    return p;
+}
+
+/**
+  * \brief decode_base32 Decode unpadded BASE32 like apr_decode_base32_binary, sizing only if dst is NULL
+  * \return true on success, false on an invalid character
+ **/
+static bool
+decode_base32(unsigned char *dst, const char *src, apr_size_t len,
+              apr_size_t *out_len)
+{
+    const char     *p;
+    unsigned int    bits = 0, value = 0;
+    apr_size_t      n = 0;
+
+    for (; len > 0; ++src, --len) {
+        if (!(p = strchr("ABCDEFGHIJKLMNOPQRSTUVWXYZ234567", *src)) || !*src)
+            return false;
+        value = (value << 5) | (p - "ABCDEFGHIJKLMNOPQRSTUVWXYZ234567");
+        if ((bits += 5) >= 8) {
+            bits -= 8;
+            if (dst)
+                dst[n] = value >> bits;
+            ++n;
+        }
+    }
+    *out_len = n;
+    return true;
+}
+
+/* The loop read_user_config ran before the single pass */
+
+typedef struct {
+    const char     *pos;
+    const char     *end;
+} bench_config_buffer;
+
+/**
+  * \brief bench_cfg_getline ap_cfg_getline over config_buffer_getstr: copy a line, then strip white space
+  * \return 0 on success, 1 at the end of the buffer
+ **/
+static int
+bench_cfg_getline(char *line, apr_size_t bufsiz, bench_config_buffer *buf)
+{
+    apr_size_t      len = 0;
+    char           *start;
+
+    if (buf->pos >= buf->end)
+        return 1;
+
+    while ((len + 1 < bufsiz) && (buf->pos < buf->end)) {
+        line[len] = *buf->pos++;
+        if (line[len++] == '\n')
+            break;
+    }
+    line[len] = '\0';
+
+    while ((len > 0) && apr_isspace(line[len - 1]))
+        line[--len] = '\0';
+    for (start = line; apr_isspace(*start); ++start);
+    if (start != line)
+        memmove(line, start, len - (start - line) + 1);
+
+    return 0;
+}
+
+static bool
+is_digit_str(const char *val)
+{
+    const char     *tmp = val;
+    for (; *tmp; ++tmp)
+        if (!apr_isdigit(*tmp))
+            return false;
+    return true;
+}
+
+static bool
+parse_line_copy(const char *data, apr_size_t len,
+                bench_user_config *user_config)
+{
+    const char     *psep = " ";
+    char           *token, *last;
+    char            line[MAX_STRING_LEN];
+    apr_size_t      key_len = 0;
+    bench_config_buffer buf = { data, data + len };
+
+    memset(user_config, 0, sizeof(*user_config));
+
+    while (!bench_cfg_getline(line, MAX_STRING_LEN, &buf)) {
+        if (!line[0])
+            continue;
+        if (line[0] == '"') {
+            token = strtok_r(&line[2], psep, &last);
+            if (token != NULL) {
+                if (0 == strcmp(token, "DISALLOW_REUSE")) {
+                    user_config->disallow_reuse = true;
+                } else if (0 == strcmp(token, "WINDOW_SIZE")) {
+                    token = strtok_r(NULL, psep, &last);
+                    if (is_digit_str(token))
+                        user_config->window_size =
+                            max(0, min(apr_atoi64(token), 32));
+                } else if (0 == strcmp(token, "RATE_LIMIT")) {
+                    token = strtok_r(NULL, psep, &last);
+                    if (is_digit_str(token))
+                        user_config->rate_limit_count =
+                            max(0, min(apr_atoi64(token), 5));
+                    token = strtok_r(NULL, psep, &last);
+                    if (!is_digit_str(token))
+                        user_config->rate_limit_count = 0;
+                    else
+                        user_config->rate_limit_seconds =
+                            max(0, min(apr_atoi64(token), 300));
+                }
+            }
+        } else if (!user_config->shared_key_len) {
+            if (!decode_base32(NULL, line, strlen(line), &key_len) ||
+                (key_len > TOTP_MAX_SECRET_LEN) ||
+                !decode_base32(user_config->shared_key, line, strlen(line),
+                               &user_config->shared_key_len) ||
+                !user_config->shared_key_len) {
+                memset(user_config, 0, sizeof(*user_config));
+                return false;
+            }
+        } else {
+            token = apr_pstrdup(line);
+            if (is_digit_str(token) && (user_config->scratch_codes_count < 10))
+                user_config->scratch_codes[user_config->scratch_codes_count++]
+                    = apr_atoi64(token);
+        }
+    }
+
+    return (user_config->shared_key_len > 0);
+}
+
+/* The single pass of read_user_config and parse_scratch_codes */
+
+static const char *
+config_next_line(const char **pos, const char *end, apr_size_t *len)
+{
+    const char     *line = *pos, *eol;
+
+    if (line >= end)
+        return NULL;
+
+    eol = memchr(line, '\n', end - line);
+    *pos = eol ? eol + 1 : end;
+    if (!eol)
+        eol = end;
+
+    while ((line < eol) && apr_isspace(*line))
+        ++line;
+    while ((eol > line) && apr_isspace(eol[-1]))
+        --eol;
+
+    *len = eol - line;
+    return line;
+}
+
+static const char *
+config_next_token(const char **pos, const char *end, apr_size_t *len)
+{
+    const char     *token = *pos;
+
+    while ((token < end) && (*token == ' '))
+        ++token;
+    for (*pos = token; (*pos < end) && (**pos != ' '); ++*pos);
+
+    *len = *pos - token;
+    return token;
+}
+
+static bool
+config_token_number(const char *token, apr_size_t len, apr_int64_t *value)
+{
+    apr_size_t      i;
+
+    *value = 0;
+    for (i = 0; i < len; ++i) {
+        if (!apr_isdigit(token[i]))
+            return false;
+        *value = min(*value * 10 + (token[i] - '0'), 1000000000);
+    }
+
+    return (len > 0);
+}
+
+static bool
+parse_single_pass(const char *data, apr_size_t len,
+                  bench_user_config *user_config)
+{
+    const char     *pos = data, *end = data + len;
+    const char     *line, *line_end, *token;
+    const char     *scratch = NULL, *scratch_end = NULL;
+    apr_size_t      line_len, token_len, key_len = 0;
+    apr_int64_t     value;
+
+    memset(user_config, 0, sizeof(*user_config));
+
+    while ((line = config_next_line(&pos, end, &line_len))) {
+        line_end = line + line_len;
+        if (!line_len)
+            continue;
+        if (line[0] == '"') {
+            line += min(line_len, 2);
+            token = config_next_token(&line, line_end, &token_len);
+            if (!token_len) {
+                /* comment */
+            } else if ((token_len == 14) &&
+                       (0 == memcmp(token, "DISALLOW_REUSE", 14))) {
+                user_config->disallow_reuse = true;
+            } else if ((token_len == 11) &&
+                       (0 == memcmp(token, "WINDOW_SIZE", 11))) {
+                token = config_next_token(&line, line_end, &token_len);
+                if (config_token_number(token, token_len, &value))
+                    user_config->window_size = min(value, 32);
+            } else if ((token_len == 10) &&
+                       (0 == memcmp(token, "RATE_LIMIT", 10))) {
+                token = config_next_token(&line, line_end, &token_len);
+                if (config_token_number(token, token_len, &value))
+                    user_config->rate_limit_count = min(value, 5);
+                token = config_next_token(&line, line_end, &token_len);
+                if (!config_token_number(token, token_len, &value))
+                    user_config->rate_limit_count = 0;
+                else
+                    user_config->rate_limit_seconds = min(value, 300);
+            }
+        } else if (!user_config->shared_key_len) {
+            if (!decode_base32(NULL, line, line_len, &key_len) ||
+                (key_len > TOTP_MAX_SECRET_LEN) ||
+                !decode_base32(user_config->shared_key, line, line_len,
+                               &user_config->shared_key_len) ||
+                !user_config->shared_key_len) {
+                memset(user_config, 0, sizeof(*user_config));
+                return false;
+            }
+        } else {
+            if (!scratch)
+                scratch = line;
+            scratch_end = line_end;
+        }
+    }
+
+    if (!user_config->shared_key_len)
+        return false;
+
+    if (scratch) {
+        len = scratch_end - scratch;
+        if (len > sizeof(user_config->scratch_text)) {
+            len = sizeof(user_config->scratch_text);
+            while (len && (scratch[len] != '\n'))
+                --len;
+        }
+        memcpy(user_config->scratch_text, scratch, len);
+        user_config->scratch_text_len = len;
+    }
+
+    return true;
+}
+
+static void
+parse_scratch(bench_user_config *user_config)
+{
+    const char     *pos = user_config->scratch_text;
+    const char     *end = pos + user_config->scratch_text_len;
+    const char     *line;
+    apr_size_t      line_len;
+    apr_int64_t     value;
+
+    if (user_config->scratch_parsed)
+        return;
+    user_config->scratch_parsed = true;
+
+    while ((line = config_next_line(&pos, end, &line_len))) {
+        if (!line_len || (line[0] == '"'))
+            continue;
+        if (config_token_number(line, line_len, &value) &&
+            (user_config->scratch_codes_count < 10))
+            user_config->scratch_codes[user_config->scratch_codes_count++]
+                = value;
+    }
+}
+
+static uint64_t
+now_nsec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+  * \brief bench_parse Parse the sample n times
+  * \param variant 0 line copy, 1 single pass, 2 single pass and scratch codes
+  * \return Nanoseconds per parse
+ **/
+static double
+bench_parse(int variant, long n)
+{
+    bench_user_config user_config;
+    uint64_t        start = now_nsec();
+    unsigned long   check = 0;
+    long            i;
+
+    for (i = 0; i < n; ++i) {
+        pool_used = 0;
+        if (!(variant ? parse_single_pass(sample, sizeof(sample) - 1,
+                                          &user_config) :
+              parse_line_copy(sample, sizeof(sample) - 1, &user_config))) {
+            fprintf(stderr, "parser_bench: the sample did not parse\n");
+            exit(2);
+        }
+        if (variant == 2)
+            parse_scratch(&user_config);
+        check += user_config.shared_key[i % 20] + user_config.rate_limit_seconds
+            + user_config.scratch_codes_count;
+    }
+
+    /* keeps the compiler from dropping the loop */
+    if (check == 1)
+        printf("\n");
+    return (double) (now_nsec() - start) / n;
+}
+
+int
+main(int argc, char *argv[])
+{
+    bench_user_config a, b;
+    long            n = (argc > 1) ? atol(argv[1]) : 2000000;
+    double          copy, single, scratch;
+
+    if (n < 1000) {
+        fprintf(stderr, "usage: parser_bench [iterations]\n");
+        return 2;
+    }
+
+    /* both loops must agree on the sample before they are compared */
+    parse_line_copy(sample, sizeof(sample) - 1, &a);
+    parse_single_pass(sample, sizeof(sample) - 1, &b);
+    parse_scratch(&b);
+    if ((a.shared_key_len != b.shared_key_len) ||
+        memcmp(a.shared_key, b.shared_key, a.shared_key_len) ||
+        (a.disallow_reuse != b.disallow_reuse) ||
+        (a.window_size != b.window_size) ||
+        (a.rate_limit_count != b.rate_limit_count) ||
+        (a.rate_limit_seconds != b.rate_limit_seconds) ||
+        (a.scratch_codes_count != b.scratch_codes_count) ||
+        memcmp(a.scratch_codes, b.scratch_codes, sizeof(a.scratch_codes))) {
+        fprintf(stderr, "parser_bench: the loops disagree on the sample\n");
+        return 1;
+    }
+
+    copy = bench_parse(0, n);
+    single = bench_parse(1, n);
+    scratch = bench_parse(2, n);
+
+    printf("%-34s %7.1f ns  %6.2f M/s\n", "line copy + strtok", copy,
+           1000 / copy);
+    printf("%-34s %7.1f ns  %6.2f M/s  %.1fx\n", "single pass", single,
+           1000 / single, copy / single);
+    printf("%-34s %7.1f ns  %6.2f M/s  %.1fx\n",
+           "single pass + parse_scratch_codes", scratch, 1000 / scratch,
+           copy / scratch);
+    return 0;
+}
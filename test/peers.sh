@@ -0,0 +1,77 @@
+#!/bin/sh
+#
+# Licensed to the Apache Software Foundation (ASF) under one or more
+# contributor license agreements.  See the NOTICE file distributed with
+# this work for additional information regarding copyright ownership.
+# The ASF licenses this file to You under the Apache License, Version 2.0
+# (the "License"); you may not use this file except in compliance with
+# the License.  You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+# TOTPAuthPeers: three instances on loopback, each with its own shmcb state
+# cache, send each other the codes and scratch codes used on them, so these
+# are rejected on the other two a moment later, even without the state files
+# of the first node.
+
+. "$(dirname "$0")/lib.sh"
+
+require_module mod_socache_shmcb.so
+
+# a request is sent to another node only after this delay
+DELAY=${DELAY:-0.2}
+
+for node in 0 1 2; do
+    peers=
+    for peer in 0 1 2; do
+        [ $peer = $node ] || peers="$peers 127.0.0.1:$((PORT + 20 + peer))"
+    done
+    start_httpd node$node $((PORT + node)) <<EOT
+$(load_module socache_shmcb_module mod_socache_shmcb.so)
+TOTPAuthStateCache shmcb
+TOTPAuthPeerListen 127.0.0.1:$((PORT + 20 + node))
+TOTPAuthPeers$peers
+TOTPAuthPeerSecret 0123456789abcdef0123456789abcdef
+EOT
+done
+
+# bob allows code reuse, so only the used scratch code bits reject his
+# scratch codes, not the used codes
+add_user alice DISALLOW_REUSE
+add_user bob
+
+CODE=$(fresh_code)
+expect 200 $PORT alice "$CODE" "code accepted on node 0"
+forget_local_state alice
+sleep $DELAY
+expect 401 $((PORT + 1)) alice "$CODE" "used code rejected on node 1 after ${DELAY}s"
+expect 401 $((PORT + 2)) alice "$CODE" "used code rejected on node 2 after ${DELAY}s"
+
+expect 200 $((PORT + 1)) bob $SCRATCH1 "scratch code accepted on node 1"
+forget_local_state bob
+sleep $DELAY
+expect 401 $PORT bob $SCRATCH1 "used scratch code rejected on node 0 after ${DELAY}s"
+expect 401 $((PORT + 2)) bob $SCRATCH1 "used scratch code rejected on node 2 after ${DELAY}s"
+expect 200 $((PORT + 2)) bob $SCRATCH2 "other scratch code accepted on node 2"
+
+# a signed datagram naming a file outside TOTPAuthStateDir is dropped
+command -v python3 >/dev/null 2>&1 || exit 0
+python3 - "$WORK/state/../tokens/alice" $((PORT + 20)) <<'EOT'
+import hashlib, hmac, socket, struct, sys, time
+key = sys.argv[1].encode()
+buf = b"TOTP" + struct.pack(">BBQH", 1, 1, int(time.time() * 1000000),
+                            len(key)) + key + struct.pack(">BQI", 1, 0, 0)
+buf += hmac.new(b"0123456789abcdef0123456789abcdef", buf, hashlib.sha1).digest()
+socket.socket(socket.AF_INET, socket.SOCK_DGRAM).sendto(
+    buf, ("127.0.0.1", int(sys.argv[2])))
+EOT
+sleep $DELAY
+grep -q "outside TOTPAuthStateDir" "$WORK/node0/logs/error.log" ||
+    fail "state of a user outside TOTPAuthStateDir accepted"
+pass "state of a user outside TOTPAuthStateDir dropped"
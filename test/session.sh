@@ -0,0 +1,55 @@
+#!/bin/sh
+#
+# Licensed to the Apache Software Foundation (ASF) under one or more
+# contributor license agreements.  See the NOTICE file distributed with
+# this work for additional information regarding copyright ownership.
+# The ASF licenses this file to You under the Apache License, Version 2.0
+# (the "License"); you may not use this file except in compliance with
+# the License.  You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+# Session tokens: with TOTPAuthConfigCache and TOTPAuthSessionStateCheck Off,
+# checking a session token allocates nothing from r->pool, as counted by the
+# DEBUG_TOTP_AUTH build at LogLevel debug.
+
+. "$(dirname "$0")/lib.sh"
+
+require_module mod_session.so
+require_module mod_session_cookie.so
+
+start_httpd a $PORT <<EOT
+$(load_module session_module mod_session.so)
+$(load_module session_cookie_module mod_session_cookie.so)
+Session On
+SessionCookieName session path=/
+TOTPAuthConfigCache 64 60
+TOTPAuthSessionStateCheck Off
+EOT
+
+add_user alice
+
+status=$(curl -s -o /dev/null -w '%{http_code}' -c "$WORK/cookies" \
+    -u "alice:$(fresh_code)" "http://127.0.0.1:$PORT/private")
+[ "$status" = 200 ] || fail "login: expected 200, got $status"
+pass "login"
+
+for i in 1 2 3; do
+    status=$(curl -s -o /dev/null -w '%{http_code}' -b "$WORK/cookies" \
+        "http://127.0.0.1:$PORT/private")
+    [ "$status" = 200 ] || fail "session $i: expected 200, got $status"
+done
+pass "session accepted without credentials"
+
+log="$WORK/a/logs/error.log"
+grep -q "verification allocated" "$log" ||
+    skip "the module was built without DEBUG_TOTP_AUTH"
+grep "verification allocated" "$log" | tail -n 1 | grep -q "allocated nothing" ||
+    fail "session check allocated from r->pool"
+pass "session check allocated nothing from r->pool"
@@ -0,0 +1,62 @@
+#!/bin/sh
+#
+# Licensed to the Apache Software Foundation (ASF) under one or more
+# contributor license agreements.  See the NOTICE file distributed with
+# this work for additional information regarding copyright ownership.
+# The ASF licenses this file to You under the Apache License, Version 2.0
+# (the "License"); you may not use this file except in compliance with
+# the License.  You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+# TOTPAuthStateCache: codes and scratch codes used on one node are rejected
+# on another node sharing the cache, even without the state files of the
+# first node. Two instances share a local memcached if it is installed,
+# otherwise a single instance with shmcb stands in for both nodes.
+
+. "$(dirname "$0")/lib.sh"
+
+if command -v memcached >/dev/null 2>&1 &&
+    [ -f "$MODULES/mod_socache_memcache.so" ]; then
+    memcached -l 127.0.0.1 -p $((PORT + 10)) -U 0 \
+        $([ "$(id -u)" = 0 ] && echo -u nobody) &
+    DAEMONS="$DAEMONS $!"
+    sleep 1
+    CONFIG="$(load_module socache_memcache_module mod_socache_memcache.so)
+TOTPAuthStateCache memcache:127.0.0.1:$((PORT + 10))"
+    NODE_A=$PORT
+    NODE_B=$((PORT + 1))
+    echo "$CONFIG" | start_httpd a $NODE_A
+    echo "$CONFIG" | start_httpd b $NODE_B
+else
+    require_module mod_socache_shmcb.so
+    NODE_A=$PORT
+    NODE_B=$PORT
+    start_httpd a $NODE_A <<EOF
+$(load_module socache_shmcb_module mod_socache_shmcb.so)
+TOTPAuthStateCache shmcb
+EOF
+fi
+
+# bob allows code reuse, so only the used scratch code bits reject his
+# scratch codes, not the used codes
+add_user alice DISALLOW_REUSE
+add_user bob
+
+CODE=$(fresh_code)
+expect 200 $NODE_A alice "$CODE" "code accepted on node a"
+forget_local_state alice
+expect 401 $NODE_B alice "$CODE" "used code rejected on node b"
+
+expect 200 $NODE_A bob $SCRATCH1 "scratch code accepted on node a"
+forget_local_state bob
+expect 401 $NODE_B bob $SCRATCH1 "used scratch code rejected on node b"
+expect 200 $NODE_B bob $SCRATCH2 "other scratch code accepted on node b"
+forget_local_state bob
+expect 401 $NODE_A bob $SCRATCH2 "used scratch code rejected on node a"
@@ -0,0 +1,45 @@
+#!/bin/sh
+#
+# Licensed to the Apache Software Foundation (ASF) under one or more
+# contributor license agreements.  See the NOTICE file distributed with
+# this work for additional information regarding copyright ownership.
+# The ASF licenses this file to You under the Apache License, Version 2.0
+# (the "License"); you may not use this file except in compliance with
+# the License.  You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+# totpd: latency of a state update and the replay race check of
+# test/totpd_bench.c against the totpd built in the source tree, without
+# httpd.
+#
+#   TOTPD        totpd binary (default ./totpd)
+#   TOTPD_BENCH  benchmark binary (default ./test/totpd_bench)
+
+TOTPD=${TOTPD:-./totpd}
+TOTPD_BENCH=${TOTPD_BENCH:-./test/totpd_bench}
+
+for bin in "$TOTPD" "$TOTPD_BENCH"; do
+    if [ ! -x "$bin" ]; then
+        echo "skipped: $bin is not built"
+        exit 77
+    fi
+done
+
+WORK=$(mktemp -d /tmp/totpd-test.XXXXXX) || exit 1
+"$TOTPD" -s "$WORK/totpd.sock" &
+PID=$!
+trap 'kill $PID 2>/dev/null; wait $PID 2>/dev/null; rm -rf "$WORK"' EXIT
+
+for i in 1 2 3 4 5 6 7 8 9 10; do
+    [ -S "$WORK/totpd.sock" ] && break
+    sleep 0.2
+done
+
+"$TOTPD_BENCH" "$WORK/totpd.sock"
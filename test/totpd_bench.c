@@ -0,0 +1,353 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * totpd_bench - latency of totpd's state updates and a replay race check
+ *
+ * Measures the round trip of TOTPD_OP_UPDATE as mod_authn_totp sends it to
+ * check and mark a code, next to the TOTPD_OP_GET and TOTPD_OP_SET pair it
+ * replaces, on a state of about 90 used codes. Then forks clients that all
+ * present the same code for the same user at once, and fails unless exactly
+ * one of them is accepted in every round.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include "totpd.h"
+
+#define BENCH_WINDOW_USEC       90000000ULL     /* TOTPExpires 90 */
+#define BENCH_STEP_USEC         1000000ULL
+
+typedef struct {
+    int64_t         timestamp;
+    uint32_t        totp_code;
+    uint32_t        padding;
+} bench_code_rec;
+
+static void
+put_be32(unsigned char *dst, uint32_t value)
+{
+    dst[0] = value >> 24;
+    dst[1] = value >> 16;
+    dst[2] = value >> 8;
+    dst[3] = value;
+}
+
+static void
+put_be64(unsigned char *dst, uint64_t value)
+{
+    put_be32(dst, value >> 32);
+    put_be32(dst + 4, value);
+}
+
+static uint32_t
+get_be32(const unsigned char *src)
+{
+    return ((uint32_t) src[0] << 24) | ((uint32_t) src[1] << 16) |
+        ((uint32_t) src[2] << 8) | src[3];
+}
+
+static uint64_t
+now_nsec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+  * \brief bench_connect Connect to totpd
+  * \return Socket descriptor, exits on error
+ **/
+static int
+bench_connect(const char *path)
+{
+    struct sockaddr_un addr;
+    int             fd;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+    if (((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) ||
+        (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0)) {
+        fprintf(stderr, "totpd_bench: could not connect to \"%s\": %s\n",
+                path, strerror(errno));
+        exit(2);
+    }
+    return fd;
+}
+
+static bool
+bench_io(int fd, unsigned char *buf, size_t len, bool writing)
+{
+    ssize_t         n;
+
+    while (len > 0) {
+        n = writing ? write(fd, buf, len) : read(fd, buf, len);
+        if ((n < 0) && (EINTR == errno))
+            continue;
+        if (n <= 0)
+            return false;
+        buf += n;
+        len -= n;
+    }
+    return true;
+}
+
+/**
+  * \brief bench_request Send a request and receive its response, like totpd_request
+  * \return Response status, exits on error
+ **/
+static unsigned char
+bench_request(int fd, char op, const char *key, uint64_t expiry,
+              const unsigned char *val, uint32_t val_len,
+              unsigned char *resp, uint32_t *resp_len)
+{
+    unsigned char   buf[TOTPD_REQUEST_LEN + TOTPD_MAX_KEY_LEN + 4 +
+                        TOTPD_STATE_MAX];
+    size_t          key_len = strlen(key);
+    uint32_t        len;
+
+    buf[0] = op;
+    buf[1] = key_len >> 8;
+    buf[2] = key_len;
+    put_be32(buf + 3, val_len);
+    put_be64(buf + 7, expiry);
+    memcpy(buf + TOTPD_REQUEST_LEN, key, key_len);
+    memcpy(buf + TOTPD_REQUEST_LEN + key_len, val, val_len);
+
+    if (!bench_io(fd, buf, TOTPD_REQUEST_LEN + key_len + val_len, true) ||
+        !bench_io(fd, buf, TOTPD_RESPONSE_LEN, false) ||
+        ((len = get_be32(buf + 1)) > sizeof(buf)) ||
+        !bench_io(fd, buf + TOTPD_RESPONSE_LEN, len, false)) {
+        fprintf(stderr, "totpd_bench: request failed\n");
+        exit(2);
+    }
+
+    if (resp) {
+        memcpy(resp, buf + TOTPD_RESPONSE_LEN, len);
+        *resp_len = len;
+    }
+    return buf[0];
+}
+
+/**
+  * \brief bench_update Check and mark a code, as mark_code_invalid does with totpd
+  * \return Number of earlier uses of the code
+ **/
+static uint32_t
+bench_update(int fd, const char *key, int64_t timestamp, uint32_t code)
+{
+    unsigned char   val[TOTPD_UPDATE_LEN + sizeof(bench_code_rec)];
+    unsigned char   resp[4 + TOTPD_STATE_MAX];
+    bench_code_rec  entry = { timestamp, code, 0 };
+    uint32_t        resp_len;
+
+    val[0] = TOTPD_STATE_CODES;
+    val[1] = TOTPD_UPDATE_SAME_CODE | TOTPD_UPDATE_APPEND;
+    put_be64(val + 2, BENCH_WINDOW_USEC);
+    memcpy(val + TOTPD_UPDATE_LEN, &entry, sizeof(entry));
+
+    if ((bench_request(fd, TOTPD_OP_UPDATE, key, timestamp + BENCH_WINDOW_USEC,
+                       val, sizeof(val), resp, &resp_len) != TOTPD_STATUS_OK) ||
+        (resp_len < 4 + TOTPD_STATE_HEADER_LEN)) {
+        fprintf(stderr, "totpd_bench: update failed\n");
+        exit(2);
+    }
+    return get_be32(resp);
+}
+
+/**
+  * \brief bench_get_set Check and mark a code with a separate get and set, as before TOTPD_OP_UPDATE
+ **/
+static void
+bench_get_set(int fd, const char *key, int64_t timestamp, uint32_t code)
+{
+    unsigned char   state[TOTPD_STATE_MAX];
+    bench_code_rec  entry = { timestamp, code, 0 };
+    uint32_t        len = 0, codes_len;
+
+    if (bench_request(fd, TOTPD_OP_GET, key, 0, NULL, 0, state, &len) !=
+        TOTPD_STATUS_OK) {
+        memset(state, 0, TOTPD_STATE_HEADER_LEN);
+        put_be32(state, TOTPD_STATE_VERSION);
+        len = TOTPD_STATE_HEADER_LEN;
+    }
+
+    /* the codes come first, drop the oldest to keep the state's size */
+    codes_len = get_be32(state + 4);
+    if (codes_len >= 90 * sizeof(entry)) {
+        memmove(state + TOTPD_STATE_HEADER_LEN,
+                state + TOTPD_STATE_HEADER_LEN + sizeof(entry),
+                len - TOTPD_STATE_HEADER_LEN - sizeof(entry));
+        len -= sizeof(entry);
+        codes_len -= sizeof(entry);
+    }
+    memmove(state + TOTPD_STATE_HEADER_LEN + codes_len + sizeof(entry),
+            state + TOTPD_STATE_HEADER_LEN + codes_len,
+            len - TOTPD_STATE_HEADER_LEN - codes_len);
+    memcpy(state + TOTPD_STATE_HEADER_LEN + codes_len, &entry, sizeof(entry));
+    put_be32(state + 4, codes_len + sizeof(entry));
+    len += sizeof(entry);
+
+    bench_request(fd, TOTPD_OP_SET, key, timestamp + BENCH_WINDOW_USEC, state,
+                  len, NULL, NULL);
+}
+
+static int
+compare_u64(const void *a, const void *b)
+{
+    uint64_t        x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+    return (x > y) - (x < y);
+}
+
+static void
+report(const char *what, uint64_t *samples, int n)
+{
+    uint64_t        sum = 0;
+    int             i;
+
+    for (i = 0; i < n; ++i)
+        sum += samples[i];
+    qsort(samples, n, sizeof(uint64_t), compare_u64);
+    printf("%-24s mean %6.2f us  p50 %6.2f us  p99 %6.2f us\n", what,
+           sum / 1000.0 / n, samples[n / 2] / 1000.0,
+           samples[n * 99 / 100] / 1000.0);
+}
+
+/**
+  * \brief bench_race Present the same code from several clients at once
+  * \return Number of rounds in which not exactly one client was accepted
+ **/
+static int
+bench_race(const char *path, int clients, int rounds)
+{
+    char            key[64];
+    int             barrier[2], round, i, fd, status, accepted, failed = 0;
+    int64_t         timestamp = (int64_t) time(NULL) * 1000000;
+    pid_t           pid;
+
+    for (round = 0; round < rounds; ++round) {
+        snprintf(key, sizeof(key), "/bench/race/user%d", round);
+        if (pipe(barrier) < 0)
+            exit(2);
+
+        for (i = 0; i < clients; ++i) {
+            if ((pid = fork()) < 0)
+                exit(2);
+            if (pid == 0) {
+                char            c;
+
+                close(barrier[1]);
+                fd = bench_connect(path);
+                /* all clients go once the parent closes the pipe */
+                while ((read(barrier[0], &c, 1) < 0) && (EINTR == errno));
+                _exit(bench_update(fd, key, timestamp, 123456) ? 1 : 0);
+            }
+        }
+        close(barrier[0]);
+        usleep(10000);
+        close(barrier[1]);
+
+        for (i = 0, accepted = 0; i < clients; ++i) {
+            if ((wait(&status) > 0) && WIFEXITED(status) &&
+                (WEXITSTATUS(status) == 0))
+                ++accepted;
+        }
+        if (accepted != 1) {
+            fprintf(stderr, "totpd_bench: round %d accepted the code %d times\n",
+                    round, accepted);
+            ++failed;
+        }
+    }
+    return failed;
+}
+
+int
+main(int argc, char *argv[])
+{
+    const char     *path;
+    uint64_t       *samples, start;
+    int64_t         timestamp = (int64_t) time(NULL) * 1000000;
+    int             n = 100000, clients = 16, rounds = 200, fd, i, opt;
+
+    while ((opt = getopt(argc, argv, "n:c:r:")) != -1) {
+        switch (opt) {
+        case 'n':
+            n = atoi(optarg);
+            break;
+        case 'c':
+            clients = atoi(optarg);
+            break;
+        case 'r':
+            rounds = atoi(optarg);
+            break;
+        default:
+            n = 0;
+        }
+    }
+    if ((optind + 1 != argc) || (n < 100) || (clients < 2)) {
+        fprintf(stderr, "usage: totpd_bench [-n requests] [-c clients] "
+                "[-r rounds] socket\n");
+        return 2;
+    }
+    path = argv[optind];
+
+    if (!(samples = malloc(n * sizeof(uint64_t))))
+        return 2;
+    fd = bench_connect(path);
+
+    /* one step per request, so the window keeps about 90 codes */
+    for (i = 0; i < n; ++i) {
+        start = now_nsec();
+        bench_update(fd, "/bench/update/user", timestamp +
+                     i * BENCH_STEP_USEC, i % 1000000);
+        samples[i] = now_nsec() - start;
+    }
+    report("update (1 round trip)", samples, n);
+
+    for (i = 0; i < n; ++i) {
+        start = now_nsec();
+        bench_get_set(fd, "/bench/get-set/user", timestamp +
+                      i * BENCH_STEP_USEC, i % 1000000);
+        samples[i] = now_nsec() - start;
+    }
+    report("get + set (2 round trips)", samples, n);
+
+    close(fd);
+    free(samples);
+
+    if (bench_race(path, clients, rounds)) {
+        printf("race: FAILED\n");
+        return 1;
+    }
+    printf("race: %d rounds of %d clients, the code was accepted once in each\n",
+           rounds, clients);
+    return 0;
+}
@@ -0,0 +1,78 @@
+#!/bin/sh
+#
+# Licensed to the Apache Software Foundation (ASF) under one or more
+# contributor license agreements.  See the NOTICE file distributed with
+# this work for additional information regarding copyright ownership.
+# The ASF licenses this file to You under the Apache License, Version 2.0
+# (the "License"); you may not use this file except in compliance with
+# the License.  You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+# Move the user files of a TOTPAuthTokenDir or TOTPAuthStateDir between the
+# flat layout and the hashed layout of "TOTPAuthHashedDirs On", where the
+# files of a user live in <dir>/xx/yy/, xxyy being the first four hex digits
+# of the MD5 hash of the user name.
+#
+# usage: totp-hash-dirs.sh [-r] <dir>...
+#   -r  move files back from the hashed to the flat layout
+
+set -e
+
+usage() {
+    echo "usage: $0 [-r] <dir>..." >&2
+    exit 1
+}
+
+if command -v md5sum >/dev/null 2>&1; then
+    md5() { printf '%s' "$1" | md5sum | cut -c1-4; }
+elif command -v md5 >/dev/null 2>&1; then
+    md5() { printf '%s' "$1" | md5 -q | cut -c1-4; }
+else
+    echo "$0: md5sum or md5 is required" >&2
+    exit 1
+fi
+
+reverse=0
+if [ "$1" = "-r" ]; then
+    reverse=1
+    shift
+fi
+[ $# -gt 0 ] || usage
+
+for dir in "$@"; do
+    [ -d "$dir" ] || { echo "$0: $dir is not a directory" >&2; exit 1; }
+    moved=0
+
+    if [ $reverse -eq 0 ]; then
+        for file in "$dir"/*; do
+            [ -f "$file" ] || continue
+            name=${file##*/}
+            # user names are alphanumeric, the rest is the file suffix
+            user=${name%%.*}
+            case "$user" in
+                ''|*[!A-Za-z0-9]*) echo "$0: skipping $file" >&2; continue ;;
+            esac
+            hash=$(md5 "$user")
+            sub="$dir/$(echo "$hash" | cut -c1-2)/$(echo "$hash" | cut -c3-4)"
+            mkdir -p "$sub"
+            mv "$file" "$sub/$name"
+            moved=$((moved + 1))
+        done
+    else
+        for file in "$dir"/[0-9a-f][0-9a-f]/[0-9a-f][0-9a-f]/*; do
+            [ -f "$file" ] || continue
+            mv "$file" "$dir/${file##*/}"
+            moved=$((moved + 1))
+        done
+        find "$dir" -mindepth 1 -type d -empty -delete
+    fi
+
+    echo "$dir: moved $moved files"
+done
@@ -0,0 +1,813 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * totpd - keeps the TOTP state of mod_authn_totp in memory
+ *
+ * The module uses it as the "totpd" provider of TOTPAuthStateCache. All
+ * children of all servers on a host then share one consistent copy of the
+ * used codes and login attempts, which totpd periodically writes to a
+ * snapshot file and reads back when it starts.
+ *
+ * Clients keep their connections open and may send further requests before
+ * the answer to the previous one arrived; requests are answered in order.
+ *
+ *   request:  op (1) | key length (BE16) | value length (BE32) | expiry (BE64) | key | value
+ *   response: status (1) | value length (BE32) | value
+ *
+ * op is TOTPD_OP_GET, TOTPD_OP_SET, TOTPD_OP_DELETE or TOTPD_OP_UPDATE, the
+ * expiry is in microseconds since the epoch and only used by TOTPD_OP_SET and
+ * TOTPD_OP_UPDATE. Only TOTPD_OP_GET and TOTPD_OP_UPDATE answer with a value,
+ * see totpd.h for the latter.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include "totpd.h"
+
+#define TOTPD_MAX_CLIENTS       1024
+#define TOTPD_BUFFER_SIZE       16384
+#define TOTPD_SNAPSHOT_MAGIC    "TOTPD1\n"
+
+typedef struct totpd_entry {
+    struct totpd_entry *next;
+    uint32_t        hash;
+    uint64_t        expiry;
+    uint16_t        key_len;
+    uint32_t        val_len;
+    unsigned char   data[];     /* key, then value */
+} totpd_entry;
+
+typedef struct {
+    totpd_entry   **buckets;
+    uint32_t        size;       /* power of two */
+    uint32_t        count;
+    bool            dirty;      /* changed since the last snapshot */
+} totpd_table;
+
+typedef struct {
+    int             fd;
+    unsigned char  *in;
+    size_t          in_len;
+    unsigned char  *out;
+    size_t          out_len;
+    size_t          out_size;
+} totpd_client;
+
+static totpd_table table;
+static totpd_client clients[TOTPD_MAX_CLIENTS];
+static int      client_count;
+static volatile sig_atomic_t terminate;
+
+/* Helper functions */
+
+static uint64_t
+now_usec(void)
+{
+    struct timeval  tv;
+
+    gettimeofday(&tv, NULL);
+    return (uint64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static void
+put_be16(unsigned char *dst, uint16_t value)
+{
+    dst[0] = value >> 8;
+    dst[1] = value;
+}
+
+static void
+put_be32(unsigned char *dst, uint32_t value)
+{
+    put_be16(dst, value >> 16);
+    put_be16(dst + 2, value);
+}
+
+static void
+put_be64(unsigned char *dst, uint64_t value)
+{
+    put_be32(dst, value >> 32);
+    put_be32(dst + 4, value);
+}
+
+static uint16_t
+get_be16(const unsigned char *src)
+{
+    return ((uint16_t) src[0] << 8) | src[1];
+}
+
+static uint32_t
+get_be32(const unsigned char *src)
+{
+    return ((uint32_t) get_be16(src) << 16) | get_be16(src + 2);
+}
+
+static uint64_t
+get_be64(const unsigned char *src)
+{
+    return ((uint64_t) get_be32(src) << 32) | get_be32(src + 4);
+}
+
+static uint32_t
+fnv1a(const unsigned char *data, size_t len)
+{
+    uint32_t        hash = 2166136261u;
+
+    while (len--) {
+        hash ^= *data++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/* State table */
+
+/**
+  * \brief table_find Find the entry of a key
+  * \param key Key
+  * \param key_len Key length in bytes
+  * \param hash Hash of the key
+  * \return Pointer to the link to the entry, pointing to NULL if not found
+ **/
+static totpd_entry **
+table_find(const unsigned char *key, uint16_t key_len, uint32_t hash)
+{
+    totpd_entry   **link = &table.buckets[hash & (table.size - 1)];
+
+    for (; *link; link = &(*link)->next) {
+        if (((*link)->hash == hash) && ((*link)->key_len == key_len) &&
+            (0 == memcmp((*link)->data, key, key_len)))
+            break;
+    }
+    return link;
+}
+
+/**
+  * \brief table_grow Double the number of buckets once there are more entries than buckets
+ **/
+static void
+table_grow(void)
+{
+    totpd_entry   **buckets;
+    totpd_entry    *entry, *next;
+    uint32_t        i, size = table.size * 2;
+
+    if ((table.count < table.size) ||
+        !(buckets = calloc(size, sizeof(totpd_entry *))))
+        return;
+
+    for (i = 0; i < table.size; ++i) {
+        for (entry = table.buckets[i]; entry; entry = next) {
+            next = entry->next;
+            entry->next = buckets[entry->hash & (size - 1)];
+            buckets[entry->hash & (size - 1)] = entry;
+        }
+    }
+    free(table.buckets);
+    table.buckets = buckets;
+    table.size = size;
+}
+
+/**
+  * \brief table_set Store a value under a key, replacing an existing one
+  * \return true on success, false if out of memory
+ **/
+static bool
+table_set(const unsigned char *key, uint16_t key_len, const unsigned char *val,
+          uint32_t val_len, uint64_t expiry)
+{
+    uint32_t        hash = fnv1a(key, key_len);
+    totpd_entry   **link = table_find(key, key_len, hash);
+    totpd_entry    *entry;
+
+    entry = malloc(sizeof(totpd_entry) + key_len + val_len);
+    if (!entry)
+        return false;
+    entry->hash = hash;
+    entry->expiry = expiry;
+    entry->key_len = key_len;
+    entry->val_len = val_len;
+    memcpy(entry->data, key, key_len);
+    memcpy(entry->data + key_len, val, val_len);
+
+    if (*link) {
+        entry->next = (*link)->next;
+        free(*link);
+    } else {
+        entry->next = NULL;
+        ++table.count;
+    }
+    *link = entry;
+    table.dirty = true;
+
+    table_grow();
+    return true;
+}
+
+/**
+  * \brief table_delete Remove the entry of a key
+ **/
+static void
+table_delete(totpd_entry **link)
+{
+    totpd_entry    *entry = *link;
+
+    *link = entry->next;
+    free(entry);
+    --table.count;
+    table.dirty = true;
+}
+
+/**
+  * \brief table_expire Remove all expired entries
+ **/
+static void
+table_expire(uint64_t now)
+{
+    totpd_entry   **link;
+    uint32_t        i;
+
+    for (i = 0; i < table.size; ++i) {
+        for (link = &table.buckets[i]; *link;) {
+            if ((*link)->expiry <= now)
+                table_delete(link);
+            else
+                link = &(*link)->next;
+        }
+    }
+}
+
+/* State updates */
+
+/**
+  * \brief state_update Apply TOTPD_OP_UPDATE to the state under a key
+  * \param key Key
+  * \param key_len Key length in bytes
+  * \param val Request value
+  * \param val_len Request value length in bytes
+  * \param expiry Requested expiry of the state
+  * \param now Current time
+  * \param out Buffer of 4 + TOTPD_STATE_MAX bytes for the response value
+  * \param out_len Pointer to the response value length
+  * \return TOTPD_STATUS_OK on success, TOTPD_STATUS_ERROR otherwise
+ **/
+static unsigned char
+state_update(const unsigned char *key, uint16_t key_len,
+             const unsigned char *val, uint32_t val_len, uint64_t expiry,
+             uint64_t now, unsigned char *out, uint32_t *out_len)
+{
+    static const uint32_t entry_sizes[TOTPD_STATE_KINDS] = {
+        TOTPD_CODE_ENTRY_LEN, TOTPD_LOGIN_ENTRY_LEN, 0
+    };
+    static unsigned char kept[TOTPD_STATE_MAX + TOTPD_CODE_ENTRY_LEN];
+    const unsigned char *entry = val + TOTPD_UPDATE_LEN, *old = NULL;
+    const unsigned char *data[TOTPD_STATE_KINDS];
+    unsigned char  *state = out + 4;
+    uint32_t        hash = fnv1a(key, key_len);
+    uint32_t        lens[TOTPD_STATE_KINDS] = { 0 };
+    uint32_t        entry_size, len, pos, room, skip, count = 0;
+    uint64_t        window;
+    int64_t         timestamp = 0, entry_time;
+    totpd_entry   **link;
+    int             kind, mode, i;
+    bool            keep;
+
+    if (val_len < TOTPD_UPDATE_LEN)
+        return TOTPD_STATUS_ERROR;
+    kind = val[0];
+    mode = val[1] & ~TOTPD_UPDATE_APPEND;
+    window = get_be64(val + 2);
+    if ((kind >= TOTPD_STATE_KINDS) || (mode > TOTPD_UPDATE_REPLACE))
+        return TOTPD_STATUS_ERROR;
+
+    /* the user kind is a single record of any size, only ever replaced */
+    entry_size = entry_sizes[kind] ? entry_sizes[kind] : val_len - TOTPD_UPDATE_LEN;
+    if ((val_len - TOTPD_UPDATE_LEN != entry_size) || !entry_size ||
+        (entry_size > TOTPD_STATE_MAX - TOTPD_STATE_HEADER_LEN) ||
+        (!entry_sizes[kind] && (mode != TOTPD_UPDATE_REPLACE)) ||
+        ((kind != TOTPD_STATE_CODES) && ((mode == TOTPD_UPDATE_SAME_CODE) ||
+                                         (mode == TOTPD_UPDATE_SAME_ENTRY))))
+        return TOTPD_STATUS_ERROR;
+    if (entry_sizes[kind])
+        memcpy(&timestamp, entry, sizeof(timestamp));
+
+    /* a missing, expired or invalid state counts as empty */
+    link = table_find(key, key_len, hash);
+    if (*link && ((*link)->expiry > now) &&
+        ((*link)->val_len >= TOTPD_STATE_HEADER_LEN)) {
+        old = (*link)->data + key_len;
+        for (i = 0, len = TOTPD_STATE_HEADER_LEN; i < TOTPD_STATE_KINDS; ++i) {
+            lens[i] = get_be32(old + 4 + 4 * i);
+            data[i] = old + len;
+            len += lens[i];
+        }
+        if ((get_be32(old) != TOTPD_STATE_VERSION) ||
+            (len != (*link)->val_len)) {
+            old = NULL;
+            memset(lens, 0, sizeof(lens));
+        }
+    }
+
+    /* same rules as mod_authn_totp's callbacks of the kinds */
+    for (pos = 0, len = 0; old && (pos + entry_size <= lens[kind]);
+         pos += entry_size) {
+        memcpy(&entry_time, data[kind] + pos, sizeof(entry_time));
+        switch (mode) {
+        case TOTPD_UPDATE_EARLIER:
+            keep = (entry_time < timestamp) &&
+                ((uint64_t) (timestamp - entry_time) <= window);
+            count += keep;
+            break;
+        case TOTPD_UPDATE_CLEAR:
+            keep = (entry_time > timestamp);
+            break;
+        case TOTPD_UPDATE_REPLACE:
+            keep = false;
+            break;
+        default:
+            keep = (entry_time <= timestamp) &&
+                ((uint64_t) (timestamp - entry_time) <= window);
+            if (keep && (mode == TOTPD_UPDATE_SAME_CODE))
+                count += !memcmp(data[kind] + pos + 8, entry + 8, 4);
+            else if (keep && (mode == TOTPD_UPDATE_SAME_ENTRY))
+                count += !memcmp(data[kind] + pos, entry, 12);
+        }
+        if (keep) {
+            memcpy(kept + len, data[kind] + pos, entry_size);
+            len += entry_size;
+        }
+    }
+    if ((val[1] & TOTPD_UPDATE_APPEND) || (mode == TOTPD_UPDATE_REPLACE)) {
+        memcpy(kept + len, entry, entry_size);
+        len += entry_size;
+    }
+
+    /* drop the oldest entries of the kind if the state grew too large */
+    room = TOTPD_STATE_MAX - TOTPD_STATE_HEADER_LEN;
+    for (i = 0; i < TOTPD_STATE_KINDS; ++i) {
+        if (i != kind)
+            room -= lens[i];
+    }
+    skip = (len > room) ? (len - room + entry_size - 1) / entry_size * entry_size : 0;
+    data[kind] = kept + skip;
+    lens[kind] = len - skip;
+
+    put_be32(out, count);
+    put_be32(state, TOTPD_STATE_VERSION);
+    for (i = 0, len = TOTPD_STATE_HEADER_LEN; i < TOTPD_STATE_KINDS; ++i) {
+        put_be32(state + 4 + 4 * i, lens[i]);
+        if (lens[i])
+            memcpy(state + len, data[i], lens[i]);
+        len += lens[i];
+    }
+    *out_len = 4 + len;
+
+    /* only a changed state is stored, a missing one stays missing if empty */
+    if (old ? ((len == (*link)->val_len) && !memcmp(state, old, len)) :
+        (len == TOTPD_STATE_HEADER_LEN))
+        return TOTPD_STATUS_OK;
+
+    if (old && ((*link)->expiry > expiry))
+        expiry = (*link)->expiry;
+    return table_set(key, key_len, state, len, expiry) ?
+        TOTPD_STATUS_OK : TOTPD_STATUS_ERROR;
+}
+
+/* Snapshots */
+
+/**
+  * \brief snapshot_write Write all entries to a file, replacing it atomically
+  * \param path Snapshot file path
+  * \return true on success, false otherwise
+ **/
+static bool
+snapshot_write(const char *path)
+{
+    char            tmp_path[PATH_MAX];
+    unsigned char   header[14];
+    totpd_entry    *entry;
+    FILE           *file;
+    uint32_t        i;
+    bool            ok;
+
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%ld", path, (long) getpid());
+    if (!(file = fopen(tmp_path, "wb")))
+        return false;
+
+    ok = (fputs(TOTPD_SNAPSHOT_MAGIC, file) >= 0);
+    for (i = 0; ok && (i < table.size); ++i) {
+        for (entry = table.buckets[i]; ok && entry; entry = entry->next) {
+            put_be16(header, entry->key_len);
+            put_be32(header + 2, entry->val_len);
+            put_be64(header + 6, entry->expiry);
+            ok = (fwrite(header, sizeof(header), 1, file) == 1) &&
+                (fwrite(entry->data, entry->key_len + entry->val_len, 1,
+                        file) == 1);
+        }
+    }
+    ok = (0 == fflush(file)) && (0 == fsync(fileno(file))) && ok;
+    ok = (0 == fclose(file)) && ok;
+
+    if (!ok || (0 != rename(tmp_path, path))) {
+        unlink(tmp_path);
+        return false;
+    }
+    return true;
+}
+
+/**
+  * \brief snapshot_read Load the unexpired entries of a snapshot file
+  * \param path Snapshot file path
+ **/
+static void
+snapshot_read(const char *path)
+{
+    char            magic[sizeof(TOTPD_SNAPSHOT_MAGIC)];
+    unsigned char   header[14];
+    unsigned char  *data;
+    uint64_t        now = now_usec(), expiry;
+    uint32_t        key_len, val_len, loaded = 0;
+    FILE           *file;
+
+    if (!(file = fopen(path, "rb"))) {
+        if (ENOENT != errno)
+            fprintf(stderr, "totpd: could not open snapshot \"%s\": %s\n",
+                    path, strerror(errno));
+        return;
+    }
+
+    if (!fgets(magic, sizeof(magic), file) || strcmp(magic, TOTPD_SNAPSHOT_MAGIC)) {
+        fprintf(stderr, "totpd: ignoring invalid snapshot \"%s\"\n", path);
+        fclose(file);
+        return;
+    }
+
+    while (fread(header, sizeof(header), 1, file) == 1) {
+        key_len = get_be16(header);
+        val_len = get_be32(header + 2);
+        expiry = get_be64(header + 6);
+        if (!key_len || (val_len > TOTPD_MAX_VALUE_LEN) ||
+            !(data = malloc(key_len + val_len)))
+            break;
+        if (fread(data, key_len + val_len, 1, file) != 1) {
+            free(data);
+            break;
+        }
+        if ((expiry > now) &&
+            table_set(data, key_len, data + key_len, val_len, expiry))
+            ++loaded;
+        free(data);
+    }
+    fclose(file);
+
+    table.dirty = false;
+    fprintf(stderr, "totpd: loaded %u entries from \"%s\"\n", loaded, path);
+}
+
+/* Clients */
+
+/**
+  * \brief client_reply Queue a response for a client
+  * \return true on success, false if out of memory
+ **/
+static bool
+client_reply(totpd_client *client, unsigned char status,
+             const unsigned char *val, uint32_t val_len)
+{
+    unsigned char  *out;
+    size_t          size = client->out_size;
+
+    while (client->out_len + TOTPD_RESPONSE_LEN + val_len > size)
+        size = size ? size * 2 : TOTPD_BUFFER_SIZE;
+    if (size != client->out_size) {
+        if (!(out = realloc(client->out, size)))
+            return false;
+        client->out = out;
+        client->out_size = size;
+    }
+
+    client->out[client->out_len] = status;
+    put_be32(client->out + client->out_len + 1, val_len);
+    memcpy(client->out + client->out_len + TOTPD_RESPONSE_LEN, val, val_len);
+    client->out_len += TOTPD_RESPONSE_LEN + val_len;
+
+    return true;
+}
+
+/**
+  * \brief client_process Answer all complete requests received from a client
+  * \return true on success, false if the client has to be disconnected
+ **/
+static bool
+client_process(totpd_client *client, uint64_t now)
+{
+    static unsigned char update[4 + TOTPD_STATE_MAX];
+    const unsigned char *req = client->in, *key, *val;
+    size_t          left = client->in_len;
+    uint32_t        key_len, val_len, update_len;
+    totpd_entry   **link;
+    unsigned char   status;
+    bool            ok = true;
+
+    while (ok && (left >= TOTPD_REQUEST_LEN)) {
+        key_len = get_be16(req + 1);
+        val_len = get_be32(req + 3);
+        if (!key_len || (key_len > TOTPD_MAX_KEY_LEN) ||
+            (val_len > TOTPD_MAX_VALUE_LEN))
+            return false;
+        if (left < TOTPD_REQUEST_LEN + key_len + val_len)
+            break;
+        key = req + TOTPD_REQUEST_LEN;
+        val = key + key_len;
+
+        switch (req[0]) {
+        case TOTPD_OP_GET:
+            link = table_find(key, key_len, fnv1a(key, key_len));
+            if (*link && ((*link)->expiry > now)) {
+                ok = client_reply(client, TOTPD_STATUS_OK,
+                                  (*link)->data + key_len, (*link)->val_len);
+            } else {
+                /* the link moves on to the next entry of the bucket */
+                if (*link)
+                    table_delete(link);
+                ok = client_reply(client, TOTPD_STATUS_NOTFOUND, NULL, 0);
+            }
+            break;
+        case TOTPD_OP_SET:
+            ok = client_reply(client,
+                              table_set(key, key_len, val, val_len,
+                                        get_be64(req + 7)) ?
+                              TOTPD_STATUS_OK : TOTPD_STATUS_ERROR, NULL, 0);
+            break;
+        case TOTPD_OP_DELETE:
+            link = table_find(key, key_len, fnv1a(key, key_len));
+            if (*link)
+                table_delete(link);
+            ok = client_reply(client, TOTPD_STATUS_OK, NULL, 0);
+            break;
+        case TOTPD_OP_UPDATE:
+            status = state_update(key, key_len, val, val_len, get_be64(req + 7),
+                                  now, update, &update_len);
+            ok = client_reply(client, status, update,
+                              (status == TOTPD_STATUS_OK) ? update_len : 0);
+            break;
+        default:
+            return false;
+        }
+
+        req += TOTPD_REQUEST_LEN + key_len + val_len;
+        left -= TOTPD_REQUEST_LEN + key_len + val_len;
+    }
+
+    memmove(client->in, req, left);
+    client->in_len = left;
+
+    return ok;
+}
+
+/**
+  * \brief client_close Disconnect a client
+ **/
+static void
+client_close(int i)
+{
+    close(clients[i].fd);
+    free(clients[i].in);
+    free(clients[i].out);
+    clients[i] = clients[--client_count];
+}
+
+/**
+  * \brief client_read Read what a client sent and answer it
+  * \return true on success, false if the client has to be disconnected
+ **/
+static bool
+client_read(totpd_client *client, uint64_t now)
+{
+    size_t          size = TOTPD_REQUEST_LEN + TOTPD_MAX_KEY_LEN +
+        TOTPD_MAX_VALUE_LEN;
+    ssize_t         len;
+
+    if (!client->in && !(client->in = malloc(size)))
+        return false;
+
+    len = read(client->fd, client->in + client->in_len, size - client->in_len);
+    if (len <= 0)
+        return (len < 0) && ((EAGAIN == errno) || (EINTR == errno));
+    client->in_len += len;
+
+    return client_process(client, now);
+}
+
+/**
+  * \brief client_write Send queued responses to a client
+  * \return true on success, false if the client has to be disconnected
+ **/
+static bool
+client_write(totpd_client *client)
+{
+    ssize_t         len;
+
+    if (!client->out_len)
+        return true;
+
+    len = write(client->fd, client->out, client->out_len);
+    if (len < 0)
+        return (EAGAIN == errno) || (EINTR == errno);
+
+    memmove(client->out, client->out + len, client->out_len - len);
+    client->out_len -= len;
+
+    return true;
+}
+
+/* Main loop */
+
+static void
+on_terminate(int sig)
+{
+    terminate = 1;
+}
+
+static int
+listen_unix(const char *path, mode_t mode)
+{
+    struct sockaddr_un addr;
+    int             fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "totpd: socket path \"%s\" is too long\n", path);
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    unlink(path);
+    if (((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) ||
+        (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) ||
+        (chmod(path, mode) < 0) || (listen(fd, 128) < 0)) {
+        fprintf(stderr, "totpd: could not listen on \"%s\": %s\n", path,
+                strerror(errno));
+        return -1;
+    }
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+
+    return fd;
+}
+
+static void
+usage(void)
+{
+    fprintf(stderr,
+            "usage: totpd [-s socket] [-m mode] [-f snapshot] [-i seconds]\n"
+            "  -s socket    Unix socket to listen on (default /run/totpd.sock)\n"
+            "  -m mode      permissions of the socket (default 0660)\n"
+            "  -f snapshot  file to keep the state in across restarts\n"
+            "  -i seconds   interval between snapshots (default 60)\n");
+    exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+    static struct pollfd fds[TOTPD_MAX_CLIENTS + 1];
+    const char     *socket_path = "/run/totpd.sock";
+    const char     *snapshot_path = NULL;
+    mode_t          mode = 0660;
+    uint64_t        now, interval = 60, next_snapshot;
+    pid_t           snapshot_pid = 0;
+    int             listen_fd, fd, opt, i, n;
+
+    while ((opt = getopt(argc, argv, "s:m:f:i:")) != -1) {
+        switch (opt) {
+        case 's':
+            socket_path = optarg;
+            break;
+        case 'm':
+            mode = strtoul(optarg, NULL, 8);
+            break;
+        case 'f':
+            snapshot_path = optarg;
+            break;
+        case 'i':
+            interval = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            usage();
+        }
+    }
+    if ((optind != argc) || !interval)
+        usage();
+    interval *= 1000000;
+
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, on_terminate);
+    signal(SIGTERM, on_terminate);
+
+    table.size = 1024;
+    if (!(table.buckets = calloc(table.size, sizeof(totpd_entry *))))
+        return 1;
+    if (snapshot_path)
+        snapshot_read(snapshot_path);
+
+    if ((listen_fd = listen_unix(socket_path, mode)) < 0)
+        return 1;
+
+    next_snapshot = now_usec() + interval;
+    while (!terminate) {
+        fds[0].fd = listen_fd;
+        fds[0].events = (client_count < TOTPD_MAX_CLIENTS) ? POLLIN : 0;
+        for (i = 0; i < client_count; ++i) {
+            fds[i + 1].fd = clients[i].fd;
+            fds[i + 1].events = clients[i].out_len ? POLLIN | POLLOUT : POLLIN;
+        }
+
+        n = poll(fds, client_count + 1, 1000);
+        if ((n < 0) && (EINTR != errno)) {
+            fprintf(stderr, "totpd: poll failed: %s\n", strerror(errno));
+            break;
+        }
+        now = now_usec();
+
+        /* walk backwards, client_close() moves the last client into the gap */
+        for (i = client_count - 1; (n > 0) && (i >= 0); --i) {
+            if (!fds[i + 1].revents)
+                continue;
+            if ((fds[i + 1].revents & (POLLERR | POLLNVAL)) ||
+                ((fds[i + 1].revents & (POLLIN | POLLHUP)) &&
+                 !client_read(&clients[i], now)) ||
+                !client_write(&clients[i]))
+                client_close(i);
+        }
+
+        if ((n > 0) && (fds[0].revents & POLLIN)) {
+            while ((client_count < TOTPD_MAX_CLIENTS) &&
+                   ((fd = accept(listen_fd, NULL, NULL)) >= 0)) {
+                fcntl(fd, F_SETFL, O_NONBLOCK);
+                memset(&clients[client_count], 0, sizeof(totpd_client));
+                clients[client_count++].fd = fd;
+            }
+        }
+
+        if (snapshot_pid && (waitpid(snapshot_pid, NULL, WNOHANG) != 0))
+            snapshot_pid = 0;
+
+        if (now >= next_snapshot) {
+            next_snapshot = now + interval;
+            table_expire(now);
+            /* a forked copy writes the snapshot while the state stays available */
+            if (snapshot_path && table.dirty && !snapshot_pid) {
+                snapshot_pid = fork();
+                if (0 == snapshot_pid)
+                    _exit(snapshot_write(snapshot_path) ? 0 : 1);
+                if (snapshot_pid > 0)
+                    table.dirty = false;
+                else
+                    snapshot_pid = 0;
+            }
+        }
+    }
+
+    close(listen_fd);
+    unlink(socket_path);
+
+    if (snapshot_pid)
+        waitpid(snapshot_pid, NULL, 0);
+    if (snapshot_path && table.dirty && !snapshot_write(snapshot_path)) {
+        fprintf(stderr, "totpd: could not write snapshot \"%s\"\n",
+                snapshot_path);
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,306 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * totpenc - encrypts the user configurations of mod_authn_totp
+ *
+ * Files in TOTPAuthTokenDir are encrypted in place with the key that
+ * TOTPAuthMasterKey points to; the file name is taken as the user name.
+ * Encrypted and plain files can be mixed, the module tells them apart by
+ * their magic. See totpenc.h for the format.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+
+#include "totpenc.h"
+
+#define TOTPENC_MAX_FILE_LEN    (TOTPENC_MAX_PLAIN_LEN + TOTPENC_OVERHEAD)
+
+static unsigned char key[TOTPENC_KEY_LEN];
+
+/* read a whole file of at most max bytes into a buffer of max + 1 bytes */
+static bool
+read_file(const char *path, unsigned char *buf, size_t max, size_t *len)
+{
+    FILE           *file = fopen(path, "rb");
+
+    if (!file) {
+        fprintf(stderr, "totpenc: could not open \"%s\": %s\n", path,
+                strerror(errno));
+        return false;
+    }
+    *len = fread(buf, 1, max + 1, file);
+    fclose(file);
+
+    if (*len > max) {
+        fprintf(stderr, "totpenc: \"%s\" is too large\n", path);
+        return false;
+    }
+    return true;
+}
+
+/* write a file through a temporary file, keeping the permissions of the original */
+static bool
+replace_file(const char *path, const unsigned char *buf, size_t len)
+{
+    char            tmp_path[4096];
+    struct stat     st;
+    int             fd;
+
+    if (stat(path, &st) < 0)
+        st.st_mode = 0600;
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%d", path, (int) getpid());
+
+    fd = open(tmp_path, O_WRONLY | O_CREAT | O_EXCL, st.st_mode & 07777);
+    if ((fd < 0) || (write(fd, buf, len) != (ssize_t) len) ||
+        (fsync(fd) < 0) || (close(fd) < 0) || (rename(tmp_path, path) < 0)) {
+        fprintf(stderr, "totpenc: could not write \"%s\": %s\n", path,
+                strerror(errno));
+        if (fd >= 0)
+            unlink(tmp_path);
+        return false;
+    }
+    return true;
+}
+
+static bool
+load_key(const char *path)
+{
+    unsigned char   buf[2 * TOTPENC_KEY_LEN + 3];
+    size_t          len, i;
+    unsigned int    byte;
+
+    if (!read_file(path, buf, sizeof(buf) - 1, &len))
+        return false;
+    while (len && ((buf[len - 1] == '\n') || (buf[len - 1] == '\r')))
+        --len;
+
+    if (len == TOTPENC_KEY_LEN) {
+        memcpy(key, buf, TOTPENC_KEY_LEN);
+    } else if (len == 2 * TOTPENC_KEY_LEN) {
+        for (i = 0; i < TOTPENC_KEY_LEN; ++i) {
+            if (sscanf((const char *) buf + 2 * i, "%2x", &byte) != 1) {
+                len = 0;
+                break;
+            }
+            key[i] = byte;
+        }
+    }
+    memset(buf, 0, sizeof(buf));
+
+    if ((len != TOTPENC_KEY_LEN) && (len != 2 * TOTPENC_KEY_LEN)) {
+        fprintf(stderr, "totpenc: \"%s\" must hold %d bytes or %d hex digits\n",
+                path, TOTPENC_KEY_LEN, 2 * TOTPENC_KEY_LEN);
+        return false;
+    }
+    return true;
+}
+
+static bool
+generate_key(const char *path)
+{
+    char            hex[2 * TOTPENC_KEY_LEN + 2];
+    int             fd, i;
+
+    if (RAND_bytes(key, TOTPENC_KEY_LEN) != 1) {
+        fprintf(stderr, "totpenc: could not generate a key\n");
+        return false;
+    }
+    for (i = 0; i < TOTPENC_KEY_LEN; ++i)
+        sprintf(hex + 2 * i, "%02x", key[i]);
+    hex[2 * TOTPENC_KEY_LEN] = '\n';
+
+    fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0400);
+    if ((fd < 0) || (write(fd, hex, 2 * TOTPENC_KEY_LEN + 1) < 0) ||
+        (close(fd) < 0)) {
+        fprintf(stderr, "totpenc: could not create \"%s\": %s\n", path,
+                strerror(errno));
+        return false;
+    }
+    memset(hex, 0, sizeof(hex));
+    return true;
+}
+
+static const char *
+user_name(const char *path)
+{
+    const char     *name = strrchr(path, '/');
+
+    return name ? name + 1 : path;
+}
+
+static bool
+encrypt_file(const char *path)
+{
+    unsigned char   plain[TOTPENC_MAX_FILE_LEN + 1];
+    unsigned char   out[TOTPENC_MAX_FILE_LEN];
+    unsigned char  *nonce = out + TOTPENC_MAGIC_LEN;
+    unsigned char  *cipher = nonce + TOTPENC_NONCE_LEN;
+    const char     *user = user_name(path);
+    EVP_CIPHER_CTX *ctx;
+    size_t          len;
+    int             outl, finl;
+    bool            ok;
+
+    if (!read_file(path, plain, TOTPENC_MAX_FILE_LEN, &len))
+        return false;
+    if ((len >= TOTPENC_MAGIC_LEN) &&
+        (0 == memcmp(plain, TOTPENC_MAGIC, TOTPENC_MAGIC_LEN))) {
+        fprintf(stderr, "totpenc: \"%s\" is already encrypted\n", path);
+        return true;
+    }
+    /* the module reads at most TOTPENC_MAX_PLAIN_LEN plus the overhead */
+    if (len > TOTPENC_MAX_PLAIN_LEN) {
+        memset(plain, 0, sizeof(plain));
+        fprintf(stderr, "totpenc: \"%s\" is too large\n", path);
+        return false;
+    }
+
+    memcpy(out, TOTPENC_MAGIC, TOTPENC_MAGIC_LEN);
+    ok = (RAND_bytes(nonce, TOTPENC_NONCE_LEN) == 1) &&
+        (ctx = EVP_CIPHER_CTX_new());
+    if (ok) {
+        ok = EVP_EncryptInit_ex(ctx, EVP_aes_256_gcm(), NULL, NULL, NULL) &&
+            EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_IVLEN,
+                                TOTPENC_NONCE_LEN, NULL) &&
+            EVP_EncryptInit_ex(ctx, NULL, NULL, key, nonce) &&
+            EVP_EncryptUpdate(ctx, NULL, &outl, (const unsigned char *) user,
+                              strlen(user)) &&
+            EVP_EncryptUpdate(ctx, cipher, &outl, plain, len) &&
+            EVP_EncryptFinal_ex(ctx, cipher + outl, &finl) &&
+            EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, TOTPENC_TAG_LEN,
+                                cipher + len);
+        EVP_CIPHER_CTX_free(ctx);
+    }
+    memset(plain, 0, sizeof(plain));
+
+    if (!ok) {
+        fprintf(stderr, "totpenc: could not encrypt \"%s\"\n", path);
+        return false;
+    }
+    return replace_file(path, out, cipher + len + TOTPENC_TAG_LEN - out);
+}
+
+static bool
+decrypt_file(const char *path)
+{
+    unsigned char   in[TOTPENC_MAX_FILE_LEN + 1];
+    unsigned char   plain[TOTPENC_MAX_PLAIN_LEN];
+    const unsigned char *nonce = in + TOTPENC_MAGIC_LEN;
+    const unsigned char *cipher = nonce + TOTPENC_NONCE_LEN;
+    const char     *user = user_name(path);
+    EVP_CIPHER_CTX *ctx;
+    size_t          len;
+    int             outl, finl;
+    bool            ok;
+
+    if (!read_file(path, in, TOTPENC_MAX_FILE_LEN, &len))
+        return false;
+    if ((len < TOTPENC_MAGIC_LEN + TOTPENC_NONCE_LEN + TOTPENC_TAG_LEN) ||
+        memcmp(in, TOTPENC_MAGIC, TOTPENC_MAGIC_LEN)) {
+        fprintf(stderr, "totpenc: \"%s\" is not encrypted\n", path);
+        return false;
+    }
+    len -= TOTPENC_MAGIC_LEN + TOTPENC_NONCE_LEN + TOTPENC_TAG_LEN;
+
+    ok = (ctx = EVP_CIPHER_CTX_new()) != NULL;
+    if (ok) {
+        ok = EVP_DecryptInit_ex(ctx, EVP_aes_256_gcm(), NULL, NULL, NULL) &&
+            EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_IVLEN,
+                                TOTPENC_NONCE_LEN, NULL) &&
+            EVP_DecryptInit_ex(ctx, NULL, NULL, key, nonce) &&
+            EVP_DecryptUpdate(ctx, NULL, &outl, (const unsigned char *) user,
+                              strlen(user)) &&
+            EVP_DecryptUpdate(ctx, plain, &outl, cipher, len) &&
+            EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, TOTPENC_TAG_LEN,
+                                (void *) (cipher + len)) &&
+            (EVP_DecryptFinal_ex(ctx, plain + outl, &finl) > 0);
+        EVP_CIPHER_CTX_free(ctx);
+    }
+
+    if (ok)
+        fwrite(plain, 1, len, stdout);
+    else
+        fprintf(stderr, "totpenc: could not decrypt \"%s\", wrong key or user\n",
+                path);
+    memset(plain, 0, sizeof(plain));
+
+    return ok;
+}
+
+static void
+usage(void)
+{
+    fprintf(stderr,
+            "usage: totpenc -g keyfile\n"
+            "       totpenc [-d] -k keyfile file...\n"
+            "  -g keyfile   create a new key file\n"
+            "  -k keyfile   key file of TOTPAuthMasterKey\n"
+            "  -d           print the decrypted files instead of encrypting them\n"
+            "Files are encrypted in place, their names are the user names.\n");
+    exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+    const char     *key_path = NULL, *new_key_path = NULL;
+    bool            decrypt = false, ok = true;
+    int             opt;
+
+    while ((opt = getopt(argc, argv, "g:k:d")) != -1) {
+        switch (opt) {
+        case 'g':
+            new_key_path = optarg;
+            break;
+        case 'k':
+            key_path = optarg;
+            break;
+        case 'd':
+            decrypt = true;
+            break;
+        default:
+            usage();
+        }
+    }
+
+    if (new_key_path) {
+        if (key_path || (optind != argc))
+            usage();
+        return generate_key(new_key_path) ? 0 : 1;
+    }
+    if (!key_path || (optind == argc))
+        usage();
+    if (!load_key(key_path))
+        return 1;
+
+    for (; optind < argc; ++optind)
+        ok = (decrypt ? decrypt_file(argv[optind]) :
+              encrypt_file(argv[optind])) && ok;
+
+    memset(key, 0, sizeof(key));
+    return ok ? 0 : 1;
+}